@@ -81,7 +81,7 @@ buffer_add (buffer_t * buff, void * data, size_t len)
       new_size *= buff->block_size;
       if (buff->len + len > new_size)
         new_size += buff->block_size;
-      if (new_size > buff->max_size)
+      if (buff->max_size > 0 && new_size > buff->max_size)
         new_size = buff->max_size;
 
       /* Allocate Memory */
@@ -98,7 +98,19 @@ buffer_add (buffer_t * buff, void * data, size_t len)
   memcpy (buff->data + buff->len, data, len);
   buff->len += len;
 
-  return BUFF_UNKNOWN;
+  return BUFF_OK;
+}
+
+buffer_err_t
+buffer_shift (buffer_t * buff, size_t len)
+{
+  /* Move the remaining data to the front of the segment */
+  if (len > buff->len)
+    len = buff->len;
+  memmove (buff->data, buff->data + len, buff->len - len);
+  buff->len -= len;
+
+  return BUFF_OK;
 }
 
 buffer_err_t
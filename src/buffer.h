@@ -84,6 +84,16 @@ buffer_err_t buffer_extend (buffer_t * buff);
 **/
 buffer_err_t buffer_add (buffer_t * buff, void * data, size_t len);
 
+/**
+   @brief Removes data from the front of the buffer
+   @details Discards the first len bytes of the data segment and moves
+   the rest to the front. The allocation is kept for reuse.
+   @param buff The buffer to shift
+   @param len The number of bytes to discard
+   @return An error code
+**/
+buffer_err_t buffer_shift (buffer_t * buff, size_t len);
+
 /**
    @brief Destroys the Buffer
    @details Destroys the buffer and frees its contents from heap
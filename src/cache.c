@@ -0,0 +1,1291 @@
+/**
+   @file cache.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Remote Artifact Cache Client
+   @details Shares build artifacts between builders through a content
+   addressed HTTP cache. Callers hand requests to a single transfer
+   thread which drives them all through one libcurl multi handle and
+   wakes the callers as they finish. Uploads are read and deflated by
+   the caller and then left to the transfer thread.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define CURL_DISABLE_TYPECHECK
+#include <curl/curl.h>
+#include <zlib.h>
+#include "cache.h"
+#include "log.h"
+#include "util.h"
+
+#define DEFAULT_PARALLEL 8
+#define LEVEL 6
+#define POLL_MS 1000
+#define NAME_BUF 256
+#define DATA_BLOCK 65536
+#define MALLOC_FAILED "Malloc Failed\n"
+
+#define LIBCURL "libcurl.so.4"
+
+/* libcurl and its dependencies take longer to map than the rest of a
+   short command, so they are only loaded for the first transfer */
+static struct
+{
+  CURLcode (*global_init) (long flags);
+  CURL * (*easy_init) (void);
+  CURLcode (*easy_setopt) (CURL * easy, CURLoption option, ...);
+  CURLcode (*easy_getinfo) (CURL * easy, CURLINFO info, ...);
+  const char * (*easy_strerror) (CURLcode code);
+  void (*easy_cleanup) (CURL * easy);
+  CURLM * (*multi_init) (void);
+  CURLMcode (*multi_setopt) (CURLM * multi, CURLMoption option, ...);
+  CURLMcode (*multi_add_handle) (CURLM * multi, CURL * easy);
+  CURLMcode (*multi_remove_handle) (CURLM * multi, CURL * easy);
+  CURLMcode (*multi_perform) (CURLM * multi, int * running);
+  CURLMcode (*multi_poll) (CURLM * multi, struct curl_waitfd * fds,
+                           unsigned int nfds, int timeout_ms, int * ret);
+  CURLMcode (*multi_wakeup) (CURLM * multi);
+  CURLMsg * (*multi_info_read) (CURLM * multi, int * left);
+  CURLMcode (*multi_cleanup) (CURLM * multi);
+  struct curl_slist * (*slist_append) (struct curl_slist * list,
+                                       const char * str);
+  void (*slist_free_all) (struct curl_slist * list);
+} curl;
+
+static const lazy_sym_t curl_syms[] = {
+  { "curl_global_init", (void**)&curl.global_init },
+  { "curl_easy_init", (void**)&curl.easy_init },
+  { "curl_easy_setopt", (void**)&curl.easy_setopt },
+  { "curl_easy_getinfo", (void**)&curl.easy_getinfo },
+  { "curl_easy_strerror", (void**)&curl.easy_strerror },
+  { "curl_easy_cleanup", (void**)&curl.easy_cleanup },
+  { "curl_multi_init", (void**)&curl.multi_init },
+  { "curl_multi_setopt", (void**)&curl.multi_setopt },
+  { "curl_multi_add_handle", (void**)&curl.multi_add_handle },
+  { "curl_multi_remove_handle", (void**)&curl.multi_remove_handle },
+  { "curl_multi_perform", (void**)&curl.multi_perform },
+  { "curl_multi_poll", (void**)&curl.multi_poll },
+  { "curl_multi_wakeup", (void**)&curl.multi_wakeup },
+  { "curl_multi_info_read", (void**)&curl.multi_info_read },
+  { "curl_multi_cleanup", (void**)&curl.multi_cleanup },
+  { "curl_slist_append", (void**)&curl.slist_append },
+  { "curl_slist_free_all", (void**)&curl.slist_free_all },
+};
+
+static int
+curl_load (void * arg)
+{
+  if (lazy_dlopen (LIBCURL, curl_syms,
+                   sizeof (curl_syms) / sizeof (*curl_syms)) != 0)
+    return 1;
+  return curl.global_init (CURL_GLOBAL_DEFAULT) == CURLE_OK ? 0 : 1;
+}
+
+static lazy_t libcurl =
+  LAZY_INITIALIZER ("libcurl", curl_load, NULL, NULL, 1);
+
+/* What a request does */
+#define REQ_GET 0
+#define REQ_PUT 1
+#define REQ_HAS 2
+#define REQ_CHUNK 3
+#define REQ_TREE 4
+#define REQ_PUT_TREE 5
+
+/**
+   @brief Chunk of a Blob
+**/
+struct _cache_chunk_t
+{
+  uint8_t digest[DIGEST_LEN]; /**< Digest of the chunk */
+  uint64_t off; /**< Offset in the blob */
+  uint64_t len; /**< Length of the chunk */
+  struct _cache_req_t * req; /**< Download of the chunk or NULL */
+};
+
+/**
+   @brief Single Transfer
+**/
+struct _cache_req_t
+{
+  struct _cache_req_t * next; /**< Next request waiting to start */
+  int op; /**< One of the REQ_* operations */
+  char hex[DIGEST_HEX_LEN]; /**< Digest of the blob, unused by REQ_HAS */
+  const uint8_t * digest; /**< Expected digest of a download */
+  const char * path; /**< File being restored */
+  char * tmp; /**< Partial download next to path */
+  FILE * file; /**< Open partial download */
+  digest_t dgst; /**< Digest of the bytes downloaded so far */
+  uint64_t restored; /**< Bytes written to the partial download */
+  uint8_t * body; /**< Upload or request body */
+  size_t body_len; /**< Length of body */
+  uint64_t raw_len; /**< Uncompressed length of an upload */
+  int deflated; /**< Whether body is deflated */
+  uint8_t * present; /**< Answers of a REQ_HAS */
+  size_t count; /**< Digests asked by a REQ_HAS */
+  size_t got; /**< Answers received so far */
+  buffer_t data; /**< Downloaded chunk or chunk list */
+  struct _cache_req_t * parent; /**< Chunk list waiting on this chunk */
+  size_t waiting; /**< Chunks a list waits for */
+  int failed; /**< One of the chunks failed to upload */
+  uint64_t dedup; /**< Bytes of the blob the cache already had */
+  struct curl_slist * headers; /**< Extra request headers */
+  CURL * easy; /**< Transfer handle */
+  cache_err_t ret; /**< Result of the request */
+  int done; /**< Set once the request has finished */
+};
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Replaces the last error, safe from any thread */
+static void
+set_err (cache_t * cache, char * err)
+{
+  pthread_mutex_lock (&cache->lock);
+  if (cache->err != NULL)
+    free (cache->err);
+  cache->err = err;
+  pthread_mutex_unlock (&cache->lock);
+}
+
+static size_t
+write_cb (char * data, size_t size, size_t nmemb, void * arg)
+{
+  struct _cache_req_t * req = (struct _cache_req_t*) arg;
+  size_t i, len = size * nmemb;
+
+  switch (req->op)
+    {
+    case REQ_GET:
+      if (fwrite (data, sizeof (char), len, req->file) != len)
+        return 0;
+      digest_update (&req->dgst, data, len);
+      req->restored += len;
+      break;
+    case REQ_CHUNK:
+      digest_update (&req->dgst, data, len);
+      /* Fall through */
+    case REQ_TREE:
+      if (buffer_add (&req->data, data, len) != BUFF_OK)
+        return 0;
+      break;
+    case REQ_HAS:
+      /* One answer per digest in the order they were asked */
+      for (i = 0; i < len && req->got < req->count; i++)
+        if (data[i] == '0' || data[i] == '1')
+          req->present[req->got++] = data[i] == '1';
+      break;
+    }
+
+  return len;
+}
+
+static int
+req_start (cache_t * cache, struct _cache_req_t * req)
+{
+  char buf[NAME_BUF], * url;
+  struct curl_slist * tmp;
+
+  req->easy = curl.easy_init ();
+  if (req->easy == NULL)
+    return 0;
+  if (req->op == REQ_HAS)
+    url = fmtstr (buf, sizeof (buf), "%s/has", cache->url);
+  else if (req->op == REQ_TREE || req->op == REQ_PUT_TREE)
+    url = fmtstr (buf, sizeof (buf), "%s/tree/%s", cache->url, req->hex);
+  else
+    url = fmtstr (buf, sizeof (buf), "%s/cas/%s", cache->url, req->hex);
+  if (url == NULL)
+    return 0;
+  curl.easy_setopt (req->easy, CURLOPT_URL, url);
+  if (url != buf)
+    free (url);
+
+  /* Never wait for 100 Continue before sending a body */
+  req->headers = curl.slist_append (NULL, "Expect:");
+  if (req->headers == NULL)
+    return 0;
+  if (req->deflated)
+    {
+      tmp = curl.slist_append (req->headers, "Content-Encoding: deflate");
+      if (tmp == NULL)
+        return 0;
+      req->headers = tmp;
+    }
+
+  curl.easy_setopt (req->easy, CURLOPT_PRIVATE, req);
+  curl.easy_setopt (req->easy, CURLOPT_NOSIGNAL, 1L);
+  curl.easy_setopt (req->easy, CURLOPT_TIMEOUT_MS, cache->timeout_ms);
+  curl.easy_setopt (req->easy, CURLOPT_HTTPHEADER, req->headers);
+  curl.easy_setopt (req->easy, CURLOPT_WRITEFUNCTION, write_cb);
+  curl.easy_setopt (req->easy, CURLOPT_WRITEDATA, req);
+  if ((req->op == REQ_GET || req->op == REQ_CHUNK) && cache->compress)
+    curl.easy_setopt (req->easy, CURLOPT_ACCEPT_ENCODING, "deflate");
+  if (req->op == REQ_PUT || req->op == REQ_PUT_TREE || req->op == REQ_HAS)
+    {
+      /* The body is ours until the transfer is removed */
+      if (req->op != REQ_HAS)
+        curl.easy_setopt (req->easy, CURLOPT_CUSTOMREQUEST, "PUT");
+      curl.easy_setopt (req->easy, CURLOPT_POSTFIELDS, req->body);
+      curl.easy_setopt (req->easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                        (curl_off_t)req->body_len);
+    }
+
+  return curl.multi_add_handle (cache->multi, req->easy) == CURLM_OK;
+}
+
+/* Must hold the lock */
+static void
+req_queue (cache_t * cache, struct _cache_req_t * req)
+{
+  req->next = NULL;
+  if (cache->tail != NULL)
+    cache->tail->next = req;
+  else
+    cache->head = req;
+  cache->tail = req;
+}
+
+static void
+req_finish (cache_t * cache, struct _cache_req_t * req, CURLcode code)
+{
+  static const char * const ops[] = {
+    "Fetching", "Uploading", "Checking", "Fetching chunk",
+    "Fetching the chunks of", "Uploading the chunks of"
+  };
+  struct _cache_req_t * tree;
+  uint8_t digest[DIGEST_LEN];
+  curl_off_t down = 0, up = 0;
+  long status = 0;
+  int wake = 0;
+  char * err = NULL;
+
+  if (req->easy != NULL)
+    {
+      curl.easy_getinfo (req->easy, CURLINFO_RESPONSE_CODE, &status);
+      curl.easy_getinfo (req->easy, CURLINFO_SIZE_DOWNLOAD_T, &down);
+      curl.easy_getinfo (req->easy, CURLINFO_SIZE_UPLOAD_T, &up);
+    }
+
+  /* Work out how the request went */
+  if (code != CURLE_OK)
+    req->ret = CACHE_HTTP_FAILED;
+  else if ((req->op == REQ_GET || req->op == REQ_CHUNK ||
+            req->op == REQ_TREE) && status == 404)
+    req->ret = CACHE_MISS;
+  else if (status < 200 || status > 299 ||
+           (req->op == REQ_HAS && req->got != req->count))
+    req->ret = CACHE_HTTP_FAILED;
+  else
+    req->ret = CACHE_OK;
+
+  /* Only move a download into place once it checks out */
+  if (req->op == REQ_GET)
+    {
+      if (fclose (req->file) != 0 && req->ret == CACHE_OK)
+        req->ret = CACHE_IO_FAILED;
+      req->file = NULL;
+      if (req->ret == CACHE_OK)
+        {
+          digest_final (&req->dgst, digest);
+          if (memcmp (digest, req->digest, DIGEST_LEN) != 0)
+            req->ret = CACHE_CORRUPT;
+          else if (rename (req->tmp, req->path) != 0)
+            req->ret = CACHE_IO_FAILED;
+        }
+      if (req->ret != CACHE_OK)
+        unlink (req->tmp);
+    }
+  else if (req->op == REQ_CHUNK && req->ret == CACHE_OK)
+    {
+      digest_final (&req->dgst, digest);
+      if (memcmp (digest, req->digest, DIGEST_LEN) != 0)
+        req->ret = CACHE_CORRUPT;
+    }
+
+  if (req->ret != CACHE_OK && req->ret != CACHE_MISS)
+    {
+      if (code != CURLE_OK)
+        err = cpstrf ("%s %s: %s\n", ops[req->op], req->hex,
+                      curl.easy_strerror (code));
+      else if (req->ret == CACHE_HTTP_FAILED)
+        err = cpstrf ("%s %s: HTTP status %ld\n", ops[req->op], req->hex,
+                      status);
+      else if (req->ret == CACHE_CORRUPT)
+        err = cpstrf ("%s %s: Contents do not match the digest\n",
+                      ops[req->op], req->hex);
+      else
+        err = cpstrf ("Fetching %s: %s: %s\n", req->hex, req->path,
+                      strerror (errno));
+    }
+
+  if (req->easy != NULL)
+    {
+      curl.multi_remove_handle (cache->multi, req->easy);
+      curl.easy_cleanup (req->easy);
+      req->easy = NULL;
+    }
+  if (req->headers != NULL)
+    curl.slist_free_all (req->headers);
+  req->headers = NULL;
+
+  pthread_mutex_lock (&cache->lock);
+  cache->active--;
+  cache->stats.wire_recv += down;
+  cache->stats.wire_sent += up;
+  if (err != NULL)
+    {
+      if (cache->err != NULL)
+        free (cache->err);
+      cache->err = err;
+      cache->stats.failures++;
+    }
+  switch (req->op)
+    {
+    case REQ_GET:
+      if (req->ret == CACHE_OK)
+        {
+          cache->stats.hits++;
+          cache->stats.restored += req->restored;
+        }
+      else if (req->ret == CACHE_MISS)
+        cache->stats.misses++;
+      break;
+    case REQ_PUT:
+    case REQ_PUT_TREE:
+      /* Chunks are counted with the blob they belong to */
+      cache->uploads--;
+      if (req->parent != NULL)
+        break;
+      if (req->ret == CACHE_OK)
+        {
+          cache->stats.puts++;
+          cache->stats.uploaded += req->raw_len;
+          cache->stats.dedup_sent += req->dedup;
+        }
+      else
+        cache->failed_puts++;
+      break;
+    }
+
+  /* The chunk list goes up once the last of its chunks is in */
+  tree = req->parent;
+  if (tree != NULL)
+    {
+      if (req->ret != CACHE_OK)
+        tree->failed = 1;
+      if (--tree->waiting == 0 && tree->failed)
+        {
+          cache->uploads--;
+          cache->failed_puts++;
+          free (tree->body);
+          free (tree);
+        }
+      else if (tree->waiting == 0)
+        {
+          req_queue (cache, tree);
+          wake = 1;
+        }
+    }
+
+  /* Nobody waits for uploads, they are freed here */
+  if (req->op == REQ_PUT || req->op == REQ_PUT_TREE)
+    {
+      free (req->body);
+      free (req);
+    }
+  else
+    req->done = 1;
+  pthread_cond_broadcast (&cache->done);
+  pthread_mutex_unlock (&cache->lock);
+
+  /* Keep the next poll from sleeping on the queued list */
+  if (wake)
+    curl.multi_wakeup (cache->multi);
+}
+
+static void *
+cache_main (void * arg)
+{
+  cache_t * cache = (cache_t*) arg;
+  struct _cache_req_t * req;
+  CURLMsg * msg;
+  CURLcode code;
+  CURL * easy;
+  int running, left;
+
+  for (;;)
+    {
+      /* Start as many waiting requests as the limit allows */
+      pthread_mutex_lock (&cache->lock);
+      while (cache->head != NULL && cache->active < cache->parallel)
+        {
+          req = cache->head;
+          cache->head = req->next;
+          if (cache->head == NULL)
+            cache->tail = NULL;
+          cache->active++;
+          pthread_mutex_unlock (&cache->lock);
+          if (!req_start (cache, req))
+            req_finish (cache, req, CURLE_OUT_OF_MEMORY);
+          pthread_mutex_lock (&cache->lock);
+        }
+      if (cache->stop && cache->head == NULL && cache->active == 0)
+        {
+          pthread_mutex_unlock (&cache->lock);
+          break;
+        }
+      pthread_mutex_unlock (&cache->lock);
+
+      curl.multi_perform (cache->multi, &running);
+      while ((msg = curl.multi_info_read (cache->multi, &left)) != NULL)
+        {
+          if (msg->msg != CURLMSG_DONE)
+            continue;
+          easy = msg->easy_handle;
+          code = msg->data.result;
+          curl.easy_getinfo (easy, CURLINFO_PRIVATE, (char**)&req);
+          req_finish (cache, req, code);
+        }
+      curl.multi_poll (cache->multi, NULL, 0, POLL_MS, NULL);
+    }
+
+  return NULL;
+}
+
+static void
+req_submit (cache_t * cache, struct _cache_req_t * req)
+{
+  pthread_mutex_lock (&cache->lock);
+  req_queue (cache, req);
+  if (req->op == REQ_PUT || req->op == REQ_PUT_TREE)
+    cache->uploads++;
+  pthread_mutex_unlock (&cache->lock);
+  curl.multi_wakeup (cache->multi);
+}
+
+static cache_err_t
+req_wait (cache_t * cache, struct _cache_req_t * req)
+{
+  pthread_mutex_lock (&cache->lock);
+  while (!req->done)
+    pthread_cond_wait (&cache->done, &cache->lock);
+  pthread_mutex_unlock (&cache->lock);
+
+  return req->ret;
+}
+
+/* Runs on the first transfer so commands which never use the cache
+   never load libcurl or start the thread */
+static int
+cache_start (void * arg)
+{
+  cache_t * cache = (cache_t*) arg;
+
+  if (lazy_get (&libcurl) != 0)
+    {
+      set_err (cache, cpstrf ("Failed to load %s\n", LIBCURL));
+      return CACHE_UNKNOWN;
+    }
+  cache->multi = curl.multi_init ();
+  if (cache->multi == NULL)
+    {
+      set_err (cache, cpstr ("Failed to initialize libcurl\n"));
+      return CACHE_UNKNOWN;
+    }
+  curl.multi_setopt (cache->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                     (long)cache->parallel);
+
+  if (pthread_create (&cache->thread, NULL, cache_main, cache) != 0)
+    {
+      curl.multi_cleanup (cache->multi);
+      cache->multi = NULL;
+      set_err (cache, cpstr ("Failed to start the transfer thread\n"));
+      return CACHE_THREAD_FAILED;
+    }
+
+  return CACHE_OK;
+}
+
+static int
+cache_stop (void * arg)
+{
+  cache_t * cache = (cache_t*) arg;
+
+  /* Let the queued uploads finish */
+  pthread_mutex_lock (&cache->lock);
+  cache->stop = 1;
+  pthread_mutex_unlock (&cache->lock);
+  curl.multi_wakeup (cache->multi);
+  pthread_join (cache->thread, NULL);
+
+  log_info ("Remote cache transfers", LOG_UINT ("hits", cache->stats.hits),
+            LOG_UINT ("misses", cache->stats.misses),
+            LOG_UINT ("puts", cache->stats.puts),
+            LOG_UINT ("wire_recv", cache->stats.wire_recv),
+            LOG_UINT ("restored", cache->stats.restored),
+            LOG_UINT ("wire_sent", cache->stats.wire_sent),
+            LOG_UINT ("uploaded", cache->stats.uploaded),
+            LOG_UINT ("dedup_sent", cache->stats.dedup_sent),
+            LOG_UINT ("dedup_recv", cache->stats.dedup_recv));
+  if (cache->stats.chunk_ns > 0)
+    log_info ("Remote cache chunking",
+              LOG_UINT ("bytes", cache->stats.chunked),
+              LOG_DBL ("gb_per_s", (double)cache->stats.chunked /
+                       cache->stats.chunk_ns));
+
+  curl.multi_cleanup (cache->multi);
+  cache->multi = NULL;
+
+  return CACHE_OK;
+}
+
+cache_err_t
+cache_init (cache_t * cache, const char * url, size_t parallel, int compress)
+{
+  size_t len;
+
+  /* Initialize the struct */
+  memset (cache, 0, sizeof (cache_t));
+  pthread_mutex_init (&cache->lock, NULL);
+  pthread_cond_init (&cache->done, NULL);
+  lazy_init (&cache->started, "cache", cache_start, cache_stop, cache,
+             CACHE_INVALID);
+  cache->parallel = parallel > 0 ? parallel : DEFAULT_PARALLEL;
+  cache->compress = compress;
+  if (url == NULL || url[0] == '\0')
+    {
+      set_err (cache, cpstr ("No cache URL\n"));
+      return CACHE_INVALID;
+    }
+  cache->url = cpstr (url);
+  if (cache->url == NULL)
+    {
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+  for (len = strlen (cache->url); len > 0 && cache->url[len-1] == '/'; len--)
+    cache->url[len-1] = '\0';
+
+  return CACHE_OK;
+}
+
+cache_err_t
+cache_init_conf (cache_t * cache, conf_t * conf)
+{
+  cache_err_t ret;
+
+  ret = cache_init (cache, conf->vals.cache_url, conf->vals.cache_parallel,
+                    conf->vals.cache_compress);
+  if (ret != CACHE_OK)
+    return ret;
+  cache->timeout_ms = conf->vals.cache_timeout;
+  cache->chunk = conf->vals.cache_chunk;
+  if (cache->chunk > 0)
+    cdc_init (&cache->cdc, cache->chunk);
+
+  return CACHE_OK;
+}
+
+cache_err_t
+cache_has (cache_t * cache, const uint8_t * digests, size_t count,
+           uint8_t * present)
+{
+  struct _cache_req_t * reqs;
+  cache_err_t ret = CACHE_OK;
+  size_t nreqs, i, j, len;
+
+  if (count == 0)
+    return CACHE_OK;
+  memset (present, 0, count);
+  ret = lazy_get (&cache->started);
+  if (ret != CACHE_OK)
+    return ret;
+  nreqs = (count + CACHE_HAS_BATCH - 1) / CACHE_HAS_BATCH;
+  reqs = (struct _cache_req_t*) calloc (nreqs, sizeof (struct _cache_req_t));
+  if (reqs == NULL)
+    {
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+
+  /* Build every batch before sending any so they overlap */
+  for (i = 0; i < nreqs; i++)
+    {
+      len = count - i*CACHE_HAS_BATCH;
+      if (len > CACHE_HAS_BATCH)
+        len = CACHE_HAS_BATCH;
+      reqs[i].op = REQ_HAS;
+      strcpy (reqs[i].hex, "batch");
+      reqs[i].present = present + i*CACHE_HAS_BATCH;
+      reqs[i].count = len;
+      reqs[i].body_len = len * DIGEST_HEX_LEN;
+      reqs[i].body = (uint8_t*) malloc (reqs[i].body_len + 1);
+      if (reqs[i].body == NULL)
+        {
+          for (j = 0; j < i; j++)
+            free (reqs[j].body);
+          free (reqs);
+          set_err (cache, cpstr (MALLOC_FAILED));
+          return CACHE_MALLOC_FAILED;
+        }
+      for (j = 0; j < len; j++)
+        {
+          digest_hex (digests + (i*CACHE_HAS_BATCH + j) * DIGEST_LEN,
+                      (char*)reqs[i].body + j*DIGEST_HEX_LEN);
+          reqs[i].body[(j+1)*DIGEST_HEX_LEN - 1] = '\n';
+        }
+    }
+  for (i = 0; i < nreqs; i++)
+    req_submit (cache, &reqs[i]);
+
+  for (i = 0; i < nreqs; i++)
+    {
+      if (req_wait (cache, &reqs[i]) != CACHE_OK && ret == CACHE_OK)
+        ret = reqs[i].ret;
+      free (reqs[i].body);
+    }
+  free (reqs);
+
+  pthread_mutex_lock (&cache->lock);
+  cache->stats.checks += count;
+  pthread_mutex_unlock (&cache->lock);
+
+  return ret;
+}
+
+static int
+cmp_chunk (const void * a, const void * b)
+{
+  return memcmp (((const struct _cache_chunk_t*)a)->digest,
+                 ((const struct _cache_chunk_t*)b)->digest, DIGEST_LEN);
+}
+
+static int
+cmp_chunk_ptr (const void * a, const void * b)
+{
+  return cmp_chunk (*(const struct _cache_chunk_t * const *)a,
+                    *(const struct _cache_chunk_t * const *)b);
+}
+
+static int
+unhex (const char * hex, uint8_t * raw)
+{
+  size_t i;
+  int hi, lo;
+
+  for (i = 0; i < DIGEST_LEN; i++)
+    {
+      hi = hex[2*i] >= 'a' ? hex[2*i] - 'a' + 10 : hex[2*i] - '0';
+      lo = hex[2*i+1] >= 'a' ? hex[2*i+1] - 'a' + 10 : hex[2*i+1] - '0';
+      if (hi < 0 || hi > 15 || lo < 0 || lo > 15)
+        return 0;
+      raw[i] = hi << 4 | lo;
+    }
+  return 1;
+}
+
+/* Cuts data into chunks in order, NULL if out of memory */
+static struct _cache_chunk_t *
+split (cache_t * cache, const uint8_t * data, size_t len, size_t * count)
+{
+  struct _cache_chunk_t * chunks;
+  size_t off, cut, n = 0;
+  uint64_t start;
+
+  start = now_ns ();
+  chunks = (struct _cache_chunk_t*)
+    malloc ((len / cache->cdc.min + 1) * sizeof (*chunks));
+  if (chunks == NULL)
+    return NULL;
+  for (off = 0; off < len; off += cut)
+    {
+      cut = cdc_cut (&cache->cdc, data + off, len - off);
+      digest_buffer (data + off, cut, chunks[n].digest);
+      chunks[n].off = off;
+      chunks[n].len = cut;
+      chunks[n++].req = NULL;
+    }
+  *count = n;
+
+  pthread_mutex_lock (&cache->lock);
+  cache->stats.chunked += len;
+  cache->stats.chunk_ns += now_ns () - start;
+  pthread_mutex_unlock (&cache->lock);
+
+  return chunks;
+}
+
+/* Parses a NUL terminated chunk list into chunks at their offsets in
+   the blob */
+static struct _cache_chunk_t *
+parse_tree (const char * list, size_t len, size_t * count)
+{
+  struct _cache_chunk_t * chunks;
+  const char * ptr, * end;
+  char * num_end;
+  size_t n = 0, max;
+  uint64_t off = 0;
+
+  /* Every line holds a digest, a space, a digit and a newline */
+  max = len / (DIGEST_HEX_LEN + 2) + 1;
+  chunks = (struct _cache_chunk_t*) malloc (max * sizeof (*chunks));
+  if (chunks == NULL)
+    return NULL;
+  ptr = list;
+  end = list + len;
+  while (ptr < end && n < max)
+    {
+      if (end - ptr < DIGEST_HEX_LEN + 2 || ptr[DIGEST_HEX_LEN - 1] != ' ' ||
+          ptr[DIGEST_HEX_LEN] < '0' || ptr[DIGEST_HEX_LEN] > '9' ||
+          !unhex (ptr, chunks[n].digest))
+        break;
+      chunks[n].len = strtoull (ptr + DIGEST_HEX_LEN, &num_end, 10);
+      if (num_end >= end || *num_end != '\n' || chunks[n].len == 0)
+        break;
+      chunks[n].off = off;
+      chunks[n++].req = NULL;
+      off += chunks[n-1].len;
+      ptr = num_end + 1;
+    }
+  if (ptr != end)
+    {
+      free (chunks);
+      return NULL;
+    }
+  *count = n;
+
+  return chunks;
+}
+
+/* Restores a chunked blob over the old file at path, CACHE_MISS if the
+   blob is not stored as chunks */
+static cache_err_t
+get_tree (cache_t * cache, const uint8_t * digest, const char * path,
+          size_t old_len)
+{
+  struct _cache_chunk_t * have = NULL, * want = NULL, ** order = NULL;
+  struct _cache_chunk_t * found;
+  struct _cache_req_t tree, * reqs = NULL;
+  size_t nhave = 0, nwant = 0, nmissing = 0, nreqs = 0, i;
+  uint8_t raw[DIGEST_LEN], * old = MAP_FAILED, * data;
+  uint64_t restored = 0, reused = 0;
+  cache_err_t ret;
+  char * tmp = NULL;
+  FILE * file;
+  digest_t dgst;
+  int fd;
+
+  /* Ask for the chunk list first, most blobs are stored whole */
+  memset (&tree, 0, sizeof (tree));
+  tree.op = REQ_TREE;
+  digest_hex (digest, tree.hex);
+  if (buffer_init (&tree.data, DATA_BLOCK, 0) != BUFF_OK)
+    {
+      buffer_destroy (&tree.data);
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+  req_submit (cache, &tree);
+  ret = req_wait (cache, &tree);
+  if (ret == CACHE_OK && buffer_add (&tree.data, "", 1) != BUFF_OK)
+    {
+      set_err (cache, cpstr (MALLOC_FAILED));
+      ret = CACHE_MALLOC_FAILED;
+    }
+  if (ret != CACHE_OK)
+    {
+      buffer_destroy (&tree.data);
+      return ret;
+    }
+  want = parse_tree ((char*) tree.data.data, tree.data.len - 1, &nwant);
+  buffer_destroy (&tree.data);
+  if (want == NULL)
+    {
+      set_err (cache, cpstrf ("Fetching the chunks of %s: Invalid chunk "
+                              "list\n", tree.hex));
+      return CACHE_HTTP_FAILED;
+    }
+
+  /* Chunk the old file to find what it can provide */
+  fd = open (path, O_RDONLY);
+  if (fd >= 0)
+    {
+      old = (uint8_t*) mmap (NULL, old_len, PROT_READ, MAP_PRIVATE, fd, 0);
+      close (fd);
+    }
+  if (old == MAP_FAILED)
+    {
+      free (want);
+      set_err (cache, cpstrf ("Failed to map %s: %s\n", path,
+                              strerror (errno)));
+      return CACHE_IO_FAILED;
+    }
+  have = split (cache, old, old_len, &nhave);
+  order = (struct _cache_chunk_t**) malloc ((nwant + 1) * sizeof (*order));
+  reqs = (struct _cache_req_t*) calloc (nwant + 1, sizeof (*reqs));
+  ret = have != NULL && order != NULL && reqs != NULL ? CACHE_OK :
+    CACHE_MALLOC_FAILED;
+  if (ret == CACHE_OK)
+    qsort (have, nhave, sizeof (*have), cmp_chunk);
+
+  /* One download for every distinct chunk the old file lacks */
+  for (i = 0; ret == CACHE_OK && i < nwant; i++)
+    {
+      found = (struct _cache_chunk_t*)
+        bsearch (&want[i], have, nhave, sizeof (*have), cmp_chunk);
+      if (found == NULL || found->len != want[i].len)
+        order[nmissing++] = &want[i];
+      else
+        want[i].off = found->off;
+    }
+  if (ret == CACHE_OK)
+    qsort (order, nmissing, sizeof (*order), cmp_chunk_ptr);
+  for (i = 0; ret == CACHE_OK && i < nmissing; i++)
+    {
+      if (i > 0 && cmp_chunk (order[i-1], order[i]) == 0)
+        {
+          order[i]->req = order[i-1]->req;
+          continue;
+        }
+      order[i]->req = &reqs[nreqs];
+      reqs[nreqs].op = REQ_CHUNK;
+      reqs[nreqs].digest = order[i]->digest;
+      digest_hex (order[i]->digest, reqs[nreqs].hex);
+      digest_init (&reqs[nreqs].dgst);
+      if (buffer_init (&reqs[nreqs++].data, DATA_BLOCK, 0) != BUFF_OK)
+        ret = CACHE_MALLOC_FAILED;
+    }
+  if (ret == CACHE_MALLOC_FAILED)
+    set_err (cache, cpstr (MALLOC_FAILED));
+  else
+    {
+      for (i = 0; i < nreqs; i++)
+        req_submit (cache, &reqs[i]);
+      for (i = 0; i < nreqs; i++)
+        if (req_wait (cache, &reqs[i]) != CACHE_OK && ret == CACHE_OK)
+          ret = reqs[i].ret;
+    }
+
+  /* Assemble next to path in the order of the list */
+  if (ret == CACHE_OK)
+    {
+      tmp = cpstrf ("%s.part", path);
+      file = tmp != NULL ? fopen (tmp, "wb") : NULL;
+      if (file == NULL)
+        {
+          set_err (cache, tmp == NULL ? cpstr (MALLOC_FAILED) :
+               cpstrf ("Failed to create %s: %s\n", tmp, strerror (errno)));
+          ret = tmp == NULL ? CACHE_MALLOC_FAILED : CACHE_IO_FAILED;
+        }
+    }
+  if (ret == CACHE_OK)
+    {
+      digest_init (&dgst);
+      for (i = 0; ret == CACHE_OK && i < nwant; i++)
+        {
+          if (want[i].req != NULL)
+            data = want[i].req->data.data;
+          else
+            {
+              data = old + want[i].off;
+              reused += want[i].len;
+            }
+          if (want[i].req != NULL && want[i].req->data.len != want[i].len)
+            ret = CACHE_CORRUPT;
+          else if (fwrite (data, 1, want[i].len, file) != want[i].len)
+            ret = CACHE_IO_FAILED;
+          digest_update (&dgst, data, want[i].len);
+          restored += want[i].len;
+        }
+      digest_final (&dgst, raw);
+      if (fclose (file) != 0 && ret == CACHE_OK)
+        ret = CACHE_IO_FAILED;
+      if (ret == CACHE_OK && memcmp (raw, digest, DIGEST_LEN) != 0)
+        ret = CACHE_CORRUPT;
+      if (ret == CACHE_OK && rename (tmp, path) != 0)
+        ret = CACHE_IO_FAILED;
+      if (ret == CACHE_CORRUPT)
+        set_err (cache, cpstrf ("Fetching %s: Contents do not match the "
+                                "digest\n", tree.hex));
+      else if (ret == CACHE_IO_FAILED)
+        set_err (cache, cpstrf ("Fetching %s: %s: %s\n", tree.hex, path,
+                                strerror (errno)));
+      if (ret != CACHE_OK)
+        unlink (tmp);
+    }
+
+  munmap (old, old_len);
+  for (i = 0; reqs != NULL && i < nreqs; i++)
+    buffer_destroy (&reqs[i].data);
+  free (reqs);
+  free (order);
+  free (have);
+  free (want);
+  free (tmp);
+
+  if (ret == CACHE_OK)
+    {
+      pthread_mutex_lock (&cache->lock);
+      cache->stats.hits++;
+      cache->stats.restored += restored;
+      cache->stats.dedup_recv += reused;
+      pthread_mutex_unlock (&cache->lock);
+    }
+
+  return ret;
+}
+
+cache_err_t
+cache_get (cache_t * cache, const uint8_t * digest, const char * path)
+{
+  struct _cache_req_t req;
+  struct stat st;
+  cache_err_t ret;
+
+  ret = lazy_get (&cache->started);
+  if (ret != CACHE_OK)
+    return ret;
+
+  /* A large old version is worth diffing against */
+  if (cache->chunk > 0 && stat (path, &st) == 0 && S_ISREG (st.st_mode) &&
+      (uint64_t) st.st_size >= cache->cdc.max)
+    {
+      ret = get_tree (cache, digest, path, st.st_size);
+      if (ret != CACHE_MISS)
+        return ret;
+    }
+
+  memset (&req, 0, sizeof (req));
+  req.op = REQ_GET;
+  req.digest = digest;
+  req.path = path;
+  digest_hex (digest, req.hex);
+  digest_init (&req.dgst);
+  req.tmp = cpstrf ("%s.part", path);
+  if (req.tmp == NULL)
+    {
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+  req.file = fopen (req.tmp, "wb");
+  if (req.file == NULL)
+    {
+      set_err (cache, cpstrf ("Failed to create %s: %s\n", req.tmp,
+                              strerror (errno)));
+      free (req.tmp);
+      return CACHE_IO_FAILED;
+    }
+
+  req_submit (cache, &req);
+  ret = req_wait (cache, &req);
+  free (req.tmp);
+
+  return ret;
+}
+
+/* Only sends the deflated copy of the body when it is actually smaller */
+static void
+deflate_body (cache_t * cache, struct _cache_req_t * req)
+{
+  uLongf clen;
+  uint8_t * zbuf;
+
+  if (!cache->compress || req->body_len == 0)
+    return;
+  clen = compressBound (req->body_len);
+  zbuf = (uint8_t*) malloc (clen);
+  if (zbuf != NULL &&
+      compress2 (zbuf, &clen, req->body, req->body_len, LEVEL) == Z_OK &&
+      clen < req->body_len)
+    {
+      free (req->body);
+      req->body = zbuf;
+      req->body_len = clen;
+      req->deflated = 1;
+    }
+  else
+    free (zbuf);
+}
+
+/* Uploads the chunks the cache lacks, then the chunk list once they
+   are all stored */
+static cache_err_t
+put_tree (cache_t * cache, const uint8_t * digest, const uint8_t * data,
+          size_t len)
+{
+  struct _cache_chunk_t * chunks;
+  struct _cache_req_t * tree, ** reqs = NULL;
+  size_t nchunks, nuniq = 0, nreqs = 0, i, j;
+  uint8_t * digests = NULL, * present = NULL;
+  uint64_t missing = 0;
+  cache_err_t ret;
+  char * line;
+
+  chunks = split (cache, data, len, &nchunks);
+  tree = (struct _cache_req_t*) calloc (1, sizeof (struct _cache_req_t));
+  if (tree != NULL && chunks != NULL)
+    tree->body = (uint8_t*) malloc (nchunks * (DIGEST_HEX_LEN + 21) + 1);
+  if (tree == NULL || chunks == NULL || tree->body == NULL)
+    {
+      if (tree != NULL)
+        free (tree->body);
+      free (tree);
+      free (chunks);
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+  tree->op = REQ_PUT_TREE;
+  tree->raw_len = len;
+  digest_hex (digest, tree->hex);
+  line = (char*) tree->body;
+  for (i = 0; i < nchunks; i++)
+    {
+      digest_hex (chunks[i].digest, line);
+      line += DIGEST_HEX_LEN - 1;
+      line += sprintf (line, " %llu\n", (unsigned long long) chunks[i].len);
+    }
+  tree->body_len = line - (char*) tree->body;
+
+  /* Ask about every distinct chunk at once */
+  qsort (chunks, nchunks, sizeof (*chunks), cmp_chunk);
+  for (i = 0; i < nchunks; i++)
+    if (i == 0 || cmp_chunk (&chunks[i-1], &chunks[i]) != 0)
+      chunks[nuniq++] = chunks[i];
+  digests = (uint8_t*) malloc (nuniq * DIGEST_LEN);
+  present = (uint8_t*) malloc (nuniq);
+  reqs = (struct _cache_req_t**) calloc (nuniq, sizeof (*reqs));
+  if (digests == NULL || present == NULL || reqs == NULL)
+    {
+      set_err (cache, cpstr (MALLOC_FAILED));
+      ret = CACHE_MALLOC_FAILED;
+    }
+  else
+    {
+      for (i = 0; i < nuniq; i++)
+        memcpy (digests + i*DIGEST_LEN, chunks[i].digest, DIGEST_LEN);
+      ret = cache_has (cache, digests, nuniq, present);
+    }
+
+  /* Build every upload before sending any so the list waits for all */
+  for (i = 0; ret == CACHE_OK && i < nuniq; i++)
+    {
+      if (present[i])
+        continue;
+      reqs[nreqs] = (struct _cache_req_t*)
+        calloc (1, sizeof (struct _cache_req_t));
+      if (reqs[nreqs] == NULL ||
+          (reqs[nreqs]->body = (uint8_t*) malloc (chunks[i].len)) == NULL)
+        {
+          set_err (cache, cpstr (MALLOC_FAILED));
+          ret = CACHE_MALLOC_FAILED;
+          nreqs++;
+          break;
+        }
+      reqs[nreqs]->op = REQ_PUT;
+      reqs[nreqs]->parent = tree;
+      digest_hex (chunks[i].digest, reqs[nreqs]->hex);
+      memcpy (reqs[nreqs]->body, data + chunks[i].off, chunks[i].len);
+      reqs[nreqs]->body_len = reqs[nreqs]->raw_len = chunks[i].len;
+      deflate_body (cache, reqs[nreqs++]);
+      missing += chunks[i].len;
+    }
+  free (digests);
+  free (present);
+  free (chunks);
+  if (ret != CACHE_OK)
+    {
+      for (j = 0; j < nreqs; j++)
+        {
+          if (reqs[j] != NULL)
+            free (reqs[j]->body);
+          free (reqs[j]);
+        }
+      free (reqs);
+      free (tree->body);
+      free (tree);
+      return ret;
+    }
+
+  tree->dedup = len - missing;
+  tree->waiting = nreqs;
+  if (nreqs == 0)
+    req_submit (cache, tree);
+  else
+    {
+      /* The list counts as an upload until its chunks are in */
+      pthread_mutex_lock (&cache->lock);
+      cache->uploads++;
+      pthread_mutex_unlock (&cache->lock);
+      for (i = 0; i < nreqs; i++)
+        req_submit (cache, reqs[i]);
+    }
+  free (reqs);
+
+  return CACHE_OK;
+}
+
+cache_err_t
+cache_put (cache_t * cache, const uint8_t * digest, const char * path)
+{
+  struct _cache_req_t * req;
+  struct stat st;
+  FILE * file;
+  cache_err_t ret;
+  size_t len;
+
+  ret = lazy_get (&cache->started);
+  if (ret != CACHE_OK)
+    return ret;
+  file = fopen (path, "rb");
+  if (file == NULL || fstat (fileno (file), &st) != 0)
+    {
+      set_err (cache, cpstrf ("Failed to open %s: %s\n", path,
+                              strerror (errno)));
+      if (file != NULL)
+        fclose (file);
+      return CACHE_IO_FAILED;
+    }
+  len = st.st_size;
+
+  req = (struct _cache_req_t*) calloc (1, sizeof (struct _cache_req_t));
+  if (req != NULL)
+    req->body = (uint8_t*) malloc (len + 1);
+  if (req == NULL || req->body == NULL)
+    {
+      fclose (file);
+      free (req);
+      set_err (cache, cpstr (MALLOC_FAILED));
+      return CACHE_MALLOC_FAILED;
+    }
+  if (fread (req->body, sizeof (uint8_t), len, file) != len)
+    {
+      set_err (cache, cpstrf ("Failed to read %s\n", path));
+      fclose (file);
+      free (req->body);
+      free (req);
+      return CACHE_IO_FAILED;
+    }
+  fclose (file);
+
+  if (cache->chunk > 0 && len >= cache->cdc.max)
+    {
+      ret = put_tree (cache, digest, req->body, len);
+      free (req->body);
+      free (req);
+      return ret;
+    }
+
+  req->op = REQ_PUT;
+  req->body_len = req->raw_len = len;
+  digest_hex (digest, req->hex);
+  deflate_body (cache, req);
+  req_submit (cache, req);
+
+  return CACHE_OK;
+}
+
+cache_err_t
+cache_flush (cache_t * cache)
+{
+  uint64_t failed;
+
+  pthread_mutex_lock (&cache->lock);
+  while (cache->uploads > 0)
+    pthread_cond_wait (&cache->done, &cache->lock);
+  failed = cache->failed_puts;
+  cache->failed_puts = 0;
+  pthread_mutex_unlock (&cache->lock);
+
+  return failed > 0 ? CACHE_HTTP_FAILED : CACHE_OK;
+}
+
+void
+cache_stats (cache_t * cache, cache_stats_t * stats)
+{
+  pthread_mutex_lock (&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock (&cache->lock);
+}
+
+const char *
+cache_get_err (cache_t * cache)
+{
+  return cache->err;
+}
+
+cache_err_t
+cache_destroy (cache_t * cache)
+{
+  lazy_destroy (&cache->started);
+  pthread_cond_destroy (&cache->done);
+  pthread_mutex_destroy (&cache->lock);
+
+  if (cache->url != NULL)
+    free (cache->url);
+  cache->url = NULL;
+  if (cache->err != NULL)
+    free (cache->err);
+  cache->err = NULL;
+
+  return CACHE_OK;
+}
+
+const char *
+cache_err_str (cache_err_t err)
+{
+  switch (err)
+    {
+    case CACHE_OK:
+      return "Success";
+    case CACHE_MISS:
+      return "The blob is not in the cache";
+    case CACHE_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case CACHE_IO_FAILED:
+      return "Reading or writing a local file failed";
+    case CACHE_HTTP_FAILED:
+      return "The transfer or the server failed";
+    case CACHE_CORRUPT:
+      return "A downloaded blob did not match its digest";
+    case CACHE_THREAD_FAILED:
+      return "Starting the transfer thread failed";
+    case CACHE_INVALID:
+      return "Invalid argument";
+    case CACHE_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
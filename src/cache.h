@@ -0,0 +1,229 @@
+/**
+   @file cache.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Remote Artifact Cache Client
+   @details Shares build artifacts between builders through a content
+   addressed HTTP cache. Blobs are named by the hex SHA-256 digest of
+   their contents:
+
+   GET /cas/DIGEST fetches a blob, 404 if it is missing.
+   PUT /cas/DIGEST stores a blob, the server checks the digest.
+   POST /has takes one hex digest per line and answers with one '1' or
+   '0' per digest, in the same order.
+   PUT /tree/DIGEST stores a blob as the list of its chunks, one
+   "CHUNK LENGTH" line per chunk in order. Every chunk must already be
+   in the cache, the server checks them against the digest of the blob.
+   GET /tree/DIGEST fetches the list, 404 if the blob was not stored
+   as chunks.
+
+   Large blobs are cut into content defined chunks (see cdc.h) which
+   are stored as blobs of their own, so only the chunks the cache does
+   not have yet are uploaded. A restore over an older version of the
+   same file fetches the chunk list and only downloads the chunks the
+   old file does not contain.
+
+   Uploads may be deflated with Content-Encoding: deflate and
+   downloads accept the same encoding. Every transfer runs on a single
+   background thread driving a libcurl multi handle, so fetches from
+   many build threads and queued uploads proceed concurrently with the
+   build over a small pool of kept alive connections. libcurl and the
+   thread are only started by the first transfer.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "cdc.h"
+#include "conf.h"
+#include "digest.h"
+#include "lazy.h"
+
+#define CACHE_HAS_BATCH 1024 /**< Most digests checked per request */
+
+/**
+   @brief Cache Error Codes
+**/
+typedef enum _cache_err_t
+  {
+    CACHE_OK = 0, /**< Success */
+    CACHE_MISS, /**< The blob is not in the cache */
+    CACHE_MALLOC_FAILED, /**< Allocating Memory Failed */
+    CACHE_IO_FAILED, /**< Reading or writing a local file failed */
+    CACHE_HTTP_FAILED, /**< The transfer or the server failed */
+    CACHE_CORRUPT, /**< A downloaded blob did not match its digest */
+    CACHE_THREAD_FAILED, /**< Starting the transfer thread failed */
+    CACHE_INVALID, /**< An invalid argument */
+    CACHE_UNKNOWN /**< Unknown Error */
+  } cache_err_t;
+
+/**
+   @brief Transfer Counters
+**/
+typedef struct _cache_stats_t
+{
+  uint64_t hits; /**< Blobs restored */
+  uint64_t misses; /**< Blobs the cache did not have */
+  uint64_t puts; /**< Blobs uploaded */
+  uint64_t checks; /**< Digests checked by cache_has */
+  uint64_t failures; /**< Transfers which failed */
+  uint64_t wire_recv; /**< Body bytes received over the wire */
+  uint64_t restored; /**< Bytes written to restored files */
+  uint64_t wire_sent; /**< Body bytes sent over the wire */
+  uint64_t uploaded; /**< Uncompressed bytes of the uploaded blobs */
+  uint64_t dedup_sent; /**< Bytes of uploaded blobs the cache had */
+  uint64_t dedup_recv; /**< Bytes of restored blobs taken from the old file */
+  uint64_t chunked; /**< Bytes cut into chunks */
+  uint64_t chunk_ns; /**< Time spent cutting and digesting chunks */
+} cache_stats_t;
+
+/**
+   @brief Cache Client Structure
+**/
+typedef struct _cache_t
+{
+  char * err; /**< Last Error String, replaced under lock */
+  char * url; /**< Base URL without a trailing slash */
+  size_t parallel; /**< Most transfers in flight */
+  int compress; /**< Deflate uploads and accept deflated downloads */
+  long timeout_ms; /**< Limit on each transfer or 0 */
+  size_t chunk; /**< Average chunk size or 0 to send whole blobs */
+  cdc_t cdc; /**< Chunker for blobs of at least cdc.max bytes */
+  void * multi; /**< libcurl multi handle */
+  pthread_t thread; /**< Transfer thread */
+  lazy_t started; /**< Starts libcurl and the thread on first use */
+  int stop; /**< Asks the transfer thread to exit once idle */
+  pthread_mutex_t lock; /**< Guards everything below */
+  pthread_cond_t done; /**< Signalled as requests finish */
+  struct _cache_req_t * head; /**< Requests waiting to start */
+  struct _cache_req_t * tail; /**< Last waiting request */
+  size_t active; /**< Requests in flight */
+  size_t uploads; /**< Queued and running uploads */
+  uint64_t failed_puts; /**< Uploads failed since the last flush */
+  cache_stats_t stats; /**< Transfer counters */
+} cache_t;
+
+/**
+   @brief Creates a New Cache Client
+   @param cache The client structure to be initialized
+   @param url The base URL of the cache, ie. http://host:8734
+   @param parallel The most transfers in flight. Set this to 0 for the
+   default.
+   @param compress 1 to deflate uploads and accept deflated downloads
+   @return CACHE_OK(0) on success or a positive error code
+**/
+cache_err_t cache_init (cache_t * cache, const char * url, size_t parallel,
+                        int compress);
+
+/**
+   @brief Creates a Cache Client from the Configuration
+   @details Reads the CACHE_URL, CACHE_PARALLEL, CACHE_COMPRESS,
+   CACHE_TIMEOUT and CACHE_CHUNK keys. CACHE_URL must be set.
+   @param cache The client structure to be initialized
+   @param conf The parsed configuration
+   @return CACHE_OK(0) on success or a positive error code
+**/
+cache_err_t cache_init_conf (cache_t * cache, conf_t * conf);
+
+/**
+   @brief Checks which Blobs the Cache Has
+   @details Sends the digests in batches of CACHE_HAS_BATCH, all in
+   flight at once.
+   @param cache The client structure
+   @param digests count raw digests of DIGEST_LEN bytes each
+   @param count The number of digests
+   @param present Set to 1 for every digest the cache has, otherwise 0
+   @return CACHE_OK(0) on success or a positive error code
+**/
+cache_err_t cache_has (cache_t * cache, const uint8_t * digests,
+                       size_t count, uint8_t * present);
+
+/**
+   @brief Restores a Blob
+   @details Downloads next to path and renames the file into place
+   once its contents match the digest. When path already holds a large
+   file, the chunks it shares with the blob are copied from it instead
+   of downloaded. May be called from any number of threads at once.
+   @param cache The client structure
+   @param digest The raw digest of the blob
+   @param path The file to restore
+   @return CACHE_OK(0) on success, CACHE_MISS if the cache does not
+   have the blob or a positive error code
+**/
+cache_err_t cache_get (cache_t * cache, const uint8_t * digest,
+                       const char * path);
+
+/**
+   @brief Queues a Blob for Upload
+   @details Reads and compresses the file in the calling thread and
+   returns without waiting for the transfer. Large files are chunked,
+   which waits for the cache to say which chunks it is missing.
+   @param cache The client structure
+   @param digest The raw digest of the file contents
+   @param path The file to upload
+   @return CACHE_OK(0) once queued or a positive error code
+**/
+cache_err_t cache_put (cache_t * cache, const uint8_t * digest,
+                       const char * path);
+
+/**
+   @brief Waits for Queued Uploads
+   @param cache The client structure
+   @return CACHE_OK(0) if every upload since the last flush succeeded,
+   otherwise CACHE_HTTP_FAILED
+**/
+cache_err_t cache_flush (cache_t * cache);
+
+/**
+   @brief Reads the Transfer Counters
+   @param cache The client structure
+   @param stats Filled in with a snapshot of the counters
+**/
+void cache_stats (cache_t * cache, cache_stats_t * stats);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param cache The client structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * cache_get_err (cache_t * cache);
+
+/**
+   @brief Destroys the Cache Client
+   @details Waits for queued uploads before stopping the transfer
+   thread.
+   @param cache The client structure to be destroyed
+   @return CACHE_OK(0) on success or a positive error code
+**/
+cache_err_t cache_destroy (cache_t * cache);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * cache_err_str (cache_err_t err);
+
+#endif
@@ -0,0 +1,1056 @@
+/**
+   @file cachesrv.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Local Artifact Cache Server
+   @details Serves the protocol of cache.h over a directory. Blobs
+   live in DIR/XX/DIGEST, or DIR/XX/DIGEST.z when they were uploaded
+   deflated, where XX is the first two digits of the digest. Blobs
+   uploaded as chunks only keep their chunk list in DIR/XX/DIGEST.t
+   and are put back together from the chunks when fetched whole. New
+   blobs are written to a temporary file and renamed into place so a
+   partial upload is never served.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "buffer.h"
+#include "cachesrv.h"
+#include "digest.h"
+#include "log.h"
+#include "util.h"
+
+#define DEFAULT_MAX_BLOB (1ull<<30)
+#define HEADER_MAX 16384
+#define REPLY_MAX 512
+#define PATH_BUF 256
+#define CHUNK 65536
+#define BACKLOG 64
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Open Connection
+**/
+struct _cachesrv_conn_t
+{
+  cachesrv_t * srv; /**< Owning server */
+  struct _cachesrv_conn_t * next; /**< Next open connection */
+  struct _cachesrv_conn_t ** prev; /**< Link pointing at this one */
+  int fd; /**< Client socket */
+  size_t len; /**< Bytes held in buf */
+  char buf[HEADER_MAX]; /**< Request head and bytes read past it */
+};
+
+/**
+   @brief Chunk Being Checked or Sent
+**/
+struct _cachesrv_chunk_t
+{
+  cachesrv_t * srv; /**< Owning server */
+  int fd; /**< Client socket the chunk is sent to */
+  int ok; /**< Cleared once sending fails */
+  digest_t * blob; /**< Digest of the whole blob */
+  digest_t chunk; /**< Digest of the chunk alone */
+  uint64_t len; /**< Bytes of the chunk seen */
+};
+
+/**
+   @brief Parsed Request
+**/
+struct _cachesrv_req_t
+{
+  const char * method; /**< Request method */
+  const char * target; /**< Request target */
+  uint64_t length; /**< Content-Length or 0 */
+  int deflated; /**< The body is deflated */
+  int accept; /**< The client accepts deflated bodies */
+  int close; /**< Close the connection after replying */
+  int expect; /**< The client waits for 100 Continue */
+  int chunked; /**< The body uses a transfer encoding */
+  int head; /**< Reply without a body */
+  uint8_t * body; /**< The request body */
+};
+
+static int
+send_all (int fd, const void * data, size_t len)
+{
+  const char * ptr = (const char*) data;
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = send (fd, ptr, len, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return 0;
+      ptr += ret;
+      len -= ret;
+    }
+  return 1;
+}
+
+static int
+reply (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req, int status,
+       const char * reason, const char * extra, const void * body,
+       size_t len)
+{
+  char head[REPLY_MAX];
+  int n;
+
+  n = snprintf (head, sizeof (head), "HTTP/1.1 %d %s\r\n"
+                "Content-Length: %zu\r\n%s%s\r\n", status, reason, len,
+                extra != NULL ? extra : "",
+                req->close ? "Connection: close\r\n" : "");
+  if (!send_all (fd, head, n))
+    return 0;
+  if (body == NULL || req->head)
+    return 1;
+  __atomic_add_fetch (&srv->bytes_out, len, __ATOMIC_RELAXED);
+  return send_all (fd, body, len);
+}
+
+static int
+valid_hex (const char * hex)
+{
+  size_t i;
+
+  for (i = 0; i < DIGEST_HEX_LEN - 1; i++)
+    if (!((hex[i] >= '0' && hex[i] <= '9') ||
+          (hex[i] >= 'a' && hex[i] <= 'f')))
+      return 0;
+  return hex[i] == '\0';
+}
+
+static char *
+blob_path (cachesrv_t * srv, char * buf, size_t len, const char * hex,
+           const char * suffix)
+{
+  return fmtstr (buf, len, "%s/%.2s/%s%s", srv->dir, hex, hex, suffix);
+}
+
+static int
+blob_exists (cachesrv_t * srv, const char * hex, const char * suffix)
+{
+  char buf[PATH_BUF], * path;
+  int ret;
+
+  path = blob_path (srv, buf, sizeof (buf), hex, suffix);
+  if (path == NULL)
+    return 0;
+  ret = access (path, F_OK) == 0;
+  if (path != buf)
+    free (path);
+  return ret;
+}
+
+/* Any of the encodings a blob may be stored in */
+static int
+blob_stored (cachesrv_t * srv, const char * hex)
+{
+  return blob_exists (srv, hex, "") || blob_exists (srv, hex, ".z") ||
+    blob_exists (srv, hex, ".t");
+}
+
+/* Reads a whole file, NULL if it cannot be read */
+static uint8_t *
+load_file (const char * path, size_t * len)
+{
+  uint8_t * data = NULL;
+  struct stat st;
+  int file;
+
+  file = open (path, O_RDONLY);
+  if (file < 0)
+    return NULL;
+  if (fstat (file, &st) == 0 &&
+      (data = (uint8_t*) malloc (st.st_size + 1)) != NULL &&
+      read (file, data, st.st_size) != st.st_size)
+    {
+      free (data);
+      data = NULL;
+    }
+  close (file);
+  if (data != NULL)
+    {
+      data[st.st_size] = '\0';
+      *len = st.st_size;
+    }
+
+  return data;
+}
+
+/* Parses the next "DIGEST LENGTH" line of a chunk list */
+static int
+next_chunk (const char ** ptr, const char * end, char * hex, uint64_t * len)
+{
+  const char * line = *ptr;
+  char * num_end;
+
+  if (end - line < DIGEST_HEX_LEN + 2 || line[DIGEST_HEX_LEN - 1] != ' ' ||
+      line[DIGEST_HEX_LEN] < '0' || line[DIGEST_HEX_LEN] > '9')
+    return 0;
+  memcpy (hex, line, DIGEST_HEX_LEN - 1);
+  hex[DIGEST_HEX_LEN - 1] = '\0';
+  *len = strtoull (line + DIGEST_HEX_LEN, &num_end, 10);
+  if (!valid_hex (hex) || num_end >= end || *num_end != '\n' || *len == 0)
+    return 0;
+  *ptr = num_end + 1;
+  return 1;
+}
+
+/* Feeds the inflated data to cb, 1 on success or 0 if it is corrupt */
+static int
+inflate_cb (const uint8_t * in, size_t len,
+            void (*cb) (void * arg, const uint8_t * data, size_t len),
+            void * arg)
+{
+  uint8_t out[CHUNK];
+  z_stream zs;
+  int ret;
+
+  memset (&zs, 0, sizeof (zs));
+  if (inflateInit (&zs) != Z_OK)
+    return 0;
+  zs.next_in = (Bytef*) in;
+  zs.avail_in = len;
+  do
+    {
+      zs.next_out = out;
+      zs.avail_out = sizeof (out);
+      ret = inflate (&zs, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END)
+        break;
+      cb (arg, out, sizeof (out) - zs.avail_out);
+    }
+  while (ret != Z_STREAM_END);
+  inflateEnd (&zs);
+
+  return ret == Z_STREAM_END && zs.avail_in == 0;
+}
+
+static void
+digest_cb (void * arg, const uint8_t * data, size_t len)
+{
+  digest_update ((digest_t*) arg, data, len);
+}
+
+static void
+chunk_cb (void * arg, const uint8_t * data, size_t len)
+{
+  struct _cachesrv_chunk_t * chunk = (struct _cachesrv_chunk_t*) arg;
+
+  digest_update (chunk->blob, data, len);
+  digest_update (&chunk->chunk, data, len);
+  chunk->len += len;
+}
+
+static void
+send_cb (void * arg, const uint8_t * data, size_t len)
+{
+  struct _cachesrv_chunk_t * chunk = (struct _cachesrv_chunk_t*) arg;
+
+  if (!chunk->ok)
+    return;
+  chunk->ok = send_all (chunk->fd, data, len);
+  if (chunk->ok)
+    __atomic_add_fetch (&chunk->srv->bytes_out, len, __ATOMIC_RELAXED);
+}
+
+static void
+buffer_cb (void * arg, const uint8_t * data, size_t len)
+{
+  buffer_t * buff = (buffer_t*) arg;
+
+  /* A failed append drops the data so the caller sees it */
+  if (buff->data != NULL && buffer_add (buff, (void*)data, len) != BUFF_OK)
+    {
+      free (buff->data);
+      buff->data = NULL;
+    }
+}
+
+static int
+serve_file (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+            const char * path, const char * extra)
+{
+  struct stat st;
+  off_t off = 0;
+  ssize_t ret;
+  int file;
+
+  file = open (path, O_RDONLY);
+  if (file < 0 || fstat (file, &st) != 0)
+    {
+      if (file >= 0)
+        close (file);
+      return -1;
+    }
+  if (!reply (srv, fd, req, 200, "OK", extra, NULL, st.st_size))
+    {
+      close (file);
+      return 0;
+    }
+  if (!req->head)
+    while (off < st.st_size)
+      {
+        ret = sendfile (fd, file, &off, st.st_size - off);
+        if (ret < 0 && errno == EINTR)
+          continue;
+        if (ret <= 0)
+          {
+            close (file);
+            return 0;
+          }
+        __atomic_add_fetch (&srv->bytes_out, ret, __ATOMIC_RELAXED);
+      }
+  close (file);
+
+  return 1;
+}
+
+/* Feeds the plain contents of a stored blob to cb, 0 if it is missing
+   or corrupt */
+static int
+read_blob (cachesrv_t * srv, const char * hex,
+           void (*cb) (void * arg, const uint8_t * data, size_t len),
+           void * arg)
+{
+  char buf[PATH_BUF], * path;
+  int deflated, ok = 0;
+  uint8_t * data;
+  size_t len;
+
+  deflated = !blob_exists (srv, hex, "");
+  path = blob_path (srv, buf, sizeof (buf), hex, deflated ? ".z" : "");
+  data = path != NULL ? load_file (path, &len) : NULL;
+  if (data != NULL && deflated)
+    ok = inflate_cb (data, len, cb, arg);
+  else if (data != NULL)
+    {
+      cb (arg, data, len);
+      ok = 1;
+    }
+  free (data);
+  if (path != NULL && path != buf)
+    free (path);
+
+  return ok;
+}
+
+/* Sends a blob stored as chunks, -1 if nothing could be sent */
+static int
+serve_tree (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+            const char * hex)
+{
+  struct _cachesrv_chunk_t chunk;
+  char buf[PATH_BUF], name[DIGEST_HEX_LEN], * path;
+  const char * ptr, * end;
+  uint64_t len, total = 0;
+  uint8_t * list;
+  size_t list_len;
+
+  path = blob_path (srv, buf, sizeof (buf), hex, ".t");
+  list = path != NULL ? load_file (path, &list_len) : NULL;
+  if (path != NULL && path != buf)
+    free (path);
+  if (list == NULL)
+    return -1;
+  ptr = (const char*) list;
+  end = ptr + list_len;
+  while (ptr < end && next_chunk (&ptr, end, name, &len))
+    total += len;
+  if (ptr != end || !reply (srv, fd, req, 200, "OK", NULL, NULL, total))
+    {
+      free (list);
+      return ptr != end ? -1 : 0;
+    }
+
+  /* The length is out, a missing chunk can only drop the connection */
+  memset (&chunk, 0, sizeof (chunk));
+  chunk.srv = srv;
+  chunk.fd = fd;
+  chunk.ok = 1;
+  ptr = (const char*) list;
+  while (!req->head && chunk.ok && ptr < end &&
+         next_chunk (&ptr, end, name, &len))
+    chunk.ok = read_blob (srv, name, send_cb, &chunk) && chunk.ok;
+  free (list);
+
+  return chunk.ok;
+}
+
+static int
+handle_get (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+            const char * hex)
+{
+  char buf[PATH_BUF], * path;
+  buffer_t plain;
+  int ret = -1;
+
+  /* Prefer sending the blob as it is stored */
+  if (req->accept && blob_exists (srv, hex, ".z"))
+    {
+      path = blob_path (srv, buf, sizeof (buf), hex, ".z");
+      ret = path == NULL ? -1 :
+        serve_file (srv, fd, req, path, "Content-Encoding: deflate\r\n");
+    }
+  else if (blob_exists (srv, hex, ""))
+    {
+      path = blob_path (srv, buf, sizeof (buf), hex, "");
+      ret = path != NULL ? serve_file (srv, fd, req, path, NULL) : -1;
+    }
+  else if (blob_exists (srv, hex, ".z"))
+    {
+      /* The client cannot take the deflated blob */
+      path = buf;
+      if (buffer_init (&plain, CHUNK, 0) == BUFF_OK)
+        {
+          if (read_blob (srv, hex, buffer_cb, &plain) && plain.data != NULL)
+            ret = reply (srv, fd, req, 200, "OK", NULL, plain.data,
+                         plain.len);
+          buffer_destroy (&plain);
+        }
+    }
+  else if (blob_exists (srv, hex, ".t"))
+    {
+      path = buf;
+      ret = serve_tree (srv, fd, req, hex);
+    }
+  else
+    return reply (srv, fd, req, 404, "Not Found", NULL, "", 0);
+
+  if (path != buf)
+    free (path);
+  if (ret < 0)
+    return reply (srv, fd, req, 500, "Internal Server Error", NULL, "", 0);
+  return ret;
+}
+
+/* Writes next to the final name and renames into place */
+static int
+store (cachesrv_t * srv, const char * hex, const char * suffix,
+       const uint8_t * data, size_t len)
+{
+  char buf[PATH_BUF], tmp[PATH_BUF], * path;
+  int file, ok;
+
+  path = fmtstr (buf, sizeof (buf), "%s/%.2s", srv->dir, hex);
+  ok = path != NULL && (mkdir (path, 0755) == 0 || errno == EEXIST) &&
+    (size_t) snprintf (tmp, sizeof (tmp), "%s/.tmpXXXXXX", path) <
+    sizeof (tmp);
+  if (path != NULL && path != buf)
+    free (path);
+  file = ok ? mkstemp (tmp) : -1;
+  if (file < 0)
+    return 0;
+  ok = write (file, data, len) == (ssize_t) len;
+  ok = close (file) == 0 && ok;
+  path = blob_path (srv, buf, sizeof (buf), hex, suffix);
+  ok = ok && path != NULL && rename (tmp, path) == 0;
+  if (path != NULL && path != buf)
+    free (path);
+  if (!ok)
+    unlink (tmp);
+
+  return ok;
+}
+
+static int
+handle_put (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+            const char * hex)
+{
+  char hash[DIGEST_HEX_LEN];
+  uint8_t raw[DIGEST_LEN];
+  digest_t dgst;
+  int ok;
+
+  /* Never store a blob under the wrong name */
+  digest_init (&dgst);
+  if (req->deflated)
+    ok = inflate_cb (req->body, req->length, digest_cb, &dgst);
+  else
+    {
+      digest_update (&dgst, req->body, req->length);
+      ok = 1;
+    }
+  digest_final (&dgst, raw);
+  digest_hex (raw, hash);
+  if (!ok || strcmp (hash, hex) != 0)
+    return reply (srv, fd, req, 400, "Bad Request", NULL,
+                  "Digest Mismatch\n", 16);
+
+  if (blob_stored (srv, hex))
+    return reply (srv, fd, req, 200, "OK", NULL, "", 0);
+
+  if (!store (srv, hex, req->deflated ? ".z" : "", req->body, req->length))
+    return reply (srv, fd, req, 500, "Internal Server Error", NULL, "", 0);
+  __atomic_add_fetch (&srv->stored, 1, __ATOMIC_RELAXED);
+
+  return reply (srv, fd, req, 201, "Created", NULL, "", 0);
+}
+
+static int
+handle_put_tree (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+                 const char * hex)
+{
+  struct _cachesrv_chunk_t chunk;
+  char name[DIGEST_HEX_LEN], hash[DIGEST_HEX_LEN];
+  const char * ptr, * end;
+  uint8_t raw[DIGEST_LEN];
+  digest_t blob;
+  uint64_t len;
+
+  /* Lists are small and always sent plain */
+  if (req->deflated)
+    return reply (srv, fd, req, 415, "Unsupported Media Type", NULL, "", 0);
+  if (blob_stored (srv, hex))
+    return reply (srv, fd, req, 200, "OK", NULL, "", 0);
+
+  /* Every chunk must be stored and add up to the blob */
+  digest_init (&blob);
+  memset (&chunk, 0, sizeof (chunk));
+  chunk.blob = &blob;
+  ptr = (const char*) req->body;
+  end = ptr + req->length;
+  while (ptr < end)
+    {
+      if (!next_chunk (&ptr, end, name, &len))
+        return reply (srv, fd, req, 400, "Bad Request", NULL,
+                      "Invalid Chunk List\n", 19);
+      digest_init (&chunk.chunk);
+      chunk.len = 0;
+      if (!read_blob (srv, name, chunk_cb, &chunk))
+        return reply (srv, fd, req, 409, "Conflict", NULL,
+                      "Missing Chunk\n", 14);
+      digest_final (&chunk.chunk, raw);
+      digest_hex (raw, hash);
+      if (chunk.len != len || strcmp (hash, name) != 0)
+        return reply (srv, fd, req, 409, "Conflict", NULL,
+                      "Corrupt Chunk\n", 14);
+    }
+  digest_final (&blob, raw);
+  digest_hex (raw, hash);
+  if (req->length == 0 || strcmp (hash, hex) != 0)
+    return reply (srv, fd, req, 400, "Bad Request", NULL,
+                  "Digest Mismatch\n", 16);
+
+  if (!store (srv, hex, ".t", req->body, req->length))
+    return reply (srv, fd, req, 500, "Internal Server Error", NULL, "", 0);
+  __atomic_add_fetch (&srv->trees, 1, __ATOMIC_RELAXED);
+
+  return reply (srv, fd, req, 201, "Created", NULL, "", 0);
+}
+
+static int
+handle_get_tree (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req,
+                 const char * hex)
+{
+  char buf[PATH_BUF], * path;
+  int ret;
+
+  if (!blob_exists (srv, hex, ".t"))
+    return reply (srv, fd, req, 404, "Not Found", NULL, "", 0);
+  path = blob_path (srv, buf, sizeof (buf), hex, ".t");
+  ret = path != NULL ?
+    serve_file (srv, fd, req, path, "Content-Type: text/plain\r\n") : -1;
+  if (path != NULL && path != buf)
+    free (path);
+  if (ret < 0)
+    return reply (srv, fd, req, 500, "Internal Server Error", NULL, "", 0);
+  return ret;
+}
+
+static int
+handle_has (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req)
+{
+  char * body, * line, * save, * ans;
+  size_t count = 0;
+  int ret;
+
+  /* Answers are never longer than the question */
+  body = (char*) req->body;
+  body[req->length] = '\0';
+  ans = (char*) malloc (req->length + 1);
+  if (ans == NULL)
+    return reply (srv, fd, req, 500, "Internal Server Error", NULL, "", 0);
+  for (line = strtok_r (body, "\r\n", &save); line != NULL;
+       line = strtok_r (NULL, "\r\n", &save))
+    ans[count++] = valid_hex (line) && blob_stored (srv, line) ? '1' : '0';
+  ret = reply (srv, fd, req, 200, "OK", "Content-Type: text/plain\r\n", ans,
+               count);
+  free (ans);
+
+  return ret;
+}
+
+static int
+parse_head (char * head, struct _cachesrv_req_t * req)
+{
+  char * line, * save, * val, * end;
+
+  memset (req, 0, sizeof (struct _cachesrv_req_t));
+  line = strtok_r (head, "\r\n", &save);
+  if (line == NULL)
+    return 0;
+
+  /* Request line */
+  req->method = line;
+  req->target = strchr (line, ' ');
+  if (req->target == NULL)
+    return 0;
+  *(char*)req->target++ = '\0';
+  end = strchr (req->target, ' ');
+  if (end == NULL)
+    return 0;
+  *end++ = '\0';
+  if (strcmp (end, "HTTP/1.0") == 0)
+    req->close = 1;
+  else if (strcmp (end, "HTTP/1.1") != 0)
+    return 0;
+  req->head = strcmp (req->method, "HEAD") == 0;
+
+  /* Only a few headers matter */
+  while ((line = strtok_r (NULL, "\r\n", &save)) != NULL)
+    {
+      val = strchr (line, ':');
+      if (val == NULL)
+        return 0;
+      *val++ = '\0';
+      while (*val == ' ' || *val == '\t')
+        val++;
+      if (strcasecmp (line, "Content-Length") == 0)
+        {
+          req->length = strtoull (val, &end, 10);
+          if (val[0] < '0' || val[0] > '9' || *end != '\0')
+            return 0;
+        }
+      else if (strcasecmp (line, "Content-Encoding") == 0)
+        {
+          if (strcasecmp (val, "deflate") != 0)
+            return 0;
+          req->deflated = 1;
+        }
+      else if (strcasecmp (line, "Accept-Encoding") == 0)
+        req->accept = strstr (val, "deflate") != NULL;
+      else if (strcasecmp (line, "Connection") == 0)
+        req->close = strcasecmp (val, "close") == 0 ? 1 :
+          strcasecmp (val, "keep-alive") == 0 ? 0 : req->close;
+      else if (strcasecmp (line, "Expect") == 0)
+        req->expect = strcasecmp (val, "100-continue") == 0;
+      else if (strcasecmp (line, "Transfer-Encoding") == 0)
+        req->chunked = 1;
+    }
+
+  return 1;
+}
+
+static int
+handle (cachesrv_t * srv, int fd, struct _cachesrv_req_t * req)
+{
+  const char * hex;
+
+  __atomic_add_fetch (&srv->requests, 1, __ATOMIC_RELAXED);
+  if (strncmp (req->target, "/cas/", 5) == 0)
+    {
+      hex = req->target + 5;
+      if (!valid_hex (hex))
+        return reply (srv, fd, req, 404, "Not Found", NULL, "", 0);
+      if (strcmp (req->method, "GET") == 0 || req->head)
+        return handle_get (srv, fd, req, hex);
+      if (strcmp (req->method, "PUT") == 0)
+        return handle_put (srv, fd, req, hex);
+    }
+  else if (strncmp (req->target, "/tree/", 6) == 0)
+    {
+      hex = req->target + 6;
+      if (!valid_hex (hex))
+        return reply (srv, fd, req, 404, "Not Found", NULL, "", 0);
+      if (strcmp (req->method, "GET") == 0 || req->head)
+        return handle_get_tree (srv, fd, req, hex);
+      if (strcmp (req->method, "PUT") == 0)
+        return handle_put_tree (srv, fd, req, hex);
+    }
+  else if (strcmp (req->target, "/has") == 0)
+    {
+      if (strcmp (req->method, "POST") == 0)
+        return handle_has (srv, fd, req);
+    }
+  else
+    return reply (srv, fd, req, 404, "Not Found", NULL, "", 0);
+
+  return reply (srv, fd, req, 405, "Method Not Allowed", NULL, "", 0);
+}
+
+static void *
+conn_main (void * arg)
+{
+  struct _cachesrv_conn_t * conn = (struct _cachesrv_conn_t*) arg;
+  cachesrv_t * srv = conn->srv;
+  struct _cachesrv_req_t req;
+  size_t head, have, got;
+  ssize_t ret;
+  char * end;
+  int one = 1;
+
+  setsockopt (conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  for (;;)
+    {
+      /* Read until the end of the head */
+      memset (&req, 0, sizeof (req));
+      while ((end = memmem (conn->buf, conn->len, "\r\n\r\n", 4)) == NULL)
+        {
+          if (conn->len == sizeof (conn->buf))
+            {
+              req.close = 1;
+              reply (srv, conn->fd, &req, 431, "Request Header Fields Too "
+                     "Large", NULL, "", 0);
+              goto done;
+            }
+          ret = recv (conn->fd, conn->buf + conn->len,
+                      sizeof (conn->buf) - conn->len, 0);
+          if (ret < 0 && errno == EINTR)
+            continue;
+          if (ret <= 0)
+            goto done;
+          conn->len += ret;
+        }
+      *end = '\0';
+      head = end - conn->buf + 4;
+      if (!parse_head (conn->buf, &req) || req.chunked ||
+          req.length > srv->max_blob)
+        {
+          req.close = 1;
+          if (req.chunked)
+            reply (srv, conn->fd, &req, 411, "Length Required", NULL, "", 0);
+          else if (req.method != NULL && req.length > srv->max_blob)
+            reply (srv, conn->fd, &req, 413, "Payload Too Large", NULL, "",
+                   0);
+          else
+            reply (srv, conn->fd, &req, 400, "Bad Request", NULL, "", 0);
+          goto done;
+        }
+
+      /* Gather the body, part of it may already be buffered */
+      req.body = (uint8_t*) malloc (req.length + 1);
+      if (req.body == NULL)
+        {
+          req.close = 1;
+          reply (srv, conn->fd, &req, 500, "Internal Server Error", NULL, "",
+                 0);
+          goto done;
+        }
+      have = conn->len - head;
+      got = have < req.length ? have : req.length;
+      memcpy (req.body, conn->buf + head, got);
+      memmove (conn->buf, conn->buf + head + got, have - got);
+      conn->len = have - got;
+      if (got < req.length && req.expect &&
+          !send_all (conn->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25))
+        {
+          free (req.body);
+          goto done;
+        }
+      while (got < req.length)
+        {
+          ret = recv (conn->fd, req.body + got, req.length - got, 0);
+          if (ret < 0 && errno == EINTR)
+            continue;
+          if (ret <= 0)
+            {
+              free (req.body);
+              goto done;
+            }
+          got += ret;
+        }
+      __atomic_add_fetch (&srv->bytes_in, req.length, __ATOMIC_RELAXED);
+
+      ret = handle (srv, conn->fd, &req);
+      free (req.body);
+      if (!ret || req.close || __atomic_load_n (&srv->stop, __ATOMIC_RELAXED))
+        break;
+    }
+
+ done:
+  /* Unlinked first so cachesrv_destroy never shuts down a reused fd */
+  pthread_mutex_lock (&srv->lock);
+  *conn->prev = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  if (--srv->conns == 0)
+    pthread_cond_broadcast (&srv->idle);
+  pthread_mutex_unlock (&srv->lock);
+  close (conn->fd);
+  free (conn);
+
+  return NULL;
+}
+
+cachesrv_err_t
+cachesrv_init (cachesrv_t * srv, const char * dir, const char * listen_addr,
+               uint64_t max_blob)
+{
+  struct addrinfo hints, * res, * ai;
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof (addr);
+  char * host, * port;
+  int one = 1;
+
+  /* Initialize the struct */
+  memset (srv, 0, sizeof (cachesrv_t));
+  pthread_mutex_init (&srv->lock, NULL);
+  pthread_cond_init (&srv->idle, NULL);
+  srv->fd = -1;
+  srv->max_blob = max_blob > 0 ? max_blob : DEFAULT_MAX_BLOB;
+  srv->dir = cpstr (dir);
+  host = cpstr (listen_addr);
+  if (srv->dir == NULL || host == NULL)
+    {
+      free (host);
+      srv->err = cpstr (MALLOC_FAILED);
+      return CACHESRV_MALLOC_FAILED;
+    }
+  if (mkdir (dir, 0755) != 0 && errno != EEXIST)
+    {
+      free (host);
+      srv->err = cpstrf ("Failed to create %s: %s\n", dir, strerror (errno));
+      return CACHESRV_NO_DIR;
+    }
+
+  /* HOST:PORT, the host may be empty to listen everywhere */
+  port = strrchr (host, ':');
+  if (port == NULL)
+    {
+      srv->err = cpstrf ("Invalid listen address: %s\n", listen_addr);
+      free (host);
+      return CACHESRV_INVALID;
+    }
+  *port++ = '\0';
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo (host[0] != '\0' ? host : NULL, port, &hints, &res) != 0)
+    {
+      srv->err = cpstrf ("Invalid listen address: %s\n", listen_addr);
+      free (host);
+      return CACHESRV_INVALID;
+    }
+  free (host);
+
+  for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+      srv->fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+      if (srv->fd < 0)
+        continue;
+      setsockopt (srv->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+      if (bind (srv->fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+          listen (srv->fd, BACKLOG) == 0)
+        break;
+      close (srv->fd);
+      srv->fd = -1;
+    }
+  freeaddrinfo (res);
+  if (srv->fd < 0)
+    {
+      srv->err = cpstrf ("Failed to listen on %s: %s\n", listen_addr,
+                         strerror (errno));
+      return CACHESRV_BIND_FAILED;
+    }
+
+  /* Report the port which was actually bound */
+  if (getsockname (srv->fd, (struct sockaddr*)&addr, &addr_len) == 0)
+    srv->port = ntohs (addr.ss_family == AF_INET6 ?
+                       ((struct sockaddr_in6*)&addr)->sin6_port :
+                       ((struct sockaddr_in*)&addr)->sin_port);
+
+  return CACHESRV_OK;
+}
+
+cachesrv_err_t
+cachesrv_init_conf (cachesrv_t * srv, conf_t * conf, const char * dir)
+{
+  return cachesrv_init (srv, dir, conf->vals.cache_listen,
+                        conf->vals.cache_max_blob);
+}
+
+/* Sleeps while out of descriptors, doubling the delay up to a second */
+static unsigned
+backoff_fds (unsigned delay_ms)
+{
+  struct timespec ts;
+
+  if (delay_ms == 0)
+    {
+      log_warn ("Out of file descriptors, pausing accepts",
+                LOG_STR ("err", strerror (errno)));
+      delay_ms = 10;
+    }
+  else if (delay_ms < 1000)
+    delay_ms *= 2;
+  ts.tv_sec = delay_ms / 1000;
+  ts.tv_nsec = (delay_ms % 1000) * 1000000l;
+  nanosleep (&ts, NULL);
+
+  return delay_ms;
+}
+
+cachesrv_err_t
+cachesrv_run (cachesrv_t * srv)
+{
+  struct _cachesrv_conn_t * conn;
+  pthread_attr_t attr;
+  pthread_t thread;
+  unsigned backoff = 0;
+  int fd;
+
+  log_info ("Serving the artifact cache", LOG_STR ("dir", srv->dir),
+            LOG_UINT ("port", srv->port));
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  while (!__atomic_load_n (&srv->stop, __ATOMIC_RELAXED))
+    {
+      fd = accept4 (srv->fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          /* The connection stays queued until a descriptor is closed */
+          if (errno == EMFILE || errno == ENFILE)
+            {
+              backoff = backoff_fds (backoff);
+              continue;
+            }
+          break;
+        }
+      backoff = 0;
+
+      conn = (struct _cachesrv_conn_t*) malloc (sizeof (*conn));
+      if (conn == NULL)
+        {
+          close (fd);
+          continue;
+        }
+      conn->srv = srv;
+      conn->fd = fd;
+      conn->len = 0;
+
+      pthread_mutex_lock (&srv->lock);
+      conn->next = srv->open;
+      conn->prev = &srv->open;
+      if (srv->open != NULL)
+        srv->open->prev = &conn->next;
+      srv->open = conn;
+      srv->conns++;
+      if (pthread_create (&thread, &attr, conn_main, conn) != 0)
+        {
+          srv->open = conn->next;
+          if (srv->open != NULL)
+            srv->open->prev = &srv->open;
+          srv->conns--;
+          close (fd);
+          free (conn);
+        }
+      pthread_mutex_unlock (&srv->lock);
+    }
+  pthread_attr_destroy (&attr);
+
+  return __atomic_load_n (&srv->stop, __ATOMIC_RELAXED) ? CACHESRV_OK :
+    CACHESRV_UNKNOWN;
+}
+
+void
+cachesrv_stop (cachesrv_t * srv)
+{
+  __atomic_store_n (&srv->stop, 1, __ATOMIC_RELAXED);
+  if (srv->fd >= 0)
+    shutdown (srv->fd, SHUT_RDWR);
+}
+
+const char *
+cachesrv_get_err (cachesrv_t * srv)
+{
+  return srv->err;
+}
+
+cachesrv_err_t
+cachesrv_destroy (cachesrv_t * srv)
+{
+  struct _cachesrv_conn_t * conn;
+
+  /* Wake the connections waiting on their clients and let them end */
+  __atomic_store_n (&srv->stop, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock (&srv->lock);
+  for (conn = srv->open; conn != NULL; conn = conn->next)
+    shutdown (conn->fd, SHUT_RDWR);
+  while (srv->conns > 0)
+    pthread_cond_wait (&srv->idle, &srv->lock);
+  pthread_mutex_unlock (&srv->lock);
+  if (srv->fd >= 0)
+    close (srv->fd);
+  srv->fd = -1;
+  pthread_cond_destroy (&srv->idle);
+  pthread_mutex_destroy (&srv->lock);
+
+  if (srv->dir != NULL)
+    free (srv->dir);
+  srv->dir = NULL;
+  if (srv->err != NULL)
+    free (srv->err);
+  srv->err = NULL;
+
+  return CACHESRV_OK;
+}
+
+const char *
+cachesrv_err_str (cachesrv_err_t err)
+{
+  switch (err)
+    {
+    case CACHESRV_OK:
+      return "Success";
+    case CACHESRV_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case CACHESRV_NO_DIR:
+      return "The blob directory could not be created";
+    case CACHESRV_BIND_FAILED:
+      return "The listening socket could not be set up";
+    case CACHESRV_INVALID:
+      return "Invalid listen address";
+    case CACHESRV_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
@@ -0,0 +1,141 @@
+/**
+   @file cachesrv.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Local Artifact Cache Server
+   @details A small HTTP server speaking the protocol of cache.h over
+   a directory, enough to share artifacts between builders on a
+   network or to exercise the client on localhost. Blobs are checked
+   against their digest before they are stored and are kept in the
+   encoding they were uploaded in, so deflated blobs are served to
+   clients accepting deflate without recompressing them. Blobs uploaded
+   as chunks are only stored once per distinct chunk. Each
+   connection is handled by its own thread.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CACHESRV_H_
+#define _CACHESRV_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "conf.h"
+
+/**
+   @brief Cache Server Error Codes
+**/
+typedef enum _cachesrv_err_t
+  {
+    CACHESRV_OK = 0, /**< Success */
+    CACHESRV_MALLOC_FAILED, /**< Allocating Memory Failed */
+    CACHESRV_NO_DIR, /**< The blob directory could not be created */
+    CACHESRV_BIND_FAILED, /**< The listening socket could not be set up */
+    CACHESRV_INVALID, /**< An invalid listen address */
+    CACHESRV_UNKNOWN /**< Unknown Error */
+  } cachesrv_err_t;
+
+/**
+   @brief Cache Server Structure
+**/
+typedef struct _cachesrv_t
+{
+  char * err; /**< Last Error String */
+  char * dir; /**< Directory holding the blobs */
+  uint64_t max_blob; /**< Largest body accepted in bytes */
+  int fd; /**< Listening socket or -1 */
+  uint16_t port; /**< Port the socket is bound to */
+  int stop; /**< Set once the server is stopping */
+  pthread_mutex_t lock; /**< Guards open and conns */
+  pthread_cond_t idle; /**< Signalled when the last connection ends */
+  struct _cachesrv_conn_t * open; /**< Open connections */
+  size_t conns; /**< Number of open connections */
+  uint64_t requests; /**< Requests served */
+  uint64_t stored; /**< Blobs stored */
+  uint64_t trees; /**< Blobs stored as chunk lists */
+  uint64_t bytes_in; /**< Body bytes received */
+  uint64_t bytes_out; /**< Body bytes sent */
+} cachesrv_t;
+
+/**
+   @brief Creates a New Cache Server
+   @details Creates the directory if it is missing and binds the
+   listening socket without accepting connections yet.
+   @param srv The server structure to be initialized
+   @param dir The directory holding the blobs
+   @param listen The address to listen on as HOST:PORT, a port of 0
+   picks a free one which is stored in srv->port
+   @param max_blob The largest body accepted in bytes. Set this to 0
+   for the default.
+   @return CACHESRV_OK(0) on success or a positive error code
+**/
+cachesrv_err_t cachesrv_init (cachesrv_t * srv, const char * dir,
+                              const char * listen, uint64_t max_blob);
+
+/**
+   @brief Creates a Cache Server from the Configuration
+   @details Reads the CACHE_LISTEN and CACHE_MAX_BLOB keys.
+   @param srv The server structure to be initialized
+   @param conf The parsed configuration
+   @param dir The directory holding the blobs
+   @return CACHESRV_OK(0) on success or a positive error code
+**/
+cachesrv_err_t cachesrv_init_conf (cachesrv_t * srv, conf_t * conf,
+                                   const char * dir);
+
+/**
+   @brief Serves Connections
+   @details Returns once cachesrv_stop is called.
+   @param srv The server structure
+   @return CACHESRV_OK(0) on success or a positive error code
+**/
+cachesrv_err_t cachesrv_run (cachesrv_t * srv);
+
+/**
+   @brief Stops the Server
+   @details Only wakes cachesrv_run, so it is safe to call from a
+   signal handler.
+   @param srv The server structure
+**/
+void cachesrv_stop (cachesrv_t * srv);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param srv The server structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * cachesrv_get_err (cachesrv_t * srv);
+
+/**
+   @brief Destroys the Cache Server
+   @details Waits for the open connections to finish.
+   @param srv The server structure to be destroyed
+   @return CACHESRV_OK(0) on success or a positive error code
+**/
+cachesrv_err_t cachesrv_destroy (cachesrv_t * srv);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * cachesrv_err_str (cachesrv_err_t err);
+
+#endif
@@ -0,0 +1,102 @@
+/**
+   @file cdc.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Defined Chunking
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include "cdc.h"
+
+#define MIN_AVG 256
+#define GEAR_SEED 0x6175746f6275696cull
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* Changing the table moves every boundary, never do it */
+static void
+gear_fill (void)
+{
+  uint64_t state = GEAR_SEED, z;
+  size_t i;
+
+  for (i = 0; i < 256; i++)
+    {
+      z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* The top bits of the hash cover the last 64 bytes, the low ones only
+   the last few */
+inline static uint64_t
+top_bits (unsigned bits)
+{
+  return bits >= 64 ? ~0ull : ~(~0ull >> bits);
+}
+
+void
+cdc_init (cdc_t * cdc, size_t avg)
+{
+  unsigned bits = 0;
+
+  pthread_once (&gear_once, gear_fill);
+  if (avg < MIN_AVG)
+    avg = MIN_AVG;
+  while (((size_t)2 << bits) <= avg)
+    bits++;
+  cdc->avg = (size_t)1 << bits;
+  cdc->min = cdc->avg / 4;
+  cdc->max = cdc->avg * 4;
+  cdc->mask_small = top_bits (bits + 2);
+  cdc->mask_large = top_bits (bits - 2);
+}
+
+size_t
+cdc_cut (const cdc_t * cdc, const uint8_t * data, size_t len)
+{
+  uint64_t fp = 0;
+  size_t i, normal;
+
+  if (len <= cdc->min)
+    return len;
+  if (len > cdc->max)
+    len = cdc->max;
+  normal = len < cdc->avg ? len : cdc->avg;
+
+  /* Cuts are unlikely before the average and likely after it */
+  for (i = cdc->min; i < normal; i++)
+    {
+      fp = (fp << 1) + gear[data[i]];
+      if ((fp & cdc->mask_small) == 0)
+        return i;
+    }
+  for (; i < len; i++)
+    {
+      fp = (fp << 1) + gear[data[i]];
+      if ((fp & cdc->mask_large) == 0)
+        return i;
+    }
+
+  return len;
+}
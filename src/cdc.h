@@ -0,0 +1,67 @@
+/**
+   @file cdc.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Defined Chunking
+   @details Splits data into chunks whose boundaries depend only on
+   the bytes around them, so an insertion or deletion only changes the
+   chunks it touches and the rest deduplicate against an older version
+   of the same file. Boundaries are found with the FastCDC gear hash
+   and normalized chunking, which keeps most chunks close to the
+   average size. The gear table is fixed, chunks cut by any build of
+   autobuild with the same average size always match.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CDC_H_
+#define _CDC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+   @brief Chunker Parameters
+**/
+typedef struct _cdc_t
+{
+  size_t min; /**< Smallest chunk, a quarter of the average */
+  size_t avg; /**< Average chunk, a power of two */
+  size_t max; /**< Largest chunk, four times the average */
+  uint64_t mask_small; /**< Harder mask used before the average */
+  uint64_t mask_large; /**< Easier mask used after the average */
+} cdc_t;
+
+/**
+   @brief Initializes a Chunker
+   @param cdc The chunker to be initialized
+   @param avg The average chunk size, rounded down to a power of two
+   and to at least 256 bytes
+**/
+void cdc_init (cdc_t * cdc, size_t avg);
+
+/**
+   @brief Finds the End of the Next Chunk
+   @param cdc The chunker
+   @param data The data starting at the beginning of the chunk
+   @param len The length of the remaining data
+   @return The length of the chunk, len if the rest is one chunk
+**/
+size_t cdc_cut (const cdc_t * cdc, const uint8_t * data, size_t len);
+
+#endif
@@ -3,7 +3,11 @@
    @author William A. Kennington III <william@wkennington.com>
    @brief Configuration Parser
    @details A configuration parser and manager, binding keys to values
-   read from the input file.
+   read from the input file. The pairs of each file, the environment
+   and the command line are kept in immutable layers stacked on top
+   of each other, and a merged index of the winning pair of every key
+   is rebuilt whenever a layer is added, so lookups never walk the
+   layers.
    @warning Editing support is currently unavailable.
 **/
 /*
@@ -28,166 +32,1014 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include "buffer.h"
+#include <strings.h>
+#include <stddef.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "conf.h"
+#include "log.h"
 #include "util.h"
 
-#define BUFF 4096
+#define FILE_MAX (64ul<<20)
+#define INCLUDE_MAX 16
+#define HOST_MAX 256
 #define MALLOC_FAILED "Malloc Failed\n"
 #define TOO_LARGE "Configuration File Too Large\n"
 
-inline static char * 
+#define KEY(k, t, d, lo, hi, c, f)                      \
+  { k, t, d, lo, hi, c, offsetof (conf_vals_t, f), 0 }
+#define SECRET(k, t, d, lo, hi, c, f)                   \
+  { k, t, d, lo, hi, c, offsetof (conf_vals_t, f), 1 }
+#define REDACTED "<redacted>"
+
+/**
+   @brief Unit Suffix
+**/
+struct _conf_unit_t
+{
+  const char * suffix; /**< Suffix following the number */
+  uint64_t scale; /**< Multiplier to the base unit */
+};
+
+static const struct _conf_unit_t durations[] = {
+  {"", 1}, {"ms", 1}, {"s", 1000}, {"m", 60000}, {"h", 3600000},
+  {"d", 86400000}, {NULL, 0}
+};
+
+static const struct _conf_unit_t sizes[] = {
+  {"", 1}, {"B", 1}, {"K", 1ull<<10}, {"KB", 1ull<<10}, {"KiB", 1ull<<10},
+  {"M", 1ull<<20}, {"MB", 1ull<<20}, {"MiB", 1ull<<20}, {"G", 1ull<<30},
+  {"GB", 1ull<<30}, {"GiB", 1ull<<30}, {"T", 1ull<<40}, {"TB", 1ull<<40},
+  {"TiB", 1ull<<40}, {NULL, 0}
+};
+
+static const char * const type_names[] = {
+  "integer", "boolean", "duration", "size", "number", "string", "path",
+  "list"
+};
+
+static const char * const db_types[] = { "postgresql", NULL };
+static const char * const policies[] = { "critical", "longest", "fifo", NULL };
+static const char * const dists[] = {
+  "const", "uniform", "exp", "lognormal", NULL
+};
+static const char * const works[] = { "sleep", "spin", NULL };
+
+/* Sorted by key */
+static const conf_key_t schema[] = {
+  KEY ("CACHE_CHUNK", CONF_SIZE, "64K", 0, 16777216, NULL, cache_chunk),
+  KEY ("CACHE_COMPRESS", CONF_BOOL, "yes", 0, 0, NULL, cache_compress),
+  KEY ("CACHE_LISTEN", CONF_STR, "127.0.0.1:8734", 0, 0, NULL, cache_listen),
+  KEY ("CACHE_MAX_BLOB", CONF_SIZE, "1G", 1, DBL_MAX, NULL, cache_max_blob),
+  KEY ("CACHE_PARALLEL", CONF_INT, "8", 1, 256, NULL, cache_parallel),
+  KEY ("CACHE_TIMEOUT", CONF_DURATION, "5m", 0, LONG_MAX, NULL,
+       cache_timeout),
+  KEY ("CACHE_URL", CONF_STR, NULL, 0, 0, NULL, cache_url),
+  KEY ("CONTROL_SOCKET", CONF_PATH, NULL, 0, 0, NULL, control_socket),
+  KEY ("DBLOG_BATCH", CONF_SIZE, "1M", 4096, DBL_MAX, NULL, dblog_batch),
+  KEY ("DBLOG_CHUNK", CONF_SIZE, "64K", 256, 16777216, NULL, dblog_chunk),
+  KEY ("DBLOG_FLUSH", CONF_DURATION, "250ms", 1, 60000, NULL, dblog_flush),
+  KEY ("DBLOG_MAX_QUEUE", CONF_SIZE, "64M", 65536, DBL_MAX, NULL,
+       dblog_max_queue),
+  KEY ("DBLOG_SPILL", CONF_PATH, NULL, 0, 0, NULL, dblog_spill),
+  KEY ("DB_BREAKER", CONF_INT, "3", 1, 1000, NULL, db_breaker),
+  KEY ("DB_DB", CONF_STR, NULL, 0, 0, NULL, db_db),
+  KEY ("DB_HEALTH", CONF_DURATION, "30s", 0, LONG_MAX, NULL, db_health),
+  KEY ("DB_HOST", CONF_STR, NULL, 0, 0, NULL, db_host),
+  SECRET ("DB_PASS", CONF_STR, NULL, 0, 0, NULL, db_pass),
+  KEY ("DB_POOL", CONF_INT, "4", 1, 256, NULL, db_pool),
+  KEY ("DB_PORT", CONF_INT, "5432", 1, 65535, NULL, db_port),
+  KEY ("DB_QUEUE", CONF_INT, "1024", 1, 1048576, NULL, db_queue),
+  KEY ("DB_STATEMENTS", CONF_INT, "64", 0, 4096, NULL, db_statements),
+  KEY ("DB_TIMEOUT", CONF_DURATION, "30s", 0, LONG_MAX, NULL, db_timeout),
+  KEY ("DB_TYPE", CONF_STR, NULL, 0, 0, db_types, db_type),
+  KEY ("DB_USER", CONF_STR, NULL, 0, 0, NULL, db_user),
+  KEY ("HISTORY_ALPHA", CONF_DOUBLE, "0.3", 0, 1, NULL, history_alpha),
+  KEY ("HISTORY_FILE", CONF_PATH, NULL, 0, 0, NULL, history_file),
+  KEY ("LOAD_ARTIFACTS", CONF_PATH, NULL, 0, 0, NULL, load_artifacts),
+  KEY ("LOAD_DEPTH", CONF_INT, "8", 1, 65536, NULL, load_depth),
+  KEY ("LOAD_DIST", CONF_STR, "exp", 0, 0, dists, load_dist),
+  KEY ("LOAD_DURATION", CONF_DURATION, "20ms", 0, LONG_MAX, NULL,
+       load_duration),
+  KEY ("LOAD_FANIN", CONF_INT, "2", 0, 64, NULL, load_fanin),
+  KEY ("LOAD_OUTPUT", CONF_SIZE, "0", 0, DBL_MAX, NULL, load_output),
+  KEY ("LOAD_SEED", CONF_INT, "1", 0, LONG_MAX, NULL, load_seed),
+  KEY ("LOAD_TRACE", CONF_PATH, NULL, 0, 0, NULL, load_trace),
+  KEY ("LOAD_WARM", CONF_BOOL, "yes", 0, 0, NULL, load_warm),
+  KEY ("LOAD_WIDTH", CONF_INT, "32", 1, 65536, NULL, load_width),
+  KEY ("LOAD_WORK", CONF_STR, "sleep", 0, 0, works, load_work),
+  KEY ("QUEUE_AGING", CONF_DURATION, "30s", 0, UINT32_MAX, NULL, queue_aging),
+  KEY ("QUEUE_DEFAULT_WEIGHT", CONF_INT, "1", 1, UINT32_MAX, NULL,
+       queue_default_weight),
+  KEY ("QUEUE_SHARDS", CONF_INT, "16", 1, 4096, NULL, queue_shards),
+  KEY ("QUEUE_WEIGHTS", CONF_LIST, NULL, 0, 0, NULL, queue_weights),
+  KEY ("SCHED_DEFAULT_MS", CONF_DURATION, "1s", 0, DBL_MAX, NULL,
+       sched_default_ms),
+  KEY ("SCHED_NUMA", CONF_BOOL, "yes", 0, 0, NULL, sched_numa),
+  KEY ("SCHED_POLICY", CONF_STR, "critical", 0, 0, policies, sched_policy),
+  KEY ("SCHED_SLACK_MS", CONF_DURATION, "5s", 0, DBL_MAX, NULL,
+       sched_slack_ms),
+  KEY ("SCHED_STRAGGLER", CONF_DOUBLE, "2", 0, 1000, NULL, sched_straggler),
+  KEY ("SCHED_WORKERS", CONF_INT, "0", 0, 4096, NULL, sched_workers),
+};
+
+inline static int
+is_space (char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline static char *
 trim_str (char * str, size_t len)
 {
   /* Trim the spaces from the front */
-  while (str[0] == ' ' || str[0] == '\t' || str[0] == '\r' || str[0] == '\n')
-    str++;
+  while (len > 0 && is_space (str[0]))
+    {
+      str++;
+      len--;
+    }
 
   /* Work backward to place the end of string */
-  len--;
-  while (str[len] == ' ' || str[len] == '\t' || str[len] == '\r' || str[len] == '\n')
+  while (len > 0 && is_space (str[len-1]))
     len--;
-  str[len+1] = '\0';
+  str[len] = '\0';
 
   return str;
 }
 
-inline static char *
-cleanup_str (char * str, int key)
+static void
+set_err (conf_t * conf, char * err)
+{
+  if (conf->err != NULL)
+    free (conf->err);
+  conf->err = err;
+}
+
+/**
+   @brief Memory Owned by a Layer
+**/
+struct _conf_block_t
 {
-  /* Start by trimming the str */
-  str = trim_str (str, strlen (str));
+  struct _conf_block_t * next; /**< Next block of the same layer */
+};
 
-  return str;
+/**
+   @brief Immutable Set of Pairs
+   @details Sorted by section and key once it is loaded and never
+   modified afterwards, so any number of configurations may share it.
+**/
+struct _conf_layer_t
+{
+  struct _conf_layer_t * parent; /**< Layer beneath this one or NULL */
+  size_t refs; /**< Configurations and layers referencing this one */
+  struct _conf_kv_t * data; /**< The pairs */
+  size_t data_len;
+  size_t data_size; /**< Allocated length of data */
+  struct _conf_block_t * blocks; /**< File contents, strings and lists
+                                    the pairs point into */
+};
+
+extern char ** environ;
+
+static struct _conf_layer_t *
+layer_new (void)
+{
+  struct _conf_layer_t * layer;
+
+  layer = (struct _conf_layer_t*) calloc (1, sizeof (struct _conf_layer_t));
+  if (layer != NULL)
+    layer->refs = 1;
+  return layer;
 }
 
-conf_err_t
-conf_init (conf_t * conf, const char * filename)
+static void *
+layer_alloc (struct _conf_layer_t * layer, size_t len)
 {
-  FILE * file;
-  buffer_t buff;
-  uint8_t lbuff[BUFF];
-  int read;
-  size_t line_ct, i, st, eq;
-  char *tmp_key, *tmp_val;
+  struct _conf_block_t * block;
 
-  /* Initialize the struct */
-  conf->err = NULL;
-  conf->filename = cpstr (filename);
-  conf->data = NULL;
-  conf->data_len = 0;
+  block = (struct _conf_block_t*) malloc (sizeof (struct _conf_block_t) + len);
+  if (block == NULL)
+    return NULL;
+  block->next = layer->blocks;
+  layer->blocks = block;
+  return block + 1;
+}
+
+static char *
+layer_strdup (struct _conf_layer_t * layer, const char * str, size_t len)
+{
+  char * copy;
+
+  copy = (char*) layer_alloc (layer, len + 1);
+  if (copy == NULL)
+    return NULL;
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+static void
+layer_release (struct _conf_layer_t * layer)
+{
+  struct _conf_layer_t * parent;
+  struct _conf_block_t * block, * next;
+
+  /* Freeing a layer drops the reference it held on its parent */
+  for (; layer != NULL; layer = parent)
+    {
+      if (__atomic_sub_fetch (&layer->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+      parent = layer->parent;
+      for (block = layer->blocks; block != NULL; block = next)
+        {
+          next = block->next;
+          free (block);
+        }
+      if (layer->data != NULL)
+        free (layer->data);
+      free (layer);
+    }
+}
+
+inline static int
+section_cmp (const char * a, const char * b)
+{
+  /* Global pairs sort before every section */
+  if (a == NULL || b == NULL)
+    return (a != NULL) - (b != NULL);
+  return strcmp (a, b);
+}
+
+inline static int
+pair_cmp (const char * section, const char * key,
+          const struct _conf_kv_t * kv)
+{
+  int ret;
+
+  ret = section_cmp (section, kv->section);
+  return ret != 0 ? ret : strcmp (key, kv->key);
+}
+
+static int
+kv_cmp (const void * a, const void * b)
+{
+  const struct _conf_kv_t * ka = (const struct _conf_kv_t*) a;
+  const struct _conf_kv_t * kb = (const struct _conf_kv_t*) b;
+  int ret;
+
+  /* Order by section and key and then by the order they were read */
+  ret = pair_cmp (ka->section, ka->key, kb);
+  if (ret != 0)
+    return ret;
+  return ka->seq < kb->seq ? -1 : ka->seq > kb->seq;
+}
+
+static void
+layer_sort (struct _conf_layer_t * layer)
+{
+  size_t i, j;
+
+  qsort (layer->data, layer->data_len, sizeof (struct _conf_kv_t), kv_cmp);
+
+  /* Later definitions of a key override earlier ones */
+  for (i = 0, j = 0; i < layer->data_len; i++)
+    {
+      if (i + 1 < layer->data_len &&
+          pair_cmp (layer->data[i].section, layer->data[i].key,
+                    &layer->data[i+1]) == 0)
+        continue;
+      layer->data[j++] = layer->data[i];
+    }
+  layer->data_len = j;
+}
+
+static int
+key_cmp (const void * key, const void * elem)
+{
+  return strcmp ((const char *)key, ((const conf_key_t*)elem)->key);
+}
+
+static const conf_key_t *
+schema_find (const char * key)
+{
+  return (const conf_key_t*) bsearch (key, schema,
+                                      sizeof (schema) / sizeof (*schema),
+                                      sizeof (*schema), key_cmp);
+}
+
+/* 1 if parsed, 0 if malformed, -2 if out of range */
+static int
+parse_scaled (const char * val, const struct _conf_unit_t * units,
+              int nocase, uint64_t * out)
+{
+  unsigned long long num;
+  char * end;
+  int range;
+
+  if (val[0] < '0' || val[0] > '9')
+    return 0;
+  errno = 0;
+  num = strtoull (val, &end, 10);
+  range = errno == ERANGE;
+  while (*end == ' ')
+    end++;
+  for (; units->suffix != NULL; units++)
+    if ((nocase ? strcasecmp (end, units->suffix) :
+         strcmp (end, units->suffix)) == 0)
+      {
+        if (range || num > UINT64_MAX / units->scale)
+          return -2;
+        *out = num * units->scale;
+        return 1;
+      }
+
+  return 0;
+}
+
+static int
+parse_list (struct _conf_layer_t * layer, const char * val,
+            conf_list_t * list)
+{
+  char * copy, * item, * save;
+  size_t i, len, count = 1;
+
+  /* One allocation holds the item pointers followed by the strings */
+  for (i = 0; val[i] != '\0'; i++)
+    if (val[i] == ',')
+      count++;
+  len = strlen (val) + 1;
+  list->items = (char**) layer_alloc (layer, (count + 1) * sizeof (char*) +
+                                      len);
+  if (list->items == NULL)
+    return 0;
+  copy = (char*)(list->items + count + 1);
+  memcpy (copy, val, len);
+
+  list->len = 0;
+  for (item = strtok_r (copy, ",", &save); item != NULL;
+       item = strtok_r (NULL, ",", &save))
+    {
+      item = trim_str (item, strlen (item));
+      if (item[0] != '\0')
+        list->items[list->len++] = item;
+    }
+  list->items[list->len] = NULL;
+
+  return 1;
+}
+
+/* 1 if parsed, 0 if malformed, -1 if memory ran out, -2 if out of range */
+static int
+parse_val (struct _conf_layer_t * layer, struct _conf_kv_t * kv,
+           const char * slash)
+{
+  const conf_key_t * entry = kv->entry;
+  const char * const * choice, * val = kv->val;
+  char * end, * path;
+  long long num;
+  uint64_t scaled;
+  double dbl = 0;
+  size_t dir;
+  int ret;
+
+  switch (entry->type)
+    {
+    case CONF_INT:
+      errno = 0;
+      num = strtoll (val, &end, 10);
+      if (val[0] == '\0' || *end != '\0')
+        return 0;
+      if (errno == ERANGE)
+        return -2;
+      kv->parsed.i = num;
+      dbl = num;
+      break;
+    case CONF_BOOL:
+      if (strcasecmp (val, "yes") == 0 || strcasecmp (val, "true") == 0 ||
+          strcasecmp (val, "on") == 0 || strcmp (val, "1") == 0)
+        kv->parsed.b = 1;
+      else if (strcasecmp (val, "no") == 0 ||
+               strcasecmp (val, "false") == 0 ||
+               strcasecmp (val, "off") == 0 || strcmp (val, "0") == 0)
+        kv->parsed.b = 0;
+      else
+        return 0;
+      return 1;
+    case CONF_DURATION:
+    case CONF_SIZE:
+      ret = parse_scaled (val, entry->type == CONF_SIZE ? sizes : durations,
+                          entry->type == CONF_SIZE, &scaled);
+      if (ret != 1)
+        return ret;
+      kv->parsed.u = scaled;
+      dbl = scaled;
+      break;
+    case CONF_DOUBLE:
+      errno = 0;
+      dbl = strtod (val, &end);
+      if (val[0] == '\0' || *end != '\0')
+        return 0;
+      if (errno == ERANGE && (dbl == HUGE_VAL || dbl == -HUGE_VAL))
+        return -2;
+      kv->parsed.d = dbl;
+      break;
+    case CONF_STR:
+      if (entry->choices != NULL)
+        {
+          for (choice = entry->choices; *choice != NULL; choice++)
+            if (strcmp (val, *choice) == 0)
+              break;
+          if (*choice == NULL)
+            return 0;
+        }
+      kv->parsed.s = val;
+      return 1;
+    case CONF_PATH:
+      if (val[0] == '\0')
+        return 0;
+
+      /* Resolve relative paths next to the file that set them */
+      if (slash != NULL && val[0] != '/')
+        {
+          dir = slash - kv->file + 1;
+          path = (char*) layer_alloc (layer, dir + strlen (val) + 1);
+          if (path == NULL)
+            return -1;
+          memcpy (path, kv->file, dir);
+          strcpy (path + dir, val);
+          kv->val = path;
+        }
+      kv->parsed.s = kv->val;
+      return 1;
+    case CONF_LIST:
+      if (layer == NULL)
+        return 0;
+      return parse_list (layer, val, &kv->parsed.list) ? 1 : -1;
+    }
+
+  return dbl >= entry->min && dbl <= entry->max ? 1 : -2;
+}
+
+static void
+field_store (conf_vals_t * vals, const struct _conf_kv_t * kv)
+{
+  void * field = (char*)vals + kv->entry->offset;
+
+  switch (kv->entry->type)
+    {
+    case CONF_INT:
+      *(int64_t*)field = kv->parsed.i;
+      break;
+    case CONF_BOOL:
+      *(uint8_t*)field = kv->parsed.b;
+      break;
+    case CONF_DURATION:
+    case CONF_SIZE:
+      *(uint64_t*)field = kv->parsed.u;
+      break;
+    case CONF_DOUBLE:
+      *(double*)field = kv->parsed.d;
+      break;
+    case CONF_STR:
+    case CONF_PATH:
+      *(const char**)field = kv->parsed.s;
+      break;
+    case CONF_LIST:
+      *(conf_list_t*)field = kv->parsed.list;
+      break;
+    }
+}
+
+static conf_err_t
+layer_store (conf_t * conf, struct _conf_layer_t * layer,
+             const char * section, const char * key, const char * val,
+             const char * file, size_t line, int resolve)
+{
+  struct _conf_kv_t * kv, * tmp;
+  const char * shown;
+  char * where;
+  int ret;
+
+  /* Grow the data array */
+  if (layer->data_len == layer->data_size)
+    {
+      tmp = (struct _conf_kv_t*) realloc (layer->data,
+                                          (layer->data_size*2 + 16) *
+                                          sizeof (struct _conf_kv_t));
+      if (tmp == NULL)
+        {
+          set_err (conf, cpstr (MALLOC_FAILED));
+          return CONF_MALLOC_FAILED;
+        }
+      layer->data = tmp;
+      layer->data_size = layer->data_size*2 + 16;
+    }
+
+  /* Parse the value once, every configuration sharing the layer
+     reuses it */
+  kv = &layer->data[layer->data_len];
+  kv->section = section;
+  kv->key = key;
+  kv->val = val;
+  kv->file = file;
+  kv->line = line;
+  kv->seq = layer->data_len;
+  kv->entry = schema_find (key);
+  ret = kv->entry != NULL ?
+    parse_val (layer, kv, resolve ? strrchr (file, '/') : NULL) : 0;
+  if (ret == -1)
+    {
+      set_err (conf, cpstr (MALLOC_FAILED));
+      return CONF_MALLOC_FAILED;
+    }
+  shown = kv->entry != NULL && kv->entry->secret ? REDACTED : kv->val;
+  if (ret != 1)
+    {
+      where = line > 0 ? cpstrf ("%s:%zu", file, line) : cpstr (file);
+      if (where == NULL)
+        set_err (conf, cpstr (MALLOC_FAILED));
+      else if (kv->entry == NULL)
+        set_err (conf, cpstrf ("%s: Unknown key %s\n", where, key));
+      else if (ret == -2)
+        set_err (conf, cpstrf ("%s: %s is out of range for %s, expected "
+                               "%g to %g\n", where, shown, key, kv->entry->min,
+                               kv->entry->max));
+      else
+        set_err (conf, cpstrf ("%s: Invalid %s for %s: %s\n", where,
+                               type_names[kv->entry->type], key, shown));
+      free (where);
+      return where != NULL ? CONF_INVALID : CONF_MALLOC_FAILED;
+    }
+
+  log_debug ("Parsed configuration value", LOG_STR ("file", file),
+             LOG_UINT ("line", line),
+             LOG_STR ("section", section != NULL ? section : ""),
+             LOG_STR ("key", key), LOG_STR ("val", shown));
+  layer->data_len++;
+
+  return CONF_OK;
+}
+
+static char *
+include_path (const char * base, const char * arg)
+{
+  char host[HOST_MAX], * path, * out;
+  const char * slash, * c;
+  size_t len, dir = 0, host_len = 0;
+
+  if (strstr (arg, "%h") != NULL)
+    {
+      if (gethostname (host, sizeof (host)) != 0)
+        host[0] = '\0';
+      host[sizeof (host) - 1] = '\0';
+      host_len = strlen (host);
+    }
+
+  /* Relative includes are found next to the including file */
+  slash = strrchr (base, '/');
+  if (arg[0] != '/' && slash != NULL)
+    dir = slash - base + 1;
+  len = dir + 1;
+  for (c = arg; *c != '\0'; c++)
+    if (c[0] == '%' && c[1] == 'h')
+      {
+        len += host_len;
+        c++;
+      }
+    else
+      len++;
+
+  path = (char*) malloc (len);
+  if (path == NULL)
+    return NULL;
+  memcpy (path, base, dir);
+  out = path + dir;
+  for (c = arg; *c != '\0'; c++)
+    if (c[0] == '%' && c[1] == 'h')
+      {
+        memcpy (out, host, host_len);
+        out += host_len;
+        c++;
+      }
+    else
+      *out++ = *c;
+  *out = '\0';
+
+  return path;
+}
+
+static conf_err_t
+layer_file (conf_t * conf, struct _conf_layer_t * layer, const char * path,
+            const char * section, size_t depth, int optional)
+{
+  struct stat st;
+  FILE * file;
+  char * data, * line, * next, * eq, * key, * val, * inc;
+  const char * name;
+  size_t line_ct = 0, len;
+  conf_err_t ret;
+  int skip;
 
   /* Attempt to open the file */
-  file = fopen (filename, "r");
+  file = fopen (path, "r");
   if (file == NULL)
     {
-      conf->err = cpstrf ("Invalid File: %s\n", filename);
+      if (optional && errno == ENOENT)
+        return CONF_OK;
+      set_err (conf, cpstrf ("Invalid File: %s\n", path));
       return CONF_NO_FILE;
     }
+  if (fstat (fileno (file), &st) != 0 || st.st_size < 0 ||
+      (unsigned long)st.st_size > FILE_MAX)
+    {
+      fclose (file);
+      set_err (conf, cpstr (TOO_LARGE));
+      return CONF_TOO_LARGE;
+    }
 
-  /* Load the entire file into memory */
-  if (buffer_init (&buff, BUFF, BUFF<<3) == BUFF_MALLOC_FAILED)
+  /* The pairs point into the contents, which the layer keeps */
+  len = st.st_size;
+  name = layer_strdup (layer, path, strlen (path));
+  data = (char*) layer_alloc (layer, len + 1);
+  if (name == NULL || data == NULL)
     {
       fclose (file);
-      conf->err = cpstr (MALLOC_FAILED);
+      set_err (conf, cpstr (MALLOC_FAILED));
       return CONF_MALLOC_FAILED;
     }
-  while ((read = fread (lbuff, sizeof (uint8_t), BUFF, file)) > 0)
-    switch (buffer_add (&buff, lbuff, read))
-      {
-      case BUFF_MALLOC_FAILED:
-        conf->err = cpstr (MALLOC_FAILED);
-        buffer_destroy (&buff);
-        fclose (file);
-        return CONF_MALLOC_FAILED;
-      case BUFF_TOO_SMALL:
-        conf->err = cpstr (TOO_LARGE);
-        buffer_destroy (&buff);
-        fclose (file);
-        return CONF_TOO_LARGE;
-      }
-
-  /* Close File Handle */
+  len = fread (data, sizeof (char), len, file);
   fclose (file);
+  data[len] = '\0';
 
-  /* Parse each line looking for errors */
-  line_ct = 0;
-  st = 0;
-  eq = 0;
-  for (i = 0; i < buff.len; i++)
-    switch (buff.data[i])
-      {
-      case '=':
-        eq = i;
-        break;
-      case '\n':
-        line_ct++;
-
-        /* Break down the line into a string */
-        tmp_key = buff.data + st;
-        buff.data[i] = '\0';
-        tmp_key = trim_str (tmp_key, i-st+1);
-
-        /* Empty or comment line */
-        if (strlen (tmp_key) == 0 || tmp_key[0] == '#')
-          break;
+  for (line = data; line != NULL; line = next)
+    {
+      line_ct++;
+      next = strchr (line, '\n');
+      if (next != NULL)
+        *next++ = '\0';
+      line = trim_str (line, strlen (line));
 
-        /* Validate Line */
-        if (eq <= st)
-          {
-            conf->err = cpstrf ("Parse Error: Invalid Line #%d\n", line_ct);
-            buffer_destroy (&buff);
-            return CONF_PARSE_ERR;
-          }
-
-        /* Trim value and key strings */
-        buff.data[eq] = '\0';
-        tmp_val = buff.data + eq + 1;
-        tmp_key = cleanup_str (tmp_key, 1);
-        if (tmp_key == NULL)
-          {
-            conf->err = cpstrf ("Key Error on Line #%d\n", line_ct);
-            return CONF_PARSE_ERR;
-          }
-        tmp_val = cleanup_str (tmp_val, 0);
-        if (tmp_val == NULL)
-          {
-            conf->err = cpstrf ("Value Error on Line #%d\n", line_ct);
-            return CONF_PARSE_ERR;
-          }
-
-        /* Store the values */
-        printf ("Key: %s\nValue: %s\n", tmp_key, tmp_val);
-
-        st = i+1;
-        break;
-      }
+      /* Empty or comment line */
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
 
-  /* Cleanup */
-  buffer_destroy (&buff);
+      /* Section header */
+      if (line[0] == '[')
+        {
+          len = strlen (line);
+          key = len >= 2 && line[len-1] == ']' ?
+            trim_str (line + 1, len - 2) : "";
+          if (key[0] == '\0')
+            {
+              set_err (conf, cpstrf ("%s:%zu: Invalid section header\n",
+                                     path, line_ct));
+              return CONF_PARSE_ERR;
+            }
+          section = key;
+          continue;
+        }
 
-  /* Sort the array */
+      /* Read another file in place */
+      skip = line[0] == '-';
+      if (strncmp (line + skip, "include", 7) == 0 &&
+          is_space (line[skip + 7]))
+        {
+          if (depth >= INCLUDE_MAX)
+            {
+              set_err (conf, cpstrf ("%s:%zu: Includes nested too deeply\n",
+                                     path, line_ct));
+              return CONF_PARSE_ERR;
+            }
+          inc = include_path (path, trim_str (line + skip + 8,
+                                              strlen (line + skip + 8)));
+          if (inc == NULL)
+            {
+              set_err (conf, cpstr (MALLOC_FAILED));
+              return CONF_MALLOC_FAILED;
+            }
+          ret = layer_file (conf, layer, inc, section, depth + 1, skip);
+          free (inc);
+          if (ret != CONF_OK)
+            return ret;
+          continue;
+        }
+
+      /* Validate Line */
+      eq = strchr (line, '=');
+      if (eq == NULL)
+        {
+          set_err (conf, cpstrf ("%s:%zu: Invalid line\n", path, line_ct));
+          return CONF_PARSE_ERR;
+        }
+      *eq = '\0';
+      key = trim_str (line, eq - line);
+      val = trim_str (eq + 1, strlen (eq + 1));
+      if (key[0] == '\0')
+        {
+          set_err (conf, cpstrf ("%s:%zu: Missing key\n", path, line_ct));
+          return CONF_PARSE_ERR;
+        }
+
+      ret = layer_store (conf, layer, section, key, val, name, line_ct, 1);
+      if (ret != CONF_OK)
+        return ret;
+    }
 
   return CONF_OK;
 }
 
-char *
-conf_get (conf_t * conf, const char * key)
+static conf_err_t
+conf_compile (conf_t * conf, const struct _conf_kv_t ** index, size_t len,
+              conf_vals_t * vals)
+{
+  struct _conf_kv_t def;
+  size_t i;
+
+  /* Start from the defaults */
+  memset (vals, 0, sizeof (conf_vals_t));
+  for (i = 0; i < sizeof (schema) / sizeof (*schema); i++)
+    {
+      if (schema[i].def == NULL)
+        continue;
+      memset (&def, 0, sizeof (def));
+      def.key = schema[i].key;
+      def.val = schema[i].def;
+      def.entry = &schema[i];
+      if (parse_val (NULL, &def, NULL) != 1)
+        {
+          set_err (conf, cpstrf ("Invalid default for %s\n", schema[i].key));
+          return CONF_UNKNOWN;
+        }
+      field_store (vals, &def);
+    }
+
+  /* Global pairs sort first and were validated when they were read */
+  for (i = 0; i < len && index[i]->section == NULL; i++)
+    field_store (vals, index[i]);
+
+  return CONF_OK;
+}
+
+static conf_err_t
+conf_push (conf_t * conf, struct _conf_layer_t * layer)
+{
+  const struct _conf_kv_t ** index, ** tmp, ** swap;
+  struct _conf_layer_t * l;
+  conf_vals_t vals;
+  size_t len, total = 1, i, j, k;
+  conf_err_t ret;
+  int cmp;
+
+  /* The new layer takes over the reference to the old top */
+  layer_sort (layer);
+  layer->parent = conf->layer;
+  for (l = layer; l != NULL; l = l->parent)
+    total += l->data_len;
+  index = (const struct _conf_kv_t**) malloc (total * sizeof (*index));
+  tmp = (const struct _conf_kv_t**) malloc (total * sizeof (*tmp));
+  if (index == NULL || tmp == NULL)
+    {
+      free (index);
+      free (tmp);
+      layer->parent = NULL;
+      layer_release (layer);
+      set_err (conf, cpstr (MALLOC_FAILED));
+      return CONF_MALLOC_FAILED;
+    }
+
+  /* Merge the sorted layers from the top down, upper pairs win ties */
+  len = 0;
+  for (l = layer; l != NULL; l = l->parent)
+    {
+      for (i = 0, j = 0, k = 0; i < len || j < l->data_len;)
+        {
+          cmp = i == len ? 1 : j == l->data_len ? -1 :
+            pair_cmp (index[i]->section, index[i]->key, &l->data[j]);
+          if (cmp <= 0)
+            {
+              tmp[k++] = index[i++];
+              j += cmp == 0;
+            }
+          else
+            tmp[k++] = &l->data[j++];
+        }
+      swap = index;
+      index = tmp;
+      tmp = swap;
+      len = k;
+    }
+  free (tmp);
+
+  ret = conf_compile (conf, index, len, &vals);
+  if (ret != CONF_OK)
+    {
+      free (index);
+      layer->parent = NULL;
+      layer_release (layer);
+      return ret;
+    }
+
+  if (conf->index != NULL)
+    free (conf->index);
+  conf->index = index;
+  conf->index_len = len;
+  conf->vals = vals;
+  conf->layer = layer;
+
+  return CONF_OK;
+}
+
+conf_err_t
+conf_init (conf_t * conf, const char * filename)
+{
+  struct _conf_layer_t * layer;
+  conf_err_t ret;
+
+  /* Initialize the struct */
+  memset (conf, 0, sizeof (conf_t));
+  conf->filename = cpstr (filename);
+  layer = layer_new ();
+  if (conf->filename == NULL || layer == NULL)
+    {
+      free (layer);
+      set_err (conf, cpstr (MALLOC_FAILED));
+      return CONF_MALLOC_FAILED;
+    }
+
+  ret = layer_file (conf, layer, filename, NULL, 0, 0);
+  if (ret == CONF_NO_FILE)
+    {
+      /* Leave the defaults behind for callers which go on without it */
+      layer->data_len = 0;
+      return conf_push (conf, layer) == CONF_OK ? CONF_NO_FILE :
+        CONF_MALLOC_FAILED;
+    }
+  if (ret != CONF_OK)
+    {
+      layer_release (layer);
+      return ret;
+    }
+
+  return conf_push (conf, layer);
+}
+
+conf_err_t
+conf_fork (conf_t * conf, const conf_t * base)
+{
+  memset (conf, 0, sizeof (conf_t));
+  conf->filename = base->filename != NULL ? cpstr (base->filename) : NULL;
+  conf->index = (const struct _conf_kv_t**) malloc ((base->index_len + 1) *
+                                                    sizeof (*conf->index));
+  if ((base->filename != NULL && conf->filename == NULL) ||
+      conf->index == NULL)
+    {
+      set_err (conf, cpstr (MALLOC_FAILED));
+      return CONF_MALLOC_FAILED;
+    }
+
+  /* Share the layers, the values point into them */
+  memcpy (conf->index, base->index, base->index_len * sizeof (*conf->index));
+  conf->index_len = base->index_len;
+  conf->vals = base->vals;
+  conf->layer = base->layer;
+  if (conf->layer != NULL)
+    __atomic_add_fetch (&conf->layer->refs, 1, __ATOMIC_RELAXED);
+
+  return CONF_OK;
+}
+
+conf_err_t
+conf_overlay (conf_t * conf, const char * source,
+              const char * const * pairs, size_t count)
+{
+  struct _conf_layer_t * layer;
+  char * name, * copy, * eq, * key, * val, * dot;
+  const char * section;
+  conf_err_t ret = CONF_OK;
+  size_t i;
+
+  if (count == 0)
+    return CONF_OK;
+  layer = layer_new ();
+  name = layer != NULL ? layer_strdup (layer, source, strlen (source)) : NULL;
+  if (name == NULL)
+    {
+      set_err (conf, cpstr (MALLOC_FAILED));
+      ret = CONF_MALLOC_FAILED;
+    }
+
+  for (i = 0; ret == CONF_OK && i < count; i++)
+    {
+      copy = layer_strdup (layer, pairs[i], strlen (pairs[i]));
+      if (copy == NULL)
+        {
+          set_err (conf, cpstr (MALLOC_FAILED));
+          ret = CONF_MALLOC_FAILED;
+          break;
+        }
+      eq = strchr (copy, '=');
+      key = eq != NULL ? trim_str (copy, eq - copy) : copy;
+
+      /* Keys never contain a dot, section names may */
+      section = NULL;
+      dot = strrchr (key, '.');
+      if (dot != NULL)
+        {
+          *dot = '\0';
+          section = key;
+          key = dot + 1;
+        }
+      if (eq == NULL || key[0] == '\0' ||
+          (section != NULL && section[0] == '\0'))
+        {
+          set_err (conf, cpstrf ("%s: Invalid override %s, expected "
+                                 "[SECTION.]KEY=VALUE\n", source, pairs[i]));
+          ret = CONF_PARSE_ERR;
+          break;
+        }
+      val = trim_str (eq + 1, strlen (eq + 1));
+      ret = layer_store (conf, layer, section, key, val, name, i + 1, 0);
+    }
+
+  if (ret != CONF_OK)
+    {
+      if (layer != NULL)
+        layer_release (layer);
+      return ret;
+    }
+
+  return conf_push (conf, layer);
+}
+
+conf_err_t
+conf_overlay_env (conf_t * conf, const char * prefix)
+{
+  struct _conf_layer_t * layer;
+  char ** env, * key, * val, * eq;
+  size_t len = strlen (prefix);
+  conf_err_t ret;
+
+  layer = layer_new ();
+  if (layer == NULL)
+    {
+      set_err (conf, cpstr (MALLOC_FAILED));
+      return CONF_MALLOC_FAILED;
+    }
+
+  for (env = environ; *env != NULL; env++)
+    {
+      eq = strchr (*env, '=');
+      if (strncmp (*env, prefix, len) != 0 || eq == NULL)
+        continue;
+      key = layer_strdup (layer, *env + len, eq - *env - len);
+      val = layer_strdup (layer, eq + 1, strlen (eq + 1));
+      if (key == NULL || val == NULL)
+        {
+          layer_release (layer);
+          set_err (conf, cpstr (MALLOC_FAILED));
+          return CONF_MALLOC_FAILED;
+        }
+
+      /* The prefix is shared with variables which are not settings */
+      if (schema_find (key) == NULL)
+        continue;
+      ret = layer_store (conf, layer, NULL, key, val, "environment", 0, 0);
+      if (ret != CONF_OK)
+        {
+          layer_release (layer);
+          return ret;
+        }
+    }
+
+  if (layer->data_len == 0)
+    {
+      layer_release (layer);
+      return CONF_OK;
+    }
+  return conf_push (conf, layer);
+}
+
+static const struct _conf_kv_t *
+conf_find (conf_t * conf, const char * section, const char * key)
 {
   size_t left, right, median;
   int ret;
 
   /* Initialize LR */
   left = 0;
-  right = conf->data_len;
+  right = conf->index_len;
 
-  /* Binary Search over the sorted array */
+  /* Binary Search over the merged index */
   while (left < right)
     {
       median = (left+right)>>1;
-      ret = strcmp (conf->data[median].key, key);
+      ret = pair_cmp (section, key, conf->index[median]);
       if (ret == 0)
-        return conf->data[median].val;
+        return conf->index[median];
       else if (ret > 0)
         left = median + 1;
       else
@@ -197,25 +1049,67 @@ conf_get (conf_t * conf, const char * key)
   return NULL;
 }
 
+const char *
+conf_get (conf_t * conf, const char * key)
+{
+  const struct _conf_kv_t * kv;
+
+  kv = conf_find (conf, NULL, key);
+  return kv != NULL ? kv->val : NULL;
+}
+
+const char *
+conf_get_section (conf_t * conf, const char * section, const char * key)
+{
+  const struct _conf_kv_t * kv;
+
+  kv = conf_find (conf, section, key);
+  if (kv == NULL)
+    kv = conf_find (conf, NULL, key);
+  return kv != NULL ? kv->val : NULL;
+}
+
+size_t
+conf_section_vals (conf_t * conf, const char * section, conf_vals_t * vals)
+{
+  size_t left, right, median, i;
+
+  /* Find the first pair of the section */
+  left = 0;
+  right = conf->index_len;
+  while (left < right)
+    {
+      median = (left+right)>>1;
+      if (section_cmp (conf->index[median]->section, section) < 0)
+        left = median + 1;
+      else
+        right = median;
+    }
+
+  *vals = conf->vals;
+  for (i = left; i < conf->index_len &&
+         section_cmp (conf->index[i]->section, section) == 0; i++)
+    field_store (vals, conf->index[i]);
+
+  return i - left;
+}
+
 conf_err_t
 conf_destroy (conf_t * conf)
 {
-  size_t i;
-
   /* Free Data Members */
+  memset (&conf->vals, 0, sizeof (conf_vals_t));
   if (conf->err != NULL)
     free ((void*)conf->err);
   if (conf->filename != NULL)
     free ((void*)conf->filename);
-  if (conf->data != NULL)
-    {
-      for (i = 0; i < conf->data_len; i++)
-        {
-          free (conf->data[i].key);
-          free (conf->data[i].val);
-        }
-      free ((void*)conf->data);
-    }
+  if (conf->index != NULL)
+    free ((void*)conf->index);
+  layer_release (conf->layer);
+  conf->err = conf->filename = NULL;
+  conf->index = NULL;
+  conf->index_len = 0;
+  conf->layer = NULL;
 
   return CONF_OK;
 }
@@ -232,6 +1126,16 @@ conf_err_str (conf_err_t err)
     {
     case CONF_OK:
       return "Success";
+    case CONF_NO_FILE:
+      return "File does not Exist";
+    case CONF_MALLOC_FAILED:
+      return "Malloc Failed";
+    case CONF_TOO_LARGE:
+      return "Configuration File Too Large";
+    case CONF_PARSE_ERR:
+      return "Parse Error";
+    case CONF_INVALID:
+      return "Unknown Key or Invalid Value";
     case CONF_UNKNOWN:
       return "Unknown Cause of Error";
     }
@@ -3,7 +3,11 @@
    @author William A. Kennington III <william@wkennington.com>
    @brief Configuration Parser
    @details A configuration parser and manager, binding keys to values
-   read from the input file.
+   read from the input file. The pairs of each file, the environment
+   and the command line are kept in immutable layers stacked on top
+   of each other, and a merged index of the winning pair of every key
+   is rebuilt whenever a layer is added, so lookups never walk the
+   layers.
    @warning Editing support is currently unavailable.
 **/
 /*
@@ -28,6 +32,9 @@
 #ifndef _CONF_H
 #define _CONF_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
    @brief Configuration Error Codes
 **/
@@ -38,16 +45,135 @@ typedef enum _conf_err_t
     CONF_MALLOC_FAILED, /**< Malloc failed to produce a new block */
     CONF_TOO_LARGE, /**< The conf file is too large to process */
     CONF_PARSE_ERR, /**< The Parse Hit an unexpected symbol */
+    CONF_INVALID, /**< A key is unknown or its value is invalid */
     CONF_UNKNOWN /**< Unknown Cause of Error */
   } conf_err_t;
 
+/**
+   @brief Configuration Value Types
+**/
+typedef enum _conf_type_t
+  {
+    CONF_INT = 0, /**< Decimal integer, stored as int64_t */
+    CONF_BOOL, /**< yes/no, true/false, on/off or 1/0, stored as uint8_t */
+    CONF_DURATION, /**< Integer with an ms, s, m, h or d suffix,
+                      stored as uint64_t milliseconds */
+    CONF_SIZE, /**< Integer with a K, M, G or T suffix, stored as
+                  uint64_t bytes */
+    CONF_DOUBLE, /**< Decimal number, stored as double */
+    CONF_STR, /**< String, stored as const char * */
+    CONF_PATH, /**< Path, relative paths are resolved against the
+                  directory of the configuration file */
+    CONF_LIST /**< Comma separated strings, stored as conf_list_t */
+  } conf_type_t;
+
+/**
+   @brief Parsed List Value
+**/
+typedef struct _conf_list_t
+{
+  char ** items; /**< The trimmed items, allocated with the array */
+  size_t len; /**< Number of items */
+} conf_list_t;
+
+/**
+   @brief Schema Entry
+   @details Declares a configuration key and where its parsed value is
+   stored in conf_vals_t.
+**/
+typedef struct _conf_key_t
+{
+  const char * key; /**< Name of the key */
+  conf_type_t type; /**< Type of the value */
+  const char * def; /**< Default value as it would be written or NULL */
+  double min; /**< Smallest numeric value allowed */
+  double max; /**< Largest numeric value allowed, unused by strings */
+  const char * const * choices; /**< NULL terminated strings allowed for
+                                   CONF_STR or NULL for any */
+  size_t offset; /**< Offset of the value in conf_vals_t */
+  int secret; /**< The value is a credential and is never logged */
+} conf_key_t;
+
+/**
+   @brief Typed Configuration Values
+   @details Filled in by conf_init from the schema, so readers load
+   fields instead of looking up and parsing strings.
+**/
+typedef struct _conf_vals_t
+{
+  const char * cache_url; /**< CACHE_URL or NULL */
+  int64_t cache_parallel; /**< CACHE_PARALLEL */
+  uint8_t cache_compress; /**< CACHE_COMPRESS */
+  uint64_t cache_timeout; /**< CACHE_TIMEOUT, 0 for none */
+  uint64_t cache_chunk; /**< CACHE_CHUNK, 0 for whole blobs */
+  const char * cache_listen; /**< CACHE_LISTEN */
+  uint64_t cache_max_blob; /**< CACHE_MAX_BLOB */
+  const char * control_socket; /**< CONTROL_SOCKET or NULL */
+  uint64_t dblog_chunk; /**< DBLOG_CHUNK */
+  uint64_t dblog_flush; /**< DBLOG_FLUSH */
+  uint64_t dblog_max_queue; /**< DBLOG_MAX_QUEUE */
+  uint64_t dblog_batch; /**< DBLOG_BATCH */
+  const char * dblog_spill; /**< DBLOG_SPILL or NULL */
+  const char * db_type; /**< DB_TYPE */
+  const char * db_host; /**< DB_HOST */
+  int64_t db_port; /**< DB_PORT */
+  const char * db_user; /**< DB_USER */
+  const char * db_pass; /**< DB_PASS */
+  const char * db_db; /**< DB_DB */
+  int64_t db_pool; /**< DB_POOL */
+  int64_t db_queue; /**< DB_QUEUE */
+  int64_t db_statements; /**< DB_STATEMENTS */
+  int64_t db_breaker; /**< DB_BREAKER */
+  uint64_t db_health; /**< DB_HEALTH, 0 for never */
+  uint64_t db_timeout; /**< DB_TIMEOUT, 0 for none */
+  const char * history_file; /**< HISTORY_FILE or NULL */
+  double history_alpha; /**< HISTORY_ALPHA, 0 for the default */
+  int64_t load_width; /**< LOAD_WIDTH */
+  int64_t load_depth; /**< LOAD_DEPTH */
+  int64_t load_fanin; /**< LOAD_FANIN */
+  uint64_t load_duration; /**< LOAD_DURATION */
+  const char * load_dist; /**< LOAD_DIST */
+  const char * load_work; /**< LOAD_WORK */
+  uint64_t load_output; /**< LOAD_OUTPUT */
+  int64_t load_seed; /**< LOAD_SEED */
+  uint8_t load_warm; /**< LOAD_WARM */
+  const char * load_trace; /**< LOAD_TRACE or NULL */
+  const char * load_artifacts; /**< LOAD_ARTIFACTS or NULL */
+  int64_t queue_shards; /**< QUEUE_SHARDS */
+  uint64_t queue_aging; /**< QUEUE_AGING */
+  int64_t queue_default_weight; /**< QUEUE_DEFAULT_WEIGHT */
+  conf_list_t queue_weights; /**< QUEUE_WEIGHTS as tenant:weight */
+  int64_t sched_workers; /**< SCHED_WORKERS, 0 for one per cpu */
+  const char * sched_policy; /**< SCHED_POLICY */
+  uint64_t sched_default_ms; /**< SCHED_DEFAULT_MS */
+  double sched_straggler; /**< SCHED_STRAGGLER, 0 disables speculation */
+  uint64_t sched_slack_ms; /**< SCHED_SLACK_MS */
+  uint8_t sched_numa; /**< SCHED_NUMA */
+} conf_vals_t;
+
 /**
    @brief Key value pair string
+   @details Pairs belong to an immutable layer and are shared by every
+   configuration built on top of it.
 **/
 struct _conf_kv_t
 {
-  char * key;
-  char * val;
+  const char * section; /**< Section the pair was set in or NULL */
+  const char * key;
+  const char * val;
+  const char * file; /**< File, or other source, the pair was read from */
+  size_t line; /**< Line the pair was read from */
+  size_t seq; /**< Order the pair was read in within its layer */
+  const conf_key_t * entry; /**< Schema entry of the key */
+  union
+  {
+    int64_t i;
+    uint64_t u;
+    uint8_t b;
+    double d;
+    const char * s;
+    conf_list_t list;
+  } parsed; /**< The value parsed as entry->type */
 };
 
 /**
@@ -57,26 +183,102 @@ typedef struct _conf_t
 {
   char * err; /**< Last Error String */
   char * filename; /**< The path of the configuration file. */
-  struct _conf_kv_t * data; /**< The data struct for kv pairs.*/
-  size_t data_len;
+  struct _conf_layer_t * layer; /**< Topmost layer, possibly shared */
+  const struct _conf_kv_t ** index; /**< The winning pair of every key
+                                       across the layers, sorted */
+  size_t index_len;
+  conf_vals_t vals; /**< Values parsed by the schema */
 } conf_t;
 
 /**
    @brief Initializes the configuration struct to the given filename.
+   @details Every key is checked against the schema and parsed into
+   conf->vals, keys which are not set take their defaults. Unknown
+   keys and invalid values are reported with their file and line.
+
+   A line of the form "include PATH" reads another file in place,
+   "-include PATH" does the same but skips files which do not exist.
+   Relative paths are resolved against the including file and %h is
+   replaced by the host name, so per host overrides can be kept in
+   their own files. A "[NAME]" line starts a section, usually named
+   after a target, whose keys override the global ones for that name
+   only. Included files start in the section of the include line.
    @param conf The configuration struct to be initialized with data.
    @param filename The name of the file where the configuration is
    stored.
-   @return CONF_OK(0) on success or a positive error code.
+   @return CONF_OK(0) on success or a positive error code. On
+   CONF_NO_FILE the configuration is left holding only the defaults,
+   so callers which can do without the file may still overlay it.
 */
 conf_err_t conf_init (conf_t * conf, const char * filename);
 
+/**
+   @brief Initializes a configuration sharing the layers of another
+   @details Nothing is copied, overlays added to either configuration
+   afterwards are not seen by the other. The base may be destroyed
+   first.
+   @param conf The configuration struct to be initialized.
+   @param base The configuration to share.
+   @return CONF_OK(0) on success or a positive error code.
+**/
+conf_err_t conf_fork (conf_t * conf, const conf_t * base);
+
+/**
+   @brief Layers overrides on top of the configuration
+   @details Each pair is written as KEY=VALUE, or SECTION.KEY=VALUE to
+   override a key of one section. On failure the configuration is
+   left as it was.
+   @param conf The configuration struct.
+   @param source The name of the overrides used in error messages,
+   such as "command line".
+   @param pairs The override strings.
+   @param count The number of override strings.
+   @return CONF_OK(0) on success or a positive error code.
+**/
+conf_err_t conf_overlay (conf_t * conf, const char * source,
+                         const char * const * pairs, size_t count);
+
+/**
+   @brief Layers environment variables on top of the configuration
+   @details Every variable named prefix followed by a key of the
+   schema overrides that key, other variables with the prefix are
+   ignored.
+   @param conf The configuration struct.
+   @param prefix The variable name prefix, such as "AUTOBUILD_".
+   @return CONF_OK(0) on success or a positive error code.
+**/
+conf_err_t conf_overlay_env (conf_t * conf, const char * prefix);
+
 /**
    @brief Gets the value of a key -> value pair
    @param conf The configuration struct.
    @param key The key of the associated key -> value pair.
    @return NULL on failure or the value of the assoicated key.
 **/
-char * conf_get (conf_t * conf, const char * key);
+const char * conf_get (conf_t * conf, const char * key);
+
+/**
+   @brief Gets the value of a key as seen by a section
+   @param conf The configuration struct.
+   @param section The name of the section.
+   @param key The key of the associated key -> value pair.
+   @return The value set in the section, otherwise the global value or
+   NULL if neither is set.
+**/
+const char * conf_get_section (conf_t * conf, const char * section,
+                               const char * key);
+
+/**
+   @brief Gets the typed values as seen by a section
+   @details Copies conf->vals with the keys set in the section
+   replaced. The strings and lists still belong to conf.
+   @param conf The configuration struct.
+   @param section The name of the section.
+   @param vals The values to fill in.
+   @return The number of keys the section overrides.
+**/
+size_t conf_section_vals (conf_t * conf, const char * section,
+                          conf_vals_t * vals);
 
 /**
    @brief Get Detailed Error Message
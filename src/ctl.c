@@ -0,0 +1,491 @@
+/**
+   @file ctl.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Daemon Control Socket
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include "ctl.h"
+#include "log.h"
+#include "util.h"
+
+#define BACKLOG 16
+#define REQUEST_MAX 4096
+#define TIMEOUT_S 5
+#define MALLOC_FAILED "Malloc Failed\n"
+
+static int
+sock_addr (const char * path, struct sockaddr_un * addr)
+{
+  if (strlen (path) >= sizeof (addr->sun_path))
+    return 0;
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy (addr->sun_path, path);
+  return 1;
+}
+
+/* Checks that path is a socket of the current user */
+static int
+sock_owned (const char * path)
+{
+  struct stat st;
+
+  return lstat (path, &st) == 0 && S_ISSOCK (st.st_mode) &&
+    st.st_uid == geteuid ();
+}
+
+/* Checks that the other end of fd runs as the current user */
+static int
+peer_owned (int fd)
+{
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+
+  return getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+    cred.uid == geteuid ();
+}
+
+static int
+sock_connect (struct sockaddr_un * addr)
+{
+  struct timeval tv = { TIMEOUT_S, 0 };
+  int fd;
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect (fd, (struct sockaddr*)addr, sizeof (*addr)) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+
+  /* A wedged peer should not hang the other side forever */
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  return fd;
+}
+
+static int
+send_all (int fd, const void * data, size_t len)
+{
+  const char * ptr = (const char*) data;
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = send (fd, ptr, len, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return 0;
+      ptr += ret;
+      len -= ret;
+    }
+  return 1;
+}
+
+static int
+cmd_help (void * arg, const char * args, buffer_t * out)
+{
+  ctl_t * ctl = (ctl_t*) arg;
+  char buf[256], * line;
+  size_t i;
+  int ok = 1;
+
+  for (i = 0; i < ctl->ncmds && ok; i++)
+    {
+      line = fmtstr (buf, sizeof (buf), "%-12s %s\n", ctl->cmds[i].name,
+                     ctl->cmds[i].help);
+      ok = line != NULL && buffer_add (out, line, strlen (line)) == BUFF_OK;
+      if (line != buf)
+        free (line);
+    }
+
+  return ok ? 0 : 1;
+}
+
+static void
+answer (ctl_t * ctl, int fd)
+{
+  char req[REQUEST_MAX], * args;
+  struct timeval tv = { TIMEOUT_S, 0 };
+  struct _ctl_cmd_t * cmd = NULL;
+  buffer_t out;
+  size_t len = 0, i;
+  ssize_t ret;
+  int failed;
+
+  /* Read the request line */
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  while (len < sizeof (req) - 1 && memchr (req, '\n', len) == NULL)
+    {
+      ret = recv (fd, req + len, sizeof (req) - 1 - len, 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        break;
+      len += ret;
+    }
+  req[len] = '\0';
+  req[strcspn (req, "\r\n")] = '\0';
+
+  args = req + strcspn (req, " \t");
+  if (*args != '\0')
+    *args++ = '\0';
+  for (i = 0; i < ctl->ncmds; i++)
+    if (strcmp (ctl->cmds[i].name, req) == 0)
+      cmd = &ctl->cmds[i];
+
+  if (buffer_init (&out, 0, 0) != BUFF_OK)
+    return;
+  if (cmd == NULL)
+    {
+      failed = 1;
+      buffer_add (&out, "Unknown command, try help\n", 26);
+    }
+  else
+    failed = cmd->fn (cmd->arg, args, &out);
+
+  log_debug ("Answered a control request", LOG_STR ("cmd", req),
+             LOG_INT ("failed", failed));
+  if (send_all (fd, failed ? "error\n" : "ok\n", failed ? 6 : 3))
+    send_all (fd, out.data, out.len);
+  buffer_destroy (&out);
+}
+
+/* Sleeps while out of descriptors, doubling the delay up to a second */
+static unsigned
+backoff_fds (unsigned delay_ms)
+{
+  struct timespec ts;
+
+  if (delay_ms == 0)
+    {
+      log_warn ("Out of file descriptors, pausing accepts",
+                LOG_STR ("err", strerror (errno)));
+      delay_ms = 10;
+    }
+  else if (delay_ms < 1000)
+    delay_ms *= 2;
+  ts.tv_sec = delay_ms / 1000;
+  ts.tv_nsec = (delay_ms % 1000) * 1000000l;
+  nanosleep (&ts, NULL);
+
+  return delay_ms;
+}
+
+static void *
+ctl_main (void * arg)
+{
+  ctl_t * ctl = (ctl_t*) arg;
+  unsigned backoff = 0;
+  int fd;
+
+  while (!__atomic_load_n (&ctl->stop, __ATOMIC_RELAXED))
+    {
+      fd = accept4 (ctl->fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          /* The connection stays queued until a descriptor is closed */
+          if (errno == EMFILE || errno == ENFILE)
+            {
+              backoff = backoff_fds (backoff);
+              continue;
+            }
+          break;
+        }
+      backoff = 0;
+      if (!peer_owned (fd))
+        {
+          log_warn ("Refused a control request from another user",
+                    LOG_STR ("path", ctl->path));
+          close (fd);
+          continue;
+        }
+
+      /* Commands only read counters, so one thread answers them all */
+      answer (ctl, fd);
+      close (fd);
+      ctl->calls++;
+    }
+
+  return NULL;
+}
+
+ctl_err_t
+ctl_init (ctl_t * ctl, const char * path)
+{
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd, ret;
+
+  /* Initialize the struct */
+  memset (ctl, 0, sizeof (ctl_t));
+  ctl->fd = -1;
+  if (path == NULL || !sock_addr (path, &addr))
+    {
+      ctl->err = cpstrf ("Invalid control socket path: %s\n",
+                         path != NULL ? path : "(null)");
+      return CTL_INVALID;
+    }
+  ctl->path = cpstr (path);
+  if (ctl->path == NULL)
+    {
+      ctl->err = cpstr (MALLOC_FAILED);
+      return CTL_MALLOC_FAILED;
+    }
+  ctl_add (ctl, "help", "Lists the commands", cmd_help, ctl);
+
+  ctl->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (ctl->fd < 0)
+    {
+      ctl->err = cpstrf ("Failed to create a socket: %s\n", strerror (errno));
+      return CTL_BIND_FAILED;
+    }
+  /* bind honours the umask, so the socket is owner only from the
+     moment it exists and the chmod below only makes that explicit */
+  mask = umask (0177);
+  ret = bind (ctl->fd, (struct sockaddr*)&addr, sizeof (addr));
+  if (ret != 0 && errno == EADDRINUSE)
+    {
+      /* Never remove something another user put in a shared directory */
+      if (!sock_owned (path))
+        {
+          umask (mask);
+          close (ctl->fd);
+          ctl->fd = -1;
+          ctl->err = cpstrf ("%s exists and is not a socket owned by this "
+                             "user\n", path);
+          return CTL_NOT_OWNER;
+        }
+
+      /* Only replace sockets nobody answers on */
+      fd = sock_connect (&addr);
+      if (fd >= 0)
+        {
+          umask (mask);
+          close (fd);
+          close (ctl->fd);
+          ctl->fd = -1;
+          ctl->err = cpstrf ("A daemon is already listening on %s\n", path);
+          return CTL_BUSY;
+        }
+      unlink (path);
+      ret = bind (ctl->fd, (struct sockaddr*)&addr, sizeof (addr));
+    }
+  umask (mask);
+  if (ret == 0)
+    ret = chmod (path, 0600);
+  if (ret != 0 || listen (ctl->fd, BACKLOG) != 0)
+    {
+      ctl->err = cpstrf ("Failed to listen on %s: %s\n", path,
+                         strerror (errno));
+      close (ctl->fd);
+      ctl->fd = -1;
+      return CTL_BIND_FAILED;
+    }
+
+  return CTL_OK;
+}
+
+ctl_err_t
+ctl_add (ctl_t * ctl, const char * name, const char * help, ctl_cmd_fn_t fn,
+         void * arg)
+{
+  if (ctl->ncmds >= CTL_MAX_CMDS || ctl->started)
+    {
+      ctl->err = cpstrf ("Failed to add the %s command\n", name);
+      return CTL_INVALID;
+    }
+  ctl->cmds[ctl->ncmds].name = name;
+  ctl->cmds[ctl->ncmds].help = help;
+  ctl->cmds[ctl->ncmds].fn = fn;
+  ctl->cmds[ctl->ncmds].arg = arg;
+  ctl->ncmds++;
+
+  return CTL_OK;
+}
+
+ctl_err_t
+ctl_start (ctl_t * ctl)
+{
+  if (pthread_create (&ctl->thread, NULL, ctl_main, ctl) != 0)
+    {
+      ctl->err = cpstr ("Failed to start the control thread\n");
+      return CTL_THREAD_FAILED;
+    }
+  ctl->started = 1;
+  log_info ("Listening for control requests", LOG_STR ("path", ctl->path));
+
+  return CTL_OK;
+}
+
+ctl_err_t
+ctl_call (const char * path, const char * request, buffer_t * reply)
+{
+  struct sockaddr_un addr;
+  char buf[4096], * nl;
+  ssize_t ret;
+  int fd;
+
+  if (!sock_addr (path, &addr))
+    return CTL_INVALID;
+  if (access (path, F_OK) == 0 && !sock_owned (path))
+    return CTL_NOT_OWNER;
+  fd = sock_connect (&addr);
+  if (fd < 0)
+    return CTL_NO_DAEMON;
+  if (!peer_owned (fd))
+    {
+      close (fd);
+      return CTL_NOT_OWNER;
+    }
+  if (!send_all (fd, request, strlen (request)) || !send_all (fd, "\n", 1))
+    {
+      close (fd);
+      return CTL_IO_FAILED;
+    }
+
+  for (;;)
+    {
+      ret = recv (fd, buf, sizeof (buf), 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0)
+        {
+          close (fd);
+          return CTL_IO_FAILED;
+        }
+      if (ret == 0)
+        break;
+      if (buffer_add (reply, buf, ret) != BUFF_OK)
+        {
+          close (fd);
+          return CTL_MALLOC_FAILED;
+        }
+    }
+  close (fd);
+
+  /* Split off the status line */
+  nl = reply->len > 0 ? memchr (reply->data, '\n', reply->len) : NULL;
+  if (nl == NULL)
+    return CTL_IO_FAILED;
+  ret = nl + 1 - (char*)reply->data;
+  if (ret == 3 && memcmp (reply->data, "ok\n", 3) == 0)
+    {
+      buffer_shift (reply, ret);
+      return CTL_OK;
+    }
+  buffer_shift (reply, ret);
+  return CTL_REFUSED;
+}
+
+char *
+ctl_default_path (char * buf, size_t len)
+{
+  const char * dir;
+
+  dir = getenv ("XDG_RUNTIME_DIR");
+  if (dir != NULL && dir[0] != '\0')
+    snprintf (buf, len, "%s/autobuild.sock", dir);
+  else
+    snprintf (buf, len, "/tmp/autobuild-%u.sock", (unsigned)getuid ());
+  return buf;
+}
+
+const char *
+ctl_get_err (ctl_t * ctl)
+{
+  return ctl->err;
+}
+
+ctl_err_t
+ctl_destroy (ctl_t * ctl)
+{
+  /* Wakes the blocked accept */
+  __atomic_store_n (&ctl->stop, 1, __ATOMIC_RELAXED);
+  if (ctl->fd >= 0)
+    shutdown (ctl->fd, SHUT_RDWR);
+  if (ctl->started)
+    pthread_join (ctl->thread, NULL);
+  ctl->started = 0;
+  if (ctl->fd >= 0)
+    {
+      close (ctl->fd);
+      unlink (ctl->path);
+    }
+  ctl->fd = -1;
+
+  if (ctl->path != NULL)
+    free (ctl->path);
+  ctl->path = NULL;
+  if (ctl->err != NULL)
+    free (ctl->err);
+  ctl->err = NULL;
+
+  return CTL_OK;
+}
+
+const char *
+ctl_err_str (ctl_err_t err)
+{
+  switch (err)
+    {
+    case CTL_OK:
+      return "Success";
+    case CTL_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case CTL_BIND_FAILED:
+      return "The control socket could not be set up";
+    case CTL_BUSY:
+      return "Another daemon is listening on the socket";
+    case CTL_NO_DAEMON:
+      return "No daemon is listening on the socket";
+    case CTL_IO_FAILED:
+      return "Talking to the daemon failed";
+    case CTL_REFUSED:
+      return "The daemon answered with an error";
+    case CTL_NOT_OWNER:
+      return "The socket belongs to another user";
+    case CTL_THREAD_FAILED:
+      return "Starting the control thread failed";
+    case CTL_INVALID:
+      return "Invalid argument";
+    case CTL_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
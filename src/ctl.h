@@ -0,0 +1,179 @@
+/**
+   @file ctl.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Daemon Control Socket
+   @details Lets short lived invocations query and steer a running
+   daemon over a unix socket instead of loading the configuration and
+   starting every subsystem themselves. The protocol is one request
+   line, NAME [ARGS], answered by a line of "ok" or "error" followed
+   by the command's output, after which the daemon closes the
+   connection.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer.h"
+
+#define CTL_MAX_CMDS 16 /**< Most commands a daemon registers */
+#define CTL_PATH_MAX 108 /**< Longest socket path, with the terminator */
+
+/**
+   @brief Control Socket Error Codes
+**/
+typedef enum _ctl_err_t
+  {
+    CTL_OK = 0, /**< Success */
+    CTL_MALLOC_FAILED, /**< Allocating Memory Failed */
+    CTL_BIND_FAILED, /**< The socket could not be set up */
+    CTL_BUSY, /**< Another daemon is listening on the socket */
+    CTL_NO_DAEMON, /**< Nothing is listening on the socket */
+    CTL_IO_FAILED, /**< Sending or receiving failed */
+    CTL_REFUSED, /**< The daemon answered with an error */
+    CTL_NOT_OWNER, /**< The socket belongs to another user */
+    CTL_THREAD_FAILED, /**< Starting the server thread failed */
+    CTL_INVALID, /**< An invalid argument */
+    CTL_UNKNOWN /**< Unknown Error */
+  } ctl_err_t;
+
+/**
+   @brief Runs a Command in the Daemon
+   @param arg The argument given to ctl_add
+   @param args Everything after the command name, possibly empty
+   @param out Where the output of the command goes
+   @return 0 on success or non-zero to answer with an error
+**/
+typedef int (*ctl_cmd_fn_t) (void * arg, const char * args, buffer_t * out);
+
+/**
+   @brief Registered Command
+**/
+struct _ctl_cmd_t
+{
+  const char * name; /**< What clients send */
+  const char * help; /**< One line description */
+  ctl_cmd_fn_t fn; /**< Runs the command */
+  void * arg; /**< Passed to fn */
+};
+
+/**
+   @brief Control Server Structure
+**/
+typedef struct _ctl_t
+{
+  char * err; /**< Last Error String */
+  char * path; /**< Path of the socket */
+  int fd; /**< Listening socket or -1 */
+  pthread_t thread; /**< Serving thread */
+  int started; /**< Whether the thread is running */
+  int stop; /**< Set once the server is stopping */
+  struct _ctl_cmd_t cmds[CTL_MAX_CMDS]; /**< Registered commands */
+  size_t ncmds; /**< Number of commands */
+  uint64_t calls; /**< Requests answered */
+} ctl_t;
+
+/**
+   @brief Creates a New Control Server
+   @details Binds the socket, replacing one left behind by a daemon
+   which is no longer running, without serving it yet. The socket is
+   only accessible to the current user, a path held by anything but
+   one of the user's own sockets is never replaced, and connections
+   from other users are refused.
+   @param ctl The server structure to be initialized
+   @param path The path of the socket
+   @return CTL_OK(0) on success, CTL_BUSY if another daemon owns the
+   socket or a positive error code
+**/
+ctl_err_t ctl_init (ctl_t * ctl, const char * path);
+
+/**
+   @brief Registers a Command
+   @details Must be called before ctl_start.
+   @param ctl The server structure
+   @param name The command name
+   @param help One line description listed by the help command
+   @param fn Runs the command on the serving thread
+   @param arg Passed to fn
+   @return CTL_OK(0) on success or a positive error code
+**/
+ctl_err_t ctl_add (ctl_t * ctl, const char * name, const char * help,
+                   ctl_cmd_fn_t fn, void * arg);
+
+/**
+   @brief Starts Answering Requests
+   @details Requests are answered one at a time on a single thread.
+   @param ctl The server structure
+   @return CTL_OK(0) on success or a positive error code
+**/
+ctl_err_t ctl_start (ctl_t * ctl);
+
+/**
+   @brief Sends a Request to a Daemon
+   @details Only connects and exchanges the request, so it costs no
+   more than the round trip. Refuses to talk to a socket or daemon
+   owned by another user.
+   @param path The path of the daemon's socket
+   @param request The command name and arguments
+   @param reply Filled in with the daemon's output
+   @return CTL_OK(0) on success, CTL_REFUSED if the command failed in
+   which case reply holds the reason, CTL_NOT_OWNER if another user
+   owns the socket, or a positive error code
+**/
+ctl_err_t ctl_call (const char * path, const char * request,
+                    buffer_t * reply);
+
+/**
+   @brief Generates the Default Socket Path
+   @details Uses $XDG_RUNTIME_DIR/autobuild.sock if the variable is
+   set, otherwise a per user path under /tmp.
+   @param buf Receives the path
+   @param len The size of buf
+   @return buf
+**/
+char * ctl_default_path (char * buf, size_t len);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param ctl The server structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * ctl_get_err (ctl_t * ctl);
+
+/**
+   @brief Destroys the Control Server
+   @details Stops answering requests and removes the socket.
+   @param ctl The server structure to be destroyed
+   @return CTL_OK(0) on success or a positive error code
+**/
+ctl_err_t ctl_destroy (ctl_t * ctl);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * ctl_err_str (ctl_err_t err);
+
+#endif
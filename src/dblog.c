@@ -0,0 +1,884 @@
+/**
+   @file dblog.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Build Output Streaming to the Database
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "dblog.h"
+#include "log.h"
+#include "util.h"
+
+#define DEFAULT_SHARDS 16
+#define DEFAULT_CHUNK (64 * 1024)
+#define DEFAULT_FLUSH_MS 250
+#define DEFAULT_MAX_QUEUED (64 * 1024 * 1024)
+#define DEFAULT_BATCH (1024 * 1024)
+#define FIRST_CHUNK 256
+#define STREAMS_SIZE 64
+#define ROW_HEAD 64
+#define MALLOC_FAILED "Malloc Failed\n"
+
+#define CREATE_TABLE                                            \
+  "CREATE TABLE IF NOT EXISTS build_log ("                      \
+  "job bigint NOT NULL, seq integer NOT NULL, "                 \
+  "at_ms bigint NOT NULL, ts timestamptz NOT NULL DEFAULT now(), " \
+  "data text NOT NULL, PRIMARY KEY (job, seq))"
+#define COPY_ROWS "COPY build_log (job, seq, at_ms, data) FROM STDIN"
+
+/**
+   @brief Piece of the Output of a Job
+   @details Becomes one row of build_log.
+**/
+struct _dblog_chunk_t
+{
+  struct _dblog_chunk_t * next; /**< Next sealed chunk */
+  uint64_t job; /**< The id of the job */
+  uint32_t seq; /**< Position in the output of the job */
+  uint64_t first_ns; /**< Monotonic time of the first byte */
+  uint64_t first_ms; /**< Wall clock time of the first byte */
+  size_t len; /**< Bytes of output */
+  size_t size; /**< Allocated bytes after the header */
+};
+
+/**
+   @brief Output State of a Running Job
+**/
+struct _dblog_stream_t
+{
+  uint64_t job; /**< The id of the job */
+  struct _dblog_stream_t * next; /**< Next job in the bucket */
+  struct _dblog_stream_t * open_next; /**< Next job with an open chunk */
+  struct _dblog_stream_t ** open_prev; /**< Link pointing at this job */
+  struct _dblog_chunk_t * chunk; /**< Unsealed chunk or NULL */
+  uint32_t seq; /**< Sequence number of the next chunk */
+  uint64_t gap; /**< Bytes only kept locally since the last chunk */
+};
+
+/**
+   @brief Batch of Chunks Given to the Pool
+**/
+struct _dblog_batch_t
+{
+  dblog_t * dl; /**< Owning log */
+  struct _dblog_chunk_t * rows; /**< Chunks in the batch */
+  char * copy; /**< The rows escaped for COPY */
+};
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline static uint64_t
+hash_job (uint64_t job)
+{
+  job ^= job >> 33;
+  job *= 0xff51afd7ed558ccdull;
+  job ^= job >> 33;
+  return job;
+}
+
+inline static char *
+chunk_data (struct _dblog_chunk_t * chunk)
+{
+  return (char*)(chunk + 1);
+}
+
+static void
+set_err (dblog_t * dl, char * err)
+{
+  pthread_mutex_lock (&dl->lock);
+  if (dl->err != NULL)
+    free (dl->err);
+  dl->err = err;
+  pthread_mutex_unlock (&dl->lock);
+}
+
+static void
+spill (dblog_t * dl, uint64_t job, const char * data, size_t len)
+{
+  char head[ROW_HEAD];
+  int head_len;
+
+  __atomic_add_fetch (&dl->stats.spilled, len, __ATOMIC_RELAXED);
+  if (dl->spill == NULL || len == 0)
+    return;
+
+  head_len = snprintf (head, sizeof (head), "--- job %llu ---\n",
+                       (unsigned long long)job);
+  pthread_mutex_lock (&dl->spill_lock);
+  logstore_write (dl->spill, head, head_len);
+  logstore_write (dl->spill, data, len);
+  if (data[len-1] != '\n')
+    logstore_write (dl->spill, "\n", 1);
+  pthread_mutex_unlock (&dl->spill_lock);
+}
+
+static struct _dblog_stream_t *
+stream_get (struct _dblog_shard_t * shard, uint64_t job, uint64_t hash,
+            int create)
+{
+  struct _dblog_stream_t ** link, * stream;
+
+  link = &shard->streams[(hash >> 16) % shard->streams_size];
+  for (stream = *link; stream != NULL; stream = stream->next)
+    if (stream->job == job)
+      return stream;
+  if (!create)
+    return NULL;
+
+  stream = (struct _dblog_stream_t*) calloc (1, sizeof (*stream));
+  if (stream == NULL)
+    return NULL;
+  stream->job = job;
+  stream->next = *link;
+  *link = stream;
+  shard->nstreams++;
+  return stream;
+}
+
+static void
+seal (struct _dblog_shard_t * shard, struct _dblog_stream_t * stream)
+{
+  struct _dblog_chunk_t * chunk = stream->chunk;
+
+  if (chunk == NULL)
+    return;
+  chunk->next = NULL;
+  *shard->sealed_tail = chunk;
+  shard->sealed_tail = &chunk->next;
+  stream->chunk = NULL;
+
+  *stream->open_prev = stream->open_next;
+  if (stream->open_next != NULL)
+    stream->open_next->open_prev = stream->open_prev;
+  stream->open_next = NULL;
+  stream->open_prev = NULL;
+}
+
+static struct _dblog_chunk_t *
+chunk_open (dblog_t * dl, struct _dblog_shard_t * shard,
+            struct _dblog_stream_t * stream, size_t want)
+{
+  struct _dblog_chunk_t * chunk;
+  struct timespec ts;
+  size_t size;
+
+  size = want < FIRST_CHUNK ? FIRST_CHUNK : want;
+  if (size > dl->chunk_size)
+    size = dl->chunk_size;
+  chunk = (struct _dblog_chunk_t*) malloc (sizeof (*chunk) + size);
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = NULL;
+  chunk->job = stream->job;
+  chunk->seq = stream->seq++;
+  chunk->first_ns = now_ns ();
+  clock_gettime (CLOCK_REALTIME, &ts);
+  chunk->first_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  chunk->len = 0;
+  chunk->size = size;
+
+  /* Tell the reader where output is missing */
+  if (stream->gap > 0)
+    {
+      chunk->len = snprintf (chunk_data (chunk), size,
+                             "[%llu bytes only in the local log]\n",
+                             (unsigned long long)stream->gap);
+      if (chunk->len >= size)
+        chunk->len = size - 1;
+      __atomic_add_fetch (&dl->stats.queued, chunk->len, __ATOMIC_RELAXED);
+      stream->gap = 0;
+    }
+
+  stream->chunk = chunk;
+  stream->open_prev = &shard->open;
+  stream->open_next = shard->open;
+  if (shard->open != NULL)
+    shard->open->open_prev = &stream->open_next;
+  shard->open = stream;
+  return chunk;
+}
+
+static int
+chunk_grow (dblog_t * dl, struct _dblog_stream_t * stream, size_t want)
+{
+  struct _dblog_chunk_t * chunk = stream->chunk, * tmp;
+  size_t size;
+
+  if (chunk->size - chunk->len >= want)
+    return 1;
+  size = chunk->size * 2;
+  if (size < chunk->len + want)
+    size = chunk->len + want;
+  if (size > dl->chunk_size)
+    size = dl->chunk_size;
+  tmp = (struct _dblog_chunk_t*) realloc (chunk, sizeof (*chunk) + size);
+  if (tmp == NULL)
+    return 0;
+  tmp->size = size;
+
+  /* The open list points into the stream, not the chunk */
+  stream->chunk = tmp;
+  return 1;
+}
+
+static size_t
+utf8_len (const uint8_t * in, size_t len)
+{
+  uint8_t lo = 0x80, hi = 0xbf;
+  size_t n, i;
+
+  if (in[0] >= 0xc2 && in[0] <= 0xdf)
+    n = 2;
+  else if (in[0] >= 0xe0 && in[0] <= 0xef)
+    {
+      n = 3;
+      if (in[0] == 0xe0)
+        lo = 0xa0;
+      else if (in[0] == 0xed)
+        hi = 0x9f;
+    }
+  else if (in[0] >= 0xf0 && in[0] <= 0xf4)
+    {
+      n = 4;
+      if (in[0] == 0xf0)
+        lo = 0x90;
+      else if (in[0] == 0xf4)
+        hi = 0x8f;
+    }
+  else
+    return 0;
+  if (len < n || in[1] < lo || in[1] > hi)
+    return 0;
+  for (i = 2; i < n; i++)
+    if (in[i] < 0x80 || in[i] > 0xbf)
+      return 0;
+  return n;
+}
+
+size_t
+dblog_copy_escape (const void * data, size_t len, char * out)
+{
+  const uint8_t * in = (const uint8_t*) data;
+  char * o = out;
+  size_t i = 0, n;
+
+  while (i < len)
+    {
+      if (in[i] < 0x80)
+        {
+          switch (in[i])
+            {
+            case '\\':
+              *o++ = '\\';
+              *o++ = '\\';
+              break;
+            case '\n':
+              *o++ = '\\';
+              *o++ = 'n';
+              break;
+            case '\r':
+              *o++ = '\\';
+              *o++ = 'r';
+              break;
+            case '\t':
+              *o++ = '\\';
+              *o++ = 't';
+              break;
+            case '\0':
+              /* Text columns cannot hold NUL */
+              memcpy (o, "\xef\xbf\xbd", 3);
+              o += 3;
+              break;
+            default:
+              *o++ = in[i];
+            }
+          i++;
+          continue;
+        }
+
+      /* The database rejects invalid UTF-8 and with it the batch */
+      n = utf8_len (in + i, len - i);
+      if (n == 0)
+        {
+          memcpy (o, "\xef\xbf\xbd", 3);
+          o += 3;
+          i++;
+          continue;
+        }
+      memcpy (o, in + i, n);
+      o += n;
+      i += n;
+    }
+
+  return o - out;
+}
+
+/* Runs on the pool thread once the batch is in or has failed */
+static void
+shipped (void * arg, dbpool_err_t ret)
+{
+  struct _dblog_batch_t * batch = (struct _dblog_batch_t*) arg;
+  struct _dblog_chunk_t * rows = batch->rows, * chunk;
+  uint64_t now, lag, lag_max, lag_sum, nrows, bytes;
+  dblog_t * dl = batch->dl;
+
+  now = now_ns ();
+  lag_max = lag_sum = nrows = bytes = 0;
+  while (rows != NULL)
+    {
+      chunk = rows;
+      rows = rows->next;
+      if (ret == DBPOOL_OK)
+        {
+          lag = (now - chunk->first_ns) / 1000000;
+          lag_sum += lag;
+          if (lag > lag_max)
+            lag_max = lag;
+          nrows++;
+          bytes += chunk->len;
+        }
+      else
+        spill (dl, chunk->job, chunk_data (chunk), chunk->len);
+      __atomic_sub_fetch (&dl->stats.queued, chunk->len, __ATOMIC_RELAXED);
+      free (chunk);
+    }
+  free (batch->copy);
+  free (batch);
+
+  pthread_mutex_lock (&dl->lock);
+  if (ret == DBPOOL_OK)
+    {
+      dl->stats.batches++;
+      dl->stats.rows += nrows;
+      dl->stats.bytes += bytes;
+      dl->stats.lag_sum_ms += lag_sum;
+      if (lag_max > dl->stats.lag_max_ms)
+        dl->stats.lag_max_ms = lag_max;
+    }
+  else
+    dl->stats.failures++;
+  dl->inflight = 0;
+  pthread_cond_signal (&dl->wake);
+  pthread_mutex_unlock (&dl->lock);
+}
+
+/* Hands the next batch to the pool, 0 once pending is empty */
+static int
+ship (dblog_t * dl)
+{
+  struct _dblog_chunk_t ** tail, * chunk, * next;
+  struct _dblog_batch_t * batch;
+  dbpool_query_t query;
+  dbpool_err_t ret;
+  size_t need, nbytes, len = 0;
+
+  if (dl->pending == NULL)
+    return 0;
+
+  /* Take at least one chunk and at most batch_size bytes */
+  batch = (struct _dblog_batch_t*) calloc (1, sizeof (*batch));
+  if (batch == NULL)
+    {
+      /* Keep the rows locally rather than waiting on memory forever */
+      set_err (dl, cpstr (MALLOC_FAILED));
+      for (chunk = dl->pending; chunk != NULL; chunk = next)
+        {
+          next = chunk->next;
+          spill (dl, chunk->job, chunk_data (chunk), chunk->len);
+          __atomic_sub_fetch (&dl->stats.queued, chunk->len,
+                              __ATOMIC_RELAXED);
+          free (chunk);
+        }
+      dl->pending = NULL;
+      dl->pending_tail = &dl->pending;
+      pthread_mutex_lock (&dl->lock);
+      dl->stats.failures++;
+      pthread_mutex_unlock (&dl->lock);
+      return 1;
+    }
+  batch->dl = dl;
+  batch->rows = dl->pending;
+  tail = &dl->pending->next;
+  nbytes = dl->pending->len;
+  for (chunk = dl->pending->next; chunk != NULL &&
+         nbytes + chunk->len <= dl->batch_size; chunk = chunk->next)
+    {
+      nbytes += chunk->len;
+      tail = &chunk->next;
+    }
+  dl->pending = *tail;
+  if (dl->pending == NULL)
+    dl->pending_tail = &dl->pending;
+  *tail = NULL;
+
+  need = nbytes * 3;
+  for (chunk = batch->rows; chunk != NULL; chunk = chunk->next)
+    need += ROW_HEAD;
+  batch->copy = (char*) malloc (need);
+  if (batch->copy == NULL)
+    {
+      set_err (dl, cpstr (MALLOC_FAILED));
+      shipped (batch, DBPOOL_MALLOC_FAILED);
+      return 1;
+    }
+  for (chunk = batch->rows; chunk != NULL; chunk = chunk->next)
+    {
+      len += snprintf (batch->copy + len, ROW_HEAD, "%llu\t%u\t%llu\t",
+                       (unsigned long long)chunk->job, chunk->seq,
+                       (unsigned long long)chunk->first_ms);
+      len += dblog_copy_escape (chunk_data (chunk), chunk->len,
+                                batch->copy + len);
+      batch->copy[len++] = '\n';
+    }
+
+  /* One COPY per batch is one round trip and one commit */
+  memset (&query, 0, sizeof (query));
+  query.sql = COPY_ROWS;
+  query.copy = batch->copy;
+  query.copy_len = len;
+  pthread_mutex_lock (&dl->lock);
+  dl->inflight = 1;
+  pthread_mutex_unlock (&dl->lock);
+  ret = dbpool_submit (&dl->pool, &query, shipped, batch);
+
+  /* An open breaker means the database is down, keep the rows locally */
+  if (ret != DBPOOL_OK)
+    shipped (batch, ret);
+  return 1;
+}
+
+static struct _dblog_chunk_t *
+collect (dblog_t * dl, int all)
+{
+  struct _dblog_chunk_t * chunks = NULL, ** tail = &chunks;
+  struct _dblog_stream_t * stream, * next;
+  struct _dblog_shard_t * shard;
+  uint64_t now, age;
+  size_t i;
+
+  now = now_ns ();
+  age = dl->flush_ms * 1000000ull;
+  for (i = 0; i < dl->nshards; i++)
+    {
+      shard = &dl->shards[i];
+      pthread_mutex_lock (&shard->lock);
+      for (stream = shard->open; stream != NULL; stream = next)
+        {
+          next = stream->open_next;
+          if (all || now - stream->chunk->first_ns >= age)
+            seal (shard, stream);
+        }
+      if (shard->sealed != NULL)
+        {
+          *tail = shard->sealed;
+          tail = shard->sealed_tail;
+          shard->sealed = NULL;
+          shard->sealed_tail = &shard->sealed;
+        }
+      pthread_mutex_unlock (&shard->lock);
+    }
+
+  return chunks;
+}
+
+static void *
+dblog_main (void * arg)
+{
+  dblog_t * dl = (dblog_t*) arg;
+  struct _dblog_chunk_t * chunks;
+  struct timespec ts;
+  uint64_t tick_ns;
+  int stop, inflight;
+
+  /* Waking a few times per interval keeps the lag near flush_ms */
+  tick_ns = dl->flush_ms * 1000000ull / 4;
+  if (tick_ns == 0)
+    tick_ns = 1000000;
+
+  do
+    {
+      pthread_mutex_lock (&dl->lock);
+      if (!dl->stop || dl->inflight)
+        {
+          clock_gettime (CLOCK_REALTIME, &ts);
+          ts.tv_sec += (ts.tv_nsec + tick_ns) / 1000000000ull;
+          ts.tv_nsec = (ts.tv_nsec + tick_ns) % 1000000000ull;
+          pthread_cond_timedwait (&dl->wake, &dl->lock, &ts);
+        }
+      stop = dl->stop;
+      pthread_mutex_unlock (&dl->lock);
+
+      chunks = collect (dl, stop);
+      if (chunks != NULL)
+        {
+          *dl->pending_tail = chunks;
+          for (; chunks->next != NULL; chunks = chunks->next);
+          dl->pending_tail = &chunks->next;
+        }
+
+      /* One batch at a time keeps the rows of a job in order */
+      do
+        {
+          pthread_mutex_lock (&dl->lock);
+          inflight = dl->inflight;
+          pthread_mutex_unlock (&dl->lock);
+        }
+      while (!inflight && ship (dl));
+    }
+  while (!stop || inflight || dl->pending != NULL);
+
+  return NULL;
+}
+
+static int
+dblog_start (void * arg)
+{
+  dblog_t * dl = (dblog_t*) arg;
+
+  if (pthread_create (&dl->thread, NULL, dblog_main, dl) != 0)
+    {
+      set_err (dl, cpstr ("Failed to start the flusher thread\n"));
+      return DBLOG_THREAD_FAILED;
+    }
+
+  return DBLOG_OK;
+}
+
+static int
+dblog_stop (void * arg)
+{
+  dblog_t * dl = (dblog_t*) arg;
+
+  /* Seal everything and give the database one last try */
+  pthread_mutex_lock (&dl->lock);
+  dl->stop = 1;
+  pthread_cond_signal (&dl->wake);
+  pthread_mutex_unlock (&dl->lock);
+  pthread_join (dl->thread, NULL);
+
+  log_info ("Database log streaming", LOG_UINT ("rows", dl->stats.rows),
+            LOG_UINT ("batches", dl->stats.batches),
+            LOG_UINT ("bytes", dl->stats.bytes),
+            LOG_UINT ("spilled", dl->stats.spilled),
+            LOG_UINT ("failures", dl->stats.failures),
+            LOG_UINT ("lag_max_ms", dl->stats.lag_max_ms));
+
+  return DBLOG_OK;
+}
+
+/* Everything but the pool */
+static dblog_err_t
+dblog_setup (dblog_t * dl, logstore_t * spill)
+{
+  size_t i;
+
+  /* Initialize the struct */
+  memset (dl, 0, sizeof (dblog_t));
+  pthread_mutex_init (&dl->lock, NULL);
+  pthread_mutex_init (&dl->spill_lock, NULL);
+  pthread_cond_init (&dl->wake, NULL);
+  lazy_init (&dl->started, "dblog", dblog_start, dblog_stop, dl,
+             DBLOG_INVALID);
+  dl->spill = spill;
+  dl->chunk_size = DEFAULT_CHUNK;
+  dl->flush_ms = DEFAULT_FLUSH_MS;
+  dl->max_queued = DEFAULT_MAX_QUEUED;
+  dl->batch_size = DEFAULT_BATCH;
+  dl->pending_tail = &dl->pending;
+  dl->shards = (struct _dblog_shard_t*)
+    aligned_alloc (64, sizeof (*dl->shards) * DEFAULT_SHARDS);
+  if (dl->shards == NULL)
+    {
+      dl->err = cpstr (MALLOC_FAILED);
+      return DBLOG_MALLOC_FAILED;
+    }
+
+  for (i = 0; i < DEFAULT_SHARDS; i++)
+    {
+      memset (&dl->shards[i], 0, sizeof (*dl->shards));
+      pthread_mutex_init (&dl->shards[i].lock, NULL);
+      dl->shards[i].sealed_tail = &dl->shards[i].sealed;
+      dl->shards[i].streams_size = STREAMS_SIZE;
+      dl->shards[i].streams = (struct _dblog_stream_t**)
+        calloc (STREAMS_SIZE, sizeof (struct _dblog_stream_t*));
+      dl->nshards++;
+      if (dl->shards[i].streams == NULL)
+        {
+          dl->err = cpstr (MALLOC_FAILED);
+          return DBLOG_MALLOC_FAILED;
+        }
+    }
+
+  return DBLOG_OK;
+}
+
+static dblog_err_t
+pool_err (dblog_t * dl, dbpool_err_t ret)
+{
+  const char * err;
+
+  if (ret == DBPOOL_OK)
+    return DBLOG_OK;
+  err = dbpool_get_err (&dl->pool);
+  set_err (dl, cpstr (err != NULL ? err : MALLOC_FAILED));
+  return ret == DBPOOL_MALLOC_FAILED ? DBLOG_MALLOC_FAILED : DBLOG_INVALID;
+}
+
+dblog_err_t
+dblog_init (dblog_t * dl, const char * conninfo, logstore_t * spill)
+{
+  dblog_err_t ret;
+
+  ret = dblog_setup (dl, spill);
+  if (ret != DBLOG_OK)
+    return ret;
+  return pool_err (dl, dbpool_init (&dl->pool, conninfo, 0, CREATE_TABLE));
+}
+
+dblog_err_t
+dblog_init_conf (dblog_t * dl, conf_t * conf, logstore_t * spill)
+{
+  conf_vals_t * vals = &conf->vals;
+  dblog_err_t ret;
+
+  ret = dblog_setup (dl, spill);
+  if (ret != DBLOG_OK)
+    return ret;
+  ret = pool_err (dl, dbpool_init_conf (&dl->pool, conf, CREATE_TABLE));
+  if (ret != DBLOG_OK)
+    return ret;
+  dl->chunk_size = vals->dblog_chunk;
+  dl->flush_ms = vals->dblog_flush;
+  dl->max_queued = vals->dblog_max_queue;
+  dl->batch_size = vals->dblog_batch;
+
+  return DBLOG_OK;
+}
+
+dblog_err_t
+dblog_write (dblog_t * dl, uint64_t job, const void * data, size_t len)
+{
+  const char * in = (const char*) data;
+  struct _dblog_stream_t * stream;
+  struct _dblog_shard_t * shard;
+  struct _dblog_chunk_t * chunk;
+  uint64_t hash, queued;
+  size_t n, k;
+  int sealed = 0;
+
+  if (len == 0)
+    return DBLOG_OK;
+  if (lazy_get (&dl->started) != DBLOG_OK)
+    {
+      spill (dl, job, in, len);
+      return DBLOG_THREAD_FAILED;
+    }
+  hash = hash_job (job);
+  shard = &dl->shards[hash % dl->nshards];
+  pthread_mutex_lock (&shard->lock);
+  stream = stream_get (shard, job, hash, 1);
+  if (stream == NULL)
+    {
+      pthread_mutex_unlock (&shard->lock);
+      spill (dl, job, in, len);
+      return DBLOG_MALLOC_FAILED;
+    }
+
+  /* Backpressure goes to the local log, never to the writer */
+  queued = __atomic_add_fetch (&dl->stats.queued, len, __ATOMIC_RELAXED);
+  if (queued > dl->max_queued)
+    {
+      __atomic_sub_fetch (&dl->stats.queued, len, __ATOMIC_RELAXED);
+      stream->gap += len;
+      pthread_mutex_unlock (&shard->lock);
+      spill (dl, job, in, len);
+      return DBLOG_DROPPED;
+    }
+
+  while (len > 0)
+    {
+      chunk = stream->chunk;
+      if (chunk == NULL)
+        chunk = chunk_open (dl, shard, stream, len);
+      if (chunk == NULL || !chunk_grow (dl, stream, len))
+        break;
+      chunk = stream->chunk;
+      n = chunk->size - chunk->len;
+      if (n >= len)
+        n = len;
+      else
+        /* Keep UTF-8 sequences whole within a row */
+        for (k = 0; k < 3 && n > 0 && ((uint8_t)in[n] & 0xc0) == 0x80; k++)
+          n--;
+      memcpy (chunk_data (chunk) + chunk->len, in, n);
+      chunk->len += n;
+      in += n;
+      len -= n;
+      if (len > 0 || chunk->len == dl->chunk_size)
+        {
+          seal (shard, stream);
+          sealed = 1;
+        }
+    }
+  if (len > 0)
+    {
+      __atomic_sub_fetch (&dl->stats.queued, len, __ATOMIC_RELAXED);
+      stream->gap += len;
+    }
+  pthread_mutex_unlock (&shard->lock);
+
+  if (len > 0)
+    {
+      spill (dl, job, in, len);
+      return DBLOG_MALLOC_FAILED;
+    }
+  if (sealed)
+    {
+      pthread_mutex_lock (&dl->lock);
+      pthread_cond_signal (&dl->wake);
+      pthread_mutex_unlock (&dl->lock);
+    }
+
+  return DBLOG_OK;
+}
+
+dblog_err_t
+dblog_end (dblog_t * dl, uint64_t job)
+{
+  struct _dblog_stream_t ** link, * stream;
+  struct _dblog_shard_t * shard;
+  uint64_t hash;
+
+  hash = hash_job (job);
+  shard = &dl->shards[hash % dl->nshards];
+  pthread_mutex_lock (&shard->lock);
+  link = &shard->streams[(hash >> 16) % shard->streams_size];
+  for (; *link != NULL; link = &(*link)->next)
+    if ((*link)->job == job)
+      break;
+  stream = *link;
+  if (stream == NULL)
+    {
+      pthread_mutex_unlock (&shard->lock);
+      return DBLOG_OK;
+    }
+
+  /* Output dropped at the very end still gets its note */
+  if (stream->chunk == NULL && stream->gap > 0)
+    chunk_open (dl, shard, stream, 0);
+  seal (shard, stream);
+  *link = stream->next;
+  shard->nstreams--;
+  pthread_mutex_unlock (&shard->lock);
+  free (stream);
+
+  /* The job is done so its tail should not wait out flush_ms */
+  pthread_mutex_lock (&dl->lock);
+  pthread_cond_signal (&dl->wake);
+  pthread_mutex_unlock (&dl->lock);
+
+  return DBLOG_OK;
+}
+
+void
+dblog_stats (dblog_t * dl, dblog_stats_t * stats)
+{
+  pthread_mutex_lock (&dl->lock);
+  *stats = dl->stats;
+  pthread_mutex_unlock (&dl->lock);
+  stats->queued = __atomic_load_n (&dl->stats.queued, __ATOMIC_RELAXED);
+  stats->spilled = __atomic_load_n (&dl->stats.spilled, __ATOMIC_RELAXED);
+  dbpool_stats (&dl->pool, &stats->pool);
+}
+
+const char *
+dblog_get_err (dblog_t * dl)
+{
+  return dl->err;
+}
+
+dblog_err_t
+dblog_destroy (dblog_t * dl)
+{
+  struct _dblog_stream_t * stream, * next;
+  size_t i, j;
+
+  /* The flusher waits for its last batch before the pool goes */
+  lazy_destroy (&dl->started);
+  dbpool_destroy (&dl->pool);
+
+  for (i = 0; i < dl->nshards; i++)
+    {
+      for (j = 0; j < dl->shards[i].streams_size; j++)
+        for (stream = dl->shards[i].streams[j]; stream != NULL; stream = next)
+          {
+            next = stream->next;
+            free (stream);
+          }
+      if (dl->shards[i].streams != NULL)
+        free (dl->shards[i].streams);
+      pthread_mutex_destroy (&dl->shards[i].lock);
+    }
+  if (dl->shards != NULL)
+    free (dl->shards);
+  dl->shards = NULL;
+  dl->nshards = 0;
+  pthread_cond_destroy (&dl->wake);
+  pthread_mutex_destroy (&dl->spill_lock);
+  pthread_mutex_destroy (&dl->lock);
+
+  if (dl->err != NULL)
+    free (dl->err);
+  dl->err = NULL;
+
+  return DBLOG_OK;
+}
+
+const char *
+dblog_err_str (dblog_err_t err)
+{
+  switch (err)
+    {
+    case DBLOG_OK:
+      return "Success";
+    case DBLOG_DROPPED:
+      return "The output was only kept locally";
+    case DBLOG_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case DBLOG_THREAD_FAILED:
+      return "Starting the flusher thread failed";
+    case DBLOG_INVALID:
+      return "Invalid argument";
+    case DBLOG_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
@@ -0,0 +1,209 @@
+/**
+   @file dblog.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Build Output Streaming to the Database
+   @details Ships the output of running jobs to the build_log table of
+   the configured database so it can be followed live. Writers append
+   to a per job chunk which is sealed once it reaches the chunk size
+   or the flush interval, and a single flusher thread hands the sealed
+   chunks to the database pool as one COPY per batch, one batch at a
+   time so a job's rows always arrive in order.
+
+   Writers never wait on the database. The queue is bounded in bytes,
+   output which does not fit, or whose batch the database rejects, is
+   written to a local spill store instead and the job's next chunk
+   starts with a note of how much was left out. While the pool's
+   breaker is open every batch goes straight to the spill store.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DBLOG_H_
+#define _DBLOG_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "conf.h"
+#include "dbpool.h"
+#include "lazy.h"
+#include "logstore.h"
+
+/**
+   @brief Database Log Error Codes
+**/
+typedef enum _dblog_err_t
+  {
+    DBLOG_OK = 0, /**< Success */
+    DBLOG_DROPPED, /**< The output was only kept locally */
+    DBLOG_MALLOC_FAILED, /**< Allocating Memory Failed */
+    DBLOG_THREAD_FAILED, /**< Starting the flusher thread failed */
+    DBLOG_INVALID, /**< An invalid argument or configuration */
+    DBLOG_UNKNOWN /**< Unknown Error */
+  } dblog_err_t;
+
+/**
+   @brief Streaming Counters
+**/
+typedef struct _dblog_stats_t
+{
+  uint64_t queued; /**< Bytes waiting for the database */
+  uint64_t rows; /**< Chunks inserted */
+  uint64_t batches; /**< Batches inserted */
+  uint64_t bytes; /**< Output bytes inserted */
+  uint64_t spilled; /**< Output bytes only written to the spill store */
+  uint64_t failures; /**< Batches which failed or were refused */
+  uint64_t lag_max_ms; /**< Longest time from first byte to commit */
+  uint64_t lag_sum_ms; /**< Total of the per chunk lags */
+  dbpool_stats_t pool; /**< Counters of the database pool */
+} dblog_stats_t;
+
+/**
+   @brief Queue Shard
+   @details Aligned so shards never share a cache line.
+**/
+struct _dblog_shard_t
+{
+  pthread_mutex_t lock; /**< Guards everything in the shard */
+  struct _dblog_stream_t ** streams; /**< Job hash buckets */
+  size_t streams_size; /**< Number of hash buckets */
+  size_t nstreams; /**< Number of jobs */
+  struct _dblog_stream_t * open; /**< Jobs with an unsealed chunk */
+  struct _dblog_chunk_t * sealed; /**< Chunks ready to insert */
+  struct _dblog_chunk_t ** sealed_tail; /**< End of the sealed list */
+} __attribute__ ((aligned (64)));
+
+/**
+   @brief Database Log Structure
+**/
+typedef struct _dblog_t
+{
+  char * err; /**< Last Error String */
+  dbpool_t pool; /**< Database connections */
+  struct _dblog_shard_t * shards; /**< Job shards */
+  size_t nshards; /**< Number of shards */
+  size_t chunk_size; /**< Seal chunks at this many bytes */
+  uint64_t flush_ms; /**< Seal chunks this old */
+  uint64_t max_queued; /**< Most bytes waiting for the database */
+  size_t batch_size; /**< Most bytes in one insert */
+  logstore_t * spill; /**< Where dropped output goes or NULL */
+  pthread_mutex_t spill_lock; /**< Guards spill */
+  pthread_t thread; /**< Flusher thread */
+  lazy_t started; /**< Starts the flusher on the first write */
+  int stop; /**< Asks the flusher to drain and exit */
+  pthread_mutex_t lock; /**< Guards wake, inflight and stats */
+  pthread_cond_t wake; /**< Wakes the flusher early */
+  int inflight; /**< A batch is with the pool */
+  struct _dblog_chunk_t * pending; /**< Sealed chunks not yet shipped */
+  struct _dblog_chunk_t ** pending_tail; /**< End of the pending list */
+  dblog_stats_t stats; /**< Streaming counters */
+} dblog_t;
+
+/**
+   @brief Creates a New Database Log
+   @details The flusher thread is started by the first write.
+   @param dl The log structure to be initialized
+   @param conninfo The libpq connection string
+   @param spill An open, writable store for output which does not make
+   it to the database or NULL to discard it. It must outlive dl.
+   @return DBLOG_OK(0) on success or a positive error code
+**/
+dblog_err_t dblog_init (dblog_t * dl, const char * conninfo,
+                        logstore_t * spill);
+
+/**
+   @brief Creates a Database Log from the Configuration
+   @details Sets up the pool with the DB_* keys, see
+   dbpool_init_conf(), and reads DBLOG_CHUNK, DBLOG_FLUSH,
+   DBLOG_MAX_QUEUE and DBLOG_BATCH.
+   @param dl The log structure to be initialized
+   @param conf The parsed configuration
+   @param spill An open, writable store or NULL
+   @return DBLOG_OK(0) on success or a positive error code
+**/
+dblog_err_t dblog_init_conf (dblog_t * dl, conf_t * conf, logstore_t * spill);
+
+/**
+   @brief Appends Output of a Job
+   @details Never blocks on the database.
+   @param dl The log structure
+   @param job The id of the job
+   @param data The output
+   @param len The length of the output
+   @return DBLOG_OK(0) if queued, DBLOG_DROPPED if the queue was full
+   or a positive error code
+**/
+dblog_err_t dblog_write (dblog_t * dl, uint64_t job, const void * data,
+                         size_t len);
+
+/**
+   @brief Finishes the Output of a Job
+   @details Seals the job's last chunk and forgets the job. If output
+   was only kept locally since the last chunk, a final chunk noting it
+   is sealed as well.
+   @param dl The log structure
+   @param job The id of the job
+   @return DBLOG_OK(0) on success or a positive error code
+**/
+dblog_err_t dblog_end (dblog_t * dl, uint64_t job);
+
+/**
+   @brief Reads the Streaming Counters
+   @param dl The log structure
+   @param stats Filled in with a snapshot of the counters
+**/
+void dblog_stats (dblog_t * dl, dblog_stats_t * stats);
+
+/**
+   @brief Escapes Output for the COPY Text Format
+   @details Backslashes and line breaks are escaped, NUL bytes and
+   invalid UTF-8, which a text column would reject along with the
+   whole batch, become U+FFFD.
+   @param data The output
+   @param len The length of the output
+   @param out Filled in with the escaped output, at least 3 * len bytes
+   @return The length of the escaped output
+**/
+size_t dblog_copy_escape (const void * data, size_t len, char * out);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param dl The log structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * dblog_get_err (dblog_t * dl);
+
+/**
+   @brief Destroys the Database Log
+   @details Seals every open chunk and gives the flusher one last
+   chance to insert them before it stops.
+   @param dl The log structure to be destroyed
+   @return DBLOG_OK(0) on success or a positive error code
+**/
+dblog_err_t dblog_destroy (dblog_t * dl);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * dblog_err_str (dblog_err_t err);
+
+#endif
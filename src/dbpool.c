@@ -0,0 +1,1131 @@
+/**
+   @file dbpool.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Database Connection Pool
+   @details Callers queue queries and a single pool thread hands them
+   to idle connections, driving every connection through libpq's
+   non-blocking calls from one poll loop. Connections only ever move
+   between states on the pool thread, the lock only guards the queue,
+   the breaker and the counters.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <libpq-fe.h>
+#include "dbpool.h"
+#include "log.h"
+#include "util.h"
+
+#define DEFAULT_SIZE 4
+#define DEFAULT_WAITING 1024
+#define DEFAULT_STMTS 64
+#define DEFAULT_TRIP 3
+#define DEFAULT_HEALTH_MS 30000
+#define DEFAULT_TIMEOUT_MS 30000
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 30000
+#define CONNECT_TIMEOUT 5
+#define POLL_MS 1000
+#define COPY_PIECE 65536
+#define NAME_BUF 32
+#define HEALTH_SQL "SELECT 1"
+#define MALLOC_FAILED "Malloc Failed\n"
+
+#define LIBPQ "libpq.so.5"
+
+/* Loaded by the pool thread before its first connection so that
+   commands which never touch the database never map libpq */
+static struct
+{
+  PGconn * (*connectStart) (const char * conninfo);
+  PostgresPollingStatusType (*connectPoll) (PGconn * conn);
+  ConnStatusType (*status) (const PGconn * conn);
+  void (*finish) (PGconn * conn);
+  char * (*errorMessage) (const PGconn * conn);
+  int (*socket) (const PGconn * conn);
+  int (*setnonblocking) (PGconn * conn, int arg);
+  int (*sendQuery) (PGconn * conn, const char * query);
+  int (*sendQueryParams) (PGconn * conn, const char * command, int nParams,
+                          const Oid * paramTypes,
+                          const char * const * paramValues,
+                          const int * paramLengths, const int * paramFormats,
+                          int resultFormat);
+  int (*sendPrepare) (PGconn * conn, const char * stmtName,
+                      const char * query, int nParams,
+                      const Oid * paramTypes);
+  int (*sendQueryPrepared) (PGconn * conn, const char * stmtName,
+                            int nParams, const char * const * paramValues,
+                            const int * paramLengths,
+                            const int * paramFormats, int resultFormat);
+  int (*consumeInput) (PGconn * conn);
+  int (*isBusy) (PGconn * conn);
+  int (*flush) (PGconn * conn);
+  PGresult * (*getResult) (PGconn * conn);
+  ExecStatusType (*resultStatus) (const PGresult * res);
+  char * (*resultErrorMessage) (const PGresult * res);
+  void (*clear) (PGresult * res);
+  int (*putCopyData) (PGconn * conn, const char * buf, int len);
+  int (*putCopyEnd) (PGconn * conn, const char * errmsg);
+} pq;
+
+static const lazy_sym_t pq_syms[] = {
+  { "PQconnectStart", (void**)&pq.connectStart },
+  { "PQconnectPoll", (void**)&pq.connectPoll },
+  { "PQstatus", (void**)&pq.status },
+  { "PQfinish", (void**)&pq.finish },
+  { "PQerrorMessage", (void**)&pq.errorMessage },
+  { "PQsocket", (void**)&pq.socket },
+  { "PQsetnonblocking", (void**)&pq.setnonblocking },
+  { "PQsendQuery", (void**)&pq.sendQuery },
+  { "PQsendQueryParams", (void**)&pq.sendQueryParams },
+  { "PQsendPrepare", (void**)&pq.sendPrepare },
+  { "PQsendQueryPrepared", (void**)&pq.sendQueryPrepared },
+  { "PQconsumeInput", (void**)&pq.consumeInput },
+  { "PQisBusy", (void**)&pq.isBusy },
+  { "PQflush", (void**)&pq.flush },
+  { "PQgetResult", (void**)&pq.getResult },
+  { "PQresultStatus", (void**)&pq.resultStatus },
+  { "PQresultErrorMessage", (void**)&pq.resultErrorMessage },
+  { "PQclear", (void**)&pq.clear },
+  { "PQputCopyData", (void**)&pq.putCopyData },
+  { "PQputCopyEnd", (void**)&pq.putCopyEnd },
+};
+
+static int
+pq_load (void * arg)
+{
+  return lazy_dlopen (LIBPQ, pq_syms, sizeof (pq_syms) / sizeof (*pq_syms));
+}
+
+static lazy_t libpq =
+  LAZY_INITIALIZER ("libpq", pq_load, NULL, NULL, 1);
+
+/* What a connection is doing */
+#define CONN_DOWN 0
+#define CONN_CONNECTING 1
+#define CONN_SETUP 2
+#define CONN_IDLE 3
+#define CONN_PREPARE 4
+#define CONN_COPY 5
+#define CONN_QUERY 6
+#define CONN_CHECK 7
+
+/**
+   @brief Queued Query
+**/
+struct _dbpool_req_t
+{
+  struct _dbpool_req_t * next; /**< Next query waiting for a connection */
+  dbpool_query_t query; /**< The statement */
+  dbpool_cb_t cb; /**< Called once the query finishes or NULL */
+  void * arg; /**< Passed to cb */
+  uint64_t queued_ns; /**< When the query was submitted */
+  uint64_t started_ns; /**< When it got a connection, 0 before */
+  size_t copied; /**< Bytes of the COPY rows sent */
+  int ended; /**< The end of the COPY was sent */
+};
+
+/**
+   @brief Pooled Connection
+**/
+struct _dbpool_conn_t
+{
+  PGconn * pg; /**< libpq connection or NULL while down */
+  int state; /**< One of the CONN_* states */
+  int writing; /**< libpq has output waiting for the socket */
+  int ok; /**< Every result of the current command succeeded */
+  uint64_t since_ns; /**< When the state was entered */
+  struct _dbpool_req_t * req; /**< Query being run or NULL */
+  char ** stmts; /**< Prepared statements, named after their index */
+  size_t nstmts; /**< Number of prepared statements */
+};
+
+/**
+   @brief Synchronous Query
+**/
+struct _dbpool_wait_t
+{
+  dbpool_t * pool; /**< Owning pool */
+  dbpool_err_t ret; /**< Result of the query */
+  int done; /**< Set once the query has finished */
+};
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+set_err (dbpool_t * pool, char * err)
+{
+  pthread_mutex_lock (&pool->lock);
+  if (pool->err != NULL)
+    free (pool->err);
+  pool->err = err;
+  pthread_mutex_unlock (&pool->lock);
+}
+
+/* Must hold the lock */
+static void
+hist_add (uint64_t * hist, uint64_t ns)
+{
+  size_t bucket;
+
+  for (bucket = 0; bucket < DBPOOL_BUCKETS - 1 &&
+         (ns / 1000) >> bucket > 1; bucket++);
+  hist[bucket]++;
+}
+
+static void
+req_done (dbpool_t * pool, struct _dbpool_req_t * req, dbpool_err_t ret)
+{
+  uint64_t took;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->active--;
+  if (req->started_ns == 0)
+    pool->stats.rejected++;
+  else
+    {
+      took = now_ns () - req->started_ns;
+      hist_add (pool->stats.query_hist, took);
+      if (took > pool->stats.query_max_ns)
+        pool->stats.query_max_ns = took;
+      if (ret == DBPOOL_OK)
+        pool->stats.queries++;
+      else
+        pool->stats.failures++;
+    }
+  pthread_cond_broadcast (&pool->done);
+  pthread_mutex_unlock (&pool->lock);
+
+  if (req->cb != NULL)
+    req->cb (req->arg, ret);
+  free (req);
+}
+
+static void
+conn_close (struct _dbpool_conn_t * conn)
+{
+  size_t i;
+
+  if (conn->pg != NULL)
+    pq.finish (conn->pg);
+  conn->pg = NULL;
+  for (i = 0; i < conn->nstmts; i++)
+    free (conn->stmts[i]);
+  conn->nstmts = 0;
+  conn->state = CONN_DOWN;
+  conn->writing = 0;
+}
+
+/* Backs off after a failed attempt or a lost connection and opens the
+   breaker once they keep failing */
+static void
+lost (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  struct _dbpool_req_t * req = conn->req, * rejected = NULL, * next;
+  const char * msg;
+  int tripped = 0;
+
+  msg = conn->pg != NULL ? pq.errorMessage (conn->pg) : MALLOC_FAILED;
+  set_err (pool, cpstrf ("Database: %s", msg));
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stats.lost++;
+  pool->failed++;
+  pool->backoff_ms = pool->backoff_ms == 0 ? BACKOFF_MIN_MS :
+    pool->backoff_ms * 2;
+  if (pool->backoff_ms > BACKOFF_MAX_MS)
+    pool->backoff_ms = BACKOFF_MAX_MS;
+  pool->retry_ns = now_ns () + pool->backoff_ms * 1000000ull;
+
+  /* Nobody should wait out the outage, nor the last try at exit */
+  if (!pool->open && (pool->failed >= pool->trip_after || pool->stop))
+    {
+      pool->open = 1;
+      pool->stats.trips++;
+      rejected = pool->head;
+      pool->head = pool->tail = NULL;
+      pool->waiting = 0;
+      tripped = 1;
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  if (tripped)
+    log_warn ("Database unavailable, failing queries until it is back",
+              LOG_STR ("err", msg), LOG_UINT ("retry_ms", pool->backoff_ms));
+  else
+    log_warn ("Lost a database connection", LOG_STR ("err", msg),
+              LOG_UINT ("retry_ms", pool->backoff_ms));
+  conn->req = NULL;
+  conn_close (conn);
+
+  if (req != NULL)
+    req_done (pool, req, DBPOOL_FAILED);
+  for (; rejected != NULL; rejected = next)
+    {
+      next = rejected->next;
+      req_done (pool, rejected, DBPOOL_UNAVAILABLE);
+    }
+}
+
+static void
+connected (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  int reopened;
+
+  conn->state = CONN_IDLE;
+  conn->since_ns = now_ns ();
+  pthread_mutex_lock (&pool->lock);
+  pool->stats.connects++;
+  reopened = pool->open;
+  pool->open = 0;
+  pool->failed = 0;
+  pool->backoff_ms = 0;
+  pool->retry_ns = 0;
+  pthread_mutex_unlock (&pool->lock);
+
+  if (reopened)
+    log_info ("Database is back");
+}
+
+/* Sends what libpq has buffered, 0 if the connection was lost */
+static int
+conn_flush (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  int ret;
+
+  ret = pq.flush (conn->pg);
+  if (ret < 0)
+    {
+      lost (pool, conn);
+      return 0;
+    }
+  conn->writing = ret == 1;
+  return 1;
+}
+
+static void
+conn_send (dbpool_t * pool, struct _dbpool_conn_t * conn, int state,
+           int sent)
+{
+  if (!sent)
+    {
+      lost (pool, conn);
+      return;
+    }
+  conn->state = state;
+  conn->ok = 1;
+  conn->since_ns = now_ns ();
+  conn_flush (pool, conn);
+}
+
+static void
+conn_connect (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  conn->pg = pq.connectStart (pool->conninfo);
+  if (conn->pg == NULL || pq.status (conn->pg) == CONNECTION_BAD)
+    {
+      lost (pool, conn);
+      return;
+    }
+
+  /* libpq wants the socket to be writable first */
+  conn->state = CONN_CONNECTING;
+  conn->writing = 1;
+  conn->since_ns = now_ns ();
+}
+
+static void
+conn_poll_connect (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  switch (pq.connectPoll (conn->pg))
+    {
+    case PGRES_POLLING_READING:
+      conn->writing = 0;
+      break;
+    case PGRES_POLLING_WRITING:
+      conn->writing = 1;
+      break;
+    case PGRES_POLLING_OK:
+      if (pq.setnonblocking (conn->pg, 1) != 0)
+        lost (pool, conn);
+      else if (pool->setup != NULL)
+        conn_send (pool, conn, CONN_SETUP,
+                   pq.sendQuery (conn->pg, pool->setup));
+      else
+        connected (pool, conn);
+      break;
+    default:
+      lost (pool, conn);
+    }
+}
+
+/* Statements are few, a linear scan is cheaper than the round trip */
+static size_t
+stmt_find (struct _dbpool_conn_t * conn, const char * sql)
+{
+  size_t i;
+
+  for (i = 0; i < conn->nstmts; i++)
+    if (strcmp (conn->stmts[i], sql) == 0)
+      return i;
+  return i;
+}
+
+static void
+conn_execute (dbpool_t * pool, struct _dbpool_conn_t * conn, size_t stmt)
+{
+  const dbpool_query_t * q = &conn->req->query;
+  char name[NAME_BUF];
+
+  snprintf (name, sizeof (name), "ab_%zu", stmt);
+  conn_send (pool, conn, CONN_QUERY,
+             pq.sendQueryPrepared (conn->pg, name, q->nparams, q->params,
+                                   NULL, NULL, 0));
+}
+
+static void
+conn_start (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  const dbpool_query_t * q = &conn->req->query;
+  char name[NAME_BUF];
+  size_t stmt;
+
+  /* COPY cannot be prepared */
+  if (q->copy != NULL)
+    {
+      conn_send (pool, conn, CONN_QUERY, pq.sendQuery (conn->pg, q->sql));
+      return;
+    }
+
+  stmt = stmt_find (conn, q->sql);
+  if (stmt < conn->nstmts)
+    {
+      pthread_mutex_lock (&pool->lock);
+      pool->stats.reused++;
+      pthread_mutex_unlock (&pool->lock);
+      conn_execute (pool, conn, stmt);
+    }
+  else if (conn->nstmts < pool->max_stmts)
+    {
+      snprintf (name, sizeof (name), "ab_%zu", stmt);
+      conn_send (pool, conn, CONN_PREPARE,
+                 pq.sendPrepare (conn->pg, name, q->sql, q->nparams, NULL));
+    }
+  else
+    conn_send (pool, conn, CONN_QUERY,
+               pq.sendQueryParams (conn->pg, q->sql, q->nparams, NULL,
+                                   q->params, NULL, NULL, 0));
+}
+
+static void
+conn_copy (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  struct _dbpool_req_t * req = conn->req;
+  size_t len;
+  int ret;
+
+  /* Non-blocking puts refuse data once libpq's buffer is full */
+  while (req->copied < req->query.copy_len)
+    {
+      len = req->query.copy_len - req->copied;
+      if (len > COPY_PIECE)
+        len = COPY_PIECE;
+      ret = pq.putCopyData (conn->pg, req->query.copy + req->copied, len);
+      if (ret < 0)
+        {
+          lost (pool, conn);
+          return;
+        }
+      if (ret == 0)
+        {
+          conn_flush (pool, conn);
+          return;
+        }
+      req->copied += len;
+    }
+  if (!req->ended)
+    {
+      ret = pq.putCopyEnd (conn->pg, NULL);
+      if (ret < 0)
+        {
+          lost (pool, conn);
+          return;
+        }
+      if (ret == 0)
+        {
+          conn_flush (pool, conn);
+          return;
+        }
+      req->ended = 1;
+    }
+
+  /* Only the results are left */
+  conn->state = CONN_QUERY;
+  conn_flush (pool, conn);
+}
+
+/* Every result of the command is in */
+static void
+conn_finish (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  struct _dbpool_req_t * req = conn->req;
+
+  if (pq.status (conn->pg) == CONNECTION_BAD)
+    {
+      lost (pool, conn);
+      return;
+    }
+
+  switch (conn->state)
+    {
+    case CONN_SETUP:
+    case CONN_CHECK:
+      /* A connection which cannot run these is no use */
+      if (!conn->ok)
+        lost (pool, conn);
+      else if (conn->state == CONN_SETUP)
+        connected (pool, conn);
+      else
+        {
+          conn->state = CONN_IDLE;
+          conn->since_ns = now_ns ();
+        }
+      return;
+    case CONN_PREPARE:
+      if (conn->ok)
+        {
+          conn->stmts[conn->nstmts] = cpstr (req->query.sql);
+          if (conn->stmts[conn->nstmts] != NULL)
+            {
+              pthread_mutex_lock (&pool->lock);
+              pool->stats.prepared++;
+              pthread_mutex_unlock (&pool->lock);
+              conn_execute (pool, conn, conn->nstmts++);
+              return;
+            }
+          conn->ok = 0;
+        }
+      break;
+    }
+
+  conn->req = NULL;
+  conn->state = CONN_IDLE;
+  conn->since_ns = now_ns ();
+  req_done (pool, req, conn->ok ? DBPOOL_OK : DBPOOL_FAILED);
+}
+
+static void
+conn_read (dbpool_t * pool, struct _dbpool_conn_t * conn)
+{
+  ExecStatusType status;
+  PGresult * res;
+
+  while (conn->state != CONN_DOWN && conn->state != CONN_IDLE &&
+         conn->state != CONN_COPY && !pq.isBusy (conn->pg))
+    {
+      res = pq.getResult (conn->pg);
+      if (res == NULL)
+        {
+          conn_finish (pool, conn);
+          continue;
+        }
+      status = pq.resultStatus (res);
+      if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT ||
+          status == PGRES_COPY_BOTH)
+        {
+          /* Only a query can feed rows in, nothing reads rows out */
+          pq.clear (res);
+          if (status != PGRES_COPY_IN || conn->req == NULL)
+            lost (pool, conn);
+          else
+            {
+              conn->state = CONN_COPY;
+              conn_copy (pool, conn);
+            }
+          continue;
+        }
+      if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK &&
+          status != PGRES_EMPTY_QUERY)
+        {
+          if (conn->ok)
+            {
+              set_err (pool, cpstrf ("Database: %s",
+                                     pq.resultErrorMessage (res)));
+              log_warn ("Database statement failed",
+                        LOG_STR ("err", pq.resultErrorMessage (res)));
+            }
+          conn->ok = 0;
+        }
+      pq.clear (res);
+    }
+}
+
+/* Runs one poll result through the connection's state */
+static void
+conn_event (dbpool_t * pool, struct _dbpool_conn_t * conn, short revents)
+{
+  if (conn->state == CONN_DOWN)
+    return;
+  if (conn->state == CONN_CONNECTING)
+    {
+      conn_poll_connect (pool, conn);
+      return;
+    }
+  if (conn->writing && (revents & (POLLOUT | POLLERR | POLLHUP)) &&
+      !conn_flush (pool, conn))
+    return;
+  if ((revents & (POLLIN | POLLERR | POLLHUP)) &&
+      !pq.consumeInput (conn->pg))
+    {
+      lost (pool, conn);
+      return;
+    }
+  if (conn->state == CONN_IDLE && pq.status (conn->pg) == CONNECTION_BAD)
+    lost (pool, conn);
+  else if (conn->state == CONN_COPY)
+    conn_copy (pool, conn);
+  conn_read (pool, conn);
+}
+
+/* Starts connections, checks idle ones and drops stuck ones */
+static uint64_t
+conn_timers (dbpool_t * pool, struct _dbpool_conn_t * conn, uint64_t now,
+             int * probing)
+{
+  uint64_t retry_ns, limit_ns;
+  int open;
+
+  pthread_mutex_lock (&pool->lock);
+  retry_ns = pool->retry_ns;
+  open = pool->open;
+  pthread_mutex_unlock (&pool->lock);
+
+  switch (conn->state)
+    {
+    case CONN_DOWN:
+      /* While the breaker is open a single connection probes */
+      if (open && *probing)
+        return POLL_MS;
+      if (now < retry_ns)
+        return (retry_ns - now) / 1000000 + 1;
+      conn_connect (pool, conn);
+      if (conn->state != CONN_DOWN)
+        *probing = 1;
+      return POLL_MS;
+    case CONN_CONNECTING:
+    case CONN_SETUP:
+      *probing = 1;
+      limit_ns = CONNECT_TIMEOUT * 1000000000ull;
+      break;
+    case CONN_IDLE:
+      if (pool->health_ms == 0 ||
+          now - conn->since_ns < pool->health_ms * 1000000ull)
+        return POLL_MS;
+      pthread_mutex_lock (&pool->lock);
+      pool->stats.checks++;
+      pthread_mutex_unlock (&pool->lock);
+      conn_send (pool, conn, CONN_CHECK, pq.sendQuery (conn->pg, HEALTH_SQL));
+      return POLL_MS;
+    default:
+      if (pool->timeout_ms == 0)
+        return POLL_MS;
+      limit_ns = pool->timeout_ms * 1000000ull;
+    }
+
+  if (now - conn->since_ns >= limit_ns)
+    {
+      set_err (pool, cpstr ("Database: Timed out\n"));
+      lost (pool, conn);
+    }
+  return POLL_MS;
+}
+
+static void *
+dbpool_main (void * arg)
+{
+  dbpool_t * pool = (dbpool_t*) arg;
+  struct pollfd * fds = pool->fds;
+  struct _dbpool_req_t * req;
+  struct _dbpool_conn_t * conn;
+  uint64_t now, wait_ms, ms;
+  char drain[64];
+  size_t i;
+  int probing;
+
+  for (;;)
+    {
+      /* Hand waiting queries to idle connections */
+      for (i = 0; i < pool->size; i++)
+        {
+          conn = &pool->conns[i];
+          if (conn->state != CONN_IDLE)
+            continue;
+          pthread_mutex_lock (&pool->lock);
+          req = pool->head;
+          if (req != NULL)
+            {
+              pool->head = req->next;
+              if (pool->head == NULL)
+                pool->tail = NULL;
+              pool->waiting--;
+              req->started_ns = now_ns ();
+              hist_add (pool->stats.wait_hist,
+                        req->started_ns - req->queued_ns);
+              if (req->started_ns - req->queued_ns > pool->stats.wait_max_ns)
+                pool->stats.wait_max_ns = req->started_ns - req->queued_ns;
+            }
+          pthread_mutex_unlock (&pool->lock);
+          if (req == NULL)
+            break;
+          conn->req = req;
+          conn_start (pool, conn);
+        }
+
+      pthread_mutex_lock (&pool->lock);
+      if (pool->stop && pool->active == 0)
+        {
+          pthread_mutex_unlock (&pool->lock);
+          break;
+        }
+      pthread_mutex_unlock (&pool->lock);
+
+      now = now_ns ();
+      wait_ms = POLL_MS;
+      probing = 0;
+      for (i = 0; i < pool->size; i++)
+        if (pool->conns[i].state == CONN_CONNECTING ||
+            pool->conns[i].state == CONN_SETUP)
+          probing = 1;
+      for (i = 0; i < pool->size; i++)
+        {
+          ms = conn_timers (pool, &pool->conns[i], now, &probing);
+          if (ms < wait_ms)
+            wait_ms = ms;
+        }
+
+      /* The socket may change while connecting, so look it up each time */
+      fds[0].fd = pool->wake[0];
+      fds[0].events = POLLIN;
+      for (i = 0; i < pool->size; i++)
+        {
+          conn = &pool->conns[i];
+          fds[i+1].fd = conn->state != CONN_DOWN ? pq.socket (conn->pg) : -1;
+          fds[i+1].events = conn->writing ? POLLIN | POLLOUT : POLLIN;
+          fds[i+1].revents = 0;
+        }
+      if (poll (fds, pool->size + 1, wait_ms) < 0 && errno != EINTR)
+        break;
+      if (fds[0].revents & POLLIN)
+        while (read (pool->wake[0], drain, sizeof (drain)) > 0);
+      for (i = 0; i < pool->size; i++)
+        if (fds[i+1].fd >= 0 && fds[i+1].revents != 0)
+          conn_event (pool, &pool->conns[i], fds[i+1].revents);
+    }
+
+  for (i = 0; i < pool->size; i++)
+    conn_close (&pool->conns[i]);
+
+  return NULL;
+}
+
+static void
+wake (dbpool_t * pool)
+{
+  ssize_t ret;
+
+  /* A full pipe already wakes the loop */
+  ret = write (pool->wake[1], "", 1);
+  (void) ret;
+}
+
+static int
+dbpool_start (void * arg)
+{
+  dbpool_t * pool = (dbpool_t*) arg;
+  size_t i;
+
+  if (lazy_get (&libpq) != 0)
+    {
+      set_err (pool, cpstrf ("Failed to load %s\n", LIBPQ));
+      return DBPOOL_UNKNOWN;
+    }
+
+  /* Sized here since the configuration may change them after init */
+  pool->fds = (struct pollfd*) calloc (pool->size + 1, sizeof (struct pollfd));
+  for (i = 0; pool->fds != NULL && i < pool->size; i++)
+    if (pool->max_stmts > 0)
+      {
+        pool->conns[i].stmts = (char**) calloc (pool->max_stmts,
+                                                sizeof (char*));
+        if (pool->conns[i].stmts == NULL)
+          break;
+      }
+  if (pool->fds == NULL || i < pool->size)
+    {
+      set_err (pool, cpstr (MALLOC_FAILED));
+      return DBPOOL_MALLOC_FAILED;
+    }
+  if (pipe2 (pool->wake, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+      set_err (pool, cpstrf ("Failed to create the wake pipe: %s\n",
+                             strerror (errno)));
+      return DBPOOL_THREAD_FAILED;
+    }
+  if (pthread_create (&pool->thread, NULL, dbpool_main, pool) != 0)
+    {
+      close (pool->wake[0]);
+      close (pool->wake[1]);
+      set_err (pool, cpstr ("Failed to start the pool thread\n"));
+      return DBPOOL_THREAD_FAILED;
+    }
+
+  return DBPOOL_OK;
+}
+
+static int
+dbpool_stop (void * arg)
+{
+  dbpool_t * pool = (dbpool_t*) arg;
+  dbpool_stats_t * s = &pool->stats;
+
+  /* Give a down database one more chance at the queued queries */
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = 1;
+  pool->retry_ns = 0;
+  pthread_mutex_unlock (&pool->lock);
+  wake (pool);
+  pthread_join (pool->thread, NULL);
+  close (pool->wake[0]);
+  close (pool->wake[1]);
+
+  log_info ("Database pool", LOG_UINT ("queries", s->queries),
+            LOG_UINT ("failures", s->failures),
+            LOG_UINT ("rejected", s->rejected),
+            LOG_UINT ("connects", s->connects),
+            LOG_UINT ("lost", s->lost), LOG_UINT ("trips", s->trips),
+            LOG_UINT ("prepared", s->prepared),
+            LOG_UINT ("reused", s->reused),
+            LOG_UINT ("wait_p99_us", dbpool_hist_pct (s->wait_hist, 99)),
+            LOG_UINT ("query_p50_us", dbpool_hist_pct (s->query_hist, 50)),
+            LOG_UINT ("query_p99_us", dbpool_hist_pct (s->query_hist, 99)));
+
+  return DBPOOL_OK;
+}
+
+dbpool_err_t
+dbpool_init (dbpool_t * pool, const char * conninfo, size_t size,
+             const char * setup)
+{
+  /* Initialize the struct */
+  memset (pool, 0, sizeof (dbpool_t));
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->done, NULL);
+  lazy_init (&pool->started, "dbpool", dbpool_start, dbpool_stop, pool,
+             DBPOOL_INVALID);
+  pool->size = size > 0 ? size : DEFAULT_SIZE;
+  pool->max_waiting = DEFAULT_WAITING;
+  pool->max_stmts = DEFAULT_STMTS;
+  pool->trip_after = DEFAULT_TRIP;
+  pool->health_ms = DEFAULT_HEALTH_MS;
+  pool->timeout_ms = DEFAULT_TIMEOUT_MS;
+  if (conninfo == NULL)
+    {
+      pool->err = cpstr ("No database connection string\n");
+      return DBPOOL_INVALID;
+    }
+  pool->conninfo = cpstr (conninfo);
+  pool->setup = setup != NULL ? cpstr (setup) : NULL;
+  pool->conns = (struct _dbpool_conn_t*)
+    calloc (pool->size, sizeof (struct _dbpool_conn_t));
+  if (pool->conninfo == NULL || (setup != NULL && pool->setup == NULL) ||
+      pool->conns == NULL)
+    {
+      pool->err = cpstr (MALLOC_FAILED);
+      return DBPOOL_MALLOC_FAILED;
+    }
+
+  return DBPOOL_OK;
+}
+
+static char *
+conninfo_add (char * out, const char * key, const char * val)
+{
+  if (val == NULL)
+    return out;
+
+  /* Values are quoted so spaces and quotes survive */
+  out += sprintf (out, "%s%s='", out[-1] == '\0' ? "" : " ", key);
+  for (; *val != '\0'; val++)
+    {
+      if (*val == '\'' || *val == '\\')
+        *out++ = '\\';
+      *out++ = *val;
+    }
+  *out++ = '\'';
+  *out = '\0';
+  return out;
+}
+
+dbpool_err_t
+dbpool_init_conf (dbpool_t * pool, conf_t * conf, const char * setup)
+{
+  conf_vals_t * vals = &conf->vals;
+  char port[32], timeout[32], * conninfo, * end;
+  dbpool_err_t ret;
+  size_t len;
+
+  if (vals->db_type == NULL || strcmp (vals->db_type, "postgresql") != 0)
+    {
+      memset (pool, 0, sizeof (dbpool_t));
+      pool->err = cpstr ("DB_TYPE must be postgresql\n");
+      return DBPOOL_INVALID;
+    }
+
+  snprintf (port, sizeof (port), "%lld", (long long)vals->db_port);
+  snprintf (timeout, sizeof (timeout), "%d", CONNECT_TIMEOUT);
+  len = 128 + 2 * strlen (port) + 2 * strlen (timeout);
+  len += vals->db_host != NULL ? 2 * strlen (vals->db_host) : 0;
+  len += vals->db_user != NULL ? 2 * strlen (vals->db_user) : 0;
+  len += vals->db_pass != NULL ? 2 * strlen (vals->db_pass) : 0;
+  len += vals->db_db != NULL ? 2 * strlen (vals->db_db) : 0;
+  conninfo = (char*) malloc (len + 1);
+  if (conninfo == NULL)
+    {
+      memset (pool, 0, sizeof (dbpool_t));
+      pool->err = cpstr (MALLOC_FAILED);
+      return DBPOOL_MALLOC_FAILED;
+    }
+
+  /* conninfo_add looks one byte back for a separator */
+  conninfo[0] = '\0';
+  end = conninfo_add (conninfo + 1, "host", vals->db_host);
+  end = conninfo_add (end, "port", port);
+  end = conninfo_add (end, "user", vals->db_user);
+  end = conninfo_add (end, "password", vals->db_pass);
+  end = conninfo_add (end, "dbname", vals->db_db);
+  end = conninfo_add (end, "connect_timeout", timeout);
+
+  ret = dbpool_init (pool, conninfo + 1, vals->db_pool, setup);
+  free (conninfo);
+  if (ret != DBPOOL_OK)
+    return ret;
+  pool->max_waiting = vals->db_queue;
+  pool->max_stmts = vals->db_statements;
+  pool->trip_after = vals->db_breaker;
+  pool->health_ms = vals->db_health;
+  pool->timeout_ms = vals->db_timeout;
+
+  return DBPOOL_OK;
+}
+
+dbpool_err_t
+dbpool_submit (dbpool_t * pool, const dbpool_query_t * query, dbpool_cb_t cb,
+               void * arg)
+{
+  struct _dbpool_req_t * req;
+  dbpool_err_t ret;
+
+  if (query == NULL || query->sql == NULL)
+    return DBPOOL_INVALID;
+  ret = lazy_get (&pool->started);
+  if (ret != DBPOOL_OK)
+    return ret;
+  req = (struct _dbpool_req_t*) calloc (1, sizeof (struct _dbpool_req_t));
+  if (req == NULL)
+    {
+      set_err (pool, cpstr (MALLOC_FAILED));
+      return DBPOOL_MALLOC_FAILED;
+    }
+  req->query = *query;
+  req->cb = cb;
+  req->arg = arg;
+  req->queued_ns = now_ns ();
+
+  /* Refuse at once rather than queue behind an outage */
+  pthread_mutex_lock (&pool->lock);
+  if (pool->open)
+    {
+      pool->stats.rejected++;
+      pthread_mutex_unlock (&pool->lock);
+      free (req);
+      return DBPOOL_UNAVAILABLE;
+    }
+  if (pool->waiting >= pool->max_waiting)
+    {
+      pthread_mutex_unlock (&pool->lock);
+      free (req);
+      return DBPOOL_BUSY;
+    }
+  if (pool->tail != NULL)
+    pool->tail->next = req;
+  else
+    pool->head = req;
+  pool->tail = req;
+  pool->waiting++;
+  pool->active++;
+  pthread_mutex_unlock (&pool->lock);
+  wake (pool);
+
+  return DBPOOL_OK;
+}
+
+static void
+exec_cb (void * arg, dbpool_err_t ret)
+{
+  struct _dbpool_wait_t * wait = (struct _dbpool_wait_t*) arg;
+
+  pthread_mutex_lock (&wait->pool->lock);
+  wait->ret = ret;
+  wait->done = 1;
+  pthread_cond_broadcast (&wait->pool->done);
+  pthread_mutex_unlock (&wait->pool->lock);
+}
+
+dbpool_err_t
+dbpool_exec (dbpool_t * pool, const dbpool_query_t * query)
+{
+  struct _dbpool_wait_t wait;
+  dbpool_err_t ret;
+
+  wait.pool = pool;
+  wait.ret = DBPOOL_OK;
+  wait.done = 0;
+  ret = dbpool_submit (pool, query, exec_cb, &wait);
+  if (ret != DBPOOL_OK)
+    return ret;
+
+  pthread_mutex_lock (&pool->lock);
+  while (!wait.done)
+    pthread_cond_wait (&pool->done, &pool->lock);
+  pthread_mutex_unlock (&pool->lock);
+
+  return wait.ret;
+}
+
+void
+dbpool_drain (dbpool_t * pool)
+{
+  pthread_mutex_lock (&pool->lock);
+  while (pool->active > 0)
+    pthread_cond_wait (&pool->done, &pool->lock);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+void
+dbpool_stats (dbpool_t * pool, dbpool_stats_t * stats)
+{
+  pthread_mutex_lock (&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock (&pool->lock);
+}
+
+uint64_t
+dbpool_hist_pct (const uint64_t * hist, double pct)
+{
+  uint64_t total = 0, seen = 0;
+  size_t i;
+
+  for (i = 0; i < DBPOOL_BUCKETS; i++)
+    total += hist[i];
+  if (total == 0)
+    return 0;
+  for (i = 0; i < DBPOOL_BUCKETS - 1; i++)
+    {
+      seen += hist[i];
+      if (seen >= total * pct / 100)
+        break;
+    }
+  return (uint64_t)2 << i;
+}
+
+const char *
+dbpool_get_err (dbpool_t * pool)
+{
+  return pool->err;
+}
+
+dbpool_err_t
+dbpool_destroy (dbpool_t * pool)
+{
+  size_t i;
+
+  lazy_destroy (&pool->started);
+  pthread_cond_destroy (&pool->done);
+  pthread_mutex_destroy (&pool->lock);
+
+  for (i = 0; pool->conns != NULL && i < pool->size; i++)
+    free (pool->conns[i].stmts);
+  free (pool->fds);
+  pool->fds = NULL;
+  if (pool->conns != NULL)
+    free (pool->conns);
+  pool->conns = NULL;
+  if (pool->setup != NULL)
+    free (pool->setup);
+  pool->setup = NULL;
+  if (pool->conninfo != NULL)
+    free (pool->conninfo);
+  pool->conninfo = NULL;
+  if (pool->err != NULL)
+    free (pool->err);
+  pool->err = NULL;
+
+  return DBPOOL_OK;
+}
+
+const char *
+dbpool_err_str (dbpool_err_t err)
+{
+  switch (err)
+    {
+    case DBPOOL_OK:
+      return "Success";
+    case DBPOOL_UNAVAILABLE:
+      return "The database is unavailable";
+    case DBPOOL_BUSY:
+      return "Too many queries are waiting";
+    case DBPOOL_FAILED:
+      return "The statement failed";
+    case DBPOOL_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case DBPOOL_THREAD_FAILED:
+      return "Starting the pool thread failed";
+    case DBPOOL_INVALID:
+      return "Invalid argument";
+    case DBPOOL_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
@@ -0,0 +1,240 @@
+/**
+   @file dbpool.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Database Connection Pool
+   @details Runs statements over a small pool of non-blocking libpq
+   connections, all driven by a single poll loop on a background
+   thread, so any number of threads can have queries in flight without
+   one connection each or a thread blocked per query. Statements are
+   prepared once per connection and reused, idle connections are
+   checked periodically and lost connections come back with an
+   exponential backoff.
+
+   A circuit breaker opens after a run of connection failures. While
+   it is open every query fails at once with DBPOOL_UNAVAILABLE, so
+   callers fall back to a local journal instead of piling up behind a
+   dead database. Only a single connection probes the database until
+   one succeeds and closes the breaker again.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DBPOOL_H_
+#define _DBPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "conf.h"
+#include "lazy.h"
+
+#define DBPOOL_BUCKETS 32 /**< Buckets in the latency histograms */
+
+/**
+   @brief Pool Error Codes
+**/
+typedef enum _dbpool_err_t
+  {
+    DBPOOL_OK = 0, /**< Success */
+    DBPOOL_UNAVAILABLE, /**< The database is down, nothing was sent */
+    DBPOOL_BUSY, /**< Too many queries are waiting for a connection */
+    DBPOOL_FAILED, /**< The statement failed or its connection was lost */
+    DBPOOL_MALLOC_FAILED, /**< Allocating Memory Failed */
+    DBPOOL_THREAD_FAILED, /**< Starting the pool thread failed */
+    DBPOOL_INVALID, /**< An invalid argument or configuration */
+    DBPOOL_UNKNOWN /**< Unknown Error */
+  } dbpool_err_t;
+
+/**
+   @brief Called Once a Query Finishes
+   @details Runs on the pool thread, so it must not wait on the pool.
+   @param arg The argument given with the query
+   @param ret DBPOOL_OK(0) on success or a positive error code
+**/
+typedef void (*dbpool_cb_t) (void * arg, dbpool_err_t ret);
+
+/**
+   @brief Statement to Run
+   @details Everything pointed to must stay valid until the query
+   finishes.
+**/
+typedef struct _dbpool_query_t
+{
+  const char * sql; /**< Statement text, $1 and up for parameters */
+  int nparams; /**< Number of parameters */
+  const char * const * params; /**< Parameters as text, NULL for NULL */
+  const char * copy; /**< Rows for a COPY FROM STDIN or NULL */
+  size_t copy_len; /**< Length of copy */
+} dbpool_query_t;
+
+/**
+   @brief Pool Counters
+**/
+typedef struct _dbpool_stats_t
+{
+  uint64_t queries; /**< Queries which succeeded */
+  uint64_t failures; /**< Queries which failed once sent */
+  uint64_t rejected; /**< Queries refused while the breaker was open */
+  uint64_t connects; /**< Connections made */
+  uint64_t lost; /**< Connection attempts and connections which failed */
+  uint64_t trips; /**< Times the breaker opened */
+  uint64_t prepared; /**< Statements prepared */
+  uint64_t reused; /**< Queries which reused a prepared statement */
+  uint64_t checks; /**< Health checks of idle connections */
+  uint64_t wait_hist[DBPOOL_BUCKETS]; /**< Waits for a connection by power
+                                         of two us */
+  uint64_t query_hist[DBPOOL_BUCKETS]; /**< Query latencies by power of
+                                          two us */
+  uint64_t wait_max_ns; /**< Longest wait for a connection */
+  uint64_t query_max_ns; /**< Longest query */
+} dbpool_stats_t;
+
+/**
+   @brief Pool Structure
+**/
+typedef struct _dbpool_t
+{
+  char * err; /**< Last Error String */
+  char * conninfo; /**< libpq connection string */
+  char * setup; /**< Run on every new connection or NULL */
+  struct _dbpool_conn_t * conns; /**< The connections */
+  size_t size; /**< Number of connections */
+  size_t max_waiting; /**< Most queries waiting for a connection */
+  size_t max_stmts; /**< Most statements prepared per connection */
+  size_t trip_after; /**< Connection failures in a row which open the
+                        breaker */
+  uint64_t health_ms; /**< Check connections idle this long, 0 never */
+  uint64_t timeout_ms; /**< Drop connections stuck on a query this long,
+                          0 never */
+  int wake[2]; /**< Pipe waking the poll loop */
+  struct pollfd * fds; /**< Sockets polled by the pool thread */
+  pthread_t thread; /**< Pool thread */
+  lazy_t started; /**< Starts the thread on the first query */
+  pthread_mutex_t lock; /**< Guards everything below */
+  pthread_cond_t done; /**< Signalled as queries finish */
+  int stop; /**< Asks the pool thread to exit once idle */
+  struct _dbpool_req_t * head; /**< Queries waiting for a connection */
+  struct _dbpool_req_t * tail; /**< Last waiting query */
+  size_t waiting; /**< Queries waiting for a connection */
+  size_t active; /**< Queries submitted and not yet finished */
+  int open; /**< The breaker is open */
+  size_t failed; /**< Connection failures in a row */
+  uint64_t retry_ns; /**< Earliest time to connect again */
+  uint64_t backoff_ms; /**< Current reconnect delay */
+  dbpool_stats_t stats; /**< Pool counters */
+} dbpool_t;
+
+/**
+   @brief Creates a New Pool
+   @details Nothing connects until the first query.
+   @param pool The pool structure to be initialized
+   @param conninfo The libpq connection string
+   @param size The number of connections. Set this to 0 for the
+   default.
+   @param setup A statement run on every new connection before it is
+   used, ie. to create tables, or NULL
+   @return DBPOOL_OK(0) on success or a positive error code
+**/
+dbpool_err_t dbpool_init (dbpool_t * pool, const char * conninfo,
+                          size_t size, const char * setup);
+
+/**
+   @brief Creates a Pool from the Configuration
+   @details Connects with the DB_* keys and reads DB_POOL, DB_QUEUE,
+   DB_STATEMENTS, DB_BREAKER, DB_HEALTH and DB_TIMEOUT. DB_TYPE must
+   be postgresql.
+   @param pool The pool structure to be initialized
+   @param conf The parsed configuration
+   @param setup A statement run on every new connection or NULL
+   @return DBPOOL_OK(0) on success or a positive error code
+**/
+dbpool_err_t dbpool_init_conf (dbpool_t * pool, conf_t * conf,
+                               const char * setup);
+
+/**
+   @brief Queues a Query
+   @details Never waits on the database. cb is not called when the
+   query is refused.
+   @param pool The pool structure
+   @param query The statement to run, copied before returning
+   @param cb Called once the query finishes or NULL
+   @param arg Passed to cb
+   @return DBPOOL_OK(0) once queued, DBPOOL_UNAVAILABLE while the
+   breaker is open, DBPOOL_BUSY if the queue is full or a positive
+   error code
+**/
+dbpool_err_t dbpool_submit (dbpool_t * pool, const dbpool_query_t * query,
+                            dbpool_cb_t cb, void * arg);
+
+/**
+   @brief Runs a Query and Waits for It
+   @param pool The pool structure
+   @param query The statement to run
+   @return DBPOOL_OK(0) on success or a positive error code
+**/
+dbpool_err_t dbpool_exec (dbpool_t * pool, const dbpool_query_t * query);
+
+/**
+   @brief Waits for Every Submitted Query
+   @param pool The pool structure
+**/
+void dbpool_drain (dbpool_t * pool);
+
+/**
+   @brief Reads the Pool Counters
+   @param pool The pool structure
+   @param stats Filled in with a snapshot of the counters
+**/
+void dbpool_stats (dbpool_t * pool, dbpool_stats_t * stats);
+
+/**
+   @brief Estimates a Percentile of a Histogram
+   @param hist DBPOOL_BUCKETS counts by power of two us
+   @param pct The percentile between 0 and 100
+   @return The upper bound of the bucket holding it in us, 0 if the
+   histogram is empty
+**/
+uint64_t dbpool_hist_pct (const uint64_t * hist, double pct);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param pool The pool structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * dbpool_get_err (dbpool_t * pool);
+
+/**
+   @brief Destroys the Pool
+   @details Waits for the queued queries before closing the
+   connections.
+   @param pool The pool structure to be destroyed
+   @return DBPOOL_OK(0) on success or a positive error code
+**/
+dbpool_err_t dbpool_destroy (dbpool_t * pool);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * dbpool_err_str (dbpool_err_t err);
+
+#endif
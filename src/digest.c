@@ -0,0 +1,178 @@
+/**
+   @file digest.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Digests
+   @details A small SHA-256 implementation used to identify the
+   contents of build inputs and artifacts.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "digest.h"
+
+#define ROTR(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+digest_block (digest_t * dgst, const uint8_t * blk)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  size_t i;
+
+  /* Build the message schedule */
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t)blk[i*4] << 24 | (uint32_t)blk[i*4+1] << 16 |
+      (uint32_t)blk[i*4+2] << 8 | (uint32_t)blk[i*4+3];
+  for (; i < 64; i++)
+    w[i] = w[i-16] + w[i-7] +
+      (ROTR (w[i-15], 7) ^ ROTR (w[i-15], 18) ^ (w[i-15] >> 3)) +
+      (ROTR (w[i-2], 17) ^ ROTR (w[i-2], 19) ^ (w[i-2] >> 10));
+
+  /* Compress the block */
+  a = dgst->state[0]; b = dgst->state[1]; c = dgst->state[2];
+  d = dgst->state[3]; e = dgst->state[4]; f = dgst->state[5];
+  g = dgst->state[6]; h = dgst->state[7];
+  for (i = 0; i < 64; i++)
+    {
+      t1 = h + (ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25)) +
+        ((e & f) ^ (~e & g)) + K[i] + w[i];
+      t2 = (ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22)) +
+        ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+  dgst->state[0] += a; dgst->state[1] += b; dgst->state[2] += c;
+  dgst->state[3] += d; dgst->state[4] += e; dgst->state[5] += f;
+  dgst->state[6] += g; dgst->state[7] += h;
+}
+
+void
+digest_init (digest_t * dgst)
+{
+  dgst->state[0] = 0x6a09e667;
+  dgst->state[1] = 0xbb67ae85;
+  dgst->state[2] = 0x3c6ef372;
+  dgst->state[3] = 0xa54ff53a;
+  dgst->state[4] = 0x510e527f;
+  dgst->state[5] = 0x9b05688c;
+  dgst->state[6] = 0x1f83d9ab;
+  dgst->state[7] = 0x5be0cd19;
+  dgst->len = 0;
+  dgst->block_len = 0;
+}
+
+void
+digest_update (digest_t * dgst, const void * data, size_t len)
+{
+  const uint8_t * ptr = (const uint8_t*) data;
+  size_t cp;
+
+  dgst->len += len;
+
+  /* Finish any partial block first */
+  if (dgst->block_len > 0)
+    {
+      cp = 64 - dgst->block_len;
+      if (cp > len)
+        cp = len;
+      memcpy (dgst->block + dgst->block_len, ptr, cp);
+      dgst->block_len += cp;
+      ptr += cp;
+      len -= cp;
+      if (dgst->block_len < 64)
+        return;
+      digest_block (dgst, dgst->block);
+      dgst->block_len = 0;
+    }
+
+  /* Consume whole blocks directly from the input */
+  for (; len >= 64; ptr += 64, len -= 64)
+    digest_block (dgst, ptr);
+
+  /* Save the remainder */
+  memcpy (dgst->block, ptr, len);
+  dgst->block_len = len;
+}
+
+void
+digest_final (digest_t * dgst, uint8_t * out)
+{
+  uint64_t bits = dgst->len << 3;
+  size_t i;
+
+  /* Pad to 56 bytes mod 64 and append the bit length */
+  dgst->block[dgst->block_len++] = 0x80;
+  if (dgst->block_len > 56)
+    {
+      memset (dgst->block + dgst->block_len, 0, 64 - dgst->block_len);
+      digest_block (dgst, dgst->block);
+      dgst->block_len = 0;
+    }
+  memset (dgst->block + dgst->block_len, 0, 56 - dgst->block_len);
+  for (i = 0; i < 8; i++)
+    dgst->block[56+i] = (uint8_t)(bits >> (56 - i*8));
+  digest_block (dgst, dgst->block);
+
+  /* Write out the big endian state */
+  for (i = 0; i < 8; i++)
+    {
+      out[i*4] = (uint8_t)(dgst->state[i] >> 24);
+      out[i*4+1] = (uint8_t)(dgst->state[i] >> 16);
+      out[i*4+2] = (uint8_t)(dgst->state[i] >> 8);
+      out[i*4+3] = (uint8_t)dgst->state[i];
+    }
+}
+
+void
+digest_buffer (const void * data, size_t len, uint8_t * out)
+{
+  digest_t dgst;
+
+  digest_init (&dgst);
+  digest_update (&dgst, data, len);
+  digest_final (&dgst, out);
+}
+
+void
+digest_hex (const uint8_t * dgst, char * out)
+{
+  const static char HEX[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < DIGEST_LEN; i++)
+    {
+      out[i*2] = HEX[dgst[i] >> 4];
+      out[i*2+1] = HEX[dgst[i] & 0xf];
+    }
+  out[DIGEST_LEN*2] = '\0';
+}
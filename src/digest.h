@@ -0,0 +1,86 @@
+/**
+   @file digest.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Digests
+   @details A small SHA-256 implementation used to identify the
+   contents of build inputs and artifacts.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_LEN 32 /**< Length of a raw digest in bytes */
+#define DIGEST_HEX_LEN (DIGEST_LEN*2+1) /**< Length of a hex digest string */
+
+/**
+   @brief Digest State
+   @details Running state of a digest over a stream of data.
+**/
+typedef struct _digest_t
+{
+  uint32_t state[8]; /**< Intermediate Hash Value */
+  uint64_t len; /**< Total number of bytes consumed */
+  uint8_t block[64]; /**< Partially filled input block */
+  size_t block_len; /**< Number of bytes in the partial block */
+} digest_t;
+
+/**
+   @brief Initializes a Digest
+   @param dgst The digest state to be reset.
+**/
+void digest_init (digest_t * dgst);
+
+/**
+   @brief Adds Data to the Digest
+   @param dgst The digest state.
+   @param data The data segment to consume.
+   @param len The length of the data segment.
+**/
+void digest_update (digest_t * dgst, const void * data, size_t len);
+
+/**
+   @brief Finishes the Digest
+   @details Pads the stream and writes out the final digest value. The
+   state must be initialized again before it can be reused.
+   @param dgst The digest state.
+   @param out The DIGEST_LEN byte output buffer.
+**/
+void digest_final (digest_t * dgst, uint8_t * out);
+
+/**
+   @brief Digests a Memory Segment
+   @param data The data segment to digest.
+   @param len The length of the data segment.
+   @param out The DIGEST_LEN byte output buffer.
+**/
+void digest_buffer (const void * data, size_t len, uint8_t * out);
+
+/**
+   @brief Converts a Digest to Hexadecimal
+   @param dgst The DIGEST_LEN byte raw digest.
+   @param out The DIGEST_HEX_LEN byte output string.
+**/
+void digest_hex (const uint8_t * dgst, char * out);
+
+#endif
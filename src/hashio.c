@@ -0,0 +1,834 @@
+/**
+   @file hashio.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Batched File Hashing Engine
+   @details Computes content digests for large sets of files. On
+   Linux the stat, open, read and close calls are batched through
+   io_uring and the data is handed to a pool of hashing threads over
+   lock-free queues. When io_uring is unavailable the hashing threads
+   read the files themselves with pread.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hashio.h"
+#include "util.h"
+
+#if defined (__linux__) && defined (__has_include)
+#if __has_include (<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+#define DEFAULT_DEPTH 256
+#define SMALL_FILE 65536
+#define BATCH_JOBS(hio) ((hio)->depth / 4 > 0 ? (hio)->depth / 4 : 1)
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/* Operation tags stored in the low bits of the ring user data */
+#define OP_STAT 0
+#define OP_OPEN 1
+#define OP_READ 2
+#define OP_CLOSE 3
+#define OP_MASK 3
+
+/* What the hashing thread should do with a job */
+#define JOB_DIGEST 0
+#define JOB_READ 1
+
+/**
+   @brief Per File State
+   @details Aligned so the ring operation can be tagged into the low
+   bits of the job pointer.
+**/
+struct _hashio_job_t
+{
+  const char * path; /**< Path of the file */
+  hashio_result_t * res; /**< Where the result is stored */
+  uint8_t * buff; /**< SMALL_FILE sized data buffer */
+  size_t len; /**< Bytes of data held in buff */
+  int fd; /**< Open descriptor or -1 */
+  int err; /**< First error hit in the ring */
+  uint8_t mode; /**< JOB_DIGEST or JOB_READ */
+  uint8_t pending; /**< Outstanding ring operations */
+#ifdef HAVE_URING
+  struct statx stx; /**< Result of the batched statx */
+#endif
+} __attribute__ ((aligned (8)));
+
+static void
+job_finish (hashio_t * hio, struct _hashio_job_t * job)
+{
+  /* Always succeeds since the queue holds every job */
+  queue_push (&hio->free, job);
+  sem_post (&hio->free_sem);
+}
+
+static void
+job_dispatch (hashio_t * hio, struct _hashio_job_t * job)
+{
+  /* Always succeeds since the queue holds every job */
+  queue_push (&hio->work, job);
+  sem_post (&hio->work_sem);
+}
+
+static void
+job_read (struct _hashio_job_t * job)
+{
+  digest_t dgst;
+  struct stat st;
+  ssize_t rd;
+  uint64_t off;
+
+  /* Open the file if the ring has not already done it */
+  if (job->fd < 0)
+    {
+      job->fd = open (job->path, O_RDONLY | O_CLOEXEC);
+      if (job->fd < 0)
+        {
+          job->res->err = errno;
+          return;
+        }
+    }
+  if (fstat (job->fd, &st) != 0)
+    {
+      job->res->err = errno;
+      close (job->fd);
+      return;
+    }
+  if (!S_ISREG (st.st_mode))
+    {
+      job->res->err = S_ISDIR (st.st_mode) ? EISDIR : EINVAL;
+      close (job->fd);
+      return;
+    }
+
+  /* Stream the file through the digest */
+  digest_init (&dgst);
+  off = 0;
+  while ((rd = pread (job->fd, job->buff, SMALL_FILE, off)) != 0)
+    {
+      if (rd < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          job->res->err = errno;
+          close (job->fd);
+          return;
+        }
+      digest_update (&dgst, job->buff, rd);
+      off += rd;
+    }
+  close (job->fd);
+
+  digest_final (&dgst, job->res->digest);
+  job->res->size = off;
+  job->res->err = 0;
+}
+
+static void *
+hashio_worker (void * arg)
+{
+  hashio_t * hio = (hashio_t*) arg;
+  struct _hashio_job_t * job;
+
+  for (;;)
+    {
+      /* Wait for a job to be published */
+      while (sem_wait (&hio->work_sem) != 0);
+      while (queue_pop (&hio->work, (void**)&job) != QUEUE_OK)
+        sched_yield ();
+
+      /* A NULL job asks the worker to exit */
+      if (job == NULL)
+        break;
+
+      if (job->mode == JOB_DIGEST)
+        {
+          digest_buffer (job->buff, job->len, job->res->digest);
+          job->res->size = job->len;
+          job->res->err = 0;
+        }
+      else
+        job_read (job);
+
+      if (job->res->err == 0)
+        {
+          __atomic_add_fetch (&hio->files, 1, __ATOMIC_RELAXED);
+          __atomic_add_fetch (&hio->bytes, job->res->size, __ATOMIC_RELAXED);
+        }
+      job_finish (hio, job);
+    }
+
+  return NULL;
+}
+
+#ifdef HAVE_URING
+
+/**
+   @brief Mapped io_uring Instance
+**/
+struct _hashio_ring_t
+{
+  int fd; /**< Ring file descriptor */
+  void * sq_map, * cq_map; /**< Mapped ring memory */
+  size_t sq_map_len, cq_map_len; /**< Length of the mappings */
+  struct io_uring_sqe * sqes; /**< Submission entries */
+  size_t sqes_len; /**< Length of the sqes mapping */
+  unsigned * sq_head, * sq_tail, * sq_mask, * sq_array; /**< SQ ring */
+  unsigned * cq_head, * cq_tail, * cq_mask; /**< CQ ring */
+  struct io_uring_cqe * cqes; /**< Completion entries */
+  unsigned queued; /**< Entries prepared but not yet submitted */
+  unsigned submitted; /**< Entries the kernel has not completed */
+  int failed; /**< Entering the ring failed, jobs leave it for the threads */
+};
+
+static void
+ring_destroy (struct _hashio_ring_t * ring)
+{
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_len);
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map != NULL)
+    munmap (ring->sq_map, ring->sq_map_len);
+  if (ring->fd >= 0)
+    close (ring->fd);
+  free (ring);
+}
+
+static int
+ring_supported (int fd)
+{
+  const static uint8_t OPS[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE
+  };
+  struct io_uring_probe * probe;
+  size_t i, len;
+  int ret = 1;
+
+  len = sizeof (struct io_uring_probe) + 256*sizeof (struct io_uring_probe_op);
+  probe = (struct io_uring_probe*) calloc (1, len);
+  if (probe == NULL)
+    return 0;
+  if (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+               probe, 256) < 0)
+    ret = 0;
+  for (i = 0; ret && i < sizeof (OPS); i++)
+    if (OPS[i] > probe->last_op ||
+        !(probe->ops[OPS[i]].flags & IO_URING_OP_SUPPORTED))
+      ret = 0;
+  free (probe);
+
+  return ret;
+}
+
+static struct _hashio_ring_t *
+ring_init (unsigned entries)
+{
+  struct _hashio_ring_t * ring;
+  struct io_uring_params p;
+  uint8_t * sq, * cq;
+
+  ring = (struct _hashio_ring_t*) calloc (1, sizeof (struct _hashio_ring_t));
+  if (ring == NULL)
+    return NULL;
+
+  /* Create the ring, this fails on kernels or sandboxes without it */
+  memset (&p, 0, sizeof (p));
+  ring->fd = syscall (__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0 || !ring_supported (ring->fd))
+    {
+      ring_destroy (ring);
+      return NULL;
+    }
+
+  /* Map the submission and completion rings */
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_map_len = p.cq_off.cqes +
+    p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_map_len > ring->sq_map_len)
+        ring->sq_map_len = ring->cq_map_len;
+      ring->cq_map_len = ring->sq_map_len;
+    }
+  ring->sq_map = mmap (NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED)
+    {
+      ring->sq_map = NULL;
+      ring_destroy (ring);
+      return NULL;
+    }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_map = ring->sq_map;
+  else
+    {
+      ring->cq_map = mmap (NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+      if (ring->cq_map == MAP_FAILED)
+        {
+          ring->cq_map = NULL;
+          ring_destroy (ring);
+          return NULL;
+        }
+    }
+  ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)
+    mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      ring_destroy (ring);
+      return NULL;
+    }
+
+  /* Resolve the ring offsets */
+  sq = (uint8_t*) ring->sq_map;
+  cq = (uint8_t*) ring->cq_map;
+  ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+  ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  ring->queued = 0;
+  ring->submitted = 0;
+  ring->failed = 0;
+
+  return ring;
+}
+
+static struct io_uring_sqe *
+ring_sqe (struct _hashio_ring_t * ring, struct _hashio_job_t * job, int op)
+{
+  struct io_uring_sqe * sqe;
+  unsigned tail, idx;
+
+  /* The ring is sized so that every job fits, so this never fills */
+  tail = *ring->sq_tail;
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->user_data = (uint64_t)(uintptr_t) job | op;
+  ring->sq_array[idx] = idx;
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+
+  return sqe;
+}
+
+static int
+ring_enter (hashio_t * hio, unsigned wait)
+{
+  struct _hashio_ring_t * ring = hio->ring;
+  int ret;
+
+  do
+    {
+      hio->enters++;
+      ret = syscall (__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret >= 0)
+        {
+          ring->queued -= ret;
+          ring->submitted += ret;
+        }
+    }
+  while ((ret < 0 && (errno == EINTR || errno == EAGAIN)) ||
+         (ret >= 0 && ring->queued > 0));
+
+  return ret < 0 ? -1 : 0;
+}
+
+static void
+ring_open (hashio_t * hio, struct _hashio_job_t * job)
+{
+  struct io_uring_sqe * sqe;
+
+  job->fd = -1;
+  job->err = 0;
+  job->pending = 2;
+
+  /* The stat and open are independent so they run side by side */
+  sqe = ring_sqe (hio->ring, job, OP_STAT);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t) job->path;
+  sqe->len = STATX_TYPE | STATX_SIZE;
+  sqe->off = (uint64_t)(uintptr_t) &job->stx;
+  sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+
+  sqe = ring_sqe (hio->ring, job, OP_OPEN);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t) job->path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void
+ring_read (hashio_t * hio, struct _hashio_job_t * job)
+{
+  struct io_uring_sqe * sqe;
+
+  job->pending = 1;
+  sqe = ring_sqe (hio->ring, job, OP_READ);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = job->fd;
+  sqe->addr = (uint64_t)(uintptr_t) job->buff;
+  sqe->len = job->stx.stx_size;
+  sqe->off = 0;
+}
+
+static void
+ring_close (hashio_t * hio, struct _hashio_job_t * job)
+{
+  struct io_uring_sqe * sqe;
+
+  job->pending = 1;
+  sqe = ring_sqe (hio->ring, job, OP_CLOSE);
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = job->fd;
+}
+
+/* Hands a job the ring will not advance to the hashing threads */
+static int
+ring_fallback (hashio_t * hio, struct _hashio_job_t * job)
+{
+  /* job_read reuses the descriptor if the ring already opened it */
+  job->mode = JOB_READ;
+  job_dispatch (hio, job);
+  return 1;
+}
+
+/**
+   @brief Advances a Job on Completion
+   @return 1 if the job has left the ring or 0 if it is still in it
+**/
+static int
+ring_complete (hashio_t * hio, struct io_uring_cqe * cqe)
+{
+  struct _hashio_job_t * job;
+  int op;
+
+  job = (struct _hashio_job_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+  op = cqe->user_data & OP_MASK;
+  job->pending--;
+  hio->ring->submitted--;
+
+  switch (op)
+    {
+    case OP_STAT:
+      if (cqe->res < 0 && job->err == 0)
+        job->err = -cqe->res;
+      else if (cqe->res >= 0 && !S_ISREG (job->stx.stx_mode))
+        job->err = S_ISDIR (job->stx.stx_mode) ? EISDIR : EINVAL;
+      break;
+    case OP_OPEN:
+      if (cqe->res < 0)
+        job->err = -cqe->res;
+      else
+        job->fd = cqe->res;
+      break;
+    case OP_READ:
+      /* Short or failed reads are retried from the hashing thread */
+      if (cqe->res != (int) job->stx.stx_size || hio->ring->failed)
+        return ring_fallback (hio, job);
+      job->len = cqe->res;
+      ring_close (hio, job);
+      return 0;
+    case OP_CLOSE:
+      job->fd = -1;
+      job->mode = JOB_DIGEST;
+      job_dispatch (hio, job);
+      return 1;
+    }
+
+  /* Wait until both the stat and open have finished */
+  if (job->pending > 0)
+    return 0;
+
+  if (job->err != 0)
+    {
+      if (job->fd >= 0)
+        close (job->fd);
+      job->res->err = job->err;
+      job_finish (hio, job);
+      return 1;
+    }
+
+  /* Large files are streamed by the hashing threads */
+  if (job->stx.stx_size > SMALL_FILE || hio->ring->failed)
+    return ring_fallback (hio, job);
+  if (job->stx.stx_size == 0)
+    {
+      job->len = 0;
+      ring_close (hio, job);
+      return 0;
+    }
+  ring_read (hio, job);
+  return 0;
+}
+
+/**
+   @brief Takes Back the Entries the Kernel has not Seen
+   @details Only valid while no thread is inside io_uring_enter.
+   @return The number of jobs which left the ring
+**/
+static size_t
+ring_cancel (hashio_t * hio)
+{
+  struct _hashio_ring_t * ring = hio->ring;
+  struct _hashio_job_t * job;
+  size_t left = 0;
+  unsigned tail;
+
+  tail = *ring->sq_tail;
+  for (; ring->queued > 0; ring->queued--)
+    {
+      tail--;
+      job = (struct _hashio_job_t*)(uintptr_t)
+        (ring->sqes[tail & *ring->sq_mask].user_data & ~(uint64_t)OP_MASK);
+      job->pending--;
+      if (job->pending > 0)
+        continue;
+      if (job->err != 0)
+        {
+          if (job->fd >= 0)
+            close (job->fd);
+          job->res->err = job->err;
+          job_finish (hio, job);
+        }
+      else
+        ring_fallback (hio, job);
+      left++;
+    }
+  __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  return left;
+}
+
+/* Reaps every completion the kernel has posted */
+static size_t
+ring_reap (hashio_t * hio)
+{
+  struct _hashio_ring_t * ring = hio->ring;
+  size_t left = 0;
+  unsigned head, tail;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    left += ring_complete (hio, &ring->cqes[head & *ring->cq_mask]);
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return left;
+}
+
+static hashio_err_t
+ring_hash (hashio_t * hio, const char * const * paths, size_t count,
+           hashio_result_t * res, size_t * done)
+{
+  struct _hashio_job_t * job;
+  size_t next, inflight, want, i;
+  int avail;
+
+  next = 0;
+  inflight = 0;
+  while (next < count || inflight > 0)
+    {
+      /* Once the hashing threads fall behind, jobs come back one at a
+         time and starting each on its own costs three enters a file,
+         so new files go into the ring in batches */
+      want = (count - next) < BATCH_JOBS (hio) ? count - next :
+        BATCH_JOBS (hio);
+      if (inflight == 0)
+        {
+          for (i = 0; i < want; i++)
+            while (sem_wait (&hio->free_sem) != 0);
+          for (i = 0; i < want; i++)
+            sem_post (&hio->free_sem);
+        }
+      else if (sem_getvalue (&hio->free_sem, &avail) != 0 ||
+               (size_t) avail < want)
+        want = 0;
+
+      /* Fill the ring with as many new files as there are free jobs */
+      while (want > 0 && next < count && sem_trywait (&hio->free_sem) == 0)
+        {
+          while (queue_pop (&hio->free, (void**)&job) != QUEUE_OK)
+            sched_yield ();
+          job->path = paths[next];
+          job->res = &res[next];
+          ring_open (hio, job);
+          inflight++;
+          next++;
+        }
+
+      /* Submit the batch and wait for at least one completion */
+      if (ring_enter (hio, 1) != 0)
+        break;
+
+      inflight -= ring_reap (hio);
+    }
+  *done = next;
+  if (inflight == 0)
+    return HASHIO_OK;
+
+  /* The ring is unusable, so pull back what was never submitted and
+     wait out the rest. Completions are posted without entering the
+     ring, every job then finishes on the hashing threads. */
+  if (hio->err != NULL)
+    free (hio->err);
+  hio->err = cpstrf ("io_uring_enter Failed: %s\n", strerror (errno));
+  hio->ring->failed = 1;
+  inflight -= ring_cancel (hio);
+  while (inflight > 0)
+    {
+      if (hio->ring->submitted > 0)
+        sched_yield ();
+      inflight -= ring_reap (hio);
+    }
+
+  return HASHIO_IO_FAILED;
+}
+
+#else
+
+struct _hashio_ring_t
+{
+  int fd; /**< Unused */
+};
+
+#endif
+
+static void
+pread_hash (hashio_t * hio, const char * const * paths, size_t count,
+            hashio_result_t * res)
+{
+  struct _hashio_job_t * job;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    {
+      while (sem_wait (&hio->free_sem) != 0);
+      while (queue_pop (&hio->free, (void**)&job) != QUEUE_OK)
+        sched_yield ();
+      job->path = paths[i];
+      job->res = &res[i];
+      job->fd = -1;
+      job->mode = JOB_READ;
+      job_dispatch (hio, job);
+    }
+}
+
+hashio_err_t
+hashio_init (hashio_t * hio, size_t threads, size_t depth)
+{
+  size_t i;
+  long cpus;
+
+  /* Initialize the struct */
+  cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  hio->err = NULL;
+  hio->threads = threads > 0 ? threads : (cpus > 0 ? (size_t)cpus : 1);
+  hio->depth = depth > 0 ? depth : DEFAULT_DEPTH;
+  hio->workers = NULL;
+  hio->jobs = NULL;
+  hio->ring = NULL;
+  hio->files = 0;
+  hio->bytes = 0;
+  hio->enters = 0;
+  hio->work.cells = NULL;
+  hio->free.cells = NULL;
+  sem_init (&hio->work_sem, 0, 0);
+  sem_init (&hio->free_sem, 0, 0);
+
+  /* Allocate the job state up front */
+  hio->jobs = (struct _hashio_job_t*)
+    calloc (hio->depth, sizeof (struct _hashio_job_t));
+  hio->workers = (pthread_t*) calloc (hio->threads, sizeof (pthread_t));
+  if (hio->jobs == NULL || hio->workers == NULL ||
+      queue_init (&hio->work, hio->depth + hio->threads) != QUEUE_OK ||
+      queue_init (&hio->free, hio->depth) != QUEUE_OK)
+    {
+      hio->threads = 0;
+      hio->err = cpstr (MALLOC_FAILED);
+      return HASHIO_MALLOC_FAILED;
+    }
+  for (i = 0; i < hio->depth; i++)
+    {
+      hio->jobs[i].buff = (uint8_t*) malloc (SMALL_FILE);
+      if (hio->jobs[i].buff == NULL)
+        {
+          hio->threads = 0;
+          hio->err = cpstr (MALLOC_FAILED);
+          return HASHIO_MALLOC_FAILED;
+        }
+      hio->jobs[i].fd = -1;
+      queue_push (&hio->free, &hio->jobs[i]);
+      sem_post (&hio->free_sem);
+    }
+
+  /* Start the hashing threads */
+  for (i = 0; i < hio->threads; i++)
+    if (pthread_create (&hio->workers[i], NULL, hashio_worker, hio) != 0)
+      {
+        hio->threads = i;
+        hio->err = cpstrf ("Failed to start hashing thread #%zu\n", i);
+        return HASHIO_THREAD_FAILED;
+      }
+
+#ifdef HAVE_URING
+  /* Each job has at most two operations in the ring at once */
+  hio->ring = ring_init (hio->depth * 2);
+#endif
+
+  return HASHIO_OK;
+}
+
+hashio_err_t
+hashio_hash (hashio_t * hio, const char * const * paths, size_t count,
+             hashio_result_t * res)
+{
+  hashio_err_t ret = HASHIO_OK;
+  size_t i, done = 0;
+
+  memset (res, 0, count * sizeof (hashio_result_t));
+
+#ifdef HAVE_URING
+  if (hio->ring != NULL)
+    {
+      ret = ring_hash (hio, paths, count, res, &done);
+
+      /* Stop using a broken ring, the threads finish the batch */
+      if (ret != HASHIO_OK)
+        {
+          ring_destroy (hio->ring);
+          hio->ring = NULL;
+        }
+    }
+#endif
+  pread_hash (hio, paths + done, count - done, res + done);
+
+  /* Wait for the hashing threads to hand back every job */
+  for (i = 0; i < hio->depth; i++)
+    while (sem_wait (&hio->free_sem) != 0);
+  for (i = 0; i < hio->depth; i++)
+    sem_post (&hio->free_sem);
+
+  return ret;
+}
+
+hashio_err_t
+hashio_pin (hashio_t * hio, topo_t * topo, size_t node)
+{
+  size_t i;
+
+  for (i = 0; i < hio->threads; i++)
+    if (topo_pin (topo, node, hio->workers[i]) != TOPO_OK)
+      {
+        if (hio->err != NULL)
+          free (hio->err);
+        hio->err = cpstrf ("Failed to pin hashing thread #%zu\n", i);
+        return HASHIO_PIN_FAILED;
+      }
+
+  return HASHIO_OK;
+}
+
+const char *
+hashio_get_err (hashio_t * hio)
+{
+  return hio->err;
+}
+
+hashio_err_t
+hashio_destroy (hashio_t * hio)
+{
+  size_t i;
+
+  /* Ask every thread to exit */
+  for (i = 0; i < hio->threads; i++)
+    job_dispatch (hio, NULL);
+  for (i = 0; i < hio->threads; i++)
+    pthread_join (hio->workers[i], NULL);
+
+#ifdef HAVE_URING
+  if (hio->ring != NULL)
+    ring_destroy (hio->ring);
+#endif
+  if (hio->jobs != NULL)
+    {
+      for (i = 0; i < hio->depth; i++)
+        if (hio->jobs[i].buff != NULL)
+          free (hio->jobs[i].buff);
+      free (hio->jobs);
+    }
+  if (hio->workers != NULL)
+    free (hio->workers);
+  if (hio->err != NULL)
+    free (hio->err);
+  queue_destroy (&hio->work);
+  queue_destroy (&hio->free);
+  sem_destroy (&hio->work_sem);
+  sem_destroy (&hio->free_sem);
+
+  return HASHIO_OK;
+}
+
+const char *
+hashio_err_str (hashio_err_t err)
+{
+  switch (err)
+    {
+    case HASHIO_OK:
+      return "Success";
+    case HASHIO_MALLOC_FAILED:
+      return "Malloc Failed";
+    case HASHIO_THREAD_FAILED:
+      return "Failed to Start a Hashing Thread";
+    case HASHIO_IO_FAILED:
+      return "The I/O Engine Failed";
+    case HASHIO_PIN_FAILED:
+      return "Pinning the Hashing Threads Failed";
+    case HASHIO_UNKNOWN:
+      return "Unknown Cause of Error";
+    }
+
+  return "Undefined Error Code";
+}
@@ -0,0 +1,150 @@
+/**
+   @file hashio.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Batched File Hashing Engine
+   @details Computes content digests for large sets of files. On
+   Linux the stat, open, read and close calls are batched through
+   io_uring and the data is handed to a pool of hashing threads over
+   lock-free queues. When io_uring is unavailable the hashing threads
+   read the files themselves with pread.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HASHIO_H_
+#define _HASHIO_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "digest.h"
+#include "queue.h"
+#include "topo.h"
+
+/**
+   @brief Hashing Engine Error Codes
+**/
+typedef enum _hashio_err_t
+  {
+    HASHIO_OK = 0, /**< Success */
+    HASHIO_MALLOC_FAILED, /**< Allocating Memory Failed */
+    HASHIO_THREAD_FAILED, /**< Creating a hashing thread failed */
+    HASHIO_IO_FAILED, /**< The I/O engine stopped responding */
+    HASHIO_PIN_FAILED, /**< The threads could not be moved */
+    HASHIO_UNKNOWN /**< Unknown Error */
+  } hashio_err_t;
+
+/**
+   @brief Digest of a Single File
+**/
+typedef struct _hashio_result_t
+{
+  uint8_t digest[DIGEST_LEN]; /**< Digest of the file contents */
+  uint64_t size; /**< Number of bytes hashed */
+  int err; /**< errno of the failure or 0 on success */
+} hashio_result_t;
+
+/**
+   @brief Hashing Engine Structure
+**/
+typedef struct _hashio_t
+{
+  char * err; /**< Last Error String */
+  size_t threads; /**< Number of hashing threads */
+  size_t depth; /**< Maximum number of files in flight */
+  pthread_t * workers; /**< Hashing threads */
+  struct _hashio_job_t * jobs; /**< Preallocated per file state */
+  queue_t work; /**< Jobs ready for the hashing threads */
+  queue_t free; /**< Jobs ready for reuse */
+  sem_t work_sem; /**< Counts the jobs in work */
+  sem_t free_sem; /**< Counts the jobs in free */
+  struct _hashio_ring_t * ring; /**< io_uring state or NULL for pread */
+  uint64_t files; /**< Number of files hashed */
+  uint64_t bytes; /**< Number of bytes hashed */
+  uint64_t enters; /**< Number of io_uring_enter calls */
+} hashio_t;
+
+/**
+   @brief Creates a New Hashing Engine
+   @details Starts the hashing threads and sets up io_uring if the
+   kernel supports every operation the engine needs.
+   @param hio The engine structure to be initialized
+   @param threads The number of hashing threads. Set this to 0 to use
+   one per online cpu.
+   @param depth The maximum number of files in flight. Set this to 0
+   for the default.
+   @return HASHIO_OK(0) on success or a positive error code
+**/
+hashio_err_t hashio_init (hashio_t * hio, size_t threads, size_t depth);
+
+/**
+   @brief Hashes a List of Files
+   @details Fills in one result for every path. Failures of
+   individual files are reported through the err member of their
+   result and do not stop the rest of the batch. Only one thread may
+   hash through an engine at a time. If io_uring fails the engine
+   drops it and the hashing threads finish the batch, so every result
+   is still filled in when HASHIO_IO_FAILED is returned.
+   @param hio The engine structure
+   @param paths The paths of the files to hash
+   @param count The number of paths
+   @param res The array of count results to fill in
+   @return HASHIO_OK(0) on success or a positive error code
+**/
+hashio_err_t hashio_hash (hashio_t * hio, const char * const * paths,
+                          size_t count, hashio_result_t * res);
+
+/**
+   @brief Keeps the Hashing Threads on one Node
+   @details The threads then hash from that node's memory and caches,
+   and a target using the digests can be queued there with
+   RUNNER_LOCAL.
+   @param hio The engine structure
+   @param topo The machine topology
+   @param node The index of the node in the topology
+   @return HASHIO_OK(0) on success or a positive error code
+**/
+hashio_err_t hashio_pin (hashio_t * hio, topo_t * topo, size_t node);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param hio The engine structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * hashio_get_err (hashio_t * hio);
+
+/**
+   @brief Destroys the Hashing Engine
+   @details Stops the hashing threads and frees all of the engine
+   state.
+   @param hio The engine structure to be destroyed
+   @return HASHIO_OK(0) on success or a positive error code
+**/
+hashio_err_t hashio_destroy (hashio_t * hio);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * hashio_err_str (hashio_err_t err);
+
+#endif
@@ -0,0 +1,397 @@
+/**
+   @file history.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Target Duration History
+   @details Keeps an exponentially weighted estimate of how long each
+   target takes to build and how much memory it uses. Every completed
+   run is appended to a local journal which is replayed, and
+   compacted when it has grown, the next time it is opened.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "history.h"
+#include "util.h"
+
+#define DEFAULT_ALPHA 0.3
+#define COMPACT_RATIO 4
+#define RECORD_MAX 4096
+#define NAME_BUF 256
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Estimates for One Target
+**/
+struct _history_ent_t
+{
+  char * name; /**< Name of the target */
+  uint64_t hash; /**< Hash of the name */
+  struct _history_ent_t * next; /**< Next target in the bucket */
+  double ms; /**< Weighted duration in milliseconds */
+  double rss_kb; /**< Weighted peak memory in kilobytes */
+  uint64_t runs; /**< Number of samples folded in */
+};
+
+inline static uint64_t
+hash_str (const char * str)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (; *str != '\0'; str++)
+    hash = (hash ^ (uint8_t)*str) * 0x100000001b3ull;
+  return hash;
+}
+
+static struct _history_ent_t *
+ent_find (history_t * hist, const char * name, uint64_t hash)
+{
+  struct _history_ent_t * ent;
+
+  if (hist->ents_size == 0)
+    return NULL;
+  for (ent = hist->ents[(hash >> 16) % hist->ents_size]; ent != NULL;
+       ent = ent->next)
+    if (ent->hash == hash && strcmp (ent->name, name) == 0)
+      return ent;
+  return NULL;
+}
+
+static struct _history_ent_t *
+ent_get (history_t * hist, const char * name)
+{
+  struct _history_ent_t ** tmp, * ent, * next;
+  uint64_t hash;
+  size_t i, size, idx;
+
+  hash = hash_str (name);
+  ent = ent_find (hist, name, hash);
+  if (ent != NULL)
+    return ent;
+
+  /* Keep the chains short */
+  if (hist->nents >= hist->ents_size)
+    {
+      size = hist->ents_size*2 + 64;
+      tmp = (struct _history_ent_t**) calloc (size, sizeof (*tmp));
+      if (tmp == NULL)
+        return NULL;
+      for (i = 0; i < hist->ents_size; i++)
+        for (ent = hist->ents[i]; ent != NULL; ent = next)
+          {
+            next = ent->next;
+            idx = (ent->hash >> 16) % size;
+            ent->next = tmp[idx];
+            tmp[idx] = ent;
+          }
+      if (hist->ents != NULL)
+        free (hist->ents);
+      hist->ents = tmp;
+      hist->ents_size = size;
+    }
+
+  ent = (struct _history_ent_t*) calloc (1, sizeof (struct _history_ent_t));
+  if (ent == NULL)
+    return NULL;
+  ent->name = cpstr (name);
+  if (ent->name == NULL)
+    {
+      free (ent);
+      return NULL;
+    }
+  ent->hash = hash;
+  idx = (hash >> 16) % hist->ents_size;
+  ent->next = hist->ents[idx];
+  hist->ents[idx] = ent;
+  hist->nents++;
+
+  return ent;
+}
+
+static void
+ent_fold (history_t * hist, struct _history_ent_t * ent, uint64_t ms,
+          uint64_t rss_kb)
+{
+  if (ent->runs == 0)
+    {
+      ent->ms = ms;
+      ent->rss_kb = rss_kb;
+    }
+  else
+    {
+      ent->ms += hist->alpha * ((double)ms - ent->ms);
+      if (rss_kb > 0)
+        ent->rss_kb += hist->alpha * ((double)rss_kb - ent->rss_kb);
+    }
+  ent->runs++;
+}
+
+inline static int
+valid_name (const char * name)
+{
+  return name[0] != '\0' && strpbrk (name, "\t\n") == NULL;
+}
+
+static history_err_t
+replay (history_t * hist, FILE * file)
+{
+  struct _history_ent_t * ent;
+  char line[RECORD_MAX], * ms, * rss, * end;
+  unsigned long long ms_val, rss_val;
+
+  while (fgets (line, sizeof (line), file) != NULL)
+    {
+      /* A torn final record is skipped rather than rejected */
+      if (strchr (line, '\n') == NULL)
+        continue;
+      ms = strchr (line, '\t');
+      if (ms == NULL)
+        continue;
+      *ms++ = '\0';
+      rss = strchr (ms, '\t');
+      if (rss == NULL)
+        continue;
+      *rss++ = '\0';
+      ms_val = strtoull (ms, &end, 10);
+      if (*end != '\0' || line[0] == '\0')
+        continue;
+      rss_val = strtoull (rss, &end, 10);
+      if (*end != '\n')
+        continue;
+
+      ent = ent_get (hist, line);
+      if (ent == NULL)
+        {
+          hist->err = cpstr (MALLOC_FAILED);
+          return HISTORY_MALLOC_FAILED;
+        }
+      ent_fold (hist, ent, ms_val, rss_val);
+      hist->records++;
+    }
+
+  return HISTORY_OK;
+}
+
+static history_err_t
+compact (history_t * hist, const char * path)
+{
+  struct _history_ent_t * ent;
+  char buf[NAME_BUF], * tmp;
+  FILE * file;
+  size_t i;
+  int ok;
+
+  tmp = fmtstr (buf, sizeof (buf), "%s.tmp", path);
+  if (tmp == NULL)
+    {
+      hist->err = cpstr (MALLOC_FAILED);
+      return HISTORY_MALLOC_FAILED;
+    }
+  file = fopen (tmp, "w");
+  if (file == NULL)
+    {
+      hist->err = cpstrf ("Failed to create %s: %s\n", tmp, strerror (errno));
+      if (tmp != buf)
+        free (tmp);
+      return HISTORY_NO_FILE;
+    }
+
+  /* One record per target carrying the current estimate */
+  for (i = 0; i < hist->ents_size; i++)
+    for (ent = hist->ents[i]; ent != NULL; ent = ent->next)
+      fprintf (file, "%s\t%llu\t%llu\n", ent->name,
+               (unsigned long long)(ent->ms + 0.5),
+               (unsigned long long)(ent->rss_kb + 0.5));
+  ok = fflush (file) == 0 && fsync (fileno (file)) == 0;
+  ok = fclose (file) == 0 && ok;
+  if (!ok || rename (tmp, path) != 0)
+    {
+      hist->err = cpstrf ("Failed to compact %s: %s\n", path,
+                          strerror (errno));
+      unlink (tmp);
+      if (tmp != buf)
+        free (tmp);
+      return HISTORY_IO_FAILED;
+    }
+  if (tmp != buf)
+    free (tmp);
+  hist->records = hist->nents;
+
+  return HISTORY_OK;
+}
+
+history_err_t
+history_open (history_t * hist, const char * path, double alpha)
+{
+  history_err_t ret;
+  FILE * file;
+
+  /* Initialize the struct */
+  memset (hist, 0, sizeof (history_t));
+  pthread_mutex_init (&hist->lock, NULL);
+  if (alpha < 0 || alpha > 1)
+    {
+      hist->err = cpstrf ("Invalid history weight: %f\n", alpha);
+      return HISTORY_INVALID;
+    }
+  hist->alpha = alpha > 0 ? alpha : DEFAULT_ALPHA;
+  if (path == NULL)
+    return HISTORY_OK;
+
+  /* Replay whatever has been journaled so far */
+  file = fopen (path, "r");
+  if (file != NULL)
+    {
+      ret = replay (hist, file);
+      fclose (file);
+      if (ret != HISTORY_OK)
+        return ret;
+    }
+  else if (errno != ENOENT)
+    {
+      hist->err = cpstrf ("Failed to open %s: %s\n", path, strerror (errno));
+      return HISTORY_NO_FILE;
+    }
+
+  /* Rewrite the journal once it is mostly superseded records */
+  if (hist->records > COMPACT_RATIO * hist->nents)
+    {
+      ret = compact (hist, path);
+      if (ret != HISTORY_OK)
+        return ret;
+    }
+
+  hist->journal = fopen (path, "a");
+  if (hist->journal == NULL)
+    {
+      hist->err = cpstrf ("Failed to open %s: %s\n", path, strerror (errno));
+      return HISTORY_NO_FILE;
+    }
+
+  return HISTORY_OK;
+}
+
+uint64_t
+history_estimate (history_t * hist, const char * name, uint64_t def)
+{
+  struct _history_ent_t * ent;
+  uint64_t ms;
+
+  pthread_mutex_lock (&hist->lock);
+  ent = ent_find (hist, name, hash_str (name));
+  ms = ent != NULL ? (uint64_t)(ent->ms + 0.5) : def;
+  pthread_mutex_unlock (&hist->lock);
+
+  return ms;
+}
+
+history_err_t
+history_record (history_t * hist, const char * name, uint64_t ms,
+                uint64_t rss_kb)
+{
+  struct _history_ent_t * ent;
+  history_err_t ret = HISTORY_OK;
+
+  if (!valid_name (name))
+    return HISTORY_INVALID;
+
+  pthread_mutex_lock (&hist->lock);
+  ent = ent_get (hist, name);
+  if (ent == NULL)
+    {
+      pthread_mutex_unlock (&hist->lock);
+      return HISTORY_MALLOC_FAILED;
+    }
+  ent_fold (hist, ent, ms, rss_kb);
+
+  /* Flush each record so a crash loses at most the one in progress */
+  if (hist->journal != NULL)
+    {
+      if (fprintf (hist->journal, "%s\t%llu\t%llu\n", name,
+                   (unsigned long long)ms, (unsigned long long)rss_kb) < 0 ||
+          fflush (hist->journal) != 0)
+        ret = HISTORY_IO_FAILED;
+      else
+        hist->records++;
+    }
+  pthread_mutex_unlock (&hist->lock);
+
+  return ret;
+}
+
+const char *
+history_get_err (history_t * hist)
+{
+  return hist->err;
+}
+
+history_err_t
+history_close (history_t * hist)
+{
+  struct _history_ent_t * ent, * next;
+  history_err_t ret = HISTORY_OK;
+  size_t i;
+
+  if (hist->journal != NULL && fclose (hist->journal) != 0)
+    ret = HISTORY_IO_FAILED;
+  hist->journal = NULL;
+
+  for (i = 0; i < hist->ents_size; i++)
+    for (ent = hist->ents[i]; ent != NULL; ent = next)
+      {
+        next = ent->next;
+        free (ent->name);
+        free (ent);
+      }
+  if (hist->ents != NULL)
+    free (hist->ents);
+  hist->ents = NULL;
+  hist->ents_size = hist->nents = 0;
+  pthread_mutex_destroy (&hist->lock);
+
+  if (hist->err != NULL)
+    free (hist->err);
+  hist->err = NULL;
+
+  return ret;
+}
+
+const char *
+history_err_str (history_err_t err)
+{
+  switch (err)
+    {
+    case HISTORY_OK:
+      return "Success";
+    case HISTORY_NO_FILE:
+      return "The journal could not be opened";
+    case HISTORY_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case HISTORY_IO_FAILED:
+      return "Writing the journal failed";
+    case HISTORY_INVALID:
+      return "Invalid target name or parameter";
+    case HISTORY_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
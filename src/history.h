@@ -0,0 +1,120 @@
+/**
+   @file history.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Target Duration History
+   @details Keeps an exponentially weighted estimate of how long each
+   target takes to build and how much memory it uses. Every completed
+   run is appended to a local journal which is replayed, and
+   compacted when it has grown, the next time it is opened.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+   @brief History Error Codes
+**/
+typedef enum _history_err_t
+  {
+    HISTORY_OK = 0, /**< Success */
+    HISTORY_NO_FILE, /**< The journal could not be opened */
+    HISTORY_MALLOC_FAILED, /**< Allocating Memory Failed */
+    HISTORY_IO_FAILED, /**< Writing the journal failed */
+    HISTORY_INVALID, /**< An invalid target name or parameter */
+    HISTORY_UNKNOWN /**< Unknown Error */
+  } history_err_t;
+
+/**
+   @brief History Structure
+**/
+typedef struct _history_t
+{
+  char * err; /**< Last Error String */
+  FILE * journal; /**< Journal opened for appending or NULL */
+  double alpha; /**< Weight of the newest sample */
+  struct _history_ent_t ** ents; /**< Target hash buckets */
+  size_t nents; /**< Number of targets */
+  size_t ents_size; /**< Number of hash buckets */
+  size_t records; /**< Records in the journal */
+  pthread_mutex_t lock; /**< Guards the table and journal */
+} history_t;
+
+/**
+   @brief Opens the History
+   @param hist The history structure to be initialized
+   @param path The journal path or NULL to only keep history in memory
+   @param alpha The weight given to each new sample, between 0 and 1.
+   Set this to 0 for the default.
+   @return HISTORY_OK(0) on success or a positive error code
+**/
+history_err_t history_open (history_t * hist, const char * path,
+                            double alpha);
+
+/**
+   @brief Estimates the Duration of a Target
+   @param hist The history structure
+   @param name The name of the target
+   @param def The estimate to use for targets never seen before
+   @return The estimated duration in milliseconds
+**/
+uint64_t history_estimate (history_t * hist, const char * name, uint64_t def);
+
+/**
+   @brief Records a Completed Run
+   @details Folds the run into the estimates and appends it to the
+   journal.
+   @param hist The history structure
+   @param name The name of the target
+   @param ms The duration of the run in milliseconds
+   @param rss_kb The peak memory use of the run in kilobytes or 0
+   @return HISTORY_OK(0) on success or a positive error code
+**/
+history_err_t history_record (history_t * hist, const char * name,
+                              uint64_t ms, uint64_t rss_kb);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param hist The history structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * history_get_err (history_t * hist);
+
+/**
+   @brief Closes the History
+   @param hist The history structure to be destroyed
+   @return HISTORY_OK(0) on success or a positive error code
+**/
+history_err_t history_close (history_t * hist);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * history_err_str (history_err_t err);
+
+#endif
@@ -0,0 +1,398 @@
+/**
+   @file intern.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief String Interning Table
+   @details Stores a single copy of every distinct string and hands out
+   a small stable ID for it. Strings live in per shard arenas and are
+   never moved or freed until the table is destroyed.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "util.h"
+
+#define DEFAULT_SHARDS 16
+#define MIN_SLOTS 64
+#define BLOCK_SIZE 65536
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Arena Block
+   @details Each string is stored as its 32 bit length followed by its
+   bytes and a null terminator, padded to keep the lengths aligned.
+**/
+struct _intern_block_t
+{
+  struct _intern_block_t * next; /**< Next older block */
+  size_t size; /**< Usable bytes in data */
+  char data[]; /**< String records */
+};
+
+inline static uint64_t
+hash_mem (const char * str, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ull;
+  return hash;
+}
+
+inline static const char *
+id_str (intern_t * it, intern_id_t id)
+{
+  const char ** page;
+
+  page = __atomic_load_n (&it->pages[id / INTERN_PAGE], __ATOMIC_ACQUIRE);
+  return __atomic_load_n (&page[id % INTERN_PAGE], __ATOMIC_ACQUIRE);
+}
+
+inline static uint32_t
+str_len (const char * str)
+{
+  return ((const uint32_t*)str)[-1];
+}
+
+inline static struct _intern_shard_t *
+shard_of (intern_t * it, uint64_t hash)
+{
+  return &it->shards[hash % it->nshards];
+}
+
+static intern_id_t
+shard_find (intern_t * it, struct _intern_shard_t * shard, const char * str,
+            size_t len, uint64_t hash)
+{
+  const char * cand;
+  uint64_t slot;
+  size_t idx, mask;
+
+  if (shard->slots_size == 0)
+    return INTERN_NONE;
+
+  /* Probe linearly, only comparing strings whose tags match */
+  mask = shard->slots_size - 1;
+  for (idx = (hash >> 16) & mask; (slot = shard->slots[idx]) != 0;
+       idx = (idx + 1) & mask)
+    if (slot >> 32 == hash >> 32)
+      {
+        cand = id_str (it, (intern_id_t)slot);
+        if (str_len (cand) == len && memcmp (cand, str, len) == 0)
+          return (intern_id_t)slot;
+      }
+
+  return INTERN_NONE;
+}
+
+static void
+slot_put (struct _intern_shard_t * shard, uint64_t hash, intern_id_t id)
+{
+  size_t idx, mask;
+
+  mask = shard->slots_size - 1;
+  for (idx = (hash >> 16) & mask; shard->slots[idx] != 0;
+       idx = (idx + 1) & mask);
+  shard->slots[idx] = (hash >> 32 << 32) | id;
+}
+
+static int
+shard_grow (intern_t * it, struct _intern_shard_t * shard)
+{
+  uint64_t * old;
+  const char * str;
+  size_t i, old_size;
+
+  old = shard->slots;
+  old_size = shard->slots_size;
+  shard->slots_size = old_size > 0 ? old_size*2 : MIN_SLOTS;
+  shard->slots = (uint64_t*) calloc (shard->slots_size, sizeof (uint64_t));
+  if (shard->slots == NULL)
+    {
+      shard->slots = old;
+      shard->slots_size = old_size;
+      return 0;
+    }
+
+  /* Only the tag is kept, so the full hashes are recomputed */
+  for (i = 0; i < old_size; i++)
+    if (old[i] != 0)
+      {
+        str = id_str (it, (intern_id_t)old[i]);
+        slot_put (shard, hash_mem (str, str_len (str)), (intern_id_t)old[i]);
+      }
+  free (old);
+  shard->bytes += (shard->slots_size - old_size) * sizeof (uint64_t);
+
+  return 1;
+}
+
+static char *
+shard_alloc (struct _intern_shard_t * shard, size_t len)
+{
+  struct _intern_block_t * block;
+  size_t need, size;
+
+  need = (sizeof (uint32_t) + len + 1 + sizeof (uint32_t) - 1) &
+    ~(sizeof (uint32_t) - 1);
+  if (shard->blocks == NULL || shard->used + need > shard->blocks->size)
+    {
+      /* Large strings get a block of their own behind the current one */
+      size = need > BLOCK_SIZE / 4 ? need : BLOCK_SIZE;
+      block = (struct _intern_block_t*)
+        malloc (sizeof (struct _intern_block_t) + size);
+      if (block == NULL)
+        return NULL;
+      block->size = size;
+      shard->bytes += sizeof (struct _intern_block_t) + size;
+      if (size == need && shard->blocks != NULL)
+        {
+          block->next = shard->blocks->next;
+          shard->blocks->next = block;
+          return block->data;
+        }
+      block->next = shard->blocks;
+      shard->blocks = block;
+      shard->used = 0;
+    }
+  shard->used += need;
+
+  return shard->blocks->data + shard->used - need;
+}
+
+static int
+page_ensure (intern_t * it, intern_id_t id)
+{
+  const char ** page, ** expected = NULL;
+
+  if (__atomic_load_n (&it->pages[id / INTERN_PAGE], __ATOMIC_ACQUIRE) !=
+      NULL)
+    return 1;
+
+  /* Racing shards may both allocate the page, only one is published */
+  page = (const char**) calloc (INTERN_PAGE, sizeof (const char *));
+  if (page == NULL)
+    return 0;
+  if (!__atomic_compare_exchange_n (&it->pages[id / INTERN_PAGE], &expected,
+                                    page, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+    free (page);
+
+  return 1;
+}
+
+intern_err_t
+intern_init (intern_t * it, size_t shards)
+{
+  size_t i;
+
+  /* Initialize the struct */
+  memset (it, 0, sizeof (intern_t));
+  it->nshards = shards > 0 ? shards : DEFAULT_SHARDS;
+  it->next = INTERN_NONE + 1;
+  it->shards = (struct _intern_shard_t*)
+    aligned_alloc (64, it->nshards * sizeof (struct _intern_shard_t));
+  if (it->shards == NULL)
+    {
+      it->err = cpstr (MALLOC_FAILED);
+      return INTERN_MALLOC_FAILED;
+    }
+  memset (it->shards, 0, it->nshards * sizeof (struct _intern_shard_t));
+  for (i = 0; i < it->nshards; i++)
+    pthread_rwlock_init (&it->shards[i].lock, NULL);
+
+  return INTERN_OK;
+}
+
+intern_id_t
+intern_idn (intern_t * it, const char * str, size_t len)
+{
+  struct _intern_shard_t * shard;
+  intern_id_t id;
+  uint64_t hash;
+  char * copy;
+
+  if (len > UINT32_MAX)
+    return INTERN_NONE;
+
+  /* Most lookups find the string and never take the write lock */
+  hash = hash_mem (str, len);
+  shard = shard_of (it, hash);
+  pthread_rwlock_rdlock (&shard->lock);
+  id = shard_find (it, shard, str, len, hash);
+  pthread_rwlock_unlock (&shard->lock);
+  if (id != INTERN_NONE)
+    return id;
+
+  pthread_rwlock_wrlock (&shard->lock);
+  id = shard_find (it, shard, str, len, hash);
+  if (id != INTERN_NONE)
+    goto out;
+  if ((shard->count + 1) * 4 > shard->slots_size * 3 &&
+      !shard_grow (it, shard))
+    goto out;
+  copy = shard_alloc (shard, len);
+  if (copy == NULL)
+    goto out;
+
+  /* IDs are only handed out once the string is stored */
+  id = __atomic_fetch_add (&it->next, 1, __ATOMIC_RELAXED);
+  if (id >= (uint64_t)INTERN_PAGE * INTERN_PAGES || !page_ensure (it, id))
+    {
+      id = INTERN_NONE;
+      goto out;
+    }
+  *(uint32_t*)copy = len;
+  copy += sizeof (uint32_t);
+  memcpy (copy, str, len);
+  copy[len] = '\0';
+  __atomic_store_n (&it->pages[id / INTERN_PAGE][id % INTERN_PAGE], copy,
+                    __ATOMIC_RELEASE);
+  slot_put (shard, hash, id);
+  shard->count++;
+
+ out:
+  pthread_rwlock_unlock (&shard->lock);
+  return id;
+}
+
+intern_id_t
+intern_id (intern_t * it, const char * str)
+{
+  return intern_idn (it, str, strlen (str));
+}
+
+intern_id_t
+intern_find (intern_t * it, const char * str)
+{
+  struct _intern_shard_t * shard;
+  intern_id_t id;
+  uint64_t hash;
+  size_t len;
+
+  len = strlen (str);
+  hash = hash_mem (str, len);
+  shard = shard_of (it, hash);
+  pthread_rwlock_rdlock (&shard->lock);
+  id = shard_find (it, shard, str, len, hash);
+  pthread_rwlock_unlock (&shard->lock);
+
+  return id;
+}
+
+const char *
+intern_str (intern_t * it, intern_id_t id)
+{
+  return id != INTERN_NONE ? id_str (it, id) : NULL;
+}
+
+const char *
+intern (intern_t * it, const char * str)
+{
+  return intern_str (it, intern_id (it, str));
+}
+
+size_t
+intern_count (intern_t * it)
+{
+  size_t i, count = 0;
+
+  for (i = 0; i < it->nshards; i++)
+    {
+      pthread_rwlock_rdlock (&it->shards[i].lock);
+      count += it->shards[i].count;
+      pthread_rwlock_unlock (&it->shards[i].lock);
+    }
+
+  return count;
+}
+
+size_t
+intern_memory (intern_t * it)
+{
+  size_t i, bytes;
+
+  bytes = it->nshards * sizeof (struct _intern_shard_t);
+  for (i = 0; i < it->nshards; i++)
+    {
+      pthread_rwlock_rdlock (&it->shards[i].lock);
+      bytes += it->shards[i].bytes;
+      pthread_rwlock_unlock (&it->shards[i].lock);
+    }
+  for (i = 0; i < INTERN_PAGES; i++)
+    if (__atomic_load_n (&it->pages[i], __ATOMIC_ACQUIRE) != NULL)
+      bytes += INTERN_PAGE * sizeof (const char *);
+
+  return bytes;
+}
+
+const char *
+intern_get_err (intern_t * it)
+{
+  return it->err;
+}
+
+intern_err_t
+intern_destroy (intern_t * it)
+{
+  struct _intern_block_t * block, * next;
+  size_t i;
+
+  for (i = 0; it->shards != NULL && i < it->nshards; i++)
+    {
+      for (block = it->shards[i].blocks; block != NULL; block = next)
+        {
+          next = block->next;
+          free (block);
+        }
+      free (it->shards[i].slots);
+      pthread_rwlock_destroy (&it->shards[i].lock);
+    }
+  free (it->shards);
+  it->shards = NULL;
+  for (i = 0; i < INTERN_PAGES; i++)
+    {
+      free (it->pages[i]);
+      it->pages[i] = NULL;
+    }
+
+  if (it->err != NULL)
+    free (it->err);
+  it->err = NULL;
+
+  return INTERN_OK;
+}
+
+const char *
+intern_err_str (intern_err_t err)
+{
+  switch (err)
+    {
+    case INTERN_OK:
+      return "Success";
+    case INTERN_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case INTERN_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
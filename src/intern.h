@@ -0,0 +1,176 @@
+/**
+   @file intern.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief String Interning Table
+   @details Stores a single copy of every distinct string and hands out
+   a small stable ID for it, so target names, paths and keys repeated
+   across the dependency graph are kept once and compared as integers.
+   Strings live in per shard arenas and are never moved or freed until
+   the table is destroyed, so both IDs and the pointers returned for
+   them stay valid for the life of the table.
+
+   The table is split into independently locked shards selected by
+   hash. Looking a string up only takes its shard's lock for reading
+   and mapping an ID back to its string takes no lock at all.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define INTERN_NONE 0 /**< ID of no string */
+#define INTERN_PAGE 4096 /**< IDs per page of the ID map */
+#define INTERN_PAGES 4096 /**< Pages in the ID map */
+
+/**
+   @brief Interned String ID
+**/
+typedef uint32_t intern_id_t;
+
+/**
+   @brief Intern Table Error Codes
+**/
+typedef enum _intern_err_t
+  {
+    INTERN_OK = 0, /**< Success */
+    INTERN_MALLOC_FAILED, /**< Allocating Memory Failed */
+    INTERN_UNKNOWN /**< Unknown Error */
+  } intern_err_t;
+
+/**
+   @brief Intern Table Shard
+   @details Aligned so shards never share a cache line.
+**/
+struct _intern_shard_t
+{
+  pthread_rwlock_t lock; /**< Guards everything in the shard */
+  uint64_t * slots; /**< Open addressed hash tag and ID pairs */
+  size_t slots_size; /**< Number of slots, a power of two */
+  size_t count; /**< Strings in the shard */
+  struct _intern_block_t * blocks; /**< Arena blocks, newest first */
+  size_t used; /**< Bytes used in the newest block */
+  size_t bytes; /**< Bytes held by the arena and slots */
+} __attribute__ ((aligned (64)));
+
+/**
+   @brief Intern Table Structure
+**/
+typedef struct _intern_t
+{
+  char * err; /**< Last Error String */
+  struct _intern_shard_t * shards; /**< Hash shards */
+  size_t nshards; /**< Number of shards */
+  const char ** pages[INTERN_PAGES]; /**< Strings by ID */
+  intern_id_t next; /**< Next ID to hand out */
+} intern_t;
+
+/**
+   @brief Creates a New Intern Table
+   @param it The table structure to be initialized
+   @param shards The number of shards. Set this to 0 for the default.
+   @return INTERN_OK(0) on success or a positive error code
+**/
+intern_err_t intern_init (intern_t * it, size_t shards);
+
+/**
+   @brief Interns a String
+   @param it The table structure
+   @param str The string to intern
+   @return The ID of the string or INTERN_NONE if memory ran out
+**/
+intern_id_t intern_id (intern_t * it, const char * str);
+
+/**
+   @brief Interns a String of Known Length
+   @param it The table structure
+   @param str The string to intern, which need not be null terminated
+   @param len The length of the string
+   @return The ID of the string or INTERN_NONE if memory ran out
+**/
+intern_id_t intern_idn (intern_t * it, const char * str, size_t len);
+
+/**
+   @brief Looks up a String without Interning it
+   @param it The table structure
+   @param str The string to look up
+   @return The ID of the string or INTERN_NONE if it was never interned
+**/
+intern_id_t intern_find (intern_t * it, const char * str);
+
+/**
+   @brief Gets the String for an ID
+   @param it The table structure
+   @param id An ID returned by the table
+   @return The null terminated interned string
+**/
+const char * intern_str (intern_t * it, intern_id_t id);
+
+/**
+   @brief Interns a String and Returns its Canonical Copy
+   @details Equal strings always return the same pointer.
+   @param it The table structure
+   @param str The string to intern
+   @return The interned string or NULL if memory ran out
+**/
+const char * intern (intern_t * it, const char * str);
+
+/**
+   @brief Counts the Interned Strings
+   @param it The table structure
+   @return The number of distinct strings
+**/
+size_t intern_count (intern_t * it);
+
+/**
+   @brief Measures the Table
+   @param it The table structure
+   @return The bytes allocated for strings, hash slots and the ID map
+**/
+size_t intern_memory (intern_t * it);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param it The table structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * intern_get_err (intern_t * it);
+
+/**
+   @brief Destroys the Intern Table
+   @details Every string and ID handed out becomes invalid.
+   @param it The table structure to be destroyed
+   @return INTERN_OK(0) on success or a positive error code
+**/
+intern_err_t intern_destroy (intern_t * it);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * intern_err_str (intern_err_t err);
+
+#endif
@@ -0,0 +1,579 @@
+/**
+   @file jobq.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Fair Job Queue
+   @details A job queue shared between tenants, usually projects or
+   users. Jobs are ordered by start time fair queueing: each job is
+   tagged with a virtual start time derived from its tenant's weight
+   and the cost of the tenant's earlier jobs, so a burst from one
+   tenant only delays its own work. Priority classes offset the tag by
+   a configurable aging interval per class, so higher classes run
+   first but a lower class job is never delayed by more than that much
+   virtual time. Without aging the class is the most significant part
+   of the tag, so classes are served in strict order.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include "jobq.h"
+#include "util.h"
+
+#define DEFAULT_SHARDS 16
+#define DEFAULT_COST 1000
+#define DEFAULT_WEIGHT 1
+#define SCALE 1024
+#define PRIO_SHIFT 60
+#define START_MAX ((1ull << PRIO_SHIFT) - 1)
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Jobs of One Tenant in One Priority Class
+**/
+struct _jobq_flow_t
+{
+  struct _jobq_tenant_t * tenant; /**< Owning tenant */
+  jobq_job_t * head, * tail; /**< Queued jobs in tag order */
+  size_t heap_idx; /**< Position in the shard heap or SIZE_MAX */
+};
+
+/**
+   @brief Tenant State
+**/
+struct _jobq_tenant_t
+{
+  char * name; /**< Name of the tenant */
+  uint64_t hash; /**< Hash of the name */
+  struct _jobq_tenant_t * next; /**< Next tenant in the bucket */
+  uint64_t finish; /**< Virtual finish of the last queued job */
+  struct _jobq_flow_t flows[JOBQ_CLASSES]; /**< Per class flows */
+  jobq_stats_t stats; /**< Metrics */
+};
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline static uint64_t
+hash_str (const char * str)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (; *str != '\0'; str++)
+    hash = (hash ^ (uint8_t)*str) * 0x100000001b3ull;
+  return hash;
+}
+
+inline static uint64_t
+flow_tag (struct _jobq_flow_t * flow)
+{
+  return flow->head->tag;
+}
+
+/* Orders by (class, start) for strict priority or by the aged start */
+inline static uint64_t
+job_tag (jobq_t * q, uint64_t start, uint8_t prio)
+{
+  if (q->aging > 0)
+    return start + prio * q->aging;
+  if (start > START_MAX)
+    start = START_MAX;
+  return ((uint64_t)prio << PRIO_SHIFT) | start;
+}
+
+static void
+heap_swap (struct _jobq_shard_t * shard, size_t a, size_t b)
+{
+  struct _jobq_flow_t * tmp = shard->heap[a];
+
+  shard->heap[a] = shard->heap[b];
+  shard->heap[b] = tmp;
+  shard->heap[a]->heap_idx = a;
+  shard->heap[b]->heap_idx = b;
+}
+
+static void
+heap_up (struct _jobq_shard_t * shard, size_t idx)
+{
+  for (; idx > 0 && flow_tag (shard->heap[idx]) <
+         flow_tag (shard->heap[(idx-1)/2]); idx = (idx-1)/2)
+    heap_swap (shard, idx, (idx-1)/2);
+}
+
+static void
+heap_down (struct _jobq_shard_t * shard, size_t idx)
+{
+  size_t min, child;
+
+  for (;;)
+    {
+      min = idx;
+      child = idx*2 + 1;
+      if (child < shard->heap_len &&
+          flow_tag (shard->heap[child]) < flow_tag (shard->heap[min]))
+        min = child;
+      if (child + 1 < shard->heap_len &&
+          flow_tag (shard->heap[child+1]) < flow_tag (shard->heap[min]))
+        min = child + 1;
+      if (min == idx)
+        return;
+      heap_swap (shard, idx, min);
+      idx = min;
+    }
+}
+
+static jobq_err_t
+heap_insert (struct _jobq_shard_t * shard, struct _jobq_flow_t * flow)
+{
+  struct _jobq_flow_t ** tmp;
+
+  if (shard->heap_len == shard->heap_size)
+    {
+      tmp = (struct _jobq_flow_t**)
+        realloc (shard->heap, (shard->heap_size*2 + 16) * sizeof (*tmp));
+      if (tmp == NULL)
+        return JOBQ_MALLOC_FAILED;
+      shard->heap = tmp;
+      shard->heap_size = shard->heap_size*2 + 16;
+    }
+
+  flow->heap_idx = shard->heap_len;
+  shard->heap[shard->heap_len++] = flow;
+  heap_up (shard, flow->heap_idx);
+
+  return JOBQ_OK;
+}
+
+static void
+heap_pop (struct _jobq_shard_t * shard)
+{
+  shard->heap[0]->heap_idx = SIZE_MAX;
+  shard->heap_len--;
+  if (shard->heap_len > 0)
+    {
+      shard->heap[0] = shard->heap[shard->heap_len];
+      shard->heap[0]->heap_idx = 0;
+      heap_down (shard, 0);
+    }
+}
+
+inline static void
+shard_publish (struct _jobq_shard_t * shard)
+{
+  __atomic_store_n (&shard->head, shard->heap_len > 0 ?
+                    flow_tag (shard->heap[0]) : UINT64_MAX, __ATOMIC_RELEASE);
+}
+
+static jobq_err_t
+shard_grow (struct _jobq_shard_t * shard)
+{
+  struct _jobq_tenant_t ** tmp, * t, * next;
+  size_t i, size, idx;
+
+  size = shard->tenants_size*2 + 64;
+  tmp = (struct _jobq_tenant_t**) calloc (size, sizeof (*tmp));
+  if (tmp == NULL)
+    return JOBQ_MALLOC_FAILED;
+
+  /* Rehash every tenant into the new buckets */
+  for (i = 0; i < shard->tenants_size; i++)
+    for (t = shard->tenants[i]; t != NULL; t = next)
+      {
+        next = t->next;
+        idx = (t->hash >> 16) % size;
+        t->next = tmp[idx];
+        tmp[idx] = t;
+      }
+  if (shard->tenants != NULL)
+    free (shard->tenants);
+  shard->tenants = tmp;
+  shard->tenants_size = size;
+
+  return JOBQ_OK;
+}
+
+static struct _jobq_tenant_t *
+tenant_get (jobq_t * q, struct _jobq_shard_t * shard, const char * name,
+            uint64_t hash)
+{
+  struct _jobq_tenant_t * t;
+  size_t i, idx;
+
+  if (shard->tenants_size > 0)
+    for (t = shard->tenants[(hash >> 16) % shard->tenants_size]; t != NULL;
+         t = t->next)
+      if (t->hash == hash && strcmp (t->name, name) == 0)
+        return t;
+
+  /* Keep the chains short */
+  if (shard->ntenants >= shard->tenants_size &&
+      shard_grow (shard) != JOBQ_OK)
+    return NULL;
+
+  t = (struct _jobq_tenant_t*) calloc (1, sizeof (struct _jobq_tenant_t));
+  if (t == NULL)
+    return NULL;
+  t->name = cpstr (name);
+  if (t->name == NULL)
+    {
+      free (t);
+      return NULL;
+    }
+  t->hash = hash;
+  t->stats.tenant = t->name;
+  t->stats.weight = q->weight;
+  for (i = 0; i < JOBQ_CLASSES; i++)
+    {
+      t->flows[i].tenant = t;
+      t->flows[i].heap_idx = SIZE_MAX;
+    }
+
+  idx = (hash >> 16) % shard->tenants_size;
+  t->next = shard->tenants[idx];
+  shard->tenants[idx] = t;
+  shard->ntenants++;
+
+  return t;
+}
+
+jobq_err_t
+jobq_init (jobq_t * q, size_t shards, uint64_t aging)
+{
+  size_t i;
+
+  /* Initialize the struct */
+  q->err = NULL;
+  q->nshards = shards > 0 ? shards : DEFAULT_SHARDS;
+  q->vtime = 0;
+  q->aging = aging * SCALE;
+  q->weight = DEFAULT_WEIGHT;
+  sem_init (&q->ready, 0, 0);
+
+  q->shards = (struct _jobq_shard_t*)
+    calloc (q->nshards, sizeof (struct _jobq_shard_t));
+  if (q->shards == NULL)
+    {
+      q->err = cpstr (MALLOC_FAILED);
+      return JOBQ_MALLOC_FAILED;
+    }
+  for (i = 0; i < q->nshards; i++)
+    {
+      pthread_mutex_init (&q->shards[i].lock, NULL);
+      q->shards[i].head = UINT64_MAX;
+    }
+
+  return JOBQ_OK;
+}
+
+jobq_err_t
+jobq_init_conf (jobq_t * q, conf_t * conf)
+{
+  char * item, * sep, * end, * tenant;
+  unsigned long weight;
+  jobq_err_t ret;
+  size_t i;
+
+  ret = jobq_init (q, conf->vals.queue_shards, conf->vals.queue_aging);
+  if (ret != JOBQ_OK)
+    return ret;
+  q->weight = conf->vals.queue_default_weight;
+
+  /* Read the tenant weights */
+  for (i = 0; i < conf->vals.queue_weights.len; i++)
+    {
+      item = conf->vals.queue_weights.items[i];
+      sep = strrchr (item, ':');
+      weight = 0;
+      if (sep != NULL && sep != item)
+        {
+          weight = strtoul (sep + 1, &end, 10);
+          if (*end != '\0' || weight > UINT32_MAX)
+            weight = 0;
+        }
+      if (weight == 0)
+        {
+          q->err = cpstrf ("Invalid QUEUE_WEIGHTS Entry: %s\n", item);
+          return JOBQ_INVALID;
+        }
+
+      /* The tenant name is the part before the colon, the list itself
+         is shared and never modified */
+      tenant = cpstrn (item, sep - item);
+      if (tenant == NULL)
+        {
+          q->err = cpstr (MALLOC_FAILED);
+          return JOBQ_MALLOC_FAILED;
+        }
+      ret = jobq_weight (q, tenant, weight);
+      free (tenant);
+      if (ret != JOBQ_OK)
+        return ret;
+    }
+
+  return JOBQ_OK;
+}
+
+jobq_err_t
+jobq_weight (jobq_t * q, const char * tenant, uint32_t weight)
+{
+  struct _jobq_shard_t * shard;
+  struct _jobq_tenant_t * t;
+  uint64_t hash;
+
+  if (weight == 0)
+    return JOBQ_INVALID;
+
+  hash = hash_str (tenant);
+  shard = &q->shards[hash % q->nshards];
+  pthread_mutex_lock (&shard->lock);
+  t = tenant_get (q, shard, tenant, hash);
+  if (t != NULL)
+    t->stats.weight = weight;
+  pthread_mutex_unlock (&shard->lock);
+
+  return t != NULL ? JOBQ_OK : JOBQ_MALLOC_FAILED;
+}
+
+jobq_err_t
+jobq_push (jobq_t * q, jobq_job_t * job)
+{
+  struct _jobq_shard_t * shard;
+  struct _jobq_tenant_t * t;
+  struct _jobq_flow_t * flow;
+  uint64_t hash, vtime, start;
+  uint32_t cost;
+
+  if (job->prio >= JOBQ_CLASSES || job->tenant == NULL)
+    return JOBQ_INVALID;
+  cost = job->cost > 0 ? job->cost : DEFAULT_COST;
+
+  hash = hash_str (job->tenant);
+  shard = &q->shards[hash % q->nshards];
+  pthread_mutex_lock (&shard->lock);
+  t = tenant_get (q, shard, job->tenant, hash);
+  if (t == NULL)
+    {
+      pthread_mutex_unlock (&shard->lock);
+      return JOBQ_MALLOC_FAILED;
+    }
+
+  /* Tag the job from the tenant's share of virtual time */
+  vtime = __atomic_load_n (&q->vtime, __ATOMIC_ACQUIRE);
+  start = t->finish > vtime ? t->finish : vtime;
+  t->finish = start + (uint64_t)cost * SCALE / t->stats.weight;
+  job->start = start;
+  job->tag = job_tag (q, start, job->prio);
+  job->queued = now_ns ();
+  job->next = NULL;
+
+  /* Append to the flow, activating it if it was idle */
+  flow = &t->flows[job->prio];
+  if (flow->head == NULL)
+    {
+      flow->head = flow->tail = job;
+      if (heap_insert (shard, flow) != JOBQ_OK)
+        {
+          flow->head = flow->tail = NULL;
+          pthread_mutex_unlock (&shard->lock);
+          return JOBQ_MALLOC_FAILED;
+        }
+    }
+  else
+    {
+      flow->tail->next = job;
+      flow->tail = job;
+    }
+  t->stats.enqueued++;
+  t->stats.queued++;
+  shard_publish (shard);
+  pthread_mutex_unlock (&shard->lock);
+
+  sem_post (&q->ready);
+  return JOBQ_OK;
+}
+
+jobq_job_t *
+jobq_pop (jobq_t * q, int wait)
+{
+  struct _jobq_shard_t * shard;
+  struct _jobq_flow_t * flow;
+  struct _jobq_tenant_t * t;
+  jobq_job_t * job;
+  uint64_t head, min, vtime, waited;
+  size_t i, best, bucket;
+
+  /* Claim one of the queued jobs */
+  if (wait)
+    {
+      while (sem_wait (&q->ready) != 0);
+    }
+  else if (sem_trywait (&q->ready) != 0)
+    return NULL;
+
+  for (;;)
+    {
+      /* Pick the shard with the smallest published head */
+      best = SIZE_MAX;
+      min = UINT64_MAX;
+      for (i = 0; i < q->nshards; i++)
+        {
+          head = __atomic_load_n (&q->shards[i].head, __ATOMIC_ACQUIRE);
+          if (head < min)
+            {
+              min = head;
+              best = i;
+            }
+        }
+      if (best == SIZE_MAX)
+        {
+          sched_yield ();
+          continue;
+        }
+
+      /* Another dispatcher may have emptied it in the meantime */
+      shard = &q->shards[best];
+      pthread_mutex_lock (&shard->lock);
+      if (shard->heap_len == 0)
+        {
+          pthread_mutex_unlock (&shard->lock);
+          continue;
+        }
+      break;
+    }
+
+  /* Take the head of the best flow */
+  flow = shard->heap[0];
+  job = flow->head;
+  flow->head = job->next;
+  if (flow->head == NULL)
+    {
+      flow->tail = NULL;
+      heap_pop (shard);
+    }
+  else
+    heap_down (shard, 0);
+  shard_publish (shard);
+
+  /* Account the wait against the tenant */
+  t = flow->tenant;
+  waited = now_ns () - job->queued;
+  for (bucket = 0; bucket < JOBQ_BUCKETS - 1 &&
+         (waited / 1000) >> bucket > 1; bucket++);
+  t->stats.queued--;
+  t->stats.dispatched++;
+  t->stats.cost += job->cost > 0 ? job->cost : DEFAULT_COST;
+  t->stats.wait_ns += waited;
+  if (waited > t->stats.wait_max_ns)
+    t->stats.wait_max_ns = waited;
+  t->stats.wait_hist[bucket]++;
+  pthread_mutex_unlock (&shard->lock);
+
+  /* Advance the system virtual time to the job in service */
+  vtime = __atomic_load_n (&q->vtime, __ATOMIC_RELAXED);
+  while (vtime < job->start &&
+         !__atomic_compare_exchange_n (&q->vtime, &vtime, job->start, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  return job;
+}
+
+void
+jobq_stats (jobq_t * q, jobq_stats_cb_t cb, void * arg)
+{
+  struct _jobq_shard_t * shard;
+  struct _jobq_tenant_t * t;
+  size_t i, j;
+
+  for (i = 0; i < q->nshards; i++)
+    {
+      shard = &q->shards[i];
+      pthread_mutex_lock (&shard->lock);
+      for (j = 0; j < shard->tenants_size; j++)
+        for (t = shard->tenants[j]; t != NULL; t = t->next)
+          cb (arg, &t->stats);
+      pthread_mutex_unlock (&shard->lock);
+    }
+}
+
+const char *
+jobq_get_err (jobq_t * q)
+{
+  return q->err;
+}
+
+jobq_err_t
+jobq_destroy (jobq_t * q)
+{
+  struct _jobq_shard_t * shard;
+  struct _jobq_tenant_t * t, * next;
+  size_t i, j;
+
+  if (q->shards != NULL)
+    {
+      for (i = 0; i < q->nshards; i++)
+        {
+          shard = &q->shards[i];
+          for (j = 0; j < shard->tenants_size; j++)
+            for (t = shard->tenants[j]; t != NULL; t = next)
+              {
+                next = t->next;
+                free (t->name);
+                free (t);
+              }
+          if (shard->tenants != NULL)
+            free (shard->tenants);
+          if (shard->heap != NULL)
+            free (shard->heap);
+          pthread_mutex_destroy (&shard->lock);
+        }
+      free (q->shards);
+    }
+  if (q->err != NULL)
+    free (q->err);
+  sem_destroy (&q->ready);
+
+  return JOBQ_OK;
+}
+
+const char *
+jobq_err_str (jobq_err_t err)
+{
+  switch (err)
+    {
+    case JOBQ_OK:
+      return "Success";
+    case JOBQ_MALLOC_FAILED:
+      return "Malloc Failed";
+    case JOBQ_INVALID:
+      return "Invalid Job or Queue Policy";
+    case JOBQ_UNKNOWN:
+      return "Unknown Cause of Error";
+    }
+
+  return "Undefined Error Code";
+}
@@ -0,0 +1,213 @@
+/**
+   @file jobq.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Fair Job Queue
+   @details A job queue shared between tenants, usually projects or
+   users. Jobs are ordered by start time fair queueing: each job is
+   tagged with a virtual start time derived from its tenant's weight
+   and the cost of the tenant's earlier jobs, so a burst from one
+   tenant only delays its own work. Priority classes offset the tag by
+   a configurable aging interval per class, so higher classes run
+   first but a lower class job is never delayed by more than that much
+   virtual time.
+
+   Tenants are spread over independently locked shards, each holding
+   a heap of the tenants' per class flows. Dispatch compares the
+   published heads of the shards and only locks the one it pops from.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _JOBQ_H_
+#define _JOBQ_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "conf.h"
+
+#define JOBQ_CLASSES 4 /**< Number of priority classes, 0 is highest */
+#define JOBQ_BUCKETS 32 /**< Buckets in the wait time histograms */
+
+/**
+   @brief Job Queue Error Codes
+**/
+typedef enum _jobq_err_t
+  {
+    JOBQ_OK = 0, /**< Success */
+    JOBQ_MALLOC_FAILED, /**< Allocating Memory Failed */
+    JOBQ_INVALID, /**< An invalid argument or policy */
+    JOBQ_UNKNOWN /**< Unknown Error */
+  } jobq_err_t;
+
+/**
+   @brief Queued Job
+   @details Embedded by the caller, the queue never allocates jobs.
+**/
+typedef struct _jobq_job_t
+{
+  struct _jobq_job_t * next; /**< Next job in the same flow */
+  const char * tenant; /**< Name of the owning tenant */
+  uint8_t prio; /**< Priority class below JOBQ_CLASSES */
+  uint32_t cost; /**< Estimated cost in milliseconds */
+  uint64_t tag; /**< Virtual time ordering key */
+  uint64_t start; /**< Virtual start time */
+  uint64_t queued; /**< Monotonic enqueue time in ns */
+  void * data; /**< User data */
+} jobq_job_t;
+
+/**
+   @brief Per Tenant Metrics
+**/
+typedef struct _jobq_stats_t
+{
+  const char * tenant; /**< Name of the tenant */
+  uint32_t weight; /**< Share weight */
+  uint64_t queued; /**< Jobs currently waiting */
+  uint64_t enqueued; /**< Jobs ever queued */
+  uint64_t dispatched; /**< Jobs ever dispatched */
+  uint64_t cost; /**< Cost of the dispatched jobs */
+  uint64_t wait_ns; /**< Total time dispatched jobs waited */
+  uint64_t wait_max_ns; /**< Longest time a job waited */
+  uint64_t wait_hist[JOBQ_BUCKETS]; /**< Waits by power of two us */
+} jobq_stats_t;
+
+/**
+   @brief Stats Callback
+   @param arg The user argument passed to jobq_stats
+   @param stats A snapshot of one tenant
+**/
+typedef void (*jobq_stats_cb_t) (void * arg, const jobq_stats_t * stats);
+
+/**
+   @brief Queue Shard
+   @details Aligned so shards never share a cache line.
+**/
+struct _jobq_shard_t
+{
+  pthread_mutex_t lock; /**< Guards everything in the shard */
+  struct _jobq_tenant_t ** tenants; /**< Tenant hash buckets */
+  size_t tenants_size; /**< Number of hash buckets */
+  size_t ntenants; /**< Number of tenants */
+  struct _jobq_flow_t ** heap; /**< Active flows by head tag */
+  size_t heap_len; /**< Active flows */
+  size_t heap_size; /**< Allocated heap entries */
+  uint64_t head; /**< Tag of the heap top or UINT64_MAX */
+} __attribute__ ((aligned (64)));
+
+/**
+   @brief Job Queue Structure
+**/
+typedef struct _jobq_t
+{
+  char * err; /**< Last Error String */
+  struct _jobq_shard_t * shards; /**< Tenant shards */
+  size_t nshards; /**< Number of shards */
+  uint64_t vtime __attribute__ ((aligned (64))); /**< System virtual time */
+  uint64_t aging; /**< Virtual tag offset per priority class */
+  uint32_t weight; /**< Weight of unconfigured tenants */
+  sem_t ready; /**< Counts the queued jobs */
+} jobq_t;
+
+/**
+   @brief Creates a New Job Queue
+   @param q The queue structure to be initialized
+   @param shards The number of shards. Set this to 0 for the default.
+   @param aging The tag offset per priority class in milliseconds of
+   job cost. Set this to 0 for strict priority, where a class is only
+   served once every higher class is empty.
+   @return JOBQ_OK(0) on success or a positive error code
+**/
+jobq_err_t jobq_init (jobq_t * q, size_t shards, uint64_t aging);
+
+/**
+   @brief Creates a Job Queue from the Configuration
+   @details Reads the QUEUE_SHARDS, QUEUE_AGING, QUEUE_DEFAULT_WEIGHT
+   and QUEUE_WEIGHTS keys. QUEUE_WEIGHTS is a comma separated list of
+   tenant:weight pairs.
+   @param q The queue structure to be initialized
+   @param conf The parsed configuration
+   @return JOBQ_OK(0) on success or a positive error code
+**/
+jobq_err_t jobq_init_conf (jobq_t * q, conf_t * conf);
+
+/**
+   @brief Sets the Weight of a Tenant
+   @details Weights only apply to jobs queued after they are set.
+   @param q The queue structure
+   @param tenant The name of the tenant
+   @param weight The relative share of the tenant, at least 1
+   @return JOBQ_OK(0) on success or a positive error code
+**/
+jobq_err_t jobq_weight (jobq_t * q, const char * tenant, uint32_t weight);
+
+/**
+   @brief Queues a Job
+   @details The tenant, prio and cost members must be filled in. A cost
+   of 0 is treated as one second.
+   @param q The queue structure
+   @param job The job to queue
+   @return JOBQ_OK(0) on success or a positive error code
+**/
+jobq_err_t jobq_push (jobq_t * q, jobq_job_t * job);
+
+/**
+   @brief Dispatches the Next Job
+   @param q The queue structure
+   @param wait 1 to block until a job is queued or 0 to return
+   immediately
+   @return The next job or NULL if the queue is empty
+**/
+jobq_job_t * jobq_pop (jobq_t * q, int wait);
+
+/**
+   @brief Reports Per Tenant Metrics
+   @details Calls cb with a snapshot of every tenant. The callback runs
+   with a shard locked and must not use the queue.
+   @param q The queue structure
+   @param cb The callback
+   @param arg Passed through to cb
+**/
+void jobq_stats (jobq_t * q, jobq_stats_cb_t cb, void * arg);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param q The queue structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * jobq_get_err (jobq_t * q);
+
+/**
+   @brief Destroys the Job Queue
+   @details Frees the queue. Jobs still queued are not touched.
+   @param q The queue structure to be destroyed
+   @return JOBQ_OK(0) on success or a positive error code
+**/
+jobq_err_t jobq_destroy (jobq_t * q);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * jobq_err_str (jobq_err_t err);
+
+#endif
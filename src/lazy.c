@@ -0,0 +1,144 @@
+/**
+   @file lazy.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Lazily Started Subsystems
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include "lazy.h"
+#include "log.h"
+
+/* Values of state */
+#define LAZY_IDLE 0
+#define LAZY_DONE 1
+#define LAZY_STOPPED 2
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+lazy_init (lazy_t * lz, const char * name, lazy_fn_t start, lazy_fn_t stop,
+           void * arg, int stopped)
+{
+  memset (lz, 0, sizeof (lazy_t));
+  pthread_mutex_init (&lz->lock, NULL);
+  lz->name = name;
+  lz->start = start;
+  lz->stop = stop;
+  lz->arg = arg;
+  lz->stopped = stopped;
+  lz->owned = 1;
+}
+
+int
+lazy_get (lazy_t * lz)
+{
+  uint64_t begin;
+  int ret;
+
+  /* Pairs with the release below so the subsystem's state is visible,
+     a stopped subsystem's lock may already be gone */
+  ret = __atomic_load_n (&lz->state, __ATOMIC_ACQUIRE);
+  if (ret == LAZY_DONE)
+    return lz->ret;
+  if (ret == LAZY_STOPPED)
+    return lz->stopped;
+
+  pthread_mutex_lock (&lz->lock);
+  if (lz->state == LAZY_IDLE)
+    {
+      begin = now_ns ();
+      lz->ret = lz->start (lz->arg);
+      lz->start_ns = now_ns () - begin;
+      log_debug ("Started subsystem", LOG_STR ("name", lz->name),
+                 LOG_INT ("ret", lz->ret),
+                 LOG_DBL ("ms", lz->start_ns / 1e6));
+      __atomic_store_n (&lz->state, LAZY_DONE, __ATOMIC_RELEASE);
+    }
+  ret = lz->state == LAZY_STOPPED ? lz->stopped : lz->ret;
+  pthread_mutex_unlock (&lz->lock);
+
+  return ret;
+}
+
+int
+lazy_started (lazy_t * lz)
+{
+  return __atomic_load_n (&lz->state, __ATOMIC_ACQUIRE) == LAZY_DONE &&
+    lz->ret == 0;
+}
+
+int
+lazy_destroy (lazy_t * lz)
+{
+  int ret = 0;
+
+  if (__atomic_load_n (&lz->state, __ATOMIC_ACQUIRE) == LAZY_STOPPED)
+    return 0;
+
+  pthread_mutex_lock (&lz->lock);
+  if (lz->state == LAZY_DONE && lz->ret == 0 && lz->stop != NULL)
+    ret = lz->stop (lz->arg);
+  __atomic_store_n (&lz->state, LAZY_STOPPED, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&lz->lock);
+
+  /* A static lock belongs to the process and is never destroyed */
+  if (lz->owned)
+    pthread_mutex_destroy (&lz->lock);
+
+  return ret;
+}
+
+int
+lazy_dlopen (const char * soname, const lazy_sym_t * syms, size_t count)
+{
+  void * lib;
+  size_t i;
+
+  lib = dlopen (soname, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL)
+    {
+      log_warn ("Failed to load a library", LOG_STR ("lib", soname),
+                LOG_STR ("err", dlerror ()));
+      return 1;
+    }
+  for (i = 0; i < count; i++)
+    {
+      *syms[i].fn = dlsym (lib, syms[i].name);
+      if (*syms[i].fn == NULL)
+        {
+          log_warn ("Failed to load a library", LOG_STR ("lib", soname),
+                    LOG_STR ("missing", syms[i].name));
+          dlclose (lib);
+          return 1;
+        }
+    }
+
+  return 0;
+}
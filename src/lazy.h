@@ -0,0 +1,138 @@
+/**
+   @file lazy.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Lazily Started Subsystems
+   @details Defers the expensive part of bringing up a subsystem,
+   such as a library's global state, a connection or a thread, until
+   the first call which needs it. Commands which never touch a
+   subsystem never pay for it, which keeps short lived invocations
+   like --help and --status fast.
+
+   Once started a subsystem stays started until lazy_destroy. A start
+   which fails is not retried and every later lazy_get returns the
+   same error.
+
+   Shared libraries with deep dependency trees, like libcurl and libpq,
+   are loaded the same way with lazy_dlopen. Mapping them at exec time
+   costs more than everything else a short command does.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LAZY_H_
+#define _LAZY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+   @brief Starts or Stops a Subsystem
+   @param arg The argument given to lazy_init
+   @return 0 on success or the subsystem's positive error code
+**/
+typedef int (*lazy_fn_t) (void * arg);
+
+/**
+   @brief Function Resolved by lazy_dlopen
+**/
+typedef struct _lazy_sym_t
+{
+  const char * name; /**< Symbol name in the library */
+  void ** fn; /**< Where the address is stored */
+} lazy_sym_t;
+
+/**
+   @brief Lazy Subsystem Structure
+**/
+typedef struct _lazy_t
+{
+  const char * name; /**< Name used in the logs */
+  lazy_fn_t start; /**< Brings the subsystem up */
+  lazy_fn_t stop; /**< Tears it down or NULL */
+  void * arg; /**< Passed to start and stop */
+  pthread_mutex_t lock; /**< Serializes the start */
+  int state; /**< Whether start has run, read without the lock */
+  int ret; /**< Result of start */
+  uint64_t start_ns; /**< How long start took */
+  int stopped; /**< Returned by lazy_get once destroyed */
+  int owned; /**< The lock was made by lazy_init and is destroyed */
+} lazy_t;
+
+/**
+   @brief Static Initializer for Process Wide Subsystems
+   @details Equivalent to lazy_init, for subsystems such as a loaded
+   library which are shared by every user in the process. The lock is
+   static so lazy_destroy leaves it alone.
+**/
+#define LAZY_INITIALIZER(name, start, stop, arg, stopped)               \
+  { (name), (start), (stop), (arg), PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, \
+      (stopped), 0 }
+
+/**
+   @brief Describes a Lazy Subsystem
+   @details Does not start it.
+   @param lz The structure to be initialized
+   @param name The name of the subsystem for the logs
+   @param start Brings the subsystem up
+   @param stop Tears the subsystem down or NULL
+   @param arg Passed to start and stop
+   @param stopped The positive error lazy_get returns after lazy_destroy
+**/
+void lazy_init (lazy_t * lz, const char * name, lazy_fn_t start,
+                lazy_fn_t stop, void * arg, int stopped);
+
+/**
+   @brief Starts the Subsystem if Needed
+   @details The first caller runs start while any others wait for it,
+   afterwards this is a single load.
+   @param lz The lazy structure
+   @return 0 if the subsystem is up, the error start returned or the
+   stopped error once the subsystem has been destroyed
+**/
+int lazy_get (lazy_t * lz);
+
+/**
+   @brief Checks whether the Subsystem is Up
+   @param lz The lazy structure
+   @return 1 if start has run and succeeded, otherwise 0
+**/
+int lazy_started (lazy_t * lz);
+
+/**
+   @brief Destroys the Lazy Subsystem
+   @details Runs stop if the subsystem was started. Later calls to
+   lazy_get fail with the stopped error instead of starting it again.
+   @param lz The lazy structure to be destroyed
+   @return 0 on success or the error stop returned
+**/
+int lazy_destroy (lazy_t * lz);
+
+/**
+   @brief Loads Functions from a Shared Library
+   @details Meant to be called from a start function. The library
+   stays loaded for the life of the process.
+   @param soname The library to load, including its major version
+   @param syms The functions to resolve
+   @param count The number of functions
+   @return 0 if every function resolved, otherwise 1 after logging why
+**/
+int lazy_dlopen (const char * soname, const lazy_sym_t * syms, size_t count);
+
+#endif
@@ -0,0 +1,487 @@
+/**
+   @file load.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Synthetic Load Generator
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "load.h"
+#include "util.h"
+
+#define NAME_MAX_LEN 32
+#define SLEEP_SLICE_NS 5000000ull
+#define SINK_BLOCK 65536
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Generated Target
+**/
+struct _load_job_t
+{
+  runner_task_t task; /**< Target handed to the scheduler */
+  uint64_t ms; /**< Generated duration */
+  size_t dep; /**< First dependency in the load's deps */
+  size_t ndep; /**< Number of dependencies */
+  uint64_t end_ns; /**< When the first copy finished or 0 */
+  uint64_t overhead_ns; /**< Dispatch overhead of the first copy */
+  int started; /**< A copy has started */
+  unsigned copies; /**< Copies started, names their scratch files */
+  const char * path; /**< Artifact under LOAD_ARTIFACTS or NULL */
+};
+
+/* Lines of text written as the output of every target */
+static char text[SINK_BLOCK];
+
+/* When the executor last returned on this worker */
+static __thread uint64_t free_ns;
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Small, fast and the same everywhere, unlike rand () */
+static uint64_t
+splitmix64 (uint64_t * state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in (0, 1) */
+static double
+uniform (uint64_t * state)
+{
+  return ((splitmix64 (state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static uint64_t
+draw (uint64_t * state, const char * dist, uint64_t mean)
+{
+  double z;
+
+  if (strcmp (dist, "uniform") == 0)
+    return llround (2.0 * mean * uniform (state));
+  if (strcmp (dist, "exp") == 0)
+    return llround (-(double)mean * log (uniform (state)));
+  if (strcmp (dist, "lognormal") == 0)
+    {
+      /* Sigma of 1 with the median at mean / e^0.5 keeps the mean */
+      z = sqrt (-2.0 * log (uniform (state))) *
+        cos (2.0 * M_PI * uniform (state));
+      return mean > 0 ? llround (exp (log ((double)mean) - 0.5 + z)) : 0;
+    }
+  return mean;
+}
+
+static void
+busy (load_t * load, uint64_t ms, const int * cancel)
+{
+  uint64_t end = now_ns () + ms * 1000000ull, now;
+  struct timespec ts;
+
+  while (!__atomic_load_n (cancel, __ATOMIC_ACQUIRE) &&
+         (now = now_ns ()) < end)
+    {
+      if (load->spin)
+        continue;
+      ts.tv_sec = 0;
+      ts.tv_nsec = end - now < SLEEP_SLICE_NS ? end - now : SLEEP_SLICE_NS;
+      nanosleep (&ts, NULL);
+    }
+}
+
+static int
+load_exec (void * arg, runner_task_t * task, const int * cancel)
+{
+  load_t * load = (load_t*) arg;
+  struct _load_job_t * job = (struct _load_job_t*) task->data;
+  uint64_t start, ready, expect = 0, left, len;
+  char tmp[PATH_MAX];
+  int fd, status = 0;
+  size_t i;
+  ssize_t ret;
+
+  /* Only the wait after both the target and a worker were ready is
+     overhead, a copy of a straggler is not dispatched in that sense */
+  start = now_ns ();
+  if (!__atomic_exchange_n (&job->started, 1, __ATOMIC_RELAXED))
+    {
+      ready = free_ns > load->begin_ns ? free_ns : load->begin_ns;
+      for (i = 0; i < job->ndep; i++)
+        if (load->jobs[load->deps[job->dep + i]].end_ns > ready)
+          ready = load->jobs[load->deps[job->dep + i]].end_ns;
+      job->overhead_ns = start > ready ? start - ready : 0;
+    }
+
+  busy (load, job->ms, cancel);
+
+  /* Copies write their own file, the finished one is renamed over the
+     artifact, and the name at the top keeps artifacts distinct */
+  fd = load->sink;
+  if (job->path != NULL)
+    {
+      snprintf (tmp, sizeof (tmp), "%s.%u", job->path,
+                __atomic_add_fetch (&job->copies, 1, __ATOMIC_RELAXED));
+      fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (fd < 0 || dprintf (fd, "%s\n", task->name) < 0)
+        status = 1;
+    }
+  for (left = load->output; left > 0 && !*cancel && !status; left -= len)
+    {
+      len = left < SINK_BLOCK ? left : SINK_BLOCK;
+      if (fd != load->sink || load->runner.log == NULL)
+        {
+          ret = write (fd, text, len);
+          if (ret < 0 && errno == EINTR)
+            len = 0;
+          else if (ret <= 0)
+            status = 1;
+          else
+            len = ret;
+        }
+      if (load->runner.log != NULL && !status)
+        runner_output (&load->runner, task, text, len);
+    }
+  if (fd != load->sink)
+    {
+      if (fd >= 0 && close (fd) != 0)
+        status = 1;
+      if (status || *cancel || rename (tmp, job->path) != 0)
+        unlink (tmp);
+    }
+  if (status)
+    return 1;
+
+  free_ns = now_ns ();
+  __atomic_compare_exchange_n (&job->end_ns, &expect, free_ns, 0,
+                               __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&load->busy_ns, free_ns - start, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+static load_err_t
+generate (load_t * load, conf_t * conf)
+{
+  const conf_vals_t * v = &conf->vals;
+  struct _load_job_t * job;
+  uint64_t state = v->load_seed;
+  size_t width = v->load_width, fanin, i, j, k, dep;
+
+  fanin = (size_t)v->load_fanin < width ? (size_t)v->load_fanin : width;
+  load->njobs = width * v->load_depth;
+  load->jobs = (struct _load_job_t*) calloc (load->njobs, sizeof (*job));
+  load->deps = (size_t*) malloc ((load->njobs * fanin + 1) * sizeof (size_t));
+  load->names = (char*) malloc (load->njobs * NAME_MAX_LEN);
+  if (v->load_artifacts != NULL)
+    {
+      load->path_len = strlen (v->load_artifacts) + 1 + NAME_MAX_LEN;
+      load->paths = (char*) malloc (load->njobs * load->path_len);
+    }
+  if (load->jobs == NULL || load->deps == NULL || load->names == NULL ||
+      (v->load_artifacts != NULL && load->paths == NULL))
+    {
+      load->err = cpstr (MALLOC_FAILED);
+      return LOAD_MALLOC_FAILED;
+    }
+
+  /* Every level draws from the one before it, so the graph is acyclic
+     and its depth is exactly LOAD_DEPTH */
+  for (i = 0; i < load->njobs; i++)
+    {
+      job = &load->jobs[i];
+      job->task.name = load->names + i * NAME_MAX_LEN;
+      snprintf (load->names + i * NAME_MAX_LEN, NAME_MAX_LEN, "load-%u-%u",
+                (unsigned)(i / width), (unsigned)(i % width));
+      job->task.flags = RUNNER_SPECULABLE;
+      job->task.data = job;
+      if (load->paths != NULL)
+        {
+          job->path = load->paths + i * load->path_len;
+          snprintf (load->paths + i * load->path_len, load->path_len,
+                    "%s/%s", v->load_artifacts, job->task.name);
+          job->task.outputs = &job->path;
+          job->task.noutputs = 1;
+        }
+      job->ms = draw (&state, v->load_dist, v->load_duration);
+      job->task.sim_ms = job->ms;
+      job->dep = load->ndeps;
+      for (j = 0; i >= width && j < fanin; j++)
+        {
+          /* Redraw duplicates, fanin is small */
+          do
+            {
+              dep = (i / width - 1) * width + splitmix64 (&state) % width;
+              for (k = 0; k < j; k++)
+                if (load->deps[job->dep + k] == dep)
+                  break;
+            }
+          while (k < j);
+          load->deps[load->ndeps++] = dep;
+        }
+      job->ndep = load->ndeps - job->dep;
+      load->work_ms += job->ms;
+    }
+
+  return LOAD_OK;
+}
+
+load_err_t
+load_init (load_t * load, conf_t * conf)
+{
+  const conf_vals_t * v = &conf->vals;
+  load_err_t ret;
+  size_t i, j;
+
+  /* Initialize the struct */
+  memset (load, 0, sizeof (load_t));
+  load->sink = -1;
+  load->spin = strcmp (v->load_work, "spin") == 0;
+  if (history_open (&load->hist, NULL, v->history_alpha) != HISTORY_OK)
+    {
+      load->err = cpstr (MALLOC_FAILED);
+      runner_init (&load->runner, NULL, 1, NULL, NULL);
+      return LOAD_MALLOC_FAILED;
+    }
+  if (runner_init_conf (&load->runner, conf, &load->hist, load_exec, load) !=
+      RUNNER_OK)
+    {
+      load->err = cpstr (runner_get_err (&load->runner) != NULL ?
+                         runner_get_err (&load->runner) : MALLOC_FAILED);
+      return LOAD_RUNNER_FAILED;
+    }
+
+  ret = generate (load, conf);
+  if (ret != LOAD_OK)
+    return ret;
+  for (i = 0; i < load->njobs; i++)
+    {
+      if (runner_add (&load->runner, &load->jobs[i].task) != RUNNER_OK)
+        {
+          load->err = cpstr (MALLOC_FAILED);
+          return LOAD_MALLOC_FAILED;
+        }
+      for (j = 0; j < load->jobs[i].ndep; j++)
+        if (runner_dep (&load->runner, &load->jobs[i].task,
+                        &load->jobs[load->deps[load->jobs[i].dep + j]].task)
+            != RUNNER_OK)
+          {
+            load->err = cpstr (MALLOC_FAILED);
+            return LOAD_MALLOC_FAILED;
+          }
+    }
+
+  /* A warm history schedules as well as a perfect estimator, a cold
+     one shows what the scheduler does on a first build */
+  if (v->load_warm)
+    for (i = 0; i < load->njobs; i++)
+      if (history_record (&load->hist, load->jobs[i].task.name,
+                          load->jobs[i].ms, 0) != HISTORY_OK)
+        {
+          load->err = cpstr (MALLOC_FAILED);
+          return LOAD_MALLOC_FAILED;
+        }
+
+  load->sink = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (load->sink < 0)
+    {
+      load->err = cpstrf ("Failed to open /dev/null: %s\n", strerror (errno));
+      return LOAD_IO_FAILED;
+    }
+  load->output = v->load_output;
+  if (v->load_artifacts != NULL && mkdir (v->load_artifacts, 0755) != 0 &&
+      errno != EEXIST)
+    {
+      load->err = cpstrf ("Failed to create %s: %s\n", v->load_artifacts,
+                          strerror (errno));
+      return LOAD_IO_FAILED;
+    }
+  for (i = 0; i < SINK_BLOCK; i++)
+    text[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  if (v->load_trace != NULL)
+    {
+      load->trace = fopen (v->load_trace, "w");
+      if (load->trace == NULL)
+        {
+          load->err = cpstrf ("Failed to open %s: %s\n", v->load_trace,
+                              strerror (errno));
+          return LOAD_IO_FAILED;
+        }
+      load->runner.trace = load->trace;
+    }
+
+  return LOAD_OK;
+}
+
+static int
+cmp_u64 (const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+load_err_t
+load_run (load_t * load, load_report_t * rep)
+{
+  runner_sim_t sim;
+  uint64_t * over, sum = 0;
+  size_t i;
+
+  memset (rep, 0, sizeof (load_report_t));
+  if (load->err != NULL)
+    free (load->err);
+  load->err = NULL;
+
+  /* Only the real run should land in the trace */
+  load->runner.trace = NULL;
+  if (runner_simulate (&load->runner, &sim) != RUNNER_OK)
+    {
+      load->err = cpstr (runner_get_err (&load->runner) != NULL ?
+                         runner_get_err (&load->runner) :
+                         "Simulation stalled\n");
+      return LOAD_RUNNER_FAILED;
+    }
+  load->runner.trace = load->trace;
+
+  over = (uint64_t*) malloc ((load->njobs + 1) * sizeof (uint64_t));
+  if (over == NULL)
+    {
+      load->err = cpstr (MALLOC_FAILED);
+      return LOAD_MALLOC_FAILED;
+    }
+  for (i = 0; i < load->njobs; i++)
+    {
+      load->jobs[i].end_ns = 0;
+      load->jobs[i].overhead_ns = 0;
+      load->jobs[i].started = 0;
+    }
+  load->busy_ns = 0;
+  load->begin_ns = now_ns ();
+  if (runner_run (&load->runner) != RUNNER_OK)
+    {
+      load->err = cpstr (runner_get_err (&load->runner) != NULL ?
+                         runner_get_err (&load->runner) :
+                         "The scheduler failed\n");
+      free (over);
+      return LOAD_RUNNER_FAILED;
+    }
+  rep->makespan_us = (now_ns () - load->begin_ns) / 1000;
+
+  rep->jobs = load->njobs;
+  rep->edges = load->ndeps;
+  rep->workers = load->runner.nworkers;
+  rep->ideal_us = sim.makespan_ms * 1000;
+  rep->critical_us = sim.critical_ms * 1000;
+  rep->work_us = load->work_ms * 1000;
+  rep->busy_us = load->busy_ns / 1000;
+  rep->output = load->output * load->njobs;
+  rep->speculated = load->runner.speculated;
+  rep->stolen = load->runner.stolen;
+  rep->nodes = load->runner.numa ? load->runner.topo.nnodes : 1;
+  for (i = 0; i < load->njobs; i++)
+    {
+      over[i] = load->jobs[i].overhead_ns / 1000;
+      sum += over[i];
+    }
+  qsort (over, load->njobs, sizeof (uint64_t), cmp_u64);
+  if (load->njobs > 0)
+    {
+      rep->overhead_mean_us = sum / load->njobs;
+      rep->overhead_p50_us = over[(load->njobs - 1) * 50 / 100];
+      rep->overhead_p99_us = over[(load->njobs - 1) * 99 / 100];
+      rep->overhead_p999_us = over[(load->njobs - 1) * 999 / 1000];
+      rep->overhead_max_us = over[load->njobs - 1];
+    }
+  free (over);
+
+  return LOAD_OK;
+}
+
+const char *
+load_get_err (load_t * load)
+{
+  return load->err;
+}
+
+load_err_t
+load_destroy (load_t * load)
+{
+  runner_destroy (&load->runner);
+  history_close (&load->hist);
+  if (load->trace != NULL)
+    fclose (load->trace);
+  load->trace = NULL;
+  if (load->sink >= 0)
+    close (load->sink);
+  load->sink = -1;
+  free (load->jobs);
+  free (load->deps);
+  free (load->names);
+  free (load->paths);
+  load->jobs = NULL;
+  load->deps = NULL;
+  load->names = NULL;
+  load->paths = NULL;
+  load->njobs = load->ndeps = 0;
+
+  if (load->err != NULL)
+    free (load->err);
+  load->err = NULL;
+
+  return LOAD_OK;
+}
+
+const char *
+load_err_str (load_err_t err)
+{
+  switch (err)
+    {
+    case LOAD_OK:
+      return "Success";
+    case LOAD_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case LOAD_IO_FAILED:
+      return "The trace or the output sink could not be opened";
+    case LOAD_RUNNER_FAILED:
+      return "The scheduler failed";
+    case LOAD_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
@@ -0,0 +1,153 @@
+/**
+   @file load.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Synthetic Load Generator
+   @details Builds a random but reproducible target graph and runs it
+   through the real scheduler with a fake executor, so scheduler and
+   queue changes can be measured without compilers. The graph has
+   LOAD_DEPTH levels of LOAD_WIDTH targets, each depending on
+   LOAD_FANIN targets of the level before it. Durations are drawn from
+   LOAD_DIST around LOAD_DURATION and each target either sleeps or
+   spins for its duration, then writes LOAD_OUTPUT bytes of text, to
+   /dev/null or through runner_output when the scheduler has a
+   database log. With LOAD_ARTIFACTS set the text is also kept as a
+   file per target in that directory, which is published to the
+   scheduler's cache if it has one. The same
+   LOAD_SEED always gives the same graph and durations, and LOAD_TRACE
+   records the run for --simulate.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOAD_H_
+#define _LOAD_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "conf.h"
+#include "history.h"
+#include "runner.h"
+
+/**
+   @brief Load Generator Error Codes
+**/
+typedef enum _load_err_t
+  {
+    LOAD_OK = 0, /**< Success */
+    LOAD_MALLOC_FAILED, /**< Allocating Memory Failed */
+    LOAD_IO_FAILED, /**< The trace or the output sink could not be opened */
+    LOAD_RUNNER_FAILED, /**< The scheduler failed */
+    LOAD_UNKNOWN /**< Unknown Error */
+  } load_err_t;
+
+/**
+   @brief Load Run Results
+   @details Overheads are the time from a target being both ready and
+   having a free worker until it started, so they exclude waiting for
+   dependencies and for busy workers.
+**/
+typedef struct _load_report_t
+{
+  uint64_t jobs; /**< Targets run */
+  uint64_t edges; /**< Dependencies between them */
+  size_t workers; /**< Workers of the scheduler */
+  uint64_t makespan_us; /**< Wall time of the run */
+  uint64_t ideal_us; /**< Simulated makespan with no overhead */
+  uint64_t critical_us; /**< Longest chain of generated durations */
+  uint64_t work_us; /**< Sum of the generated durations */
+  uint64_t busy_us; /**< Time workers spent in the executor */
+  uint64_t output; /**< Bytes written by the targets */
+  uint64_t speculated; /**< Copies launched for stragglers */
+  uint64_t stolen; /**< Targets run off the node of their inputs */
+  size_t nodes; /**< Nodes the workers were spread over */
+  uint64_t overhead_mean_us; /**< Mean dispatch overhead */
+  uint64_t overhead_p50_us; /**< Median dispatch overhead */
+  uint64_t overhead_p99_us; /**< 99th percentile dispatch overhead */
+  uint64_t overhead_p999_us; /**< 99.9th percentile dispatch overhead */
+  uint64_t overhead_max_us; /**< Largest dispatch overhead */
+} load_report_t;
+
+/**
+   @brief Load Generator Structure
+**/
+typedef struct _load_t
+{
+  char * err; /**< Last Error String */
+  runner_t runner; /**< Scheduler holding the generated targets */
+  history_t hist; /**< Durations known to the scheduler */
+  struct _load_job_t * jobs; /**< Generated targets */
+  size_t njobs; /**< Number of targets */
+  size_t * deps; /**< Dependencies of every target, by index */
+  size_t ndeps; /**< Number of dependencies */
+  char * names; /**< Storage for the target names */
+  char * paths; /**< Storage for the artifact paths or NULL */
+  size_t path_len; /**< Room for each artifact path */
+  uint64_t work_ms; /**< Sum of the generated durations */
+  uint64_t output; /**< Bytes each target writes */
+  int spin; /**< Burn cpu instead of sleeping */
+  int sink; /**< Descriptor the output is written to */
+  FILE * trace; /**< Trace of the run or NULL */
+  uint64_t begin_ns; /**< Start of the current run */
+  uint64_t busy_ns; /**< Time spent in the executor this run */
+} load_t;
+
+/**
+   @brief Generates a Load
+   @details Reads the LOAD_* keys, and the SCHED_* keys for the
+   scheduler like a real build.
+   @param load The load structure to be initialized
+   @param conf The parsed configuration
+   @return LOAD_OK(0) on success or a positive error code
+**/
+load_err_t load_init (load_t * load, conf_t * conf);
+
+/**
+   @brief Runs the Load
+   @details Simulates the graph first for the ideal makespan, then
+   runs it for real. May be called more than once.
+   @param load The load structure
+   @param rep Filled in with the results
+   @return LOAD_OK(0) on success or a positive error code
+**/
+load_err_t load_run (load_t * load, load_report_t * rep);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param load The load structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * load_get_err (load_t * load);
+
+/**
+   @brief Destroys the Load
+   @param load The load structure to be destroyed
+   @return LOAD_OK(0) on success or a positive error code
+**/
+load_err_t load_destroy (load_t * load);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * load_err_str (load_err_t err);
+
+#endif
@@ -0,0 +1,709 @@
+/**
+   @file log.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Asynchronous Structured Logging
+   @details Leveled log messages carrying typed key value fields. Each
+   thread formats its messages into a private ring buffer and a single
+   background writer drains every ring in batches with writev, so
+   threads never contend on a shared stream lock. Messages below
+   LOG_MIN_LEVEL are compiled out entirely.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "log.h"
+
+#define RING_SIZE 65536
+#define MSG_MAX 1024
+#define FLUSH_MS 10
+#define IOV_BATCH 64
+
+/**
+   @brief Cached Timestamp Prefix
+   @details Formatting the date is only done once per second.
+**/
+struct _log_stamp_t
+{
+  time_t sec; /**< Second the prefix was formatted for */
+  char str[24]; /**< YYYY-MM-DDTHH:MM:SS */
+};
+
+/**
+   @brief Per Thread Message Ring
+   @details Written only by the owning thread and drained only by the
+   writer thread.
+**/
+struct _log_ring_t
+{
+  uint8_t data[RING_SIZE]; /**< Formatted messages */
+  size_t head __attribute__ ((aligned (64))); /**< Bytes written */
+  size_t tail __attribute__ ((aligned (64))); /**< Bytes drained */
+  uint64_t dropped; /**< Messages lost to a full ring or the rate */
+  time_t window; /**< Second the rate count applies to */
+  size_t count; /**< Messages logged during the window */
+  struct _log_stamp_t stamp; /**< Timestamp cache */
+  int dead; /**< The owning thread has exited */
+  struct _log_ring_t * next; /**< Next registered ring */
+};
+
+static struct
+{
+  pthread_mutex_t lock; /**< Guards the ring list */
+  pthread_cond_t cond; /**< Wakes the writer early */
+  pthread_t writer; /**< Writer thread */
+  pthread_key_t key; /**< Marks rings dead on thread exit */
+  int running; /**< The writer is accepting messages */
+  int stop; /**< Asks the writer to exit */
+  int fd; /**< Output descriptor */
+  log_format_t format; /**< Output format */
+  size_t rate; /**< Messages per second per thread */
+  struct _log_ring_t * rings; /**< Registered rings */
+} logger = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static __thread struct _log_ring_t * local_ring = NULL;
+
+log_level_t log_level = LOG_LEVEL_INFO;
+
+static const char * LEVEL_STR[] = {
+  "TRACE", "DEBUG", "INFO", "WARN", "ERROR"
+};
+
+static const char * LEVEL_JSON[] = {
+  "trace", "debug", "info", "warn", "error"
+};
+
+/**
+   @brief Line Being Formatted
+   @details Every put is all or nothing and stops at MSG_LIMIT, the
+   bytes after it are kept for closing a cut value, the truncation
+   note and the newline, so a line is never cut mid structure.
+**/
+struct _log_buf_t
+{
+  char * out; /**< The line, MSG_MAX bytes */
+  size_t pos; /**< Bytes written */
+  int cut; /**< Something did not fit, the rest of the line is dropped */
+};
+
+/* Room kept at the end of a line, see struct _log_buf_t */
+#define MSG_TAIL 32
+#define MSG_LIMIT (MSG_MAX - MSG_TAIL)
+#define ELLIPSIS "\xe2\x80\xa6"
+
+inline static void
+put_raw (struct _log_buf_t * buf, const char * str, size_t len)
+{
+  memcpy (buf->out + buf->pos, str, len);
+  buf->pos += len;
+}
+
+inline static void
+put (struct _log_buf_t * buf, const char * str, size_t len)
+{
+  if (buf->cut || buf->pos + len > MSG_LIMIT)
+    {
+      buf->cut = 1;
+      return;
+    }
+  put_raw (buf, str, len);
+}
+
+/* Returns the length of the UTF-8 sequence at str or 0 if invalid */
+static size_t
+utf8_len (const unsigned char * str)
+{
+  size_t len, i;
+
+  if (str[0] < 0x80)
+    return 1;
+  else if (str[0] >= 0xc2 && str[0] <= 0xdf)
+    len = 2;
+  else if (str[0] >= 0xe0 && str[0] <= 0xef)
+    len = 3;
+  else if (str[0] >= 0xf0 && str[0] <= 0xf4)
+    len = 4;
+  else
+    return 0;
+  for (i = 1; i < len; i++)
+    if ((str[i] & 0xc0) != 0x80)
+      return 0;
+  return len;
+}
+
+/**
+   @brief Escapes a String
+   @details Control characters and backslashes never reach the output
+   as is. Quoted strings also escape quotes, while unquoted text
+   escapes '=' instead so a message can not be mistaken for a field.
+   Multibyte characters are copied whole and invalid UTF-8 is replaced
+   by U+FFFD, so a cut string is still valid UTF-8.
+**/
+static void
+put_esc (struct _log_buf_t * buf, const char * str, int quoted)
+{
+  char esc[8];
+  size_t i, len;
+
+  for (i = 0; str[i] != '\0' && !buf->cut; i++)
+    switch (str[i])
+      {
+      case '"':
+        quoted ? put (buf, "\\\"", 2) : put (buf, "\"", 1);
+        break;
+      case '\\':
+        put (buf, "\\\\", 2);
+        break;
+      case '\n':
+        put (buf, "\\n", 2);
+        break;
+      case '\r':
+        put (buf, "\\r", 2);
+        break;
+      case '\t':
+        put (buf, "\\t", 2);
+        break;
+      case '=':
+        quoted ? put (buf, "=", 1) : put (buf, "\\=", 2);
+        break;
+      default:
+        if ((unsigned char)str[i] < 0x20)
+          put (buf, esc, snprintf (esc, sizeof (esc), "\\u%04x", str[i]));
+        else if ((len = utf8_len ((const unsigned char*)str + i)) == 0)
+          put (buf, "\xef\xbf\xbd", 3);
+        else
+          {
+            put (buf, str + i, len);
+            i += len - 1;
+          }
+      }
+}
+
+/* Checks whether a text value has to be quoted to stay one field */
+static int
+needs_quote (const char * str)
+{
+  if (str[0] == '\0')
+    return 1;
+  for (; *str != '\0'; str++)
+    if ((unsigned char)*str <= ' ' || *str == '"' || *str == '=' ||
+        *str == '\\')
+      return 1;
+  return 0;
+}
+
+/* Writes a string value, a value which does not fit is ended early */
+static void
+put_str (struct _log_buf_t * buf, const char * str, log_format_t format)
+{
+  size_t start = buf->pos;
+  int quoted;
+
+  if (str == NULL)
+    str = "(null)";
+
+  /* Text values are only quoted when they would be ambiguous */
+  quoted = format == LOG_FORMAT_JSON || needs_quote (str);
+  if (quoted)
+    put (buf, "\"", 1);
+  if (buf->cut)
+    return;
+  put_esc (buf, str, quoted);
+
+  /* Nothing of the value fit, leave it to the caller to drop */
+  if (buf->cut && buf->pos == start + quoted)
+    {
+      buf->pos = start;
+      return;
+    }
+  if (buf->cut)
+    put_raw (buf, ELLIPSIS, sizeof (ELLIPSIS) - 1);
+  if (quoted)
+    put_raw (buf, "\"", 1);
+}
+
+/* Writes a number value */
+static void
+put_num (struct _log_buf_t * buf, const char * fmt, ...)
+{
+  char num[32];
+  va_list args;
+  int len;
+
+  va_start (args, fmt);
+  len = vsnprintf (num, sizeof (num), fmt, args);
+  va_end (args);
+  put (buf, num, len);
+}
+
+static size_t
+log_format (struct _log_stamp_t * stamp, log_level_t level,
+            const char * msg, va_list args, char * out)
+{
+  log_format_t format = logger.format;
+  struct _log_buf_t buf = { out, 0, 0 };
+  struct timespec ts;
+  struct tm tm;
+  log_field_t field;
+  char num[32];
+  size_t mark, val;
+
+  /* Refresh the timestamp prefix once a second */
+  clock_gettime (CLOCK_REALTIME, &ts);
+  if (ts.tv_sec != stamp->sec)
+    {
+      gmtime_r (&ts.tv_sec, &tm);
+      strftime (stamp->str, sizeof (stamp->str), "%Y-%m-%dT%H:%M:%S", &tm);
+      stamp->sec = ts.tv_sec;
+    }
+  snprintf (num, sizeof (num), ".%03ldZ", ts.tv_nsec / 1000000);
+
+  /* Common message header */
+  if (format == LOG_FORMAT_JSON)
+    {
+      put (&buf, "{\"time\":\"", 9);
+      put (&buf, stamp->str, strlen (stamp->str));
+      put (&buf, num, strlen (num));
+      put (&buf, "\",\"level\":\"", 11);
+      put (&buf, LEVEL_JSON[level], strlen (LEVEL_JSON[level]));
+      put (&buf, "\",\"msg\":", 8);
+      put_str (&buf, msg, format);
+    }
+  else
+    {
+      put (&buf, stamp->str, strlen (stamp->str));
+      put (&buf, num, strlen (num));
+      put (&buf, " ", 1);
+      put (&buf, LEVEL_STR[level], strlen (LEVEL_STR[level]));
+      put (&buf, " ", 1);
+      put_esc (&buf, msg, 0);
+      if (buf.cut)
+        put_raw (&buf, ELLIPSIS, sizeof (ELLIPSIS) - 1);
+    }
+
+  /* Append each of the fields, a field which does not fit at all is
+     left out */
+  for (field = va_arg (args, log_field_t);
+       field.type != LOG_FIELD_END && !buf.cut;
+       field = va_arg (args, log_field_t))
+    {
+      mark = buf.pos;
+      if (format == LOG_FORMAT_JSON)
+        {
+          put (&buf, ",", 1);
+          put_str (&buf, field.key, format);
+          put (&buf, ":", 1);
+        }
+      else
+        {
+          put (&buf, " ", 1);
+          put_esc (&buf, field.key, 0);
+          put (&buf, "=", 1);
+        }
+      val = buf.pos;
+      switch (buf.cut ? LOG_FIELD_END : field.type)
+        {
+        case LOG_FIELD_STR:
+          put_str (&buf, field.val.s, format);
+          break;
+        case LOG_FIELD_INT:
+          put_num (&buf, "%lld", (long long)field.val.i);
+          break;
+        case LOG_FIELD_UINT:
+          put_num (&buf, "%llu", (unsigned long long)field.val.u);
+          break;
+        case LOG_FIELD_DBL:
+          /* JSON has no inf or nan */
+          if (format == LOG_FORMAT_JSON && !isfinite (field.val.d))
+            put (&buf, "null", 4);
+          else
+            put_num (&buf, "%g", field.val.d);
+          break;
+        case LOG_FIELD_END:
+          break;
+        }
+
+      /* Only a string value which was partly written may be ended
+         early, anything else is left out whole */
+      if (buf.cut && (field.type != LOG_FIELD_STR || buf.pos == val))
+        buf.pos = mark;
+    }
+
+  if (buf.cut)
+    {
+      if (format == LOG_FORMAT_JSON)
+        put_raw (&buf, ",\"truncated\":true", 17);
+      else
+        put_raw (&buf, " truncated=true", 15);
+    }
+  if (format == LOG_FORMAT_JSON)
+    put_raw (&buf, "}", 1);
+  put_raw (&buf, "\n", 1);
+
+  return buf.pos;
+}
+
+static size_t
+log_line (struct _log_stamp_t * stamp, char * out, log_level_t level,
+          const char * msg, ...)
+{
+  va_list args;
+  size_t len;
+
+  va_start (args, msg);
+  len = log_format (stamp, level, msg, args, out);
+  va_end (args);
+
+  return len;
+}
+
+static void
+ring_release (void * arg)
+{
+  struct _log_ring_t * ring = (struct _log_ring_t*) arg;
+
+  /* The writer frees the ring once it has been drained */
+  __atomic_store_n (&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct _log_ring_t *
+ring_get (void)
+{
+  struct _log_ring_t * ring;
+
+  if (local_ring != NULL)
+    return local_ring;
+
+  ring = (struct _log_ring_t*) calloc (1, sizeof (struct _log_ring_t));
+  if (ring == NULL)
+    return NULL;
+
+  /* Register the ring with the writer */
+  pthread_mutex_lock (&logger.lock);
+  ring->next = logger.rings;
+  logger.rings = ring;
+  pthread_mutex_unlock (&logger.lock);
+  pthread_setspecific (logger.key, ring);
+
+  local_ring = ring;
+  return ring;
+}
+
+static int
+write_iov (int fd, struct iovec * iov, int cnt)
+{
+  ssize_t ret;
+
+  while (cnt > 0)
+    {
+      ret = writev (fd, iov, cnt);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+
+      /* Skip past whatever was written */
+      while (cnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+          ret -= iov->iov_len;
+          iov++;
+          cnt--;
+        }
+      if (cnt > 0)
+        {
+          iov->iov_base = (uint8_t*)iov->iov_base + ret;
+          iov->iov_len -= ret;
+        }
+    }
+
+  return 0;
+}
+
+/**
+   @brief Writes out Every Ring
+   @details Runs without the lock. Threads only ever push new rings
+   onto the front of the list and only the writer unlinks them, so the
+   part of the list being walked never changes underneath it.
+**/
+static void
+log_drain (struct _log_ring_t * list)
+{
+  struct _log_ring_t * ring, * batch[IOV_BATCH/2];
+  struct _log_stamp_t stamp = { 0 };
+  struct iovec iov[IOV_BATCH];
+  size_t heads[IOV_BATCH/2], head, tail, off, len, i, rings;
+  uint64_t dropped = 0;
+  char line[MSG_MAX];
+  int cnt;
+
+  ring = list;
+  while (ring != NULL)
+    {
+      /* Gather up to a batch worth of rings into the iovec */
+      cnt = 0;
+      rings = 0;
+      for (; ring != NULL && rings < IOV_BATCH/2; ring = ring->next)
+        {
+          dropped += __atomic_exchange_n (&ring->dropped, 0, __ATOMIC_RELAXED);
+          head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+          tail = ring->tail;
+          if (head == tail)
+            continue;
+
+          /* The data may wrap around the end of the ring */
+          off = tail & (RING_SIZE - 1);
+          len = head - tail;
+          if (off + len > RING_SIZE)
+            {
+              iov[cnt].iov_base = ring->data + off;
+              iov[cnt++].iov_len = RING_SIZE - off;
+              iov[cnt].iov_base = ring->data;
+              iov[cnt++].iov_len = len - (RING_SIZE - off);
+            }
+          else
+            {
+              iov[cnt].iov_base = ring->data + off;
+              iov[cnt++].iov_len = len;
+            }
+          batch[rings] = ring;
+          heads[rings++] = head;
+        }
+
+      /* Write the batch and hand the space back to the owners */
+      if (cnt > 0)
+        write_iov (logger.fd, iov, cnt);
+      for (i = 0; i < rings; i++)
+        __atomic_store_n (&batch[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+
+  /* Report anything which had to be thrown away */
+  if (dropped > 0)
+    {
+      iov[0].iov_base = line;
+      iov[0].iov_len = log_line (&stamp, line, LOG_LEVEL_WARN,
+                                 "Dropped log messages",
+                                 LOG_UINT ("count", dropped), LOG_END);
+      write_iov (logger.fd, iov, 1);
+    }
+}
+
+/* Frees the rings of exited threads once they are empty, under the lock */
+static void
+log_reap (void)
+{
+  struct _log_ring_t * ring, ** prev;
+
+  prev = &logger.rings;
+  while (*prev != NULL)
+    {
+      ring = *prev;
+      if (__atomic_load_n (&ring->dead, __ATOMIC_ACQUIRE) &&
+          __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+        {
+          *prev = ring->next;
+          free (ring);
+        }
+      else
+        prev = &ring->next;
+    }
+}
+
+static void *
+log_writer (void * arg)
+{
+  struct _log_ring_t * rings;
+  struct timespec ts;
+  int stop;
+
+  pthread_mutex_lock (&logger.lock);
+  do
+    {
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_nsec += FLUSH_MS * 1000000;
+      if (ts.tv_nsec >= 1000000000)
+        {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000;
+        }
+      if (!logger.stop)
+        pthread_cond_timedwait (&logger.cond, &logger.lock, &ts);
+
+      /* Registering threads only wait for the list head, not the write */
+      stop = logger.stop;
+      rings = logger.rings;
+      pthread_mutex_unlock (&logger.lock);
+      log_drain (rings);
+      pthread_mutex_lock (&logger.lock);
+      log_reap ();
+    }
+  while (!stop);
+  pthread_mutex_unlock (&logger.lock);
+
+  return NULL;
+}
+
+log_err_t
+log_init (int fd, log_format_t format, log_level_t level, size_t rate)
+{
+  logger.fd = fd;
+  logger.format = format;
+  logger.rate = rate;
+  logger.stop = 0;
+  logger.rings = NULL;
+  log_level = level;
+
+  if (pthread_key_create (&logger.key, ring_release) != 0)
+    return LOG_MALLOC_FAILED;
+  if (pthread_create (&logger.writer, NULL, log_writer, NULL) != 0)
+    {
+      pthread_key_delete (logger.key);
+      return LOG_THREAD_FAILED;
+    }
+  __atomic_store_n (&logger.running, 1, __ATOMIC_RELEASE);
+
+  return LOG_OK;
+}
+
+void
+log_write (log_level_t level, const char * msg, ...)
+{
+  struct _log_stamp_t stamp = { 0 };
+  struct _log_ring_t * ring;
+  char line[MSG_MAX];
+  va_list args;
+  size_t len, used, off;
+  ssize_t ret;
+  time_t now;
+
+  /* Write synchronously when the writer is not running */
+  if (!__atomic_load_n (&logger.running, __ATOMIC_ACQUIRE) ||
+      (ring = ring_get ()) == NULL)
+    {
+      va_start (args, msg);
+      len = log_format (&stamp, level, msg, args, line);
+      va_end (args);
+      ret = write (STDERR_FILENO, line, len);
+      (void) ret;
+      return;
+    }
+
+  /* Enforce the per thread rate limit */
+  if (logger.rate > 0)
+    {
+      now = time (NULL);
+      if (now != ring->window)
+        {
+          ring->window = now;
+          ring->count = 0;
+        }
+      if (++ring->count > logger.rate)
+        {
+          __atomic_add_fetch (&ring->dropped, 1, __ATOMIC_RELAXED);
+          return;
+        }
+    }
+
+  va_start (args, msg);
+  len = log_format (&ring->stamp, level, msg, args, line);
+  va_end (args);
+
+  /* Never block on the writer, drop the message instead */
+  used = ring->head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (used + len > RING_SIZE)
+    {
+      __atomic_add_fetch (&ring->dropped, 1, __ATOMIC_RELAXED);
+      pthread_cond_signal (&logger.cond);
+      return;
+    }
+
+  /* Copy the message in, wrapping around the end of the ring */
+  off = ring->head & (RING_SIZE - 1);
+  if (off + len > RING_SIZE)
+    {
+      memcpy (ring->data + off, line, RING_SIZE - off);
+      memcpy (ring->data, line + RING_SIZE - off, len - (RING_SIZE - off));
+    }
+  else
+    memcpy (ring->data + off, line, len);
+  __atomic_store_n (&ring->head, ring->head + len, __ATOMIC_RELEASE);
+
+  /* Wake the writer early once the ring starts to fill */
+  if (used + len > RING_SIZE/2)
+    pthread_cond_signal (&logger.cond);
+}
+
+log_err_t
+log_destroy (void)
+{
+  struct _log_ring_t * ring;
+
+  if (!__atomic_load_n (&logger.running, __ATOMIC_ACQUIRE))
+    return LOG_OK;
+
+  /* Stop accepting messages and drain what is left */
+  __atomic_store_n (&logger.running, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock (&logger.lock);
+  logger.stop = 1;
+  pthread_cond_signal (&logger.cond);
+  pthread_mutex_unlock (&logger.lock);
+  pthread_join (logger.writer, NULL);
+
+  /* Free every ring still registered */
+  while (logger.rings != NULL)
+    {
+      ring = logger.rings;
+      logger.rings = ring->next;
+      free (ring);
+    }
+  local_ring = NULL;
+  pthread_setspecific (logger.key, NULL);
+  pthread_key_delete (logger.key);
+
+  return LOG_OK;
+}
+
+const char *
+log_err_str (log_err_t err)
+{
+  switch (err)
+    {
+    case LOG_OK:
+      return "Success";
+    case LOG_MALLOC_FAILED:
+      return "Malloc Failed";
+    case LOG_THREAD_FAILED:
+      return "Failed to Start the Writer Thread";
+    case LOG_UNKNOWN:
+      return "Unknown Cause of Error";
+    }
+
+  return "Undefined Error Code";
+}
@@ -0,0 +1,181 @@
+/**
+   @file log.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Asynchronous Structured Logging
+   @details Leveled log messages carrying typed key value fields. Each
+   thread formats its messages into a private ring buffer and a single
+   background writer drains every ring in batches with writev, so
+   threads never contend on a shared stream lock. Messages below
+   LOG_MIN_LEVEL are compiled out entirely.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+   @brief Log Levels
+**/
+typedef enum _log_level_t
+  {
+    LOG_LEVEL_TRACE = 0, /**< Very verbose tracing */
+    LOG_LEVEL_DEBUG, /**< Debugging information */
+    LOG_LEVEL_INFO, /**< Normal operational messages */
+    LOG_LEVEL_WARN, /**< Recoverable problems */
+    LOG_LEVEL_ERROR, /**< Failures */
+    LOG_LEVEL_NONE /**< Disables all logging */
+  } log_level_t;
+
+/**
+   @brief Minimum Compiled Level
+   @details Log statements below this level are removed at compile
+   time. Override it with -DLOG_MIN_LEVEL=LOG_LEVEL_INFO in CPPFLAGS.
+**/
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_TRACE
+#endif
+
+/**
+   @brief Log Output Formats
+**/
+typedef enum _log_format_t
+  {
+    LOG_FORMAT_TEXT = 0, /**< Human readable key=value lines, escaped */
+    LOG_FORMAT_JSON /**< One JSON object per line, inf and nan as null */
+  } log_format_t;
+
+/**
+   @brief Log Error Codes
+**/
+typedef enum _log_err_t
+  {
+    LOG_OK = 0, /**< Success */
+    LOG_MALLOC_FAILED, /**< Allocating Memory Failed */
+    LOG_THREAD_FAILED, /**< The writer thread could not be started */
+    LOG_UNKNOWN /**< Unknown Error */
+  } log_err_t;
+
+/**
+   @brief Log Field Types
+**/
+typedef enum _log_field_type_t
+  {
+    LOG_FIELD_END = 0, /**< Terminates the field list */
+    LOG_FIELD_STR, /**< String value */
+    LOG_FIELD_INT, /**< Signed integer value */
+    LOG_FIELD_UINT, /**< Unsigned integer value */
+    LOG_FIELD_DBL /**< Floating point value */
+  } log_field_type_t;
+
+/**
+   @brief Structured Key Value Field
+**/
+typedef struct _log_field_t
+{
+  const char * key; /**< Name of the field */
+  log_field_type_t type; /**< Type of the value */
+  union
+  {
+    const char * s;
+    int64_t i;
+    uint64_t u;
+    double d;
+  } val; /**< The value */
+} log_field_t;
+
+#define LOG_STR(k, v) ((log_field_t){ (k), LOG_FIELD_STR, { .s = (v) } })
+#define LOG_INT(k, v) ((log_field_t){ (k), LOG_FIELD_INT, { .i = (v) } })
+#define LOG_UINT(k, v) ((log_field_t){ (k), LOG_FIELD_UINT, { .u = (v) } })
+#define LOG_DBL(k, v) ((log_field_t){ (k), LOG_FIELD_DBL, { .d = (v) } })
+#define LOG_END ((log_field_t){ NULL, LOG_FIELD_END, { .u = 0 } })
+
+/**
+   @brief Runtime Level
+   @details Messages below this level are discarded before they are
+   formatted.
+**/
+extern log_level_t log_level;
+
+/**
+   @brief Logs a Message
+   @details Takes the message followed by any number of LOG_STR,
+   LOG_INT, LOG_UINT or LOG_DBL fields, ie.
+   log_info ("Loaded configuration", LOG_STR ("file", path));
+**/
+#define LOG_AT(level, ...)                                              \
+  do                                                                    \
+    {                                                                   \
+      if ((level) >= LOG_MIN_LEVEL && (level) >= log_level)             \
+        log_write ((level), __VA_ARGS__, LOG_END);                      \
+    }                                                                   \
+  while (0)
+
+#define log_trace(...) LOG_AT (LOG_LEVEL_TRACE, __VA_ARGS__)
+#define log_debug(...) LOG_AT (LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG_AT (LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) LOG_AT (LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) LOG_AT (LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+   @brief Starts the Background Writer
+   @details Until this is called, and again after log_destroy, messages
+   are written synchronously to stderr.
+   @param fd The file descriptor the writer drains to
+   @param format The output format
+   @param level The runtime minimum level
+   @param rate The maximum number of messages per second each thread
+   may log, or 0 for unlimited. Messages over the limit are counted and
+   reported by the writer.
+   @return LOG_OK(0) on success or a positive error code
+**/
+log_err_t log_init (int fd, log_format_t format, log_level_t level,
+                    size_t rate);
+
+/**
+   @brief Formats and Queues a Message
+   @details Use the log_* macros rather than calling this directly.
+   Lines are at most 1024 bytes, a string value which does not fit is
+   ended with an ellipsis, later fields are left out and the line gets
+   a truncated=true field.
+   @param level The level of the message
+   @param msg The message string
+   @param ... Fields terminated by LOG_END
+**/
+void log_write (log_level_t level, const char * msg, ...);
+
+/**
+   @brief Stops the Background Writer
+   @details Drains every thread buffer, stops the writer and frees
+   the buffers. Every other thread must have stopped logging first.
+   @return LOG_OK(0) on success or a positive error code
+**/
+log_err_t log_destroy (void);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * log_err_str (log_err_t err);
+
+#endif
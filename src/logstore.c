@@ -0,0 +1,644 @@
+/**
+   @file logstore.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Compressed Build Log Storage
+   @details Stores captured job output as a series of independently
+   compressed chunks. A small index file records where each chunk
+   lives and the number of its first line, and every chunk carries a
+   bloom filter of the byte trigrams it contains. Tailing only
+   decompresses the last chunks and searching skips every chunk whose
+   filter rules out the pattern.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "logstore.h"
+#include "util.h"
+
+#define DEFAULT_CHUNK 262144
+#define MIN_CHUNK 4096
+#define LEVEL 3
+#define BLOOM_RATIO 32
+#define NAME_BUF 256
+#define MALLOC_FAILED "Malloc Failed\n"
+
+inline static void
+store_err (logstore_t * ls, char * err)
+{
+  if (ls->err != NULL)
+    free (ls->err);
+  ls->err = err;
+}
+
+inline static void
+bloom_bits (uint32_t tri, size_t bits, size_t * a, size_t * b)
+{
+  uint64_t h = (uint64_t)tri * 0x9e3779b97f4a7c15ull;
+
+  /* Double hashing from the two halves of the product */
+  *a = (h >> 32) % bits;
+  *b = ((h >> 32) + ((uint32_t)h | 1)) % bits;
+}
+
+static void
+bloom_build (uint8_t * bloom, size_t len, const uint8_t * data, size_t dlen)
+{
+  size_t i, a, b, bits = len << 3;
+  uint32_t tri;
+
+  memset (bloom, 0, len);
+  if (dlen < 3)
+    return;
+  tri = (uint32_t)data[0] << 8 | data[1];
+  for (i = 2; i < dlen; i++)
+    {
+      tri = (tri << 8 | data[i]) & 0xffffff;
+      bloom_bits (tri, bits, &a, &b);
+      bloom[a >> 3] |= 1 << (a & 7);
+      bloom[b >> 3] |= 1 << (b & 7);
+    }
+}
+
+static int
+bloom_test (const uint8_t * bloom, size_t len, const char * pat, size_t plen)
+{
+  const uint8_t * data = (const uint8_t*) pat;
+  size_t i, a, b, bits = len << 3;
+  uint32_t tri;
+
+  for (i = 2; i < plen; i++)
+    {
+      tri = (uint32_t)data[i-2] << 16 | (uint32_t)data[i-1] << 8 | data[i];
+      bloom_bits (tri, bits, &a, &b);
+      if (!(bloom[a >> 3] & (1 << (a & 7))) ||
+          !(bloom[b >> 3] & (1 << (b & 7))))
+        return 0;
+    }
+
+  return 1;
+}
+
+static size_t
+count_lines (const uint8_t * data, size_t len)
+{
+  const uint8_t * end = data + len;
+  size_t ret = 0;
+
+  while ((data = memchr (data, '\n', end - data)) != NULL)
+    {
+      ret++;
+      data++;
+    }
+
+  return ret;
+}
+
+static logstore_err_t
+scratch_reserve (logstore_t * ls, size_t len)
+{
+  uint8_t * tmp;
+
+  if (len <= ls->scratch_len)
+    return LOGSTORE_OK;
+  tmp = (uint8_t*) realloc (ls->scratch, len);
+  if (tmp == NULL)
+    {
+      store_err (ls, cpstr (MALLOC_FAILED));
+      return LOGSTORE_MALLOC_FAILED;
+    }
+  ls->scratch = tmp;
+  ls->scratch_len = len;
+
+  return LOGSTORE_OK;
+}
+
+static int
+pread_all (int fd, uint8_t * data, size_t len, uint64_t off)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = pread (fd, data, len, off);
+      if (ret <= 0)
+        {
+          if (ret < 0 && errno == EINTR)
+            continue;
+          return -1;
+        }
+      data += ret;
+      len -= ret;
+      off += ret;
+    }
+
+  return 0;
+}
+
+static int
+pwrite_all (int fd, const uint8_t * data, size_t len, uint64_t off)
+{
+  ssize_t ret;
+
+  while (len > 0)
+    {
+      ret = pwrite (fd, data, len, off);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data += ret;
+      len -= ret;
+      off += ret;
+    }
+
+  return 0;
+}
+
+static logstore_err_t
+chunk_seal (logstore_t * ls, size_t len)
+{
+  struct _logstore_chunk_t rec, * tmp;
+  size_t bound;
+  uLongf clen;
+  logstore_err_t ret;
+
+  /* Grow the in memory index */
+  if (ls->nchunks == ls->chunks_size)
+    {
+      tmp = (struct _logstore_chunk_t*)
+        realloc (ls->chunks, (ls->chunks_size*2 + 16) * sizeof (rec));
+      if (tmp == NULL)
+        {
+          store_err (ls, cpstr (MALLOC_FAILED));
+          return LOGSTORE_MALLOC_FAILED;
+        }
+      ls->chunks = tmp;
+      ls->chunks_size = ls->chunks_size*2 + 16;
+    }
+
+  /* Compress the chunk and build its filter behind it */
+  rec.bloom_len = ls->chunk_size / BLOOM_RATIO;
+  bound = compressBound (len);
+  ret = scratch_reserve (ls, bound + rec.bloom_len);
+  if (ret != LOGSTORE_OK)
+    return ret;
+  clen = bound;
+  if (compress2 (ls->scratch, &clen, ls->stage.data, len, LEVEL) != Z_OK)
+    {
+      store_err (ls, cpstr ("Compression Failed\n"));
+      return LOGSTORE_UNKNOWN;
+    }
+  bloom_build (ls->scratch + clen, rec.bloom_len, ls->stage.data, len);
+
+  rec.offset = ls->offset;
+  rec.first_line = ls->lines;
+  rec.clen = clen;
+  rec.ulen = len;
+  rec.lines = count_lines (ls->stage.data, len);
+
+  /* The data is on disk before the index points at it, so a crash
+     can only lose the chunk being sealed */
+  if (pwrite_all (ls->data_fd, ls->scratch, clen + rec.bloom_len,
+                  ls->offset) != 0 ||
+      fdatasync (ls->data_fd) != 0 ||
+      pwrite_all (ls->idx_fd, (uint8_t*)&rec, sizeof (rec),
+                  ls->nchunks * sizeof (rec)) != 0)
+    {
+      store_err (ls, cpstrf ("Write Failed: %s\n", strerror (errno)));
+      return LOGSTORE_IO_FAILED;
+    }
+
+  ls->chunks[ls->nchunks++] = rec;
+  ls->offset += clen + rec.bloom_len;
+  ls->lines += rec.lines;
+  ls->raw_bytes += len;
+  ls->stored_bytes += clen + rec.bloom_len;
+  buffer_shift (&ls->stage, len);
+
+  return LOGSTORE_OK;
+}
+
+static logstore_err_t
+chunk_read (logstore_t * ls, size_t idx, uint8_t ** out)
+{
+  struct _logstore_chunk_t * rec = &ls->chunks[idx];
+  uLongf ulen;
+  logstore_err_t ret;
+
+  /* Compressed data sits behind the decompressed output */
+  ret = scratch_reserve (ls, (size_t)rec->ulen + rec->clen);
+  if (ret != LOGSTORE_OK)
+    return ret;
+  if (pread_all (ls->data_fd, ls->scratch + rec->ulen, rec->clen,
+                 rec->offset) != 0)
+    {
+      store_err (ls, cpstrf ("Read Failed: %s\n", strerror (errno)));
+      return LOGSTORE_IO_FAILED;
+    }
+  ulen = rec->ulen;
+  if (uncompress (ls->scratch, &ulen, ls->scratch + rec->ulen,
+                  rec->clen) != Z_OK || ulen != rec->ulen)
+    {
+      store_err (ls, cpstrf ("Corrupt Chunk #%zu\n", idx));
+      return LOGSTORE_CORRUPT;
+    }
+  ls->chunks_read++;
+  *out = ls->scratch;
+
+  return LOGSTORE_OK;
+}
+
+/* Number of leading index records whose chunks were fully written,
+   the last one is decompressed to be sure */
+static size_t
+index_valid (logstore_t * ls, size_t n)
+{
+  struct _logstore_chunk_t * rec;
+  uint64_t end = 0, lines = 0;
+  struct stat st;
+  uint8_t * data;
+  size_t i;
+
+  if (fstat (ls->data_fd, &st) != 0)
+    return 0;
+  for (i = 0; i < n; i++)
+    {
+      rec = &ls->chunks[i];
+      if (rec->offset != end || rec->first_line != lines ||
+          rec->offset + rec->clen + rec->bloom_len > (uint64_t)st.st_size)
+        break;
+      end = rec->offset + rec->clen + rec->bloom_len;
+      lines += rec->lines;
+    }
+
+  /* A store sealed before the data was synced may end in a chunk
+     whose blocks never reached the disk */
+  ls->nchunks = i;
+  while (ls->nchunks > 0 &&
+         chunk_read (ls, ls->nchunks - 1, &data) == LOGSTORE_CORRUPT)
+    ls->nchunks--;
+  store_err (ls, NULL);
+  ls->chunks_read = 0;
+
+  return ls->nchunks;
+}
+
+logstore_err_t
+logstore_open (logstore_t * ls, const char * path, int write,
+               size_t chunk_size)
+{
+  struct _logstore_chunk_t * last;
+  struct stat st;
+  char buf[NAME_BUF], * name;
+  size_t n;
+
+  /* Initialize the struct */
+  ls->err = NULL;
+  ls->write = write;
+  ls->chunk_size = chunk_size > 0 ? chunk_size : DEFAULT_CHUNK;
+  if (ls->chunk_size < MIN_CHUNK)
+    ls->chunk_size = MIN_CHUNK;
+  ls->scratch = NULL;
+  ls->scratch_len = 0;
+  ls->chunks = NULL;
+  ls->nchunks = 0;
+  ls->chunks_size = 0;
+  ls->offset = 0;
+  ls->lines = 0;
+  ls->raw_bytes = 0;
+  ls->stored_bytes = 0;
+  ls->chunks_read = 0;
+  ls->data_fd = -1;
+  ls->idx_fd = -1;
+  ls->stage.data = NULL;
+  if (buffer_init (&ls->stage, ls->chunk_size,
+                   write ? ls->chunk_size : 0) != BUFF_OK)
+    {
+      store_err (ls, cpstr (MALLOC_FAILED));
+      return LOGSTORE_MALLOC_FAILED;
+    }
+
+  /* Open both halves of the store */
+  name = fmtstr (buf, sizeof (buf), "%s.dat", path);
+  if (name == NULL)
+    {
+      store_err (ls, cpstr (MALLOC_FAILED));
+      return LOGSTORE_MALLOC_FAILED;
+    }
+  ls->data_fd = open (name, write ? O_RDWR | O_CREAT | O_CLOEXEC :
+                      O_RDONLY | O_CLOEXEC, 0644);
+  if (name != buf)
+    free (name);
+  if (ls->data_fd >= 0)
+    {
+      name = fmtstr (buf, sizeof (buf), "%s.idx", path);
+      if (name == NULL)
+        {
+          store_err (ls, cpstr (MALLOC_FAILED));
+          return LOGSTORE_MALLOC_FAILED;
+        }
+      ls->idx_fd = open (name, write ? O_RDWR | O_CREAT | O_CLOEXEC :
+                         O_RDONLY | O_CLOEXEC, 0644);
+      if (name != buf)
+        free (name);
+    }
+  if (ls->data_fd < 0 || ls->idx_fd < 0)
+    {
+      store_err (ls, cpstrf ("Invalid Log Store: %s: %s\n", path,
+                             strerror (errno)));
+      return LOGSTORE_NO_FILE;
+    }
+
+  /* Load the index, ignoring a partially written trailing record */
+  if (fstat (ls->idx_fd, &st) != 0)
+    {
+      store_err (ls, cpstrf ("Stat Failed: %s\n", strerror (errno)));
+      return LOGSTORE_IO_FAILED;
+    }
+  n = st.st_size / sizeof (struct _logstore_chunk_t);
+  if (n > 0)
+    {
+      ls->chunks = (struct _logstore_chunk_t*)
+        malloc (n * sizeof (struct _logstore_chunk_t));
+      if (ls->chunks == NULL)
+        {
+          store_err (ls, cpstr (MALLOC_FAILED));
+          return LOGSTORE_MALLOC_FAILED;
+        }
+      ls->chunks_size = n;
+      if (pread_all (ls->idx_fd, (uint8_t*)ls->chunks,
+                     n * sizeof (struct _logstore_chunk_t), 0) != 0)
+        {
+          store_err (ls, cpstrf ("Read Failed: %s\n", strerror (errno)));
+          return LOGSTORE_IO_FAILED;
+        }
+      n = index_valid (ls, n);
+    }
+  if (n > 0)
+    {
+      last = &ls->chunks[n-1];
+      ls->offset = last->offset + last->clen + last->bloom_len;
+      ls->lines = last->first_line + last->lines;
+    }
+
+  /* Drop anything a crashed writer left behind the last record */
+  if (write &&
+      (ftruncate (ls->idx_fd, n * sizeof (struct _logstore_chunk_t)) != 0 ||
+       ftruncate (ls->data_fd, ls->offset) != 0))
+    {
+      store_err (ls, cpstrf ("Truncate Failed: %s\n", strerror (errno)));
+      return LOGSTORE_IO_FAILED;
+    }
+
+  return LOGSTORE_OK;
+}
+
+logstore_err_t
+logstore_write (logstore_t * ls, const void * data, size_t len)
+{
+  const uint8_t * ptr = (const uint8_t*) data, * nl;
+  size_t take;
+  logstore_err_t ret;
+
+  if (!ls->write)
+    return LOGSTORE_READ_ONLY;
+
+  while (len > 0)
+    {
+      /* Stage up to a full chunk */
+      take = ls->chunk_size - ls->stage.len;
+      if (take > len)
+        take = len;
+      buffer_add (&ls->stage, (void*)ptr, take);
+      ptr += take;
+      len -= take;
+      if (ls->stage.len < ls->chunk_size)
+        break;
+
+      /* Seal on the last line boundary so lines never span chunks */
+      nl = memrchr (ls->stage.data, '\n', ls->stage.len);
+      ret = chunk_seal (ls, nl != NULL ? (size_t)(nl - ls->stage.data) + 1 :
+                        ls->stage.len);
+      if (ret != LOGSTORE_OK)
+        return ret;
+    }
+
+  return LOGSTORE_OK;
+}
+
+logstore_err_t
+logstore_flush (logstore_t * ls)
+{
+  if (!ls->write)
+    return LOGSTORE_READ_ONLY;
+  if (ls->stage.len == 0)
+    return LOGSTORE_OK;
+  return chunk_seal (ls, ls->stage.len);
+}
+
+logstore_err_t
+logstore_tail (logstore_t * ls, size_t count, buffer_t * out)
+{
+  buffer_t text;
+  uint8_t * data;
+  size_t i, j, nl, pos;
+  logstore_err_t ret = LOGSTORE_OK;
+
+  if (count == 0)
+    return LOGSTORE_OK;
+
+  /* Find the first chunk holding one of the last count lines */
+  nl = count_lines (ls->stage.data, ls->stage.len);
+  for (i = ls->nchunks; i > 0 && nl <= count; i--)
+    nl += ls->chunks[i-1].lines;
+
+  /* Collect the text of those chunks and the staged output */
+  if (buffer_init (&text, 0, 0) != BUFF_OK)
+    {
+      store_err (ls, cpstr (MALLOC_FAILED));
+      return LOGSTORE_MALLOC_FAILED;
+    }
+  for (j = i; j < ls->nchunks; j++)
+    {
+      ret = chunk_read (ls, j, &data);
+      if (ret != LOGSTORE_OK)
+        {
+          buffer_destroy (&text);
+          return ret;
+        }
+      buffer_add (&text, data, ls->chunks[j].ulen);
+    }
+  buffer_add (&text, ls->stage.data, ls->stage.len);
+
+  /* Walk back over count line endings, ignoring the final newline */
+  pos = text.len;
+  if (pos > 0 && text.data[pos-1] == '\n')
+    pos--;
+  for (nl = 0; pos > 0; pos--)
+    if (text.data[pos-1] == '\n' && ++nl == count)
+      break;
+
+  if (buffer_add (out, text.data + pos, text.len - pos) != BUFF_OK)
+    {
+      store_err (ls, cpstr (MALLOC_FAILED));
+      ret = LOGSTORE_MALLOC_FAILED;
+    }
+  buffer_destroy (&text);
+
+  return ret;
+}
+
+static int
+search_text (const uint8_t * data, size_t len, uint64_t line,
+             const char * pat, size_t plen, logstore_match_t match,
+             void * arg)
+{
+  const uint8_t * pos = data, * end = data + len, * hit, * st, * fin;
+
+  while ((hit = memmem (pos, end - pos, pat, plen)) != NULL)
+    {
+      /* Expand the hit to the line around it */
+      st = memrchr (data, '\n', hit - data);
+      st = st != NULL ? st + 1 : data;
+      fin = memchr (hit, '\n', end - hit);
+      if (fin == NULL)
+        fin = end;
+
+      line += count_lines (pos, st - pos);
+      if (match (arg, line, (const char*)st, fin - st) != 0)
+        return 1;
+
+      /* Only report each line once */
+      if (fin == end)
+        break;
+      pos = fin + 1;
+      line++;
+    }
+
+  return 0;
+}
+
+logstore_err_t
+logstore_search (logstore_t * ls, const char * pattern,
+                 logstore_match_t match, void * arg)
+{
+  struct _logstore_chunk_t * rec;
+  uint8_t * data;
+  size_t i, plen = strlen (pattern);
+  logstore_err_t ret;
+
+  if (plen == 0)
+    return LOGSTORE_OK;
+
+  for (i = 0; i < ls->nchunks; i++)
+    {
+      rec = &ls->chunks[i];
+
+      /* Consult the filter before paying for decompression */
+      if (plen >= 3 && rec->bloom_len > 0)
+        {
+          ret = scratch_reserve (ls, rec->bloom_len);
+          if (ret != LOGSTORE_OK)
+            return ret;
+          if (pread_all (ls->data_fd, ls->scratch, rec->bloom_len,
+                         rec->offset + rec->clen) != 0)
+            {
+              store_err (ls, cpstrf ("Read Failed: %s\n", strerror (errno)));
+              return LOGSTORE_IO_FAILED;
+            }
+          if (!bloom_test (ls->scratch, rec->bloom_len, pattern, plen))
+            continue;
+        }
+
+      ret = chunk_read (ls, i, &data);
+      if (ret != LOGSTORE_OK)
+        return ret;
+      if (search_text (data, rec->ulen, rec->first_line, pattern, plen,
+                       match, arg))
+        return LOGSTORE_OK;
+    }
+
+  search_text (ls->stage.data, ls->stage.len, ls->lines, pattern, plen,
+               match, arg);
+
+  return LOGSTORE_OK;
+}
+
+const char *
+logstore_get_err (logstore_t * ls)
+{
+  return ls->err;
+}
+
+logstore_err_t
+logstore_close (logstore_t * ls)
+{
+  logstore_err_t ret = LOGSTORE_OK;
+
+  if (ls->write && ls->data_fd >= 0 && ls->idx_fd >= 0)
+    ret = logstore_flush (ls);
+
+  if (ls->data_fd >= 0)
+    close (ls->data_fd);
+  if (ls->idx_fd >= 0)
+    close (ls->idx_fd);
+  if (ls->scratch != NULL)
+    free (ls->scratch);
+  if (ls->chunks != NULL)
+    free (ls->chunks);
+  if (ls->err != NULL)
+    free (ls->err);
+  buffer_destroy (&ls->stage);
+
+  return ret;
+}
+
+const char *
+logstore_err_str (logstore_err_t err)
+{
+  switch (err)
+    {
+    case LOGSTORE_OK:
+      return "Success";
+    case LOGSTORE_NO_FILE:
+      return "Log Store does not Exist";
+    case LOGSTORE_MALLOC_FAILED:
+      return "Malloc Failed";
+    case LOGSTORE_IO_FAILED:
+      return "Log Store I/O Failed";
+    case LOGSTORE_CORRUPT:
+      return "Log Store is Corrupt";
+    case LOGSTORE_READ_ONLY:
+      return "Log Store is Read Only";
+    case LOGSTORE_UNKNOWN:
+      return "Unknown Cause of Error";
+    }
+
+  return "Undefined Error Code";
+}
@@ -0,0 +1,189 @@
+/**
+   @file logstore.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Compressed Build Log Storage
+   @details Stores captured job output as a series of independently
+   compressed chunks. A small index file records where each chunk
+   lives and the number of its first line, and every chunk carries a
+   bloom filter of the byte trigrams it contains. Tailing only
+   decompresses the last chunks and searching skips every chunk whose
+   filter rules out the pattern.
+
+   A store named path is kept in two files, path.dat holding the
+   compressed chunks followed by their filters and path.idx holding
+   fixed size chunk records in host byte order.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOGSTORE_H_
+#define _LOGSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/**
+   @brief Log Store Error Codes
+**/
+typedef enum _logstore_err_t
+  {
+    LOGSTORE_OK = 0, /**< Success */
+    LOGSTORE_NO_FILE, /**< The store could not be opened */
+    LOGSTORE_MALLOC_FAILED, /**< Allocating Memory Failed */
+    LOGSTORE_IO_FAILED, /**< Reading or writing the store failed */
+    LOGSTORE_CORRUPT, /**< The store contents are invalid */
+    LOGSTORE_READ_ONLY, /**< The store was not opened for writing */
+    LOGSTORE_UNKNOWN /**< Unknown Error */
+  } logstore_err_t;
+
+/**
+   @brief Chunk Index Record
+**/
+struct _logstore_chunk_t
+{
+  uint64_t offset; /**< Offset of the chunk in the data file */
+  uint64_t first_line; /**< Line number of the first byte */
+  uint32_t clen; /**< Compressed length */
+  uint32_t ulen; /**< Uncompressed length */
+  uint32_t lines; /**< Number of newlines in the chunk */
+  uint32_t bloom_len; /**< Length of the filter after the chunk */
+};
+
+/**
+   @brief Search Callback
+   @details Called for every line containing the pattern.
+   @param arg The user argument passed to logstore_search
+   @param line The 0 based number of the line
+   @param data The contents of the line without the newline
+   @param len The length of the line
+   @return 0 to continue searching or non-zero to stop
+**/
+typedef int (*logstore_match_t) (void * arg, uint64_t line,
+                                 const char * data, size_t len);
+
+/**
+   @brief Log Store Structure
+**/
+typedef struct _logstore_t
+{
+  char * err; /**< Last Error String */
+  int data_fd; /**< Compressed chunk file */
+  int idx_fd; /**< Chunk index file */
+  int write; /**< Opened for appending */
+  size_t chunk_size; /**< Uncompressed size of a sealed chunk */
+  buffer_t stage; /**< Output not yet sealed into a chunk */
+  uint8_t * scratch; /**< Compression and decompression space */
+  size_t scratch_len; /**< Length of the scratch space */
+  struct _logstore_chunk_t * chunks; /**< Index of sealed chunks */
+  size_t nchunks; /**< Number of sealed chunks */
+  size_t chunks_size; /**< Allocated index entries */
+  uint64_t offset; /**< End of the data file */
+  uint64_t lines; /**< Newlines in every sealed chunk */
+  uint64_t raw_bytes; /**< Uncompressed bytes sealed */
+  uint64_t stored_bytes; /**< Bytes written to the data file */
+  uint64_t chunks_read; /**< Chunks decompressed by tail and search */
+} logstore_t;
+
+/**
+   @brief Opens a Log Store
+   @details Opening for writing creates the store if it does not
+   exist and appends to it otherwise. Index records are checked
+   against the data file and the last chunk is decompressed, so a
+   chunk a crash left partially written is discarded, along with
+   every record after it.
+   @param ls The store structure to be initialized
+   @param path The base path of the store files
+   @param write 1 to append to the store or 0 to only read it
+   @param chunk_size The uncompressed size of each chunk. Set this to
+   0 for the default.
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_open (logstore_t * ls, const char * path, int write,
+                              size_t chunk_size);
+
+/**
+   @brief Appends Output to the Store
+   @details Data is staged in memory and sealed a chunk at a time, so
+   the store never holds more than a chunk of the log. A sealed
+   chunk's data is synced to disk before its index record is written.
+   @param ls The store structure
+   @param data The output to append
+   @param len The length of the output
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_write (logstore_t * ls, const void * data,
+                               size_t len);
+
+/**
+   @brief Seals any Staged Output
+   @details Writes out whatever is staged as a final short chunk.
+   @param ls The store structure
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_flush (logstore_t * ls);
+
+/**
+   @brief Reads the Last Lines of the Log
+   @details Only the chunks holding the last lines are decompressed.
+   @param ls The store structure
+   @param count The number of lines to read
+   @param out An initialized buffer the lines are appended to
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_tail (logstore_t * ls, size_t count, buffer_t * out);
+
+/**
+   @brief Searches the Log for a Fixed String
+   @details Chunks whose trigram filter does not contain every trigram
+   of the pattern are skipped without being decompressed.
+   @param ls The store structure
+   @param pattern The string to search for
+   @param match Called for each matching line
+   @param arg Passed through to match
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_search (logstore_t * ls, const char * pattern,
+                                logstore_match_t match, void * arg);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param ls The store structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * logstore_get_err (logstore_t * ls);
+
+/**
+   @brief Closes the Log Store
+   @details Seals any staged output and frees the store.
+   @param ls The store structure to be destroyed
+   @return LOGSTORE_OK(0) on success or a positive error code
+**/
+logstore_err_t logstore_close (logstore_t * ls);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * logstore_err_str (logstore_err_t err);
+
+#endif
@@ -25,14 +25,452 @@
 */
 
 /* Useful Definitions */
-#define HELP_TXT "Usage: autobuild [--help]"
+#define HELP_TXT "Usage: autobuild [--help] [-c|--config FILE] [-v|--verbose] [--log-json]\n" \
+  "                 [-o|--set [SECTION.]KEY=VALUE]... [--simulate TRACE]\n" \
+  "                 [--cache-serve DIR] [--status|--shutdown] [--socket PATH]\n" \
+  "                 [--load]"
 #define SHORT_HELP "Try 'autobuild --help' for more information."
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "cache.h"
+#include "cachesrv.h"
 #include "conf.h"
+#include "ctl.h"
+#include "dblog.h"
+#include "dbpool.h"
+#include "history.h"
+#include "load.h"
+#include "log.h"
+#include "logstore.h"
 #include "opt.h"
+#include "sim.h"
+#include "util.h"
+
+#define LOG_RATE 10000
+#define ENV_PREFIX "AUTOBUILD_"
+
+/**
+   @brief Replays a Build Trace under each Policy
+   @param conf The parsed configuration
+   @param trace The path of the recorded trace
+   @return EXIT_SUCCESS on success or EXIT_FAILURE on failure.
+**/
+static int
+simulate (conf_t * conf, const char * trace)
+{
+  history_t hist;
+  sim_t sim;
+  runner_sim_t res;
+  runner_policy_t policy;
+  int ret = EXIT_SUCCESS;
+
+  /* Estimate from the same history a real build would */
+  if (history_open (&hist, conf->vals.history_file,
+                    conf->vals.history_alpha) != HISTORY_OK)
+    {
+      fprintf (stderr, "History Error: %s", history_get_err (&hist));
+      history_close (&hist);
+      return EXIT_FAILURE;
+    }
+
+  if (sim_init (&sim, conf, &hist, trace) != SIM_OK)
+    {
+      fprintf (stderr, "Simulation Error: %s", sim_get_err (&sim));
+      sim_destroy (&sim);
+      history_close (&hist);
+      return EXIT_FAILURE;
+    }
+  printf ("%-10s %12s %12s %12s %8s %10s\n", "policy", "makespan_ms",
+          "critical_ms", "work_ms", "util", "spec_wins");
+  for (policy = RUNNER_CRITICAL; policy <= RUNNER_FIFO; policy++)
+    {
+      if (sim_run (&sim, policy, &res) != SIM_OK)
+        {
+          fprintf (stderr, "Simulation Error: %s", sim_get_err (&sim));
+          ret = EXIT_FAILURE;
+          break;
+        }
+      printf ("%-10s %12llu %12llu %12llu %7.1f%% %6llu/%llu\n",
+              runner_policy_str (policy),
+              (unsigned long long)res.makespan_ms,
+              (unsigned long long)res.critical_ms,
+              (unsigned long long)res.work_ms,
+              res.makespan_ms > 0 ? 100.0 * res.busy_ms /
+              (res.makespan_ms * sim.runner.nworkers) : 0.0,
+              (unsigned long long)res.spec_wins,
+              (unsigned long long)res.speculated);
+    }
+
+  sim_destroy (&sim);
+  history_close (&hist);
+  return ret;
+}
+
+/**
+   @brief Opens the Database Log of the Build Output
+   @details The spill store named by DBLOG_SPILL is opened here and
+   stays open until close_output, so output the database can not take
+   always has somewhere to go.
+   @param conf The parsed configuration
+   @param dl The log structure to be initialized
+   @param spill The spill store structure to be opened
+   @return 1 on success or 0 after printing the error
+**/
+static int
+open_output (conf_t * conf, dblog_t * dl, logstore_t * spill)
+{
+  logstore_t * store = NULL;
+
+  if (conf->vals.dblog_spill != NULL)
+    {
+      if (logstore_open (spill, conf->vals.dblog_spill, 1, 0) != LOGSTORE_OK)
+        {
+          fprintf (stderr, "Log Store Error: %s", logstore_get_err (spill));
+          logstore_close (spill);
+          return 0;
+        }
+      store = spill;
+    }
+  if (dblog_init_conf (dl, conf, store) != DBLOG_OK)
+    {
+      fprintf (stderr, "Database Log Error: %s", dblog_get_err (dl));
+      dblog_destroy (dl);
+      if (store != NULL)
+        logstore_close (store);
+      return 0;
+    }
+
+  return 1;
+}
+
+/**
+   @brief Closes the Database Log of the Build Output
+   @details Gives the log its last chance to insert what is queued
+   before the spill store is closed.
+   @param conf The parsed configuration
+   @param dl The log opened by open_output
+   @param spill The spill store opened by open_output
+**/
+static void
+close_output (conf_t * conf, dblog_t * dl, logstore_t * spill)
+{
+  dblog_destroy (dl);
+  if (conf->vals.dblog_spill != NULL)
+    logstore_close (spill);
+}
+
+/**
+   @brief Checks the Database Answers
+   @param conf The parsed configuration, read for the DB_* keys
+   @return EXIT_SUCCESS on success or EXIT_FAILURE on failure.
+**/
+static int
+check_database (conf_t * conf)
+{
+  const dbpool_query_t query = { "SELECT 1", 0, NULL, NULL, 0 };
+  dbpool_t pool;
+  dbpool_err_t err;
+
+  err = dbpool_init_conf (&pool, conf, NULL);
+  if (err == DBPOOL_OK)
+    err = dbpool_exec (&pool, &query);
+  if (err != DBPOOL_OK)
+    fprintf (stderr, "Database Error: %s", dbpool_get_err (&pool) != NULL ?
+             dbpool_get_err (&pool) : dbpool_err_str (err));
+  else
+    log_info ("Connected to the database",
+              LOG_STR ("host", conf->vals.db_host),
+              LOG_STR ("db", conf->vals.db_db));
+  dbpool_destroy (&pool);
+
+  return err == DBPOOL_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+   @brief Runs a Generated Load through the Scheduler
+   @details With DB_TYPE set the output of the targets is streamed to
+   the database like a real build's, and with CACHE_URL set their
+   LOAD_ARTIFACTS are published to the cache.
+   @param conf The parsed configuration, read for the LOAD_* keys
+   @return EXIT_SUCCESS on success or EXIT_FAILURE on failure.
+**/
+static int
+load (conf_t * conf)
+{
+  load_t load;
+  load_report_t rep;
+  dblog_stats_t st;
+  cache_stats_t cst;
+  logstore_t spill;
+  cache_t cache;
+  dblog_t dl;
+  load_err_t err;
+  int db = conf->vals.db_type != NULL, cached = conf->vals.cache_url != NULL;
+
+  if (cached && cache_init_conf (&cache, conf) != CACHE_OK)
+    {
+      fprintf (stderr, "Cache Error: %s", cache_get_err (&cache));
+      cache_destroy (&cache);
+      return EXIT_FAILURE;
+    }
+  if (db && !open_output (conf, &dl, &spill))
+    {
+      if (cached)
+        cache_destroy (&cache);
+      return EXIT_FAILURE;
+    }
+  err = load_init (&load, conf);
+  if (err == LOAD_OK && db)
+    load.runner.log = &dl;
+  if (err == LOAD_OK && cached)
+    load.runner.cache = &cache;
+  if (err != LOAD_OK || load_run (&load, &rep) != LOAD_OK)
+    {
+      fprintf (stderr, "Load Error: %s", load_get_err (&load));
+      load_destroy (&load);
+      if (db)
+        close_output (conf, &dl, &spill);
+      if (cached)
+        cache_destroy (&cache);
+      return EXIT_FAILURE;
+    }
+
+  printf ("%-12s %llu jobs, %llu edges, %zu workers on %zu nodes, %s\n",
+          "load", (unsigned long long)rep.jobs,
+          (unsigned long long)rep.edges, rep.workers, rep.nodes,
+          runner_policy_str (load.runner.policy));
+  printf ("%-12s %.1fms, ideal %.1fms, critical %.1fms, work %.1fms\n",
+          "makespan", rep.makespan_us / 1e3, rep.ideal_us / 1e3,
+          rep.critical_us / 1e3, rep.work_us / 1e3);
+  printf ("%-12s %.1f%% busy, %llu speculated, %llu stolen, "
+          "%llu bytes written\n", "workers", rep.makespan_us > 0 ?
+          100.0 * rep.busy_us / (rep.makespan_us * rep.workers) : 0.0,
+          (unsigned long long)rep.speculated,
+          (unsigned long long)rep.stolen, (unsigned long long)rep.output);
+  printf ("%-12s mean %lluus, p50 %lluus, p99 %lluus, p99.9 %lluus, "
+          "max %lluus\n", "overhead",
+          (unsigned long long)rep.overhead_mean_us,
+          (unsigned long long)rep.overhead_p50_us,
+          (unsigned long long)rep.overhead_p99_us,
+          (unsigned long long)rep.overhead_p999_us,
+          (unsigned long long)rep.overhead_max_us);
+  if (db)
+    {
+      dblog_stats (&dl, &st);
+      printf ("%-12s %llu rows, %llu bytes, %llu spilled, %llu queued, "
+              "lag max %llums\n", "dblog", (unsigned long long)st.rows,
+              (unsigned long long)st.bytes, (unsigned long long)st.spilled,
+              (unsigned long long)st.queued,
+              (unsigned long long)st.lag_max_ms);
+    }
+  if (cached)
+    {
+      cache_stats (&cache, &cst);
+      printf ("%-12s %llu checked, %llu uploaded, %llu bytes, %llu sent, "
+              "%llu deduplicated, %llu failed\n", "cache",
+              (unsigned long long)cst.checks, (unsigned long long)cst.puts,
+              (unsigned long long)cst.uploaded,
+              (unsigned long long)cst.wire_sent,
+              (unsigned long long)cst.dedup_sent,
+              (unsigned long long)cst.failures);
+    }
+
+  load_destroy (&load);
+  if (db)
+    close_output (conf, &dl, &spill);
+  if (cached)
+    cache_destroy (&cache);
+  return EXIT_SUCCESS;
+}
+
+static cachesrv_t * serving;
+
+static void
+stop_serving (int sig)
+{
+  cachesrv_stop (serving);
+}
+
+static time_t serving_since;
+
+static int
+cmd_status (void * arg, const char * args, buffer_t * out)
+{
+  cachesrv_t * srv = (cachesrv_t*) arg;
+  char buf[512], * status;
+  size_t conns;
+  int ok;
+
+  pthread_mutex_lock (&srv->lock);
+  conns = srv->conns;
+  pthread_mutex_unlock (&srv->lock);
+  status = fmtstr (buf, sizeof (buf), "mode cache-serve\ndir %s\npid %d\n"
+                   "uptime_s %lld\nconns %zu\nrequests %llu\nstored %llu\n"
+                   "trees %llu\nbytes_in %llu\nbytes_out %llu\n",
+                   srv->dir, (int)getpid (),
+                   (long long)(time (NULL) - serving_since), conns,
+                   (unsigned long long)__atomic_load_n (&srv->requests,
+                                                        __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n (&srv->stored,
+                                                        __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n (&srv->trees,
+                                                        __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n (&srv->bytes_in,
+                                                        __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n (&srv->bytes_out,
+                                                        __ATOMIC_RELAXED));
+  ok = status != NULL && buffer_add (out, status, strlen (status)) == BUFF_OK;
+  if (status != buf)
+    free (status);
+
+  return ok ? 0 : 1;
+}
+
+static int
+cmd_stop (void * arg, const char * args, buffer_t * out)
+{
+  cachesrv_stop ((cachesrv_t*) arg);
+  return 0;
+}
+
+/**
+   @brief Finds the Control Socket of the Daemon
+   @param socket The --socket argument or NULL
+   @param conf The parsed configuration
+   @param buf Holds the default path if it is used
+   @param len The size of buf
+   @return The path of the socket
+**/
+static const char *
+control_path (const char * socket, conf_t * conf, char * buf, size_t len)
+{
+  if (socket != NULL)
+    return socket;
+  if (conf->vals.control_socket != NULL)
+    return conf->vals.control_socket;
+  return ctl_default_path (buf, len);
+}
+
+/**
+   @brief Sends a Request to the Running Daemon
+   @details Runs before logging starts. Unless --socket names the
+   socket it is found like any other key, the command line overrides
+   the environment which overrides the file, and a missing file only
+   leaves the default path.
+   @param opt The parsed command line
+   @param request The command to send
+   @return EXIT_SUCCESS on success or EXIT_FAILURE on failure.
+**/
+static int
+control (opt_t * opt, const char * request)
+{
+  char buf[CTL_PATH_MAX];
+  const char * path;
+  buffer_t reply;
+  conf_err_t cerr;
+  ctl_err_t err;
+  conf_t conf;
+  int have_conf = 0;
+
+  path = opt->socket;
+  if (path == NULL)
+    {
+      cerr = conf_init (&conf, opt->conf);
+      if (cerr == CONF_NO_FILE)
+        cerr = CONF_OK;
+      if (cerr == CONF_OK)
+        cerr = conf_overlay_env (&conf, ENV_PREFIX);
+      if (cerr == CONF_OK)
+        cerr = conf_overlay (&conf, "command line", opt->overrides,
+                             opt->noverrides);
+      if (cerr != CONF_OK)
+        {
+          fprintf (stderr, "Configuration Error: %s", conf_get_err (&conf));
+          conf_destroy (&conf);
+          return EXIT_FAILURE;
+        }
+      have_conf = 1;
+      path = control_path (NULL, &conf, buf, sizeof (buf));
+    }
+
+  buffer_init (&reply, 0, 0);
+  err = ctl_call (path, request, &reply);
+  if (err == CTL_OK || err == CTL_REFUSED)
+    fwrite (reply.data, 1, reply.len, err == CTL_OK ? stdout : stderr);
+  else
+    fprintf (stderr, "Control Error: %s: %s\n", path, ctl_err_str (err));
+  buffer_destroy (&reply);
+
+  if (have_conf)
+    conf_destroy (&conf);
+  return err == CTL_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+   @brief Serves a Directory as an Artifact Cache
+   @details Runs until interrupted or asked to stop over the control
+   socket.
+   @param conf The parsed configuration
+   @param dir The directory holding the blobs
+   @param socket The --socket argument or NULL
+   @return EXIT_SUCCESS on success or EXIT_FAILURE on failure.
+**/
+static int
+serve_cache (conf_t * conf, const char * dir, const char * socket)
+{
+  char buf[CTL_PATH_MAX];
+  struct sigaction sa;
+  cachesrv_t srv;
+  ctl_t ctl;
+  int ret = EXIT_SUCCESS;
+
+  if (cachesrv_init_conf (&srv, conf, dir) != CACHESRV_OK)
+    {
+      fprintf (stderr, "Cache Server Error: %s", cachesrv_get_err (&srv));
+      cachesrv_destroy (&srv);
+      return EXIT_FAILURE;
+    }
+
+  /* Answer --status and --shutdown from other invocations */
+  serving_since = time (NULL);
+  if (ctl_init (&ctl, control_path (socket, conf, buf, sizeof (buf))) !=
+      CTL_OK || ctl_add (&ctl, "status", "Shows the server counters",
+                         cmd_status, &srv) != CTL_OK ||
+      ctl_add (&ctl, "stop", "Stops the server", cmd_stop, &srv) != CTL_OK ||
+      ctl_start (&ctl) != CTL_OK)
+    {
+      fprintf (stderr, "Control Error: %s", ctl_get_err (&ctl));
+      ctl_destroy (&ctl);
+      cachesrv_destroy (&srv);
+      return EXIT_FAILURE;
+    }
+
+  serving = &srv;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = stop_serving;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+  if (cachesrv_run (&srv) != CACHESRV_OK)
+    {
+      fprintf (stderr, "Cache Server Error: Accepting connections failed\n");
+      ret = EXIT_FAILURE;
+    }
+  log_info ("Stopped serving the artifact cache",
+            LOG_UINT ("requests", srv.requests),
+            LOG_UINT ("stored", srv.stored),
+            LOG_UINT ("trees", srv.trees),
+            LOG_UINT ("bytes_in", srv.bytes_in),
+            LOG_UINT ("bytes_out", srv.bytes_out));
+
+  ctl_destroy (&ctl);
+  cachesrv_destroy (&srv);
+  return ret;
+}
 
 /**
    @brief AutoBuilder Entry Point
@@ -48,7 +486,7 @@ main (int argc, char ** argv)
   conf_err_t cerr;
   opt_t opt;
   opt_err_t oerr;
-  const char *db_type, *db_host, *db_port, *db_user, *db_pass, *db_db;
+  int ret;
 
   /* Parse the command line */
   oerr = opt_init(&opt, argc, argv, 1);
@@ -61,33 +499,79 @@ main (int argc, char ** argv)
   if (opt.help)
     {
       fprintf (stderr, "%s\n", HELP_TXT);
+      opt_destroy (&opt);
       return EXIT_SUCCESS;
     }
 
-  /* Parse the configuration */
+  /* Talk to the running daemon without starting anything here */
+  if (opt.status || opt.shutdown)
+    {
+      ret = control (&opt, opt.shutdown ? "stop" : "status");
+      opt_destroy (&opt);
+      return ret;
+    }
+
+  /* Start logging, each -v lowers the level by one */
+  log_init (STDERR_FILENO, opt.log_json ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT,
+            opt.verbose >= LOG_LEVEL_INFO ? LOG_LEVEL_TRACE :
+            LOG_LEVEL_INFO - opt.verbose, LOG_RATE);
+
+  /* Parse the configuration, the environment overrides the file and
+     the command line overrides both */
   cerr = conf_init (&conf, opt.conf);
+  if (cerr == CONF_OK)
+    cerr = conf_overlay_env (&conf, ENV_PREFIX);
+  if (cerr == CONF_OK)
+    cerr = conf_overlay (&conf, "command line", opt.overrides,
+                         opt.noverrides);
   if (cerr != CONF_OK)
     {
       fprintf (stderr, "Configuration Error: %s", conf_get_err (&conf));
       conf_destroy (&conf);
       opt_destroy (&opt);
+      log_destroy ();
       return EXIT_FAILURE;
     }
 
-  /* Read Database Options */
-  db_type = conf_get (&conf, "DB_TYPE");
-  db_host = conf_get (&conf, "DB_HOST");
-  db_port = conf_get (&conf, "DB_PORT");
-  db_user = conf_get (&conf, "DB_USER");
-  db_pass = conf_get (&conf, "DB_PASS");
-  db_db   = conf_get (&conf, "DB_DB");
+  /* Evaluate the scheduler offline instead of building */
+  if (opt.simulate != NULL)
+    {
+      ret = simulate (&conf, opt.simulate);
+      conf_destroy (&conf);
+      opt_destroy (&opt);
+      log_destroy ();
+      return ret;
+    }
+
+  /* Measure the scheduler on a synthetic graph instead of building */
+  if (opt.load)
+    {
+      ret = load (&conf);
+      conf_destroy (&conf);
+      opt_destroy (&opt);
+      log_destroy ();
+      return ret;
+    }
+
+  /* Share artifacts with other builders instead of building */
+  if (opt.cache_serve != NULL)
+    {
+      ret = serve_cache (&conf, opt.cache_serve, opt.socket);
+      conf_destroy (&conf);
+      opt_destroy (&opt);
+      log_destroy ();
+      return ret;
+    }
 
-  /* Connect to the database */
-  //db_connect (db_type, db_host, db_port, db_user, db_pass, db_db);
+  /* Make sure the database answers before anything relies on it */
+  ret = EXIT_SUCCESS;
+  if (conf.vals.db_type != NULL)
+    ret = check_database (&conf);
 
   /* Cleanup */
   conf_destroy (&conf);
   opt_destroy (&opt);
+  log_destroy ();
 
-  return EXIT_SUCCESS;
+  return ret;
 }
@@ -33,22 +33,42 @@
 
 #define DEFAULT_CONFIG "autobuild.conf"
 
-#define OPTS "-c:hW:"
+#define OPTS "-c:ho:vW:"
 const static struct option LONG_OPTS [] = {
   {"config", 1, NULL, 'c'},
   {"help", 0, NULL, 'h'},
+  {"verbose", 0, NULL, 'v'},
+  {"log-json", 0, NULL, 0},
+  {"simulate", 1, NULL, 0},
+  {"set", 1, NULL, 'o'},
+  {"cache-serve", 1, NULL, 0},
+  {"status", 0, NULL, 0},
+  {"shutdown", 0, NULL, 0},
+  {"socket", 1, NULL, 0},
+  {"load", 0, NULL, 0},
   {0, 0, 0, 0}
 };
 
 opt_err_t
 opt_init (opt_t * opt, size_t count, char ** args, int err)
 {
+  const char ** tmp;
   int ret, idx;
 
   /* Initialize the Default Options */
   opt->err = NULL;
   opt->help = 0;
+  opt->verbose = 0;
+  opt->log_json = 0;
   opt->conf = cpstr (DEFAULT_CONFIG);
+  opt->simulate = NULL;
+  opt->cache_serve = NULL;
+  opt->status = 0;
+  opt->shutdown = 0;
+  opt->socket = NULL;
+  opt->load = 0;
+  opt->overrides = NULL;
+  opt->noverrides = 0;
 
   /* Set getopt to print errors based on user feedback */
   opterr = err;
@@ -73,17 +93,61 @@ opt_init (opt_t * opt, size_t count, char ** args, int err)
         switch (ret)
           {
           case 'c':
+            free ((void*)opt->conf);
             opt->conf = cpstr (optarg);
             break;
           case 'h':
             opt->help = 1;
             break;
+          case 'o':
+            /* Kept in the order given so later overrides win */
+            tmp = (const char**) realloc (opt->overrides,
+                                          (opt->noverrides + 1) *
+                                          sizeof (char*));
+            if (tmp == NULL)
+              {
+                opt->err = cpstr ("Malloc Failed\n");
+                return OPT_UNKNOWN;
+              }
+            opt->overrides = tmp;
+            opt->overrides[opt->noverrides++] = optarg;
+            break;
+          case 'v':
+            opt->verbose++;
+            break;
           }
 
       /* nLong Options */
       else
         switch (idx)
           {
+          case 3:
+            opt->log_json = 1;
+            break;
+          case 4:
+            if (opt->simulate != NULL)
+              free ((void*)opt->simulate);
+            opt->simulate = cpstr (optarg);
+            break;
+          case 6:
+            if (opt->cache_serve != NULL)
+              free ((void*)opt->cache_serve);
+            opt->cache_serve = cpstr (optarg);
+            break;
+          case 7:
+            opt->status = 1;
+            break;
+          case 8:
+            opt->shutdown = 1;
+            break;
+          case 9:
+            if (opt->socket != NULL)
+              free ((void*)opt->socket);
+            opt->socket = cpstr (optarg);
+            break;
+          case 10:
+            opt->load = 1;
+            break;
           }
     }
 
@@ -97,6 +161,14 @@ opt_destroy (opt_t * opt)
     free ((void*)opt->err);
   if (opt->conf != NULL)
     free ((void*)opt->conf);
+  if (opt->simulate != NULL)
+    free ((void*)opt->simulate);
+  if (opt->cache_serve != NULL)
+    free ((void*)opt->cache_serve);
+  if (opt->socket != NULL)
+    free ((void*)opt->socket);
+  if (opt->overrides != NULL)
+    free ((void*)opt->overrides);
   return OPT_OK;
 }
 
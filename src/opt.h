@@ -27,6 +27,7 @@
 #ifndef _OPT_H_
 #define _OPT_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -38,7 +39,17 @@ typedef struct _opt_t
 {
   const char * err; /**< Last Error String */
   uint8_t help; /**< Help Selected Flag */
+  uint8_t verbose; /**< Number of times verbose was given */
+  uint8_t log_json; /**< Log as JSON lines instead of text */
   const char * conf; /**< Path to the configuration file */
+  const char * simulate; /**< Build trace to replay or NULL */
+  const char * cache_serve; /**< Directory to serve as a cache or NULL */
+  uint8_t status; /**< Ask a running daemon for its status */
+  uint8_t shutdown; /**< Ask a running daemon to stop */
+  const char * socket; /**< Control socket of the daemon or NULL */
+  uint8_t load; /**< Run a generated load instead of building */
+  const char ** overrides; /**< KEY=VALUE configuration overrides */
+  size_t noverrides; /**< Number of overrides */
 } opt_t;
 
 /**
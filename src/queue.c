@@ -0,0 +1,143 @@
+/**
+   @file queue.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Lock-Free Bounded Queue
+   @details A fixed size multi-producer multi-consumer ring of
+   pointers which never takes a lock. Each cell carries a sequence
+   number so producers and consumers only contend on a single
+   compare and swap.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "queue.h"
+
+queue_err_t
+queue_init (queue_t * queue, size_t size)
+{
+  size_t i, cells;
+
+  /* Round up to a power of two */
+  for (cells = 2; cells < size; cells <<= 1);
+
+  /* Initialize Struct */
+  queue->mask = cells - 1;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->cells = (struct _queue_cell_t*)
+    malloc (cells * sizeof (struct _queue_cell_t));
+  if (queue->cells == NULL)
+    return QUEUE_MALLOC_FAILED;
+
+  /* Each cell starts out waiting for its own position */
+  for (i = 0; i < cells; i++)
+    {
+      queue->cells[i].seq = i;
+      queue->cells[i].data = NULL;
+    }
+
+  return QUEUE_OK;
+}
+
+queue_err_t
+queue_push (queue_t * queue, void * data)
+{
+  struct _queue_cell_t * cell;
+  size_t pos, seq;
+  intptr_t diff;
+
+  pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+      diff = (intptr_t)seq - (intptr_t)pos;
+
+      /* The cell is free, try and claim it */
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n (&queue->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        }
+
+      /* The consumer has not drained the cell yet */
+      else if (diff < 0)
+        return QUEUE_FULL;
+
+      /* Another producer beat us to the cell */
+      else
+        pos = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+    }
+
+  /* Publish the data to the consumers */
+  cell->data = data;
+  __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  return QUEUE_OK;
+}
+
+queue_err_t
+queue_pop (queue_t * queue, void ** data)
+{
+  struct _queue_cell_t * cell;
+  size_t pos, seq;
+  intptr_t diff;
+
+  pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+  for (;;)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+      diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      /* The cell is filled, try and claim it */
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n (&queue->tail, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        }
+
+      /* The producer has not filled the cell yet */
+      else if (diff < 0)
+        return QUEUE_EMPTY;
+
+      /* Another consumer beat us to the cell */
+      else
+        pos = __atomic_load_n (&queue->tail, __ATOMIC_RELAXED);
+    }
+
+  /* Hand the cell back to the producers one lap ahead */
+  *data = cell->data;
+  __atomic_store_n (&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+  return QUEUE_OK;
+}
+
+queue_err_t
+queue_destroy (queue_t * queue)
+{
+  if (queue->cells != NULL)
+    free (queue->cells);
+  queue->cells = NULL;
+  return QUEUE_OK;
+}
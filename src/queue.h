@@ -0,0 +1,99 @@
+/**
+   @file queue.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Lock-Free Bounded Queue
+   @details A fixed size multi-producer multi-consumer ring of
+   pointers which never takes a lock. Each cell carries a sequence
+   number so producers and consumers only contend on a single
+   compare and swap.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <stddef.h>
+
+/**
+   @brief Queue Error Codes
+**/
+typedef enum _queue_err_t
+  {
+    QUEUE_OK = 0, /**< Success */
+    QUEUE_MALLOC_FAILED, /**< Allocating Memory Failed */
+    QUEUE_FULL, /**< No free cells remain */
+    QUEUE_EMPTY, /**< No data is available */
+    QUEUE_UNKNOWN /**< Unknown Error */
+  } queue_err_t;
+
+/**
+   @brief Queue Cell
+**/
+struct _queue_cell_t
+{
+  size_t seq; /**< Sequence number guarding the cell */
+  void * data; /**< Stored pointer */
+};
+
+/**
+   @brief Queue Structure
+**/
+typedef struct _queue_t
+{
+  struct _queue_cell_t * cells; /**< Ring of cells */
+  size_t mask; /**< Size of the ring minus one */
+  size_t head __attribute__ ((aligned (64))); /**< Next cell to fill */
+  size_t tail __attribute__ ((aligned (64))); /**< Next cell to drain */
+} queue_t;
+
+/**
+   @brief Creates a New Queue
+   @param queue The queue structure to be initialized
+   @param size The minimum number of cells. This is rounded up to the
+   next power of two.
+   @return An error code
+**/
+queue_err_t queue_init (queue_t * queue, size_t size);
+
+/**
+   @brief Pushes a Pointer onto the Queue
+   @param queue The queue structure
+   @param data The pointer to store
+   @return QUEUE_OK(0) on success or QUEUE_FULL if no cell is free
+**/
+queue_err_t queue_push (queue_t * queue, void * data);
+
+/**
+   @brief Pops a Pointer from the Queue
+   @param queue The queue structure
+   @param data Where to store the popped pointer
+   @return QUEUE_OK(0) on success or QUEUE_EMPTY if nothing is ready
+**/
+queue_err_t queue_pop (queue_t * queue, void ** data);
+
+/**
+   @brief Destroys the Queue
+   @details Frees the ring. Any pointers still stored are not freed.
+   @param queue The queue structure to be destroyed
+   @return An error code
+**/
+queue_err_t queue_destroy (queue_t * queue);
+
+#endif
@@ -0,0 +1,1057 @@
+/**
+   @file runner.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Predictive Build Scheduler
+   @details Runs a graph of build targets on a pool of workers. Each
+   target's cost is estimated from its duration history and ready
+   targets are dispatched by the selected policy, by default longest
+   remaining critical path first. A target running much longer than
+   its estimate is treated as a straggler and, when it is marked
+   speculable and a worker is idle, a second copy is launched; the
+   first copy to finish wins and the other is asked to stop.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "runner.h"
+#include "hashio.h"
+#include "log.h"
+#include "util.h"
+
+#define DEFAULT_ESTIMATE 1000
+#define DEFAULT_STRAGGLER 2.0
+#define DEFAULT_SLACK 5000
+#define MONITOR_MS 100
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Target States
+**/
+enum
+  {
+    TASK_WAITING = 0,
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_DONE
+  };
+
+/**
+   @brief Ready Targets of a Node
+**/
+struct _runner_node_t
+{
+  runner_task_t ** ready; /**< Ready targets by rank */
+  size_t nready; /**< Number of ready targets */
+  hashio_t hio; /**< Hashing threads pinned to the node */
+  pthread_mutex_t hio_lock; /**< One batch at a time goes through hio */
+  int hashing; /**< hio was started */
+};
+
+/**
+   @brief Worker Thread Argument
+**/
+struct _runner_worker_t
+{
+  runner_t * r; /**< Owning scheduler */
+  size_t idx; /**< Slot in the current array */
+  size_t node; /**< Node the worker is pinned to */
+};
+
+/**
+   @brief Simulated Worker
+**/
+struct _runner_slot_t
+{
+  runner_task_t * task; /**< Copy being run or NULL */
+  uint64_t start; /**< Simulated start of the copy */
+  uint64_t end; /**< Simulated end of the copy */
+  int spec; /**< The copy is speculative */
+};
+
+static const char * policies[] = { "critical", "longest", "fifo" };
+
+inline static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline static int
+ranks_before (runner_task_t * a, runner_task_t * b)
+{
+  return a->prio > b->prio || (a->prio == b->prio && a->idx < b->idx);
+}
+
+static void
+ready_push (runner_t * r, size_t node, runner_task_t * task)
+{
+  struct _runner_node_t * n = &r->nodes[node];
+  runner_task_t * tmp;
+  size_t idx;
+
+  task->state = TASK_READY;
+  r->nready++;
+  idx = n->nready++;
+  n->ready[idx] = task;
+  for (; idx > 0 && ranks_before (n->ready[idx], n->ready[(idx-1)/2]);
+       idx = (idx-1)/2)
+    {
+      tmp = n->ready[idx];
+      n->ready[idx] = n->ready[(idx-1)/2];
+      n->ready[(idx-1)/2] = tmp;
+    }
+}
+
+static runner_task_t *
+ready_pop (runner_t * r, size_t node)
+{
+  struct _runner_node_t * n = &r->nodes[node];
+  runner_task_t * task, * tmp;
+  size_t idx = 0, best, child, i;
+
+  /* Stay on the node while it has work, otherwise take the best
+     target of any other node rather than idle */
+  if (n->nready == 0)
+    {
+      for (i = 0; i < r->nnodes; i++)
+        if (r->nodes[i].nready > 0 &&
+            (n->nready == 0 || ranks_before (r->nodes[i].ready[0],
+                                             n->ready[0])))
+          n = &r->nodes[i];
+      r->stolen++;
+    }
+
+  task = n->ready[0];
+  r->nready--;
+  n->ready[0] = n->ready[--n->nready];
+  for (;;)
+    {
+      best = idx;
+      child = idx*2 + 1;
+      if (child < n->nready && ranks_before (n->ready[child], n->ready[best]))
+        best = child;
+      if (child + 1 < n->nready &&
+          ranks_before (n->ready[child+1], n->ready[best]))
+        best = child + 1;
+      if (best == idx)
+        break;
+      tmp = n->ready[idx];
+      n->ready[idx] = n->ready[best];
+      n->ready[best] = tmp;
+      idx = best;
+    }
+
+  return task;
+}
+
+/* Draws the first job id of a run. Random, so builders sharing the
+   database never need to agree on anything, and below 2^63 so every
+   id of the run fits a bigint */
+static uint64_t
+build_id (void)
+{
+  struct timespec ts;
+  uint64_t id;
+
+  if (getrandom (&id, sizeof (id), 0) != sizeof (id))
+    {
+      clock_gettime (CLOCK_REALTIME, &ts);
+      id = ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec) ^
+        (uint64_t)getpid () << 40;
+      id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ull;
+      id = (id ^ (id >> 27)) * 0x94d049bb133111ebull;
+      id ^= id >> 31;
+    }
+  return id >> 1;
+}
+
+/* Targets go where the caller asked, else where their largest input
+   was hashed, by default the node which just produced them */
+inline static size_t
+placement (runner_t * r, runner_task_t * task, size_t node)
+{
+  if ((task->flags & RUNNER_LOCAL) && task->node < r->nnodes)
+    return task->node;
+  if (task->in_local && task->in_node < r->nnodes)
+    return task->in_node;
+  return node;
+}
+
+static runner_err_t
+nodes_alloc (runner_t * r, size_t nnodes)
+{
+  runner_task_t ** ready;
+  size_t i;
+
+  /* A target is queued on one node at a time */
+  r->nodes = (struct _runner_node_t*) calloc (nnodes, sizeof (*r->nodes));
+  ready = (runner_task_t**) malloc ((nnodes * r->ntasks + 1) *
+                                    sizeof (*ready));
+  if (r->nodes == NULL || ready == NULL)
+    {
+      free (r->nodes);
+      free (ready);
+      r->nodes = NULL;
+      r->err = cpstr (MALLOC_FAILED);
+      return RUNNER_MALLOC_FAILED;
+    }
+  for (i = 0; i < nnodes; i++)
+    r->nodes[i].ready = ready + i * r->ntasks;
+  r->nnodes = nnodes;
+  r->nready = 0;
+
+  return RUNNER_OK;
+}
+
+/* Starts the hashing threads of every node, pinned to it */
+static runner_err_t
+hashers_start (runner_t * r)
+{
+  struct _runner_node_t * n;
+  size_t i;
+
+  for (i = 0; i < r->nnodes; i++)
+    {
+      n = &r->nodes[i];
+      if (hashio_init (&n->hio, r->numa ? r->topo.nodes[i].ncpus : 0, 0) !=
+          HASHIO_OK)
+        {
+          r->err = cpstr (hashio_get_err (&n->hio));
+          hashio_destroy (&n->hio);
+          return RUNNER_THREAD_FAILED;
+        }
+      pthread_mutex_init (&n->hio_lock, NULL);
+      n->hashing = 1;
+      if (r->nnodes > 1 && hashio_pin (&n->hio, &r->topo, i) != HASHIO_OK)
+        log_warn ("Failed to pin hashing threads",
+                  LOG_INT ("node", r->topo.nodes[i].id));
+    }
+
+  return RUNNER_OK;
+}
+
+static void
+nodes_free (runner_t * r)
+{
+  size_t i;
+
+  for (i = 0; i < r->nnodes; i++)
+    if (r->nodes[i].hashing)
+      {
+        hashio_destroy (&r->nodes[i].hio);
+        pthread_mutex_destroy (&r->nodes[i].hio_lock);
+      }
+  if (r->nodes != NULL)
+    free (r->nodes[0].ready);
+  free (r->nodes);
+  r->nodes = NULL;
+  r->nnodes = 0;
+}
+
+inline static uint64_t
+straggler_limit (runner_t * r, runner_task_t * task)
+{
+  uint64_t limit;
+
+  limit = task->est_ms * r->straggler;
+  if (limit < task->est_ms + r->slack_ms)
+    limit = task->est_ms + r->slack_ms;
+  return limit > 0 ? limit : 1;
+}
+
+static runner_err_t
+rank (runner_t * r, runner_task_t *** order_out)
+{
+  runner_task_t ** order, * task;
+  uint64_t max;
+  size_t i, j, head = 0, tail = 0;
+
+  order = (runner_task_t**) malloc ((r->ntasks + 1) * sizeof (*order));
+  if (order == NULL)
+    {
+      r->err = cpstr (MALLOC_FAILED);
+      return RUNNER_MALLOC_FAILED;
+    }
+
+  /* Reset every target and estimate it */
+  for (i = 0; i < r->ntasks; i++)
+    {
+      task = r->tasks[i];
+      task->est_ms = r->hist != NULL ?
+        history_estimate (r->hist, task->name, r->default_ms) :
+        r->default_ms;
+      task->waiting = task->ndeps;
+      task->state = TASK_WAITING;
+      task->copies = 0;
+      task->speculated = 0;
+      task->cancel = 0;
+      task->result = 0;
+      task->ms = 0;
+      if (task->ndeps == 0)
+        order[tail++] = task;
+    }
+
+  /* Order the graph topologically, reusing waiting as the in degree */
+  for (; head < tail; head++)
+    for (j = 0; j < order[head]->nrdeps; j++)
+      if (--order[head]->rdeps[j]->waiting == 0)
+        order[tail++] = order[head]->rdeps[j];
+  if (tail < r->ntasks)
+    {
+      /* Anything still waiting is on or behind a cycle */
+      for (i = 0; r->tasks[i]->waiting == 0; i++);
+      r->err = cpstrf ("Dependency cycle through target %s\n",
+                       r->tasks[i]->name);
+      free (order);
+      return RUNNER_CYCLE;
+    }
+  for (i = 0; i < r->ntasks; i++)
+    r->tasks[i]->waiting = r->tasks[i]->ndeps;
+
+  /* Rank from the end of the graph back to its roots */
+  for (i = r->ntasks; i-- > 0;)
+    {
+      task = order[i];
+      switch (r->policy)
+        {
+        case RUNNER_CRITICAL:
+          max = 0;
+          for (j = 0; j < task->nrdeps; j++)
+            if (task->rdeps[j]->prio > max)
+              max = task->rdeps[j]->prio;
+          task->prio = task->est_ms + max;
+          break;
+        case RUNNER_LONGEST:
+          task->prio = task->est_ms;
+          break;
+        case RUNNER_FIFO:
+          task->prio = r->ntasks - task->idx;
+          break;
+        }
+    }
+
+  if (order_out != NULL)
+    *order_out = order;
+  else
+    free (order);
+  return RUNNER_OK;
+}
+
+static void
+trace_task (runner_t * r, runner_task_t * task)
+{
+  size_t i;
+
+  fprintf (r->trace, "%s\t%llu\t%s\t", task->name,
+           (unsigned long long)task->ms,
+           (task->flags & RUNNER_SPECULABLE) ? "s" : "-");
+  for (i = 0; i < task->nrdeps; i++)
+    fprintf (r->trace, "%s%s", i > 0 ? "," : "", task->rdeps[i]->name);
+  fputs (task->nrdeps > 0 ? "\n" : "-\n", r->trace);
+  fflush (r->trace);
+}
+
+/* Hashes the outputs of a target on the node which wrote them and
+   uploads the ones the cache lacks, returns the largest output size */
+static uint64_t
+publish (runner_t * r, runner_task_t * task, size_t node)
+{
+  struct _runner_node_t * n = &r->nodes[node];
+  hashio_result_t * res;
+  uint8_t * digests, * present;
+  size_t * map, i, count;
+  uint64_t bytes = 0;
+  cache_err_t err;
+
+  res = (hashio_result_t*) malloc (task->noutputs * sizeof (*res));
+  digests = (uint8_t*) malloc (task->noutputs * DIGEST_LEN);
+  present = (uint8_t*) malloc (task->noutputs);
+  map = (size_t*) malloc (task->noutputs * sizeof (*map));
+  if (res == NULL || digests == NULL || present == NULL || map == NULL)
+    {
+      log_warn ("Failed to publish target", LOG_STR ("target", task->name),
+                LOG_STR ("err", "Malloc Failed"));
+      goto out;
+    }
+
+  pthread_mutex_lock (&n->hio_lock);
+  if (hashio_hash (&n->hio, task->outputs, task->noutputs, res) != HASHIO_OK)
+    log_warn ("Hashing fell back to reads",
+              LOG_STR ("err", hashio_get_err (&n->hio)));
+  pthread_mutex_unlock (&n->hio_lock);
+
+  /* Only outputs which could be read are published */
+  for (i = 0, count = 0; i < task->noutputs; i++)
+    {
+      if (res[i].err != 0)
+        {
+          log_warn ("Failed to hash output", LOG_STR ("target", task->name),
+                    LOG_STR ("path", task->outputs[i]),
+                    LOG_STR ("err", strerror (res[i].err)));
+          continue;
+        }
+      memcpy (digests + count * DIGEST_LEN, res[i].digest, DIGEST_LEN);
+      map[count++] = i;
+      if (res[i].size > bytes)
+        bytes = res[i].size;
+    }
+  if (count == 0)
+    goto out;
+
+  err = cache_has (r->cache, digests, count, present);
+  if (err != CACHE_OK)
+    {
+      log_warn ("Failed to check the cache", LOG_STR ("target", task->name),
+                LOG_STR ("err", cache_err_str (err)));
+      memset (present, 0, count);
+    }
+  for (i = 0; i < count; i++)
+    if (!present[i])
+      {
+        err = cache_put (r->cache, digests + i * DIGEST_LEN,
+                         task->outputs[map[i]]);
+        if (err != CACHE_OK)
+          log_warn ("Failed to upload output", LOG_STR ("target", task->name),
+                    LOG_STR ("path", task->outputs[map[i]]),
+                    LOG_STR ("err", cache_err_str (err)));
+      }
+
+ out:
+  free (res);
+  free (digests);
+  free (present);
+  free (map);
+  return bytes;
+}
+
+static void
+finish (runner_t * r, runner_task_t * task, int ret, uint64_t ms, int spec,
+        size_t node, uint64_t bytes)
+{
+  size_t i, pushed = 0;
+
+  /* Whichever copy gets here first wins, the others are cancelled */
+  task->state = TASK_DONE;
+  task->result = ret;
+  task->ms = ms;
+  __atomic_store_n (&task->cancel, 1, __ATOMIC_RELEASE);
+  r->remaining--;
+  if (spec)
+    r->spec_wins++;
+
+  if (ret != 0)
+    {
+      log_error ("Target failed", LOG_STR ("target", task->name),
+                 LOG_INT ("status", ret));
+      if (!r->failed)
+        r->err = cpstrf ("Target %s failed with status %d\n",
+                         task->name, ret);
+      r->failed = 1;
+      return;
+    }
+  log_debug ("Target finished", LOG_STR ("target", task->name),
+             LOG_UINT ("ms", ms), LOG_UINT ("estimate_ms", task->est_ms));
+  if (r->hist != NULL &&
+      history_record (r->hist, task->name, ms, task->rss_kb) != HISTORY_OK)
+    log_warn ("Failed to record target history",
+              LOG_STR ("target", task->name));
+  if (r->trace != NULL)
+    trace_task (r, task);
+
+  /* Release the targets waiting on this one, each is kept on the node
+     which hashed its largest input */
+  for (i = 0; i < task->nrdeps; i++)
+    {
+      if (bytes > task->rdeps[i]->in_bytes)
+        {
+          task->rdeps[i]->in_bytes = bytes;
+          task->rdeps[i]->in_node = node;
+          task->rdeps[i]->in_local = 1;
+        }
+      if (--task->rdeps[i]->waiting == 0)
+        {
+          ready_push (r, placement (r, task->rdeps[i], node),
+                      task->rdeps[i]);
+          pushed++;
+        }
+    }
+  if (pushed > 1)
+    pthread_cond_broadcast (&r->work);
+  else if (pushed > 0)
+    pthread_cond_signal (&r->work);
+}
+
+static void *
+runner_worker (void * data)
+{
+  struct _runner_worker_t * w = (struct _runner_worker_t*)data;
+  runner_t * r = w->r;
+  runner_task_t * task;
+  uint64_t start, bytes;
+  int ret, spec;
+
+  if (r->nnodes > 1 && topo_pin (&r->topo, w->node, pthread_self ()) !=
+      TOPO_OK)
+    log_warn ("Failed to pin worker", LOG_UINT ("worker", w->idx),
+              LOG_INT ("node", r->topo.nodes[w->node].id));
+
+  pthread_mutex_lock (&r->lock);
+  for (;;)
+    {
+      /* Prefer fresh targets over second copies of stragglers */
+      task = NULL;
+      while (!r->stop)
+        {
+          if (!r->failed && r->nready > 0)
+            {
+              task = ready_pop (r, w->node);
+              break;
+            }
+          if (!r->failed && r->nspec > 0)
+            {
+              task = r->spec[--r->nspec];
+              if (task->state == TASK_RUNNING)
+                break;
+              task = NULL;
+              continue;
+            }
+          r->idle++;
+          pthread_cond_wait (&r->work, &r->lock);
+          r->idle--;
+        }
+      if (task == NULL)
+        break;
+
+      start = now_ns ();
+      spec = task->copies > 0;
+      if (!spec)
+        {
+          task->state = TASK_RUNNING;
+          task->start_ns = start;
+        }
+      task->copies++;
+      r->active++;
+      r->current[w->idx] = task;
+      pthread_mutex_unlock (&r->lock);
+
+      ret = r->exec (r->arg, task, &task->cancel);
+
+      /* Dependents may be fetched elsewhere once their inputs are up */
+      bytes = 0;
+      if (ret == 0 && r->cache != NULL && task->noutputs > 0 &&
+          !__atomic_load_n (&task->cancel, __ATOMIC_ACQUIRE))
+        bytes = publish (r, task, w->node);
+
+      pthread_mutex_lock (&r->lock);
+      r->current[w->idx] = NULL;
+      task->copies--;
+      r->active--;
+      if (task->state != TASK_DONE)
+        finish (r, task, ret, (now_ns () - start) / 1000000, spec, w->node,
+                bytes);
+
+      /* The stream ends with the last copy, dblog never calls back */
+      if (r->log != NULL && task->copies == 0)
+        dblog_end (r->log, task->job);
+      if (r->remaining == 0 || (r->failed && r->active == 0))
+        {
+          r->stop = 1;
+          pthread_cond_broadcast (&r->work);
+          pthread_cond_signal (&r->done);
+        }
+    }
+  pthread_mutex_unlock (&r->lock);
+
+  return NULL;
+}
+
+static void
+find_stragglers (runner_t * r)
+{
+  runner_task_t * task;
+  uint64_t now, elapsed;
+  size_t i;
+
+  now = now_ns ();
+  for (i = 0; i < r->nworkers && r->idle > r->nspec; i++)
+    {
+      task = r->current[i];
+      if (task == NULL || task->state != TASK_RUNNING || task->speculated ||
+          !(task->flags & RUNNER_SPECULABLE))
+        continue;
+      elapsed = (now - task->start_ns) / 1000000;
+      if (elapsed <= straggler_limit (r, task))
+        continue;
+
+      /* Hand a second copy to one of the idle workers */
+      log_info ("Relaunching straggling target",
+                LOG_STR ("target", task->name), LOG_UINT ("elapsed_ms", elapsed),
+                LOG_UINT ("estimate_ms", task->est_ms));
+      task->speculated = 1;
+      r->spec[r->nspec++] = task;
+      r->speculated++;
+      pthread_cond_signal (&r->work);
+    }
+}
+
+runner_err_t
+runner_init (runner_t * r, history_t * hist, size_t workers,
+             runner_exec_t exec, void * arg)
+{
+  long cpus;
+
+  /* Initialize the struct */
+  memset (r, 0, sizeof (runner_t));
+  r->hist = hist;
+  r->exec = exec;
+  r->arg = arg;
+  r->policy = RUNNER_CRITICAL;
+  r->default_ms = DEFAULT_ESTIMATE;
+  r->straggler = DEFAULT_STRAGGLER;
+  r->slack_ms = DEFAULT_SLACK;
+  pthread_mutex_init (&r->lock, NULL);
+  pthread_cond_init (&r->work, NULL);
+  pthread_cond_init (&r->done, NULL);
+
+  if (workers == 0)
+    {
+      cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      workers = cpus > 0 ? cpus : 1;
+    }
+  r->nworkers = workers;
+
+  return RUNNER_OK;
+}
+
+runner_err_t
+runner_init_conf (runner_t * r, conf_t * conf, history_t * hist,
+                  runner_exec_t exec, void * arg)
+{
+  runner_err_t ret;
+
+  ret = runner_init (r, hist, conf->vals.sched_workers, exec, arg);
+  if (ret != RUNNER_OK)
+    return ret;
+  r->default_ms = conf->vals.sched_default_ms;
+  r->straggler = conf->vals.sched_straggler;
+  r->slack_ms = conf->vals.sched_slack_ms;
+  if (conf->vals.sched_numa)
+    {
+      if (topo_init (&r->topo, NULL) != TOPO_OK)
+        {
+          r->err = cpstr (MALLOC_FAILED);
+          return RUNNER_MALLOC_FAILED;
+        }
+      r->numa = r->topo.nnodes > 1;
+      log_debug ("Found the machine topology",
+                 LOG_UINT ("nodes", r->topo.nnodes),
+                 LOG_UINT ("cpus", r->topo.ncpus));
+    }
+  if (runner_policy (conf->vals.sched_policy, &r->policy) != RUNNER_OK)
+    {
+      r->err = cpstrf ("Invalid SCHED_POLICY: %s\n", conf->vals.sched_policy);
+      return RUNNER_INVALID;
+    }
+
+  return RUNNER_OK;
+}
+
+runner_err_t
+runner_policy (const char * name, runner_policy_t * policy)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof (policies) / sizeof (*policies); i++)
+    if (strcmp (name, policies[i]) == 0)
+      {
+        *policy = (runner_policy_t)i;
+        return RUNNER_OK;
+      }
+  return RUNNER_INVALID;
+}
+
+const char *
+runner_policy_str (runner_policy_t policy)
+{
+  if ((size_t)policy < sizeof (policies) / sizeof (*policies))
+    return policies[policy];
+  return "unknown";
+}
+
+runner_err_t
+runner_add (runner_t * r, runner_task_t * task)
+{
+  runner_task_t ** tmp;
+
+  if (r->ntasks == r->tasks_size)
+    {
+      tmp = (runner_task_t**)
+        realloc (r->tasks, (r->tasks_size*2 + 64) * sizeof (*tmp));
+      if (tmp == NULL)
+        return RUNNER_MALLOC_FAILED;
+      r->tasks = tmp;
+      r->tasks_size = r->tasks_size*2 + 64;
+    }
+
+  task->rdeps = NULL;
+  task->nrdeps = task->rdeps_size = 0;
+  task->ndeps = 0;
+  task->idx = r->ntasks;
+  r->tasks[r->ntasks++] = task;
+
+  return RUNNER_OK;
+}
+
+runner_err_t
+runner_dep (runner_t * r, runner_task_t * task, runner_task_t * dep)
+{
+  runner_task_t ** tmp;
+
+  if (task == dep)
+    return RUNNER_INVALID;
+
+  if (dep->nrdeps == dep->rdeps_size)
+    {
+      tmp = (runner_task_t**)
+        realloc (dep->rdeps, (dep->rdeps_size*2 + 4) * sizeof (*tmp));
+      if (tmp == NULL)
+        return RUNNER_MALLOC_FAILED;
+      dep->rdeps = tmp;
+      dep->rdeps_size = dep->rdeps_size*2 + 4;
+    }
+  dep->rdeps[dep->nrdeps++] = task;
+  task->ndeps++;
+
+  return RUNNER_OK;
+}
+
+runner_err_t
+runner_run (runner_t * r)
+{
+  struct _runner_worker_t * args;
+  pthread_t * threads;
+  struct timespec ts;
+  runner_err_t ret;
+  size_t i, started, roots, cpu;
+
+  if (r->err != NULL)
+    free (r->err);
+  r->err = NULL;
+  ret = rank (r, NULL);
+  if (ret != RUNNER_OK)
+    return ret;
+  if (r->ntasks == 0)
+    return RUNNER_OK;
+
+  /* Each target is queued at most once and speculated at most once */
+  ret = nodes_alloc (r, r->numa ? r->topo.nnodes : 1);
+  if (ret != RUNNER_OK)
+    return ret;
+  if (r->cache != NULL && (ret = hashers_start (r)) != RUNNER_OK)
+    {
+      nodes_free (r);
+      return ret;
+    }
+  r->spec = (runner_task_t**) malloc (r->ntasks * sizeof (*r->spec));
+  r->current = (runner_task_t**) calloc (r->nworkers, sizeof (*r->current));
+  threads = (pthread_t*) malloc (r->nworkers * sizeof (pthread_t));
+  args = (struct _runner_worker_t*) malloc (r->nworkers * sizeof (*args));
+  if (r->spec == NULL || r->current == NULL ||
+      threads == NULL || args == NULL)
+    {
+      r->err = cpstr (MALLOC_FAILED);
+      ret = RUNNER_MALLOC_FAILED;
+      goto out;
+    }
+  r->nspec = r->active = r->idle = 0;
+  r->remaining = r->ntasks;
+  r->failed = r->stop = 0;
+  r->build = build_id ();
+  for (i = 0; i < r->ntasks; i++)
+    {
+      r->tasks[i]->job = (r->build + r->tasks[i]->idx) & INT64_MAX;
+      r->tasks[i]->in_bytes = 0;
+      r->tasks[i]->in_node = 0;
+      r->tasks[i]->in_local = 0;
+    }
+  for (i = 0, roots = 0; i < r->ntasks; i++)
+    if (r->tasks[i]->ndeps == 0)
+      ready_push (r, placement (r, r->tasks[i], roots++ % r->nnodes),
+                  r->tasks[i]);
+
+  /* Start the workers, spread over the nodes like the cpus are */
+  for (started = 0; started < r->nworkers; started++)
+    {
+      args[started].r = r;
+      args[started].idx = started;
+      args[started].node = 0;
+      cpu = started * r->topo.ncpus / r->nworkers;
+      while (args[started].node + 1 < r->nnodes &&
+             cpu >= r->topo.nodes[args[started].node].ncpus)
+        cpu -= r->topo.nodes[args[started].node++].ncpus;
+      if (pthread_create (&threads[started], NULL, runner_worker,
+                          &args[started]) != 0)
+        break;
+    }
+
+  /* Watch for stragglers until the workers are done */
+  pthread_mutex_lock (&r->lock);
+  if (started < r->nworkers)
+    {
+      r->err = cpstr ("Failed to start worker\n");
+      r->failed = 1;
+      if (r->active == 0)
+        r->stop = 1;
+      pthread_cond_broadcast (&r->work);
+    }
+  while (!r->stop)
+    {
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_nsec += MONITOR_MS * 1000000;
+      ts.tv_sec += ts.tv_nsec / 1000000000;
+      ts.tv_nsec %= 1000000000;
+      pthread_cond_timedwait (&r->done, &r->lock, &ts);
+      if (!r->stop && !r->failed && r->straggler > 0 && r->nready == 0)
+        find_stragglers (r);
+    }
+  pthread_mutex_unlock (&r->lock);
+  for (i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  if (started < r->nworkers)
+    ret = RUNNER_THREAD_FAILED;
+  else if (r->failed)
+    ret = RUNNER_FAILED;
+  if (r->cache != NULL && cache_flush (r->cache) != CACHE_OK)
+    log_warn ("Failed to upload outputs",
+              LOG_STR ("err", cache_get_err (r->cache)));
+  log_info ("Build finished", LOG_UINT ("targets", r->ntasks - r->remaining),
+            LOG_UINT ("speculated", r->speculated),
+            LOG_UINT ("speculative_wins", r->spec_wins),
+            LOG_UINT ("nodes", r->nnodes), LOG_UINT ("stolen", r->stolen));
+
+ out:
+  nodes_free (r);
+  free (r->spec);
+  free (r->current);
+  free (threads);
+  free (args);
+  r->spec = r->current = NULL;
+
+  return ret;
+}
+
+void
+runner_output (runner_t * r, runner_task_t * task, const void * data,
+               size_t len)
+{
+  if (r->log != NULL)
+    dblog_write (r->log, task->job, data, len);
+}
+
+runner_err_t
+runner_simulate (runner_t * r, runner_sim_t * res)
+{
+  struct _runner_slot_t * slots;
+  runner_task_t ** order, * task;
+  uint64_t now = 0, next, when, max;
+  size_t i, j, free_slots;
+  runner_err_t ret;
+
+  memset (res, 0, sizeof (runner_sim_t));
+  if (r->err != NULL)
+    free (r->err);
+  r->err = NULL;
+  ret = rank (r, &order);
+  if (ret != RUNNER_OK)
+    return ret;
+
+  /* The recorded critical path bounds any policy */
+  for (i = r->ntasks; i-- > 0;)
+    {
+      task = order[i];
+      max = 0;
+      for (j = 0; j < task->nrdeps; j++)
+        if (task->rdeps[j]->ms > max)
+          max = task->rdeps[j]->ms;
+      task->ms = task->sim_ms + max;
+      if (task->ms > res->critical_ms)
+        res->critical_ms = task->ms;
+      res->work_ms += task->sim_ms;
+    }
+  free (order);
+
+  /* Placement is not modelled, every worker shares one queue */
+  if (nodes_alloc (r, 1) != RUNNER_OK)
+    return RUNNER_MALLOC_FAILED;
+  slots = (struct _runner_slot_t*) calloc (r->nworkers, sizeof (*slots));
+  if (slots == NULL)
+    {
+      nodes_free (r);
+      r->err = cpstr (MALLOC_FAILED);
+      return RUNNER_MALLOC_FAILED;
+    }
+  r->remaining = r->ntasks;
+  for (i = 0; i < r->ntasks; i++)
+    if (r->tasks[i]->ndeps == 0)
+      ready_push (r, 0, r->tasks[i]);
+
+  while (r->remaining > 0)
+    {
+      /* Dispatch onto every free worker */
+      free_slots = 0;
+      for (i = 0; i < r->nworkers; i++)
+        {
+          if (slots[i].task == NULL && r->nready > 0)
+            {
+              task = ready_pop (r, 0);
+              task->state = TASK_RUNNING;
+              slots[i].task = task;
+              slots[i].start = now;
+              slots[i].end = now + task->sim_ms;
+              slots[i].spec = 0;
+            }
+          if (slots[i].task == NULL)
+            free_slots++;
+        }
+
+      /* Idle workers pick up stragglers */
+      next = UINT64_MAX;
+      for (i = 0; i < r->nworkers && r->straggler > 0; i++)
+        {
+          task = slots[i].task;
+          if (free_slots == 0 || task == NULL || slots[i].spec ||
+              task->speculated || !(task->flags & RUNNER_SPECULABLE))
+            continue;
+          when = slots[i].start + straggler_limit (r, task);
+          if (when > now)
+            {
+              if (when < next)
+                next = when;
+              continue;
+            }
+          for (j = 0; slots[j].task != NULL; j++);
+          slots[j].task = task;
+          slots[j].start = now;
+          slots[j].end = now + task->est_ms;
+          slots[j].spec = 1;
+          task->speculated = 1;
+          res->speculated++;
+          free_slots--;
+        }
+
+      /* Advance to the next completion */
+      for (i = 0; i < r->nworkers; i++)
+        if (slots[i].task != NULL && slots[i].end < next)
+          next = slots[i].end;
+      if (next == UINT64_MAX)
+        break;
+      now = next;
+      for (i = 0; i < r->nworkers; i++)
+        {
+          task = slots[i].task;
+          if (task == NULL || slots[i].end > now)
+            continue;
+          task->state = TASK_DONE;
+          r->remaining--;
+          if (slots[i].spec)
+            res->spec_wins++;
+          for (j = 0; j < task->nrdeps; j++)
+            if (--task->rdeps[j]->waiting == 0)
+              ready_push (r, 0, task->rdeps[j]);
+
+          /* Retire every copy of the finished target */
+          for (j = 0; j < r->nworkers; j++)
+            if (slots[j].task == task)
+              {
+                res->busy_ms += now - slots[j].start;
+                slots[j].task = NULL;
+              }
+        }
+    }
+  res->makespan_ms = now;
+
+  free (slots);
+  nodes_free (r);
+
+  return r->remaining == 0 ? RUNNER_OK : RUNNER_UNKNOWN;
+}
+
+const char *
+runner_get_err (runner_t * r)
+{
+  return r->err;
+}
+
+runner_err_t
+runner_destroy (runner_t * r)
+{
+  size_t i;
+
+  for (i = 0; i < r->ntasks; i++)
+    {
+      free (r->tasks[i]->rdeps);
+      r->tasks[i]->rdeps = NULL;
+      r->tasks[i]->nrdeps = r->tasks[i]->rdeps_size = 0;
+    }
+  free (r->tasks);
+  r->tasks = NULL;
+  r->ntasks = r->tasks_size = 0;
+  topo_destroy (&r->topo);
+  pthread_mutex_destroy (&r->lock);
+  pthread_cond_destroy (&r->work);
+  pthread_cond_destroy (&r->done);
+
+  if (r->err != NULL)
+    free (r->err);
+  r->err = NULL;
+
+  return RUNNER_OK;
+}
+
+const char *
+runner_err_str (runner_err_t err)
+{
+  switch (err)
+    {
+    case RUNNER_OK:
+      return "Success";
+    case RUNNER_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case RUNNER_INVALID:
+      return "Invalid argument or setting";
+    case RUNNER_CYCLE:
+      return "The target graph has a cycle";
+    case RUNNER_FAILED:
+      return "A target failed";
+    case RUNNER_THREAD_FAILED:
+      return "Failed to start a worker";
+    case RUNNER_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
@@ -0,0 +1,316 @@
+/**
+   @file runner.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Predictive Build Scheduler
+   @details Runs a graph of build targets on a pool of workers. Each
+   target's cost is estimated from its duration history and ready
+   targets are dispatched by the selected policy, by default longest
+   remaining critical path first. A target running much longer than
+   its estimate is treated as a straggler and, when it is marked
+   speculable and a worker is idle, a second copy is launched; the
+   first copy to finish wins and the other is asked to stop.
+
+   The same policies can be evaluated offline by simulating a recorded
+   trace against the history estimates instead of running the targets.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RUNNER_H_
+#define _RUNNER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "cache.h"
+#include "conf.h"
+#include "dblog.h"
+#include "history.h"
+#include "topo.h"
+
+#define RUNNER_SPECULABLE 0x1 /**< Idempotent and cacheable, may run twice */
+#define RUNNER_LOCAL 0x2 /**< Prefer workers on the node in node */
+
+/**
+   @brief Scheduler Error Codes
+**/
+typedef enum _runner_err_t
+  {
+    RUNNER_OK = 0, /**< Success */
+    RUNNER_MALLOC_FAILED, /**< Allocating Memory Failed */
+    RUNNER_INVALID, /**< An invalid argument or setting */
+    RUNNER_CYCLE, /**< The target graph has a cycle */
+    RUNNER_FAILED, /**< A target failed */
+    RUNNER_THREAD_FAILED, /**< A worker could not be started */
+    RUNNER_UNKNOWN /**< Unknown Error */
+  } runner_err_t;
+
+/**
+   @brief Dispatch Policies
+**/
+typedef enum _runner_policy_t
+  {
+    RUNNER_CRITICAL = 0, /**< Longest estimated path to the end first */
+    RUNNER_LONGEST, /**< Longest estimated target first */
+    RUNNER_FIFO /**< Targets in the order they were added */
+  } runner_policy_t;
+
+/**
+   @brief Build Target
+   @details Embedded or allocated by the caller. Only name, flags, node,
+   outputs and data are set by the caller, the rest is owned by the
+   scheduler. Once outputs are published the scheduler places the
+   dependents with in_node and in_local, which every run resets, see
+   runner_run.
+**/
+typedef struct _runner_task_t
+{
+  const char * name; /**< Name of the target, keys the history */
+  uint32_t flags; /**< RUNNER_* flags */
+  size_t node; /**< Node of its inputs, used with RUNNER_LOCAL */
+  const char * const * outputs; /**< Files the target writes or NULL */
+  size_t noutputs; /**< Number of outputs */
+  void * data; /**< User data */
+  uint64_t rss_kb; /**< Peak memory of the run, may be set by exec */
+  uint64_t est_ms; /**< Estimated duration */
+  uint64_t prio; /**< Dispatch rank under the policy */
+  uint64_t sim_ms; /**< Recorded duration replayed by simulation */
+  uint64_t start_ns; /**< Monotonic start of the first copy */
+  uint64_t ms; /**< Duration of the winning copy */
+  uint64_t job; /**< Id of the target's output stream */
+  uint64_t in_bytes; /**< Size of its largest published input */
+  size_t in_node; /**< Node which hashed that input */
+  int in_local; /**< in_node was set during this run */
+  struct _runner_task_t ** rdeps; /**< Targets depending on this one */
+  size_t nrdeps; /**< Number of dependent targets */
+  size_t rdeps_size; /**< Allocated dependent entries */
+  size_t ndeps; /**< Number of dependencies */
+  size_t waiting; /**< Dependencies not yet finished */
+  size_t idx; /**< Order the target was added in */
+  uint8_t state; /**< Waiting, ready, running or done */
+  uint8_t copies; /**< Copies currently running */
+  uint8_t speculated; /**< A second copy has been launched */
+  int cancel; /**< Set once another copy has won */
+  int result; /**< Exit status of the winning copy */
+} runner_task_t;
+
+/**
+   @brief Target Executor
+   @details Builds a single target, possibly concurrently with a
+   speculative copy of itself. Long running executors should poll
+   cancel and give up once it becomes non-zero.
+   @param arg The user argument passed to runner_init
+   @param task The target to build
+   @param cancel Set when another copy of the target has finished
+   @return 0 on success or non-zero if the target failed
+**/
+typedef int (*runner_exec_t) (void * arg, runner_task_t * task,
+                              const int * cancel);
+
+/**
+   @brief Simulation Results
+**/
+typedef struct _runner_sim_t
+{
+  uint64_t makespan_ms; /**< Time until the last target finished */
+  uint64_t work_ms; /**< Sum of the recorded durations */
+  uint64_t busy_ms; /**< Worker time spent, including wasted copies */
+  uint64_t critical_ms; /**< Longest recorded dependency chain */
+  uint64_t speculated; /**< Copies launched for stragglers */
+  uint64_t spec_wins; /**< Copies that beat the original */
+} runner_sim_t;
+
+/**
+   @brief Scheduler Structure
+**/
+typedef struct _runner_t
+{
+  char * err; /**< Last Error String */
+  history_t * hist; /**< Duration history or NULL */
+  runner_exec_t exec; /**< Target executor */
+  void * arg; /**< Passed through to exec */
+  runner_policy_t policy; /**< Dispatch policy */
+  size_t nworkers; /**< Number of workers */
+  uint64_t default_ms; /**< Estimate for targets without history */
+  double straggler; /**< Estimate multiple marking a straggler or 0 */
+  uint64_t slack_ms; /**< Minimum overrun marking a straggler */
+  FILE * trace; /**< Completed targets are recorded here or NULL */
+  dblog_t * log; /**< Streams the output of targets or NULL */
+  cache_t * cache; /**< Outputs of targets are published here or NULL */
+  uint64_t build; /**< First job id of the last run */
+  runner_task_t ** tasks; /**< Every target in the order added */
+  size_t ntasks; /**< Number of targets */
+  size_t tasks_size; /**< Allocated target entries */
+  topo_t topo; /**< Nodes and cpus of the machine */
+  int numa; /**< Pin workers to nodes with a queue each */
+  struct _runner_node_t * nodes; /**< Ready targets of each node */
+  size_t nnodes; /**< Number of nodes in use */
+  size_t nready; /**< Ready targets on every node */
+  runner_task_t ** spec; /**< Stragglers waiting for a second copy */
+  size_t nspec; /**< Number of waiting stragglers */
+  runner_task_t ** current; /**< Target on each worker or NULL */
+  size_t remaining; /**< Targets not yet finished */
+  size_t active; /**< Workers running a target */
+  size_t idle; /**< Workers waiting for a target */
+  int failed; /**< A target failed, dispatch has stopped */
+  int stop; /**< Workers should exit */
+  uint64_t speculated; /**< Copies launched for stragglers */
+  uint64_t spec_wins; /**< Copies that beat the original */
+  uint64_t stolen; /**< Targets run by a worker on another node */
+  pthread_mutex_t lock; /**< Guards the dispatch state */
+  pthread_cond_t work; /**< Signals workers */
+  pthread_cond_t done; /**< Signals the monitor */
+} runner_t;
+
+/**
+   @brief Creates a New Scheduler
+   @param r The scheduler structure to be initialized
+   @param hist The duration history or NULL to schedule without it
+   @param workers The number of workers. Set this to 0 for one per cpu.
+   @param exec Called to build each target
+   @param arg Passed through to exec
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_init (runner_t * r, history_t * hist, size_t workers,
+                          runner_exec_t exec, void * arg);
+
+/**
+   @brief Creates a Scheduler from the Configuration
+   @details Reads the SCHED_WORKERS, SCHED_POLICY, SCHED_DEFAULT_MS,
+   SCHED_STRAGGLER, SCHED_SLACK_MS and SCHED_NUMA keys. A
+   SCHED_STRAGGLER of 0 disables speculation. With SCHED_NUMA on a
+   machine with more than one node, workers are spread over the nodes
+   in proportion to their cpus and pinned there. Each node queues the
+   targets whose inputs were produced on it, and a worker only takes
+   a target from another node when its own has none.
+   @param r The scheduler structure to be initialized
+   @param conf The parsed configuration
+   @param hist The duration history or NULL to schedule without it
+   @param exec Called to build each target
+   @param arg Passed through to exec
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_init_conf (runner_t * r, conf_t * conf, history_t * hist,
+                               runner_exec_t exec, void * arg);
+
+/**
+   @brief Parses a Policy Name
+   @param name One of critical, longest or fifo
+   @param policy Set to the named policy
+   @return RUNNER_OK(0) on success or RUNNER_INVALID
+**/
+runner_err_t runner_policy (const char * name, runner_policy_t * policy);
+
+/**
+   @brief Names a Policy
+   @param policy The policy
+   @return The name accepted by runner_policy
+**/
+const char * runner_policy_str (runner_policy_t policy);
+
+/**
+   @brief Adds a Target
+   @param r The scheduler structure
+   @param task The target, which must outlive the scheduler
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_add (runner_t * r, runner_task_t * task);
+
+/**
+   @brief Adds a Dependency
+   @param r The scheduler structure
+   @param task The target which must wait
+   @param dep The target it waits for
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_dep (runner_t * r, runner_task_t * task,
+                         runner_task_t * dep);
+
+/**
+   @brief Builds Every Target
+   @details Blocks until every target has been built or, after a
+   failure, until the targets already running have finished.
+   Successful durations are recorded in the history and trace. With a
+   cache set, the outputs of a successful target are hashed by the
+   hashing threads of the worker's node and the ones the cache lacks
+   are uploaded before its dependents are released. Each dependent
+   without RUNNER_LOCAL of its own is then queued on the node which
+   hashed its largest input, whose memory still holds it. Each run
+   draws a random 63 bit build id and each target takes the job id
+   build plus its index, so the output streams of different runs and
+   of builders sharing a database practically never collide and every
+   id fits a bigint.
+   @param r The scheduler structure
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_run (runner_t * r);
+
+/**
+   @brief Streams Output of a Running Target
+   @details Meant to be called by the executor. The output goes to the
+   database log set in log, keyed by the target's job, and is dropped
+   if there is none. Never blocks on the database. A target's stream
+   is ended once its last running copy returns, so the output of a
+   losing speculative copy lands in the same stream until it notices
+   the cancel.
+   @param r The scheduler structure
+   @param task The target passed to the executor
+   @param data The output
+   @param len The length of the output
+**/
+void runner_output (runner_t * r, runner_task_t * task, const void * data,
+                    size_t len);
+
+/**
+   @brief Simulates Building Every Target
+   @details Replays the sim_ms of each target as its duration on the
+   configured number of workers, dispatching by the estimates exactly
+   as runner_run would. A speculative copy is assumed to take the
+   estimate. Nothing is executed or recorded.
+   @param r The scheduler structure
+   @param res Filled in with the results
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_simulate (runner_t * r, runner_sim_t * res);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param r The scheduler structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * runner_get_err (runner_t * r);
+
+/**
+   @brief Destroys the Scheduler
+   @details The targets themselves are not freed.
+   @param r The scheduler structure to be destroyed
+   @return RUNNER_OK(0) on success or a positive error code
+**/
+runner_err_t runner_destroy (runner_t * r);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * runner_err_str (runner_err_t err);
+
+#endif
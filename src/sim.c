@@ -0,0 +1,277 @@
+/**
+   @file sim.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Scheduler Simulation
+   @details Replays a build trace recorded by the scheduler to compare
+   dispatch policies offline.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sim.h"
+#include "util.h"
+
+#define MALLOC_FAILED "Malloc Failed\n"
+
+/**
+   @brief Replayed Target
+**/
+struct _sim_task_t
+{
+  runner_task_t task; /**< Target handed to the scheduler */
+  intern_id_t id; /**< Interned name of the target */
+  char * rdeps; /**< Names of the dependent targets until resolved */
+};
+
+static sim_err_t
+parse (sim_t * sim, FILE * file, const char * path)
+{
+  struct _sim_task_t * tmp, * t;
+  char * line = NULL, * field[4], * end;
+  size_t size = 0, tasks_size = 0, line_ct = 0, i;
+  ssize_t len;
+
+  while ((len = getline (&line, &size, file)) != -1)
+    {
+      line_ct++;
+      if (len > 0 && line[len-1] == '\n')
+        line[--len] = '\0';
+      if (len == 0)
+        continue;
+
+      /* Name, duration, flags and dependents */
+      field[0] = line;
+      for (i = 1; i < 4; i++)
+        {
+          field[i] = strchr (field[i-1], '\t');
+          if (field[i] == NULL)
+            break;
+          *field[i]++ = '\0';
+        }
+      if (i < 4 || field[0][0] == '\0')
+        {
+          sim->err = cpstrf ("%s:%zu: Malformed trace record\n", path,
+                             line_ct);
+          free (line);
+          return SIM_BAD_TRACE;
+        }
+
+      if (sim->ntasks == tasks_size)
+        {
+          tmp = (struct _sim_task_t*)
+            realloc (sim->tasks, (tasks_size*2 + 64) * sizeof (*tmp));
+          if (tmp == NULL)
+            goto malloc_failed;
+          sim->tasks = tmp;
+          tasks_size = tasks_size*2 + 64;
+        }
+      if (intern_find (&sim->names, field[0]) != INTERN_NONE)
+        {
+          sim->err = cpstrf ("%s:%zu: Target %s is recorded twice\n", path,
+                             line_ct, field[0]);
+          free (line);
+          return SIM_BAD_TRACE;
+        }
+      t = &sim->tasks[sim->ntasks];
+      memset (t, 0, sizeof (*t));
+      t->task.sim_ms = strtoull (field[1], &end, 10);
+      if (*end != '\0' || field[1][0] == '\0')
+        {
+          sim->err = cpstrf ("%s:%zu: Invalid duration: %s\n", path,
+                             line_ct, field[1]);
+          free (line);
+          return SIM_BAD_TRACE;
+        }
+      if (strcmp (field[2], "s") == 0)
+        t->task.flags |= RUNNER_SPECULABLE;
+      t->id = intern_id (&sim->names, field[0]);
+      t->rdeps = cpstr (strcmp (field[3], "-") == 0 ? "" : field[3]);
+      sim->ntasks++;
+      if (t->id == INTERN_NONE || t->rdeps == NULL)
+        goto malloc_failed;
+      t->task.name = intern_str (&sim->names, t->id);
+    }
+  free (line);
+
+  return SIM_OK;
+
+ malloc_failed:
+  free (line);
+  sim->err = cpstr (MALLOC_FAILED);
+  return SIM_MALLOC_FAILED;
+}
+
+static sim_err_t
+resolve (sim_t * sim)
+{
+  struct _sim_task_t ** by_id, * dep;
+  char * name, * save;
+  intern_id_t id;
+  size_t i;
+
+  /* Only target names are interned, so their IDs are dense */
+  by_id = (struct _sim_task_t**)
+    calloc (intern_count (&sim->names) + 1, sizeof (*by_id));
+  if (by_id == NULL)
+    {
+      sim->err = cpstr (MALLOC_FAILED);
+      return SIM_MALLOC_FAILED;
+    }
+  for (i = 0; i < sim->ntasks; i++)
+    by_id[sim->tasks[i].id] = &sim->tasks[i];
+
+  /* Targets which never finished are missing and simply dropped */
+  for (i = 0; i < sim->ntasks; i++)
+    {
+      for (name = strtok_r (sim->tasks[i].rdeps, ",", &save); name != NULL;
+           name = strtok_r (NULL, ",", &save))
+        {
+          id = intern_find (&sim->names, name);
+          if (id == INTERN_NONE)
+            continue;
+          dep = by_id[id];
+          if (runner_dep (&sim->runner, &dep->task, &sim->tasks[i].task) !=
+              RUNNER_OK)
+            {
+              sim->err = cpstrf ("Failed to link target %s\n", name);
+              free (by_id);
+              return SIM_RUNNER_FAILED;
+            }
+        }
+      free (sim->tasks[i].rdeps);
+      sim->tasks[i].rdeps = NULL;
+    }
+  free (by_id);
+
+  return SIM_OK;
+}
+
+sim_err_t
+sim_init (sim_t * sim, conf_t * conf, history_t * hist, const char * path)
+{
+  FILE * file;
+  sim_err_t ret;
+  size_t i;
+
+  /* Initialize the struct */
+  sim->err = NULL;
+  sim->tasks = NULL;
+  sim->ntasks = 0;
+  if (intern_init (&sim->names, 1) != INTERN_OK)
+    {
+      sim->err = cpstr (MALLOC_FAILED);
+      runner_init (&sim->runner, NULL, 1, NULL, NULL);
+      return SIM_MALLOC_FAILED;
+    }
+  if (runner_init_conf (&sim->runner, conf, hist, NULL, NULL) != RUNNER_OK)
+    {
+      sim->err = cpstr (runner_get_err (&sim->runner) != NULL ?
+                        runner_get_err (&sim->runner) : MALLOC_FAILED);
+      return SIM_RUNNER_FAILED;
+    }
+
+  file = fopen (path, "r");
+  if (file == NULL)
+    {
+      sim->err = cpstrf ("Failed to open %s: %s\n", path, strerror (errno));
+      return SIM_NO_FILE;
+    }
+  ret = parse (sim, file, path);
+  fclose (file);
+  if (ret != SIM_OK)
+    return ret;
+
+  /* The tasks array is final, hand the targets to the scheduler */
+  for (i = 0; i < sim->ntasks; i++)
+    if (runner_add (&sim->runner, &sim->tasks[i].task) != RUNNER_OK)
+      {
+        sim->err = cpstr (MALLOC_FAILED);
+        return SIM_MALLOC_FAILED;
+      }
+
+  return resolve (sim);
+}
+
+sim_err_t
+sim_run (sim_t * sim, runner_policy_t policy, runner_sim_t * res)
+{
+  sim->runner.policy = policy;
+  if (runner_simulate (&sim->runner, res) != RUNNER_OK)
+    {
+      if (sim->err != NULL)
+        free (sim->err);
+      sim->err = cpstr (runner_get_err (&sim->runner) != NULL ?
+                        runner_get_err (&sim->runner) :
+                        "Simulation stalled\n");
+      return SIM_RUNNER_FAILED;
+    }
+
+  return SIM_OK;
+}
+
+const char *
+sim_get_err (sim_t * sim)
+{
+  return sim->err;
+}
+
+sim_err_t
+sim_destroy (sim_t * sim)
+{
+  size_t i;
+
+  runner_destroy (&sim->runner);
+  for (i = 0; i < sim->ntasks; i++)
+    free (sim->tasks[i].rdeps);
+  free (sim->tasks);
+  intern_destroy (&sim->names);
+  sim->tasks = NULL;
+  sim->ntasks = 0;
+
+  if (sim->err != NULL)
+    free (sim->err);
+  sim->err = NULL;
+
+  return SIM_OK;
+}
+
+const char *
+sim_err_str (sim_err_t err)
+{
+  switch (err)
+    {
+    case SIM_OK:
+      return "Success";
+    case SIM_NO_FILE:
+      return "The trace could not be opened";
+    case SIM_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case SIM_BAD_TRACE:
+      return "The trace is malformed";
+    case SIM_RUNNER_FAILED:
+      return "The scheduler rejected the trace";
+    case SIM_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
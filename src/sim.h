@@ -0,0 +1,108 @@
+/**
+   @file sim.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Scheduler Simulation
+   @details Replays a build trace recorded by the scheduler to compare
+   dispatch policies offline. The trace holds one line per finished
+   target: its name, its duration in milliseconds, s if it may be
+   speculated or - otherwise, and a comma separated list of the
+   targets depending on it or -, all separated by tabs.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include "conf.h"
+#include "history.h"
+#include "intern.h"
+#include "runner.h"
+
+/**
+   @brief Simulation Error Codes
+**/
+typedef enum _sim_err_t
+  {
+    SIM_OK = 0, /**< Success */
+    SIM_NO_FILE, /**< The trace could not be opened */
+    SIM_MALLOC_FAILED, /**< Allocating Memory Failed */
+    SIM_BAD_TRACE, /**< The trace is malformed */
+    SIM_RUNNER_FAILED, /**< The scheduler rejected the trace */
+    SIM_UNKNOWN /**< Unknown Error */
+  } sim_err_t;
+
+/**
+   @brief Simulation Structure
+**/
+typedef struct _sim_t
+{
+  char * err; /**< Last Error String */
+  runner_t runner; /**< Scheduler holding the replayed targets */
+  intern_t names; /**< Target names */
+  struct _sim_task_t * tasks; /**< Targets in trace order */
+  size_t ntasks; /**< Number of targets */
+} sim_t;
+
+/**
+   @brief Loads a Trace
+   @details The scheduler is configured from conf like a real build
+   and estimates targets from hist.
+   @param sim The simulation structure to be initialized
+   @param conf The parsed configuration
+   @param hist The duration history or NULL to use the default estimate
+   @param path The path of the recorded trace
+   @return SIM_OK(0) on success or a positive error code
+**/
+sim_err_t sim_init (sim_t * sim, conf_t * conf, history_t * hist,
+                    const char * path);
+
+/**
+   @brief Simulates the Trace under a Policy
+   @param sim The simulation structure
+   @param policy The dispatch policy to evaluate
+   @param res Filled in with the results
+   @return SIM_OK(0) on success or a positive error code
+**/
+sim_err_t sim_run (sim_t * sim, runner_policy_t policy, runner_sim_t * res);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param sim The simulation structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * sim_get_err (sim_t * sim);
+
+/**
+   @brief Destroys the Simulation
+   @param sim The simulation structure to be destroyed
+   @return SIM_OK(0) on success or a positive error code
+**/
+sim_err_t sim_destroy (sim_t * sim);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * sim_err_str (sim_err_t err);
+
+#endif
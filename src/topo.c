@@ -0,0 +1,298 @@
+/**
+   @file topo.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Machine Topology
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include "topo.h"
+#include "util.h"
+
+#define NODE_ROOT "/sys/devices/system/node"
+#define MAX_CPUS 8192
+#define MALLOC_FAILED "Malloc Failed\n"
+
+static int
+cmp_node (const void * a, const void * b)
+{
+  return ((const struct _topo_node_t*)a)->id -
+    ((const struct _topo_node_t*)b)->id;
+}
+
+static int
+add_cpu (struct _topo_node_t * node, int cpu)
+{
+  int * tmp;
+
+  tmp = (int*) realloc (node->cpus, (node->ncpus + 1) * sizeof (int));
+  if (tmp == NULL)
+    return 0;
+  node->cpus = tmp;
+  node->cpus[node->ncpus++] = cpu;
+  return 1;
+}
+
+/* Parses a cpulist like 0-3,8-11 keeping the cpus in allowed */
+static int
+parse_cpus (const char * list, cpu_set_t * allowed, size_t size,
+            struct _topo_node_t * node)
+{
+  const char * ptr = list;
+  char * end;
+  long lo, hi, cpu;
+
+  while (*ptr != '\0' && *ptr != '\n')
+    {
+      lo = hi = strtol (ptr, &end, 10);
+      if (end == ptr || lo < 0)
+        return 0;
+      if (*end == '-')
+        {
+          ptr = end + 1;
+          hi = strtol (ptr, &end, 10);
+          if (end == ptr || hi < lo)
+            return 0;
+        }
+      for (cpu = lo; cpu <= hi && cpu < MAX_CPUS; cpu++)
+        if (CPU_ISSET_S (cpu, size, allowed) && !add_cpu (node, cpu))
+          return -1;
+      ptr = *end == ',' ? end + 1 : end;
+    }
+
+  return 1;
+}
+
+static topo_err_t
+add_node (topo_t * topo, int id)
+{
+  struct _topo_node_t * tmp;
+
+  tmp = (struct _topo_node_t*) realloc (topo->nodes, (topo->nnodes + 1) *
+                                        sizeof (*tmp));
+  if (tmp == NULL)
+    {
+      topo->err = cpstr (MALLOC_FAILED);
+      return TOPO_MALLOC_FAILED;
+    }
+  topo->nodes = tmp;
+  memset (&topo->nodes[topo->nnodes], 0, sizeof (*tmp));
+  topo->nodes[topo->nnodes++].id = id;
+
+  return TOPO_OK;
+}
+
+static topo_err_t
+read_nodes (topo_t * topo, const char * root, cpu_set_t * allowed,
+            size_t size)
+{
+  struct _topo_node_t * node;
+  struct dirent * ent;
+  char path[4096], list[4096];
+  FILE * file;
+  DIR * dir;
+  char * end;
+  long id;
+  int ok;
+
+  dir = opendir (root);
+  if (dir == NULL)
+    return TOPO_OK;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      if (strncmp (ent->d_name, "node", 4) != 0)
+        continue;
+      id = strtol (ent->d_name + 4, &end, 10);
+      if (end == ent->d_name + 4 || *end != '\0' || id < 0)
+        continue;
+      snprintf (path, sizeof (path), "%s/%s/cpulist", root, ent->d_name);
+      file = fopen (path, "r");
+      if (file == NULL)
+        continue;
+      ok = fgets (list, sizeof (list), file) != NULL;
+      fclose (file);
+      if (!ok)
+        continue;
+
+      if (add_node (topo, id) != TOPO_OK)
+        {
+          closedir (dir);
+          return TOPO_MALLOC_FAILED;
+        }
+      node = &topo->nodes[topo->nnodes - 1];
+      ok = parse_cpus (list, allowed, size, node);
+      if (ok < 0)
+        {
+          closedir (dir);
+          topo->err = cpstr (MALLOC_FAILED);
+          return TOPO_MALLOC_FAILED;
+        }
+
+      /* Memory only nodes and nodes outside our cpuset do not count */
+      if (ok == 0 || node->ncpus == 0)
+        {
+          free (node->cpus);
+          topo->nnodes--;
+        }
+    }
+  closedir (dir);
+
+  return TOPO_OK;
+}
+
+topo_err_t
+topo_init (topo_t * topo, const char * root)
+{
+  cpu_set_t * allowed;
+  size_t size, i, j;
+  topo_err_t ret;
+  int cpu;
+
+  /* Initialize the struct */
+  memset (topo, 0, sizeof (topo_t));
+  topo->max_cpu = -1;
+  allowed = CPU_ALLOC (MAX_CPUS);
+  if (allowed == NULL)
+    {
+      topo->err = cpstr (MALLOC_FAILED);
+      return TOPO_MALLOC_FAILED;
+    }
+  size = CPU_ALLOC_SIZE (MAX_CPUS);
+  if (sched_getaffinity (0, size, allowed) != 0)
+    {
+      CPU_ZERO_S (size, allowed);
+      CPU_SET_S (0, size, allowed);
+    }
+
+  ret = read_nodes (topo, root != NULL ? root : NODE_ROOT, allowed, size);
+  if (ret == TOPO_OK && topo->nnodes == 0)
+    {
+      /* Not a NUMA kernel, everything is one node */
+      ret = add_node (topo, 0);
+      for (cpu = 0; ret == TOPO_OK && cpu < MAX_CPUS; cpu++)
+        if (CPU_ISSET_S (cpu, size, allowed) &&
+            !add_cpu (&topo->nodes[0], cpu))
+          {
+            topo->err = cpstr (MALLOC_FAILED);
+            ret = TOPO_MALLOC_FAILED;
+          }
+    }
+  CPU_FREE (allowed);
+  if (ret != TOPO_OK)
+    return ret;
+
+  /* Keep the kernel's order regardless of readdir's */
+  qsort (topo->nodes, topo->nnodes, sizeof (*topo->nodes), cmp_node);
+  for (i = 0; i < topo->nnodes; i++)
+    for (j = 0; j < topo->nodes[i].ncpus; j++)
+      {
+        topo->ncpus++;
+        if (topo->nodes[i].cpus[j] > topo->max_cpu)
+          topo->max_cpu = topo->nodes[i].cpus[j];
+      }
+
+  return TOPO_OK;
+}
+
+topo_err_t
+topo_pin (topo_t * topo, size_t node, pthread_t thread)
+{
+  cpu_set_t * set;
+  size_t size, i;
+  int ret;
+
+  if (node >= topo->nnodes)
+    return TOPO_INVALID;
+  set = CPU_ALLOC (topo->max_cpu + 1);
+  if (set == NULL)
+    return TOPO_MALLOC_FAILED;
+  size = CPU_ALLOC_SIZE (topo->max_cpu + 1);
+  CPU_ZERO_S (size, set);
+  for (i = 0; i < topo->nodes[node].ncpus; i++)
+    CPU_SET_S (topo->nodes[node].cpus[i], size, set);
+  ret = pthread_setaffinity_np (thread, size, set);
+  CPU_FREE (set);
+
+  return ret == 0 ? TOPO_OK : TOPO_PIN_FAILED;
+}
+
+size_t
+topo_current (topo_t * topo)
+{
+  size_t i, j;
+  int cpu;
+
+  cpu = sched_getcpu ();
+  for (i = 0; cpu >= 0 && i < topo->nnodes; i++)
+    for (j = 0; j < topo->nodes[i].ncpus; j++)
+      if (topo->nodes[i].cpus[j] == cpu)
+        return i;
+
+  return 0;
+}
+
+const char *
+topo_get_err (topo_t * topo)
+{
+  return topo->err;
+}
+
+topo_err_t
+topo_destroy (topo_t * topo)
+{
+  size_t i;
+
+  for (i = 0; i < topo->nnodes; i++)
+    free (topo->nodes[i].cpus);
+  free (topo->nodes);
+  topo->nodes = NULL;
+  topo->nnodes = topo->ncpus = 0;
+
+  if (topo->err != NULL)
+    free (topo->err);
+  topo->err = NULL;
+
+  return TOPO_OK;
+}
+
+const char *
+topo_err_str (topo_err_t err)
+{
+  switch (err)
+    {
+    case TOPO_OK:
+      return "Success";
+    case TOPO_MALLOC_FAILED:
+      return "Allocating Memory Failed";
+    case TOPO_PIN_FAILED:
+      return "The kernel refused the cpu mask";
+    case TOPO_INVALID:
+      return "Invalid node";
+    case TOPO_UNKNOWN:
+      return "Unknown Error";
+    }
+  return "Undefined Error Code";
+}
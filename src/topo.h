@@ -0,0 +1,120 @@
+/**
+   @file topo.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Machine Topology
+   @details Groups the cpus this process may run on by NUMA node, as
+   listed under /sys/devices/system/node. Machines or kernels without
+   the listing are treated as a single node, so callers never need a
+   special case for it.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+   @brief Topology Error Codes
+**/
+typedef enum _topo_err_t
+  {
+    TOPO_OK = 0, /**< Success */
+    TOPO_MALLOC_FAILED, /**< Allocating Memory Failed */
+    TOPO_PIN_FAILED, /**< The kernel refused the cpu mask */
+    TOPO_INVALID, /**< An invalid node */
+    TOPO_UNKNOWN /**< Unknown Error */
+  } topo_err_t;
+
+/**
+   @brief NUMA Node
+**/
+struct _topo_node_t
+{
+  int id; /**< Node number given by the kernel */
+  int * cpus; /**< Usable cpus of the node */
+  size_t ncpus; /**< Number of usable cpus */
+};
+
+/**
+   @brief Topology Structure
+**/
+typedef struct _topo_t
+{
+  char * err; /**< Last Error String */
+  struct _topo_node_t * nodes; /**< Nodes with at least one usable cpu */
+  size_t nnodes; /**< Number of nodes */
+  size_t ncpus; /**< Usable cpus across every node */
+  int max_cpu; /**< Highest usable cpu number */
+} topo_t;
+
+/**
+   @brief Discovers the Topology
+   @details Only cpus in the affinity mask of the process are counted,
+   so a build confined by taskset or a cgroup stays inside it.
+   @param topo The topology structure to be initialized
+   @param root The node directory to read or NULL for the one in sysfs
+   @return TOPO_OK(0) on success or a positive error code
+**/
+topo_err_t topo_init (topo_t * topo, const char * root);
+
+/**
+   @brief Confines a Thread to a Node
+   @param topo The topology structure
+   @param node The index of the node in nodes
+   @param thread The thread to move
+   @return TOPO_OK(0) on success or a positive error code
+**/
+topo_err_t topo_pin (topo_t * topo, size_t node, pthread_t thread);
+
+/**
+   @brief Finds the Node of the Calling Thread
+   @details Only exact while the thread is pinned, otherwise it is
+   where the thread happens to run right now.
+   @param topo The topology structure
+   @return The index of the node in nodes, 0 if it is not known
+**/
+size_t topo_current (topo_t * topo);
+
+/**
+   @brief Get Detailed Error Message
+   @details Generates a string with a detailed error message
+   describing the most recent error event
+   @param topo The topology structure which had an error
+   @return Error String or NULL if no error
+**/
+const char * topo_get_err (topo_t * topo);
+
+/**
+   @brief Destroys the Topology
+   @param topo The topology structure to be destroyed
+   @return TOPO_OK(0) on success or a positive error code
+**/
+topo_err_t topo_destroy (topo_t * topo);
+
+/**
+   @brief Generates a string describing the error code
+   @param err The error code to be described.
+   @return The string representing the error code.
+*/
+const char * topo_err_str (topo_err_t err);
+
+#endif
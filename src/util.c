@@ -28,6 +28,8 @@
 #include <stdarg.h>
 #include <string.h>
 
+#define FMT_STACK 256
+
 void *
 memdup (const void * data, size_t len)
 {
@@ -70,31 +72,61 @@ cpstr (const char * str)
   return (char*) memdup (str, (strlen (str)+1) * sizeof (char));
 }
 
-char *
-cpstrf (const char * format, ...)
+static char *
+vfmtstr (char * buf, size_t len, const char * format, va_list args)
 {
-  va_list args;
+  va_list copy;
   char * ret;
   int ret_len;
 
-  /* Setup the Variable Argument List */
-  va_start (args, format);
+  /* Try the buffer first, keeping the arguments for a second pass */
+  va_copy (copy, args);
+  ret_len = vsnprintf (buf, len, format, args);
+  if (ret_len < 0)
+    {
+      va_end (copy);
+      return NULL;
+    }
+  if ((size_t)ret_len < len)
+    {
+      va_end (copy);
+      return buf;
+    }
 
-  /* Get the length of the string */
-  ret_len = vsnprintf (NULL, 0, format, args) + 1;
+  /* Generate the string */
+  ret = (char*) malloc ((ret_len+1) * sizeof (char));
+  if (ret != NULL)
+    vsnprintf (ret, ret_len+1, format, copy);
+  va_end (copy);
+
+  return ret;
+}
+
+char *
+fmtstr (char * buf, size_t len, const char * format, ...)
+{
+  va_list args;
+  char * ret;
 
-  /* Reset the args list */
-  va_end (args);
   va_start (args, format);
+  ret = vfmtstr (buf, len, format, args);
+  va_end (args);
 
-  /* Generate the string */
-  ret = (char*) malloc (ret_len * sizeof (char));
-  if (ret == NULL)
-    return NULL;
-  vsnprintf (ret, ret_len, format, args);
+  return ret;
+}
 
-  /* Cleanup the arguments list */
+char *
+cpstrf (const char * format, ...)
+{
+  char buf[FMT_STACK], * ret;
+  va_list args;
+
+  /* Short strings are formatted once and copied off the stack */
+  va_start (args, format);
+  ret = vfmtstr (buf, sizeof (buf), format, args);
   va_end (args);
+  if (ret == buf)
+    ret = cpstr (buf);
 
   return ret;
 }
@@ -62,3 +62,15 @@ char * cpstr (const char * str);
    @return A newly allocated copy of str.
 **/
 char * cpstrf (const char * format, ...);
+
+/**
+   @brief Formats a String without Allocating if it Fits
+   @details Formats the string into buf when it fits in len bytes and
+   into a chunk of heap memory otherwise, so short strings never touch
+   the heap. The result must only be freed if it is not buf.
+   @param buf A caller supplied buffer, usually on the stack
+   @param len The size of buf
+   @param format The string formatting function.
+   @return buf, a newly allocated string or NULL on failure
+**/
+char * fmtstr (char * buf, size_t len, const char * format, ...);
@@ -0,0 +1,144 @@
+/**
+   @file bench_cdc.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Defined Chunking Benchmark
+   @details Measures the cutting rate on one core, alone and with the
+   SHA-256 of every chunk as an upload does, then how much of a
+   BENCH_CDC_SIZE blob, 64M by default, would be sent again after a
+   small insertion and after a flipped byte. Fails if either edit
+   shares less than BENCH_CDC_DEDUP percent of the bytes, 90 by
+   default.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include "cdc.h"
+#include "check.h"
+#include "digest.h"
+
+#define AVG 65536 /**< The default CACHE_CHUNK */
+
+/* A chunk digest and its length */
+struct chunk
+{
+  uint8_t digest[DIGEST_LEN];
+  size_t len;
+};
+
+/* Orders chunks by digest */
+static int
+chunk_cmp (const void * a, const void * b)
+{
+  return memcmp (((const struct chunk *)a)->digest,
+                 ((const struct chunk *)b)->digest, DIGEST_LEN);
+}
+
+/* Cuts and digests data, returning the number of chunks */
+static size_t
+cut_all (const cdc_t * cdc, const uint8_t * data, size_t len,
+         struct chunk * out)
+{
+  size_t off, n = 0;
+
+  for (off = 0; off < len; off += out[n++].len)
+    {
+      out[n].len = cdc_cut (cdc, data + off, len - off);
+      digest_buffer (data + off, out[n].len, out[n].digest);
+    }
+  return n;
+}
+
+/* Counts the bytes of the new chunks missing from the old ones */
+static uint64_t
+missing (struct chunk * old, size_t nold, const struct chunk * cur,
+         size_t ncur)
+{
+  uint64_t ret = 0;
+  size_t i;
+
+  qsort (old, nold, sizeof (*old), chunk_cmp);
+  for (i = 0; i < ncur; i++)
+    if (bsearch (&cur[i], old, nold, sizeof (*old), chunk_cmp) == NULL)
+      ret += cur[i].len;
+  return ret;
+}
+
+/* Reports and checks the bytes an edited blob would resend */
+static void
+edit (const char * name, const cdc_t * cdc, const uint8_t * data,
+      size_t len, struct chunk * old, size_t nold, struct chunk * cur)
+{
+  uint64_t dedup = check_env ("BENCH_CDC_DEDUP", 90), sent;
+  size_t ncur;
+
+  ncur = cut_all (cdc, data, len, cur);
+  sent = missing (old, nold, cur, ncur);
+  printf ("  %-8s sends %8.1f K of %.1f M, %.2f%% deduplicated\n", name,
+          sent / 1024.0, len / 1048576.0, 100.0 - sent * 100.0 / len);
+  CHECK (sent * 100 <= (100 - dedup) * len);
+}
+
+int
+main (void)
+{
+  uint64_t size = check_env ("BENCH_CDC_SIZE", 64 << 20), begin, ns;
+  struct chunk * old, * cur;
+  size_t n, off, cut, max;
+  uint8_t * data;
+  cdc_t cdc;
+
+  cdc_init (&cdc, AVG);
+  max = size / cdc.min + 2;
+  data = malloc (size + 16);
+  old = malloc (max * sizeof (*old));
+  cur = malloc (max * sizeof (*cur));
+  CHECK (data != NULL && old != NULL && cur != NULL);
+  check_random (data, size, 1);
+  printf ("bench_cdc: %" PRIu64 " MB, %zu K average chunks\n", size >> 20,
+          cdc.avg >> 10);
+
+  begin = check_ns ();
+  for (off = n = 0; off < size; off += cut, n++)
+    cut = cdc_cut (&cdc, data + off, size - off);
+  ns = check_ns () - begin;
+  printf ("  cut            %8.2f GB/s, %zu chunks\n", size / (double)ns,
+          n);
+
+  begin = check_ns ();
+  n = cut_all (&cdc, data, size, old);
+  ns = check_ns () - begin;
+  printf ("  cut + digest   %8.2f GB/s\n", size / (double)ns);
+
+  /* Ten bytes inserted near the front */
+  memmove (data + 1010, data + 1000, size - 1000);
+  memset (data + 1000, 'x', 10);
+  edit ("insert", &cdc, data, size + 10, old, n, cur);
+  memmove (data + 1000, data + 1010, size - 1000);
+
+  /* One byte flipped in the middle */
+  data[size / 2] ^= 0xff;
+  edit ("flip", &cdc, data, size, old, n, cur);
+
+  free (cur);
+  free (old);
+  free (data);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+/**
+   @file bench_hashio.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Batched File Hashing Benchmark
+   @details Hashes a tree of BENCH_HASH_FILES small files, 20000 by default,
+   through io_uring and then through the pread fallback of the same
+   engine, and reports the files per second and io_uring_enter calls
+   of the best of BENCH_HASH_RUNS passes, 3 by default. Both passes
+   read from the page cache, so only the syscall and hand off costs
+   are compared. Fails if the ring needs an io_uring_enter call per
+   file, and is skipped when the kernel does not offer io_uring.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "check.h"
+#include "hashio.h"
+
+#define DIRS 64 /**< Directories the files are spread over */
+#define MAX_SIZE 8192 /**< Largest file in bytes */
+
+/* Hashes the whole tree runs times, returns the best time in ns */
+static uint64_t
+pass (hashio_t * hio, const char * const * paths, size_t count,
+      hashio_result_t * res, uint64_t runs, uint64_t * enters)
+{
+  uint64_t begin, ns, best = UINT64_MAX;
+  size_t i;
+
+  for (i = 0; i < runs; i++)
+    {
+      hio->enters = 0;
+      begin = check_ns ();
+      CHECK (hashio_hash (hio, paths, count, res) == HASHIO_OK);
+      ns = check_ns () - begin;
+      if (ns < best)
+        {
+          best = ns;
+          *enters = hio->enters;
+        }
+    }
+  return best;
+}
+
+int
+main (void)
+{
+  uint64_t count = check_env ("BENCH_HASH_FILES", 20000);
+  uint64_t runs = check_env ("BENCH_HASH_RUNS", 3);
+  uint64_t ring_ns, pread_ns, ring_enters, pread_enters;
+  hashio_result_t * ring_res, * pread_res;
+  char dir[256], sub[PATH_MAX], ** names;
+  struct _hashio_ring_t * ring;
+  uint8_t data[MAX_SIZE];
+  size_t i, size;
+  hashio_t hio;
+  FILE * file;
+
+  CHECK (count > 0 && runs > 0);
+  CHECK (hashio_init (&hio, 0, 0) == HASHIO_OK);
+  if (hio.ring == NULL)
+    {
+      printf ("bench_hashio: io_uring is unavailable\n");
+      CHECK (hashio_destroy (&hio) == HASHIO_OK);
+      return CHECK_SKIP;
+    }
+
+  check_tmpdir ("bench_hashio", dir, sizeof (dir));
+  names = malloc (count * sizeof (char*));
+  ring_res = malloc (count * sizeof (hashio_result_t));
+  pread_res = malloc (count * sizeof (hashio_result_t));
+  CHECK (names != NULL && ring_res != NULL && pread_res != NULL);
+  for (i = 0; i < DIRS && i < count; i++)
+    {
+      snprintf (sub, sizeof (sub), "%s/d%02zu", dir, i);
+      CHECK (mkdir (sub, 0755) == 0);
+    }
+  for (i = 0; i < count; i++)
+    {
+      names[i] = malloc (PATH_MAX);
+      CHECK (names[i] != NULL);
+      snprintf (names[i], PATH_MAX, "%s/d%02zu/f%zu.o", dir, i % DIRS, i);
+      check_random (data, sizeof (data), i);
+      size = data[0] | (size_t)data[1] << 8;
+      size %= MAX_SIZE;
+      file = fopen (names[i], "w");
+      CHECK (file != NULL);
+      CHECK (fwrite (data, 1, size, file) == size);
+      CHECK (fclose (file) == 0);
+    }
+
+  /* Warm the page cache so neither pass pays for the disk */
+  pass (&hio, (const char * const *) names, count, ring_res, 1,
+        &ring_enters);
+  ring_ns = pass (&hio, (const char * const *) names, count, ring_res, runs,
+                  &ring_enters);
+
+  /* The engine falls back to pread whenever it has no ring */
+  ring = hio.ring;
+  hio.ring = NULL;
+  pread_ns = pass (&hio, (const char * const *) names, count, pread_res,
+                   runs, &pread_enters);
+  hio.ring = ring;
+
+  for (i = 0; i < count; i++)
+    {
+      CHECK (ring_res[i].err == 0 && pread_res[i].err == 0);
+      CHECK (ring_res[i].size == pread_res[i].size);
+      CHECK (memcmp (ring_res[i].digest, pread_res[i].digest,
+                     DIGEST_LEN) == 0);
+    }
+
+  printf ("bench_hashio: %" PRIu64 " files, %zu threads, depth %zu\n",
+          count, hio.threads, hio.depth);
+  printf ("  io_uring  %12.0f files/s, %8" PRIu64 " enters, %.3f per file\n",
+          count * 1e9 / ring_ns, ring_enters, (double)ring_enters / count);
+  printf ("  pread     %12.0f files/s, %8" PRIu64 " enters\n",
+          count * 1e9 / pread_ns, pread_enters);
+  CHECK (pread_enters == 0);
+  CHECK (ring_enters < count);
+
+  CHECK (hashio_destroy (&hio) == HASHIO_OK);
+  for (i = 0; i < count; i++)
+    free (names[i]);
+  free (names);
+  free (ring_res);
+  free (pread_res);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
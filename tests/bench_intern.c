@@ -0,0 +1,231 @@
+/**
+   @file bench_intern.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief String Interning Benchmark
+   @details Builds BENCH_INTERN_REFS references, 1M by default, to
+   BENCH_INTERN_PATHS distinct 47 byte paths, 50k by default, and
+   compares holding them as cpstr copies with interning them: memory,
+   resolving a name with bsearch over sorted copies against
+   intern_find, and lookups from BENCH_THREADS threads. Also times
+   cpstrf against formatting twice, as it did before, and fmtstr into
+   a stack buffer. Fails if interning saves less than
+   BENCH_INTERN_SAVING percent of the memory, 75 by default.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include "check.h"
+#include "intern.h"
+#include "util.h"
+
+#define FORMATS 1000000 /**< Messages formatted by each variant */
+#define PATH_LEN 64 /**< Room for each path, they are 47 bytes */
+
+static intern_t table;
+static char ** refs;
+static size_t nrefs;
+
+/* Bytes currently allocated from the heap */
+static size_t
+heap_used (void)
+{
+  struct mallinfo2 mi = mallinfo2 ();
+
+  return mi.uordblks + mi.hblkhd;
+}
+
+/* Small, fast and the same everywhere, unlike rand () */
+static uint64_t
+next (uint64_t * state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Orders string pointers by their strings */
+static int
+str_cmp (const void * a, const void * b)
+{
+  return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/* The allocation cpstrf used to make, sized by a first format */
+static char *
+cpstrf_twice (const char * format, ...)
+{
+  va_list args;
+  char * ret;
+  int len;
+
+  va_start (args, format);
+  len = vsnprintf (NULL, 0, format, args);
+  va_end (args);
+  ret = malloc (len + 1);
+  va_start (args, format);
+  vsnprintf (ret, len + 1, format, args);
+  va_end (args);
+  return ret;
+}
+
+/* Looks up every reference in the table */
+static void *
+lookup (void * arg)
+{
+  size_t i, misses = 0;
+
+  (void) arg;
+  for (i = 0; i < nrefs; i++)
+    misses += intern_find (&table, refs[i]) == INTERN_NONE;
+  CHECK (misses == 0);
+  return NULL;
+}
+
+int
+main (void)
+{
+  uint64_t npaths = check_env ("BENCH_INTERN_PATHS", 50000);
+  uint64_t saving = check_env ("BENCH_INTERN_SAVING", 75);
+  uint64_t threads = check_env ("BENCH_THREADS", sysconf (_SC_NPROCESSORS_ONLN));
+  uint64_t state = 1, begin, ns, sink = 0;
+  size_t i, before, copies, interned;
+  char ** paths, ** sorted, ** key, * str, buf[256];
+  intern_id_t * ids;
+  pthread_t * tids;
+
+  nrefs = check_env ("BENCH_INTERN_REFS", 1000000);
+  paths = malloc (npaths * sizeof (*paths));
+  refs = malloc (nrefs * sizeof (*refs));
+  sorted = malloc (nrefs * sizeof (*sorted));
+  ids = malloc (nrefs * sizeof (*ids));
+  tids = malloc (threads * sizeof (*tids));
+  CHECK (paths != NULL && refs != NULL && sorted != NULL);
+  CHECK (ids != NULL && tids != NULL);
+  for (i = 0; i < npaths; i++)
+    {
+      paths[i] = malloc (PATH_LEN + 1);
+      CHECK (paths[i] != NULL);
+      snprintf (paths[i], PATH_LEN + 1, "src/module%02u/sub%03u/file%06zu"
+                "_%016" PRIx64, (unsigned)(i % 97), (unsigned)(i % 911), i,
+                next (&state));
+    }
+  printf ("bench_intern: %zu references to %" PRIu64 " paths\n", nrefs,
+          npaths);
+
+  /* Every reference holding its own copy */
+  before = heap_used ();
+  for (i = 0; i < nrefs; i++)
+    {
+      refs[i] = cpstr (paths[next (&state) % npaths]);
+      CHECK (refs[i] != NULL);
+    }
+  copies = heap_used () - before;
+
+  /* Every reference holding an ID */
+  CHECK (intern_init (&table, 0) == INTERN_OK);
+  for (i = 0; i < nrefs; i++)
+    {
+      ids[i] = intern_id (&table, refs[i]);
+      CHECK (ids[i] != INTERN_NONE);
+    }
+  CHECK (intern_count (&table) <= npaths);
+  interned = intern_memory (&table) + nrefs * sizeof (*ids);
+  printf ("  memory copies  %10.1f MB\n", copies / 1048576.0);
+  printf ("  memory intern  %10.1f MB, %.1f MB of it IDs\n",
+          interned / 1048576.0, nrefs * sizeof (*ids) / 1048576.0);
+
+  /* Resolving names against the sorted copies or the table */
+  memcpy (sorted, refs, nrefs * sizeof (*refs));
+  qsort (sorted, nrefs, sizeof (*sorted), str_cmp);
+  begin = check_ns ();
+  for (i = 0; i < nrefs; i++)
+    {
+      key = bsearch (&refs[i], sorted, nrefs, sizeof (*sorted), str_cmp);
+      sink += key != NULL;
+    }
+  ns = check_ns () - begin;
+  printf ("  resolve bsearch %9.1f ns\n", (double)ns / nrefs);
+  begin = check_ns ();
+  for (i = 0; i < nrefs; i++)
+    sink += intern_find (&table, refs[i]) == ids[i];
+  ns = check_ns () - begin;
+  printf ("  resolve intern %10.1f ns\n", (double)ns / nrefs);
+  CHECK (sink == nrefs * 2);
+
+  /* Readers only take shard read locks */
+  begin = check_ns ();
+  for (i = 0; i < threads; i++)
+    CHECK (pthread_create (&tids[i], NULL, lookup, NULL) == 0);
+  for (i = 0; i < threads; i++)
+    pthread_join (tids[i], NULL);
+  ns = check_ns () - begin;
+  printf ("  lookups x%-4" PRIu64 " %10.1f M/s\n", threads,
+          threads * nrefs * 1e3 / ns);
+
+  /* A typical error message */
+  begin = check_ns ();
+  for (i = 0; i < FORMATS; i++)
+    {
+      str = cpstrf_twice ("%s:%zu: Invalid %s for %s: %s\n", paths[i % 64],
+                          i, "duration", "CACHE_TIMEOUT", "soon");
+      free (str);
+    }
+  printf ("  format twice   %10.1f ns\n", (check_ns () - begin) /
+          (double)FORMATS);
+  begin = check_ns ();
+  for (i = 0; i < FORMATS; i++)
+    {
+      str = cpstrf ("%s:%zu: Invalid %s for %s: %s\n", paths[i % 64], i,
+                    "duration", "CACHE_TIMEOUT", "soon");
+      free (str);
+    }
+  printf ("  cpstrf         %10.1f ns\n", (check_ns () - begin) /
+          (double)FORMATS);
+  begin = check_ns ();
+  for (i = 0; i < FORMATS; i++)
+    {
+      str = fmtstr (buf, sizeof (buf), "%s:%zu: Invalid %s for %s: %s\n",
+                    paths[i % 64], i, "duration", "CACHE_TIMEOUT", "soon");
+      if (str != buf)
+        free (str);
+    }
+  printf ("  fmtstr         %10.1f ns\n", (check_ns () - begin) /
+          (double)FORMATS);
+
+  CHECK (interned * 100 <= (100 - saving) * copies);
+
+  CHECK (intern_destroy (&table) == INTERN_OK);
+  for (i = 0; i < nrefs; i++)
+    free (refs[i]);
+  for (i = 0; i < npaths; i++)
+    free (paths[i]);
+  free (tids);
+  free (ids);
+  free (sorted);
+  free (refs);
+  free (paths);
+  return EXIT_SUCCESS;
+}
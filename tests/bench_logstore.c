@@ -0,0 +1,183 @@
+/**
+   @file bench_logstore.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Log Store Benchmark
+   @details Writes a synthetic compile log, BENCH_LOG_SIZE bytes and
+   256M by default, then reports the compression ratio, the write
+   rate and how long tailing and searching take and how many chunks
+   they decompress. Fails if the ratio drops below BENCH_LOG_RATIO or
+   a search decompresses more than one chunk in BENCH_LOG_SKIP besides
+   those holding a match.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <limits.h>
+#include "check.h"
+#include "logstore.h"
+
+#define TAILS 1000 /**< Tails timed */
+#define SEARCHES 5 /**< Searches timed for each pattern */
+
+static const char * verbs[] = { "CC", "CC", "CC", "LD", "AR", "GEN" };
+static const char * dirs[] = { "src/core", "src/net", "src/db", "lib/util",
+                               "lib/json", "tools", "tests/unit" };
+
+/* Small, fast and the same everywhere, unlike rand () */
+static uint64_t
+next (uint64_t * state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Formats one line of build output */
+static size_t
+gen_line (char * line, size_t len, uint64_t * state, int needle)
+{
+  uint64_t r = next (state);
+  const char * dir = dirs[r % 7];
+  unsigned file = (r >> 8) % 400, col = (r >> 20) % 80;
+
+  if (needle)
+    return snprintf (line, len, "%s/file%u.c:%u:%u: error: use of "
+                     "undeclared identifier 'bench_needle'\n", dir, file,
+                     (unsigned)(r >> 32) % 2000, col);
+  if ((r >> 40) % 50 == 0)
+    return snprintf (line, len, "%s/file%u.c:%u:%u: warning: unused "
+                     "variable 'tmp%u' [-Wunused-variable]\n", dir, file,
+                     (unsigned)(r >> 32) % 2000, col, col);
+  if ((r >> 40) % 50 == 1)
+    return snprintf (line, len, "gcc -DHAVE_CONFIG_H -I. -I.. -g -O2 "
+                     "-MT %s/file%u.o -MD -MP -c -o %s/file%u.o "
+                     "%s/file%u.c\n", dir, file, dir, file, dir, file);
+  return snprintf (line, len, "  %-4s %s/file%u.o [%" PRIu64 "ms]\n",
+                   verbs[(r >> 48) % 6], dir, file, (r >> 52) % 20 * 10);
+}
+
+/* Counts the matching lines */
+static int
+count (void * arg, uint64_t line, const char * data, size_t len)
+{
+  (void) line;
+  (void) data;
+  (void) len;
+  (*(uint64_t *)arg)++;
+  return 0;
+}
+
+/* Times a search and reports what it read */
+static void
+search (logstore_t * ls, const char * name, const char * pattern,
+        uint64_t expect)
+{
+  uint64_t found = 0, begin, ns, skip;
+  size_t i;
+
+  begin = check_ns ();
+  for (i = 0; i < SEARCHES; i++)
+    {
+      ls->chunks_read = 0;
+      found = 0;
+      CHECK (logstore_search (ls, pattern, count, &found) == LOGSTORE_OK);
+    }
+  ns = (check_ns () - begin) / SEARCHES;
+  printf ("  search %-7s %10.3f ms, %" PRIu64 " of %zu chunks, %" PRIu64
+          " lines\n", name, ns / 1e6, ls->chunks_read, ls->nchunks, found);
+  CHECK (found == expect);
+
+  /* Only chunks the filters let through by mistake count against it */
+  skip = check_env ("BENCH_LOG_SKIP", 16);
+  CHECK (ls->chunks_read <= found + ls->nchunks / skip);
+}
+
+int
+main (void)
+{
+  uint64_t size = check_env ("BENCH_LOG_SIZE", 256 << 20);
+  uint64_t ratio = check_env ("BENCH_LOG_RATIO", 4);
+  uint64_t state = 1, written = 0, lines = 0, begin, ns, needles = 0;
+  uint64_t blocks, every;
+  char dir[256], base[PATH_MAX], block[65536];
+  size_t len, i;
+  int needle;
+  logstore_t ls;
+  buffer_t out;
+
+  check_tmpdir ("bench_logstore", dir, sizeof (dir));
+  snprintf (base, sizeof (base), "%s/build", dir);
+
+  /* Eight errors spread through the log whatever its size */
+  every = size / sizeof (block) / 8;
+  every = every > 0 ? every : 1;
+  CHECK (logstore_open (&ls, base, 1, 0) == LOGSTORE_OK);
+  begin = check_ns ();
+  for (blocks = 0; written < size; blocks++)
+    {
+      needle = blocks % every == every / 2;
+      needles += needle;
+      for (len = 0; len < sizeof (block) - 256; lines++, needle = 0)
+        len += gen_line (block + len, sizeof (block) - len, &state,
+                         needle);
+      CHECK (logstore_write (&ls, block, len) == LOGSTORE_OK);
+      written += len;
+    }
+  CHECK (logstore_flush (&ls) == LOGSTORE_OK);
+  ns = check_ns () - begin;
+
+  printf ("bench_logstore: %" PRIu64 " MB, %" PRIu64 " lines\n",
+          written >> 20, lines);
+  printf ("  stored         %10.1f MB, %.2fx\n", ls.stored_bytes / 1048576.0,
+          (double)ls.raw_bytes / ls.stored_bytes);
+  printf ("  write          %10.1f MB/s\n", written * 1e9 / 1048576.0 / ns);
+  CHECK (ls.raw_bytes >= ratio * ls.stored_bytes);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  /* Readers open the index and never touch most of the data */
+  begin = check_ns ();
+  CHECK (logstore_open (&ls, base, 0, 0) == LOGSTORE_OK);
+  printf ("  open           %10.3f ms, %zu chunks\n",
+          (check_ns () - begin) / 1e6, ls.nchunks);
+  CHECK (ls.lines == lines);
+
+  CHECK (buffer_init (&out, 0, 0) == BUFF_OK);
+  ls.chunks_read = 0;
+  begin = check_ns ();
+  for (i = 0; i < TAILS; i++)
+    {
+      out.len = 0;
+      CHECK (logstore_tail (&ls, 100, &out) == LOGSTORE_OK);
+    }
+  printf ("  tail 100       %10.3f ms, %.1f chunks\n",
+          (check_ns () - begin) / 1e6 / TAILS,
+          (double)ls.chunks_read / TAILS);
+  buffer_destroy (&out);
+
+  search (&ls, "hit", "bench_needle", needles);
+  search (&ls, "miss", "no_such_identifier", 0);
+
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
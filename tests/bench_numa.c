@@ -0,0 +1,171 @@
+/**
+   @file bench_numa.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief NUMA Placement Benchmark
+   @details Runs the synthetic load, spinning LOAD_WIDTH by LOAD_DEPTH
+   targets, with SCHED_NUMA off and on, and reports the makespan,
+   throughput, nodes and stolen targets of the best of BENCH_NUMA_RUNS
+   runs, 3 by default. On a machine with one node the placed run is
+   repeated on a topology split in two so the per node queues and
+   stealing are still measured. Fails if a placed run is more than
+   BENCH_NUMA_SLOWDOWN percent, 20 by default, slower than the
+   unplaced one.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include "check.h"
+#include "conf.h"
+#include "load.h"
+#include "topo.h"
+
+/* Writes a fake node directory with the allowed cpus split over two
+   nodes, both nodes get the only cpu of a single cpu machine */
+static void
+split_topology (const char * root)
+{
+  char path[PATH_MAX];
+  cpu_set_t set;
+  int cpus[CPU_SETSIZE], ncpus = 0, cpu, node, half;
+  FILE * file;
+
+  CHECK (sched_getaffinity (0, sizeof (set), &set) == 0);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET (cpu, &set))
+      cpus[ncpus++] = cpu;
+  CHECK (ncpus > 0);
+  half = ncpus > 1 ? ncpus / 2 : 1;
+
+  CHECK (mkdir (root, 0700) == 0);
+  for (node = 0; node < 2; node++)
+    {
+      snprintf (path, sizeof (path), "%s/node%d", root, node);
+      CHECK (mkdir (path, 0700) == 0);
+      snprintf (path, sizeof (path), "%s/node%d/cpulist", root, node);
+      file = fopen (path, "w");
+      CHECK (file != NULL);
+      if (ncpus == 1)
+        fprintf (file, "%d", cpus[0]);
+      for (cpu = node * half; ncpus > 1 && cpu < (node ? ncpus : half);
+           cpu++)
+        fprintf (file, "%s%d", cpu > node * half ? "," : "", cpus[cpu]);
+      fprintf (file, "\n");
+      CHECK (fclose (file) == 0);
+    }
+}
+
+/* Runs the load runs times with the override numa, on the topology
+   under root if given, and returns the best makespan in us */
+static uint64_t
+run (const char * name, conf_t * base, const char * numa, const char * root,
+     uint64_t runs)
+{
+  const char * pairs[] = { numa };
+  load_report_t rep, best;
+  conf_t conf;
+  load_t load;
+  uint64_t i;
+
+  CHECK (conf_fork (&conf, base) == CONF_OK);
+  CHECK (conf_overlay (&conf, "benchmark", pairs, 1) == CONF_OK);
+  if (load_init (&load, &conf) != LOAD_OK)
+    {
+      fprintf (stderr, "Load Error: %s", load_get_err (&load));
+      exit (EXIT_FAILURE);
+    }
+  if (root != NULL)
+    {
+      topo_destroy (&load.runner.topo);
+      CHECK (topo_init (&load.runner.topo, root) == TOPO_OK);
+      load.runner.numa = load.runner.topo.nnodes > 1;
+    }
+
+  memset (&best, 0, sizeof (best));
+  for (i = 0; i < runs; i++)
+    {
+      if (load_run (&load, &rep) != LOAD_OK)
+        {
+          fprintf (stderr, "Load Error: %s", load_get_err (&load));
+          exit (EXIT_FAILURE);
+        }
+      if (i == 0 || rep.makespan_us < best.makespan_us)
+        best = rep;
+    }
+  CHECK (best.makespan_us > 0);
+
+  printf ("  %-12s %8.1f ms, %8.1f jobs/s, %zu workers on %zu nodes, "
+          "%" PRIu64 " stolen, p99 overhead %" PRIu64 " us\n", name,
+          best.makespan_us / 1e3, best.jobs * 1e6 / best.makespan_us,
+          best.workers, best.nodes, best.stolen, best.overhead_p99_us);
+
+  CHECK (load_destroy (&load) == LOAD_OK);
+  CHECK (conf_destroy (&conf) == CONF_OK);
+  return best.makespan_us;
+}
+
+int
+main (void)
+{
+  uint64_t runs = check_env ("BENCH_NUMA_RUNS", 3);
+  uint64_t slowdown = check_env ("BENCH_NUMA_SLOWDOWN", 20);
+  uint64_t width = check_env ("BENCH_NUMA_WIDTH", 32);
+  uint64_t depth = check_env ("BENCH_NUMA_DEPTH", 8);
+  char dir[256], path[PATH_MAX], root[PATH_MAX];
+  uint64_t off, on;
+  topo_t topo;
+  conf_t conf;
+  FILE * file;
+
+  CHECK (runs > 0);
+  check_tmpdir ("bench_numa", dir, sizeof (dir));
+  snprintf (path, sizeof (path), "%s/autobuild.conf", dir);
+  file = fopen (path, "w");
+  CHECK (file != NULL);
+  fprintf (file, "LOAD_WORK = spin\nLOAD_DIST = const\n"
+           "LOAD_DURATION = 2ms\nLOAD_WIDTH = %" PRIu64 "\n"
+           "LOAD_DEPTH = %" PRIu64 "\n", width, depth);
+  CHECK (fclose (file) == 0);
+  CHECK (conf_init (&conf, path) == CONF_OK);
+
+  CHECK (topo_init (&topo, NULL) == TOPO_OK);
+  printf ("bench_numa: %" PRIu64 " x %" PRIu64 " spinning targets, "
+          "%zu cpus on %zu nodes\n", width, depth, topo.ncpus, topo.nnodes);
+
+  off = run ("unplaced", &conf, "SCHED_NUMA=no", NULL, runs);
+  on = run ("placed", &conf, "SCHED_NUMA=yes", NULL, runs);
+  CHECK (on * 100 <= off * (100 + slowdown));
+  if (topo.nnodes < 2)
+    {
+      snprintf (root, sizeof (root), "%s/node", dir);
+      split_topology (root);
+      on = run ("placed split", &conf, "SCHED_NUMA=yes", root, runs);
+      CHECK (on * 100 <= off * (100 + slowdown));
+    }
+
+  topo_destroy (&topo);
+  CHECK (conf_destroy (&conf) == CONF_OK);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
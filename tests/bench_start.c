@@ -0,0 +1,132 @@
+/**
+   @file bench_start.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Startup Time Benchmark
+   @details Spawns BENCH_START_RUNS copies, 500 by default, of
+   /bin/true and of the quick autobuild commands and reports the start
+   to exit percentiles. Fails if the median of a command is more than
+   BENCH_START_OVERHEAD microseconds, 1000 by default, over the median
+   of /bin/true. BENCH_AUTOBUILD names the binary, ../src/autobuild by
+   default.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "check.h"
+
+extern char ** environ;
+
+/* Orders the samples */
+static int
+u64_cmp (const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Times runs spawns of argv and returns the median in ns */
+static uint64_t
+run (const char * name, char * const * argv, uint64_t * samples,
+     size_t runs)
+{
+  posix_spawn_file_actions_t fa;
+  uint64_t begin;
+  size_t i;
+  pid_t pid;
+  int status;
+
+  CHECK (posix_spawn_file_actions_init (&fa) == 0);
+  CHECK (posix_spawn_file_actions_addopen (&fa, 1, "/dev/null", O_WRONLY,
+                                           0) == 0);
+  CHECK (posix_spawn_file_actions_addopen (&fa, 2, "/dev/null", O_WRONLY,
+                                           0) == 0);
+  for (i = 0; i < runs; i++)
+    {
+      begin = check_ns ();
+      CHECK (posix_spawn (&pid, argv[0], &fa, NULL, argv, environ) == 0);
+      CHECK (waitpid (pid, &status, 0) == pid);
+      samples[i] = check_ns () - begin;
+      CHECK (WIFEXITED (status));
+    }
+  posix_spawn_file_actions_destroy (&fa);
+
+  qsort (samples, runs, sizeof (*samples), u64_cmp);
+  printf ("  %-20s p50 %6.3f ms, p99 %6.3f ms\n", name,
+          samples[runs / 2] / 1e6, samples[runs * 99 / 100] / 1e6);
+  return samples[runs / 2];
+}
+
+/* The autobuild binary to time */
+static char *
+binary (void)
+{
+  char * bin = getenv ("BENCH_AUTOBUILD");
+
+  return bin != NULL && bin[0] != '\0' ? bin : "../src/autobuild";
+}
+
+int
+main (void)
+{
+  uint64_t runs = check_env ("BENCH_START_RUNS", 500);
+  uint64_t overhead = check_env ("BENCH_START_OVERHEAD", 1000) * 1000;
+  char dir[256], conf[PATH_MAX], sock[PATH_MAX], * bin = binary ();
+  char * true_argv[] = { "/bin/true", NULL };
+  char * help_argv[] = { bin, "--help", NULL };
+  char * status_argv[] = { bin, "--status", "--socket", sock, NULL };
+  char * conf_argv[] = { bin, "-c", conf, "--status", NULL };
+  uint64_t * samples, base;
+  FILE * file;
+
+  if (access (bin, X_OK) != 0)
+    {
+      fprintf (stderr, "bench_start: %s is not built\n", bin);
+      return CHECK_SKIP;
+    }
+  samples = malloc (runs * sizeof (*samples));
+  CHECK (runs > 0 && samples != NULL);
+
+  /* Nothing listens on the socket, the commands fail straight away */
+  check_tmpdir ("bench_start", dir, sizeof (dir));
+  snprintf (sock, sizeof (sock), "%s/none.sock", dir);
+  snprintf (conf, sizeof (conf), "%s/autobuild.conf", dir);
+  file = fopen (conf, "w");
+  CHECK (file != NULL);
+  fprintf (file, "CONTROL_SOCKET = none.sock\n");
+  CHECK (fclose (file) == 0);
+
+  printf ("bench_start: %" PRIu64 " runs\n", runs);
+  base = run ("/bin/true", true_argv, samples, runs);
+  CHECK (run ("--help", help_argv, samples, runs) <= base + overhead);
+  CHECK (run ("--status --socket", status_argv, samples, runs) <=
+         base + overhead);
+  CHECK (run ("--status via config", conf_argv, samples, runs) <=
+         base + overhead);
+
+  check_rmdir (dir);
+  free (samples);
+  return EXIT_SUCCESS;
+}
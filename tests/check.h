@@ -0,0 +1,173 @@
+/**
+   @file check.h
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Test and Benchmark Helpers
+   @details Shared by the programs run by make check and make bench.
+   A failed CHECK prints where it failed and exits, which automake
+   reports as a failed test.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+
+/**
+   @brief Fails the test unless cond holds
+**/
+#define CHECK(cond)                                                     \
+  do                                                                    \
+    {                                                                   \
+      if (!(cond))                                                      \
+        {                                                               \
+          fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__,       \
+                   __LINE__, #cond);                                    \
+          exit (EXIT_FAILURE);                                          \
+        }                                                               \
+    }                                                                   \
+  while (0)
+
+/**
+   @brief Exit status telling automake the test was skipped
+**/
+#define CHECK_SKIP 77
+
+/**
+   @brief Reads the monotonic clock
+   @return Nanoseconds since an arbitrary point
+**/
+inline static uint64_t
+check_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+   @brief Reads a size from the environment
+   @details Benchmarks take their sizes from BENCH_* variables so make
+   bench can be scaled without editing anything.
+   @param name The variable name
+   @param def The value used when the variable is not set
+   @return The value of the variable with an optional K, M or G suffix
+**/
+inline static uint64_t
+check_env (const char * name, uint64_t def)
+{
+  const char * val = getenv (name);
+  char * end;
+  uint64_t ret;
+
+  if (val == NULL || val[0] == '\0')
+    return def;
+  ret = strtoull (val, &end, 10);
+  switch (*end)
+    {
+    case 'G':
+      ret <<= 10;
+      /* Fall through */
+    case 'M':
+      ret <<= 10;
+      /* Fall through */
+    case 'K':
+      ret <<= 10;
+    }
+  return ret;
+}
+
+/**
+   @brief Makes a private scratch directory
+   @details The directory lives under TMPDIR, or /tmp, and is named
+   after the test.
+   @param name The name of the test
+   @param out Filled in with the path
+   @param len The size of out
+**/
+inline static void
+check_tmpdir (const char * name, char * out, size_t len)
+{
+  const char * tmp = getenv ("TMPDIR");
+
+  if (tmp == NULL || tmp[0] == '\0')
+    tmp = "/tmp";
+  snprintf (out, len, "%s/%s.XXXXXX", tmp, name);
+  if (mkdtemp (out) == NULL)
+    {
+      perror ("mkdtemp");
+      exit (EXIT_FAILURE);
+    }
+}
+
+/* Removes one entry of a scratch directory */
+inline static int
+check_unlink (const char * path, const struct stat * st, int flag,
+              struct FTW * ftw)
+{
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  return remove (path);
+}
+
+/**
+   @brief Removes a scratch directory and everything in it
+   @param path The path from check_tmpdir
+**/
+inline static void
+check_rmdir (const char * path)
+{
+  nftw (path, check_unlink, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+   @brief Fills a buffer with reproducible random bytes
+   @param data The buffer
+   @param len The length of the buffer
+   @param seed The seed, the same seed gives the same bytes
+**/
+inline static void
+check_random (uint8_t * data, size_t len, uint64_t seed)
+{
+  uint64_t z = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      if (i % 8 == 0)
+        {
+          z = (seed += 0x9e3779b97f4a7c15ull);
+          z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+          z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+          z ^= z >> 31;
+        }
+      data[i] = z >> (i % 8 * 8);
+    }
+}
+
+#endif
@@ -0,0 +1,287 @@
+/**
+   @file test_cache.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Artifact Cache Tests
+   @details Runs the client against a cache server on a free localhost port:
+   round trips of plain and deflated blobs, cache_has over several
+   batches, a PUT whose body does not match its digest and large blobs
+   sent and restored as chunk lists. Skipped when libcurl can not be
+   loaded.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <limits.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "check.h"
+#include "cache.h"
+#include "cachesrv.h"
+#include "digest.h"
+
+#define TEXT_LEN 65536
+#define TREE_LEN (256 * 1024)
+#define CHUNK 4096
+#define UNKNOWN (2 * CACHE_HAS_BATCH + 5)
+
+static char dir[256];
+
+/* Fills data with compressible build output */
+static void
+fill_text (char * data, size_t len, int seed)
+{
+  size_t pos = 0;
+  int line = 0;
+
+  while (pos < len)
+    pos += snprintf (data + pos, len - pos, "[%d] compiling file %d of %d\n",
+                     seed, line++, seed * 1000);
+}
+
+static void
+write_file (const char * path, const void * data, size_t len)
+{
+  FILE * file;
+
+  file = fopen (path, "w");
+  CHECK (file != NULL);
+  CHECK (fwrite (data, 1, len, file) == len);
+  CHECK (fclose (file) == 0);
+}
+
+/* Checks the contents of a restored file */
+static void
+check_file (const char * path, const void * data, size_t len)
+{
+  char * got;
+  FILE * file;
+
+  got = malloc (len + 1);
+  CHECK (got != NULL);
+  file = fopen (path, "r");
+  CHECK (file != NULL);
+  CHECK (fread (got, 1, len + 1, file) == len);
+  CHECK (fclose (file) == 0);
+  CHECK (memcmp (got, data, len) == 0);
+  free (got);
+}
+
+/* Writes a blob, uploads it and returns its digest */
+static void
+put (cache_t * cache, const char * name, const void * data, size_t len,
+     uint8_t * digest)
+{
+  char path[PATH_MAX];
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  write_file (path, data, len);
+  digest_buffer (data, len, digest);
+  CHECK (cache_put (cache, digest, path) == CACHE_OK);
+  CHECK (cache_flush (cache) == CACHE_OK);
+}
+
+/* Restores a blob over path and checks it */
+static void
+get (cache_t * cache, const char * name, const uint8_t * digest,
+     const void * data, size_t len)
+{
+  char path[PATH_MAX];
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  CHECK (cache_get (cache, digest, path) == CACHE_OK);
+  check_file (path, data, len);
+}
+
+/* Sends a raw request and returns the status of the reply */
+static int
+raw_put (uint16_t port, const char * target, const char * body)
+{
+  struct sockaddr_in addr;
+  char req[512], reply[512];
+  ssize_t n, got = 0;
+  int fd, status = 0;
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  CHECK (fd >= 0);
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  CHECK (connect (fd, (struct sockaddr*) &addr, sizeof (addr)) == 0);
+  n = snprintf (req, sizeof (req), "PUT %s HTTP/1.1\r\nHost: localhost\r\n"
+                "Content-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                target, strlen (body), body);
+  CHECK (write (fd, req, n) == n);
+  while (got < (ssize_t) sizeof (reply) - 1 &&
+         (n = read (fd, reply + got, sizeof (reply) - 1 - got)) > 0)
+    got += n;
+  reply[got] = '\0';
+  close (fd);
+  CHECK (sscanf (reply, "HTTP/1.1 %d ", &status) == 1);
+  return status;
+}
+
+static void *
+serve (void * arg)
+{
+  CHECK (cachesrv_run ((cachesrv_t*) arg) == CACHESRV_OK);
+  return NULL;
+}
+
+int
+main (void)
+{
+  char srvdir[PATH_MAX], url[64], target[PATH_MAX], hex[DIGEST_HEX_LEN], * text;
+  uint8_t plain_dgst[DIGEST_LEN], deflated_dgst[DIGEST_LEN];
+  uint8_t old_dgst[DIGEST_LEN], new_dgst[DIGEST_LEN];
+  uint8_t * digests, * present, * old, * new;
+  cache_t plain, deflated, chunked;
+  cache_stats_t stats;
+  pthread_t thread;
+  cachesrv_t srv;
+  void * curl;
+  size_t i;
+
+  /* The client loads libcurl at run time */
+  curl = dlopen ("libcurl.so.4", RTLD_NOW);
+  if (curl == NULL)
+    return CHECK_SKIP;
+  dlclose (curl);
+
+  check_tmpdir ("test_cache", dir, sizeof (dir));
+  snprintf (srvdir, sizeof (srvdir), "%s/srv", dir);
+  CHECK (cachesrv_init (&srv, srvdir, "127.0.0.1:0", 0) == CACHESRV_OK);
+  CHECK (srv.port != 0);
+  CHECK (pthread_create (&thread, NULL, serve, &srv) == 0);
+  snprintf (url, sizeof (url), "http://127.0.0.1:%u/", (unsigned) srv.port);
+
+  text = malloc (TEXT_LEN);
+  old = malloc (TREE_LEN);
+  new = malloc (TREE_LEN);
+  digests = malloc (UNKNOWN * DIGEST_LEN);
+  present = malloc (UNKNOWN);
+  CHECK (text != NULL && old != NULL && new != NULL && digests != NULL &&
+         present != NULL);
+
+  /* Plain blobs cross the wire as they are */
+  CHECK (cache_init (&plain, url, 0, 0) == CACHE_OK);
+  fill_text (text, TEXT_LEN, 1);
+  put (&plain, "plain", text, TEXT_LEN, plain_dgst);
+  get (&plain, "plain.out", plain_dgst, text, TEXT_LEN);
+  cache_stats (&plain, &stats);
+  CHECK (stats.puts == 1 && stats.hits == 1 && stats.failures == 0);
+  CHECK (stats.wire_sent == TEXT_LEN && stats.uploaded == TEXT_LEN);
+  CHECK (stats.wire_recv == TEXT_LEN && stats.restored == TEXT_LEN);
+
+  /* Deflated blobs are smaller on the wire than on disk */
+  CHECK (cache_init (&deflated, url, 0, 1) == CACHE_OK);
+  fill_text (text, TEXT_LEN, 2);
+  put (&deflated, "deflated", text, TEXT_LEN, deflated_dgst);
+  get (&deflated, "deflated.out", deflated_dgst, text, TEXT_LEN);
+  cache_stats (&deflated, &stats);
+  CHECK (stats.uploaded == TEXT_LEN && stats.wire_sent < TEXT_LEN / 4);
+  CHECK (stats.restored == TEXT_LEN && stats.wire_recv < TEXT_LEN / 4);
+
+  /* The server inflates for clients which do not take deflate */
+  get (&plain, "inflated.out", deflated_dgst, text, TEXT_LEN);
+  fill_text (text, TEXT_LEN, 1);
+  get (&deflated, "plain.out2", plain_dgst, text, TEXT_LEN);
+
+  /* Unknown blobs are misses, not failures */
+  digest_buffer ("missing", 7, old_dgst);
+  snprintf (target, sizeof (target), "%s/missing.out", dir);
+  CHECK (cache_get (&plain, old_dgst, target) == CACHE_MISS);
+  CHECK (access (target, F_OK) != 0);
+
+  /* Lookups span several batches */
+  for (i = 0; i < UNKNOWN; i++)
+    digest_buffer (&i, sizeof (i), digests + i * DIGEST_LEN);
+  memcpy (digests, plain_dgst, DIGEST_LEN);
+  memcpy (digests + (CACHE_HAS_BATCH + 1) * DIGEST_LEN, deflated_dgst,
+          DIGEST_LEN);
+  memcpy (digests + (UNKNOWN - 1) * DIGEST_LEN, plain_dgst, DIGEST_LEN);
+  memset (present, 2, UNKNOWN);
+  CHECK (cache_has (&plain, digests, UNKNOWN, present) == CACHE_OK);
+  for (i = 0; i < UNKNOWN; i++)
+    CHECK (present[i] == (i == 0 || i == CACHE_HAS_BATCH + 1 ||
+                          i == UNKNOWN - 1));
+  cache_stats (&plain, &stats);
+  CHECK (stats.checks == UNKNOWN);
+
+  /* A body which does not match its digest is refused, even when
+     the blob is already stored */
+  digest_hex (plain_dgst, hex);
+  snprintf (target, sizeof (target), "/cas/%s", hex);
+  CHECK (raw_put (srv.port, target, "not the blob") == 400);
+  digest_hex (old_dgst, hex);
+  snprintf (target, sizeof (target), "/cas/%s", hex);
+  CHECK (raw_put (srv.port, target, "not the blob") == 400);
+  CHECK (raw_put (srv.port, "/cas/nothex", "") == 404);
+  snprintf (target, sizeof (target), "%s/wrong", dir);
+  write_file (target, "not the blob", 12);
+  CHECK (cache_put (&plain, old_dgst, target) == CACHE_OK);
+  CHECK (cache_flush (&plain) == CACHE_HTTP_FAILED);
+  CHECK (srv.stored == 2);
+
+  /* Large blobs go up and come back as chunk lists */
+  CHECK (cache_init (&chunked, url, 0, 1) == CACHE_OK);
+  chunked.chunk = CHUNK;
+  cdc_init (&chunked.cdc, CHUNK);
+  check_random (old, TREE_LEN, 1);
+  put (&chunked, "tree", old, TREE_LEN, old_dgst);
+  CHECK (srv.trees == 1);
+  get (&plain, "tree.out", old_dgst, old, TREE_LEN);
+
+  /* Only the chunks the cache is missing are sent */
+  memcpy (new, old, TREE_LEN);
+  check_random (new + TREE_LEN / 2, 64, 2);
+  put (&chunked, "tree2", new, TREE_LEN, new_dgst);
+  CHECK (srv.trees == 2);
+  cache_stats (&chunked, &stats);
+  CHECK (stats.uploaded == 2 * TREE_LEN);
+  CHECK (stats.dedup_sent >= TREE_LEN - 4 * CHUNK * 4);
+  CHECK (stats.chunked == 2 * TREE_LEN);
+
+  /* Restoring over the old version only fetches the changed chunks */
+  get (&chunked, "tree.out", new_dgst, new, TREE_LEN);
+  cache_stats (&chunked, &stats);
+  CHECK (stats.restored == TREE_LEN);
+  CHECK (stats.dedup_recv >= TREE_LEN - 4 * CHUNK * 4);
+  CHECK (stats.wire_recv < TREE_LEN / 4);
+
+  CHECK (cache_destroy (&chunked) == CACHE_OK);
+  CHECK (cache_destroy (&deflated) == CACHE_OK);
+  CHECK (cache_destroy (&plain) == CACHE_OK);
+  cachesrv_stop (&srv);
+  CHECK (pthread_join (thread, NULL) == 0);
+  CHECK (cachesrv_destroy (&srv) == CACHESRV_OK);
+
+  free (text);
+  free (old);
+  free (new);
+  free (digests);
+  free (present);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
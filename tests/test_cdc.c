@@ -0,0 +1,124 @@
+/**
+   @file test_cdc.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Content Defined Chunking Tests
+   @details Checks that cuts are deterministic and within the size
+   bounds, and that an insertion only changes the chunks around it.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "cdc.h"
+#include "check.h"
+#include "digest.h"
+
+#define SIZE (4 << 20) /**< Bytes chunked */
+#define AVG 8192 /**< Average chunk size */
+
+/* Cuts data and returns the digest of every chunk */
+static size_t
+cut_all (const cdc_t * cdc, const uint8_t * data, size_t len,
+         uint8_t (*out)[DIGEST_LEN], size_t max)
+{
+  size_t off, cut, n = 0;
+
+  for (off = 0; off < len; off += cut)
+    {
+      cut = cdc_cut (cdc, data + off, len - off);
+      CHECK (cut > 0 && cut <= len - off);
+      CHECK (cut <= cdc->max);
+      CHECK (cut >= cdc->min || off + cut == len);
+      CHECK (n < max);
+      digest_buffer (data + off, cut, out[n++]);
+    }
+  return n;
+}
+
+/* Counts the chunks of b which are also chunks of a */
+static size_t
+shared (uint8_t (*a)[DIGEST_LEN], size_t na, uint8_t (*b)[DIGEST_LEN],
+        size_t nb)
+{
+  size_t i, j, ret = 0;
+
+  for (i = 0; i < nb; i++)
+    for (j = 0; j < na; j++)
+      if (memcmp (b[i], a[j], DIGEST_LEN) == 0)
+        {
+          ret++;
+          break;
+        }
+  return ret;
+}
+
+int
+main (void)
+{
+  uint8_t (*first)[DIGEST_LEN], (*second)[DIGEST_LEN], * data, * edited;
+  size_t max = SIZE / 1024, n1, n2, i;
+  cdc_t cdc, small;
+
+  data = malloc (SIZE);
+  edited = malloc (SIZE + 10);
+  first = malloc (max * DIGEST_LEN);
+  second = malloc (max * DIGEST_LEN);
+  CHECK (data != NULL && edited != NULL);
+  CHECK (first != NULL && second != NULL);
+  check_random (data, SIZE, 1);
+
+  /* Sizes follow the average */
+  cdc_init (&cdc, AVG + 100);
+  CHECK (cdc.avg == AVG);
+  CHECK (cdc.min == AVG / 4 && cdc.max == AVG * 4);
+  cdc_init (&small, 10);
+  CHECK (small.avg == 256);
+
+  /* The same data always cuts the same way */
+  n1 = cut_all (&cdc, data, SIZE, first, max);
+  n2 = cut_all (&cdc, data, SIZE, second, max);
+  CHECK (n1 == n2);
+  CHECK (memcmp (first, second, n1 * DIGEST_LEN) == 0);
+
+  /* Normalized chunking keeps the count near size / avg */
+  CHECK (n1 > SIZE / AVG / 2 && n1 < SIZE / AVG * 2);
+
+  /* Data shorter than the minimum is one chunk */
+  CHECK (cdc_cut (&cdc, data, 100) == 100);
+  CHECK (cdc_cut (&cdc, data, cdc.min) == cdc.min);
+
+  /* Inserting at the front only changes the first chunks */
+  memset (edited, 'x', 10);
+  memcpy (edited + 10, data, SIZE);
+  n2 = cut_all (&cdc, edited, SIZE + 10, second, max);
+  CHECK (shared (first, n1, second, n2) + 3 >= n2);
+
+  /* So does flipping a byte in the middle */
+  memcpy (edited, data, SIZE);
+  edited[SIZE / 2] ^= 0xff;
+  n2 = cut_all (&cdc, edited, SIZE, second, max);
+  i = shared (first, n1, second, n2);
+  CHECK (i + 3 >= n2 && i < n2);
+
+  free (second);
+  free (first);
+  free (edited);
+  free (data);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/**
+   @file test_conf.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Configuration Tests
+   @details Checks typed values and defaults, includes, sections,
+   overlays, that invalid keys are reported with their file and line
+   and that credentials never reach the log.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include "check.h"
+#include "conf.h"
+#include "log.h"
+
+/* Writes a file into the scratch directory */
+static void
+write_file (const char * dir, const char * name, const char * data)
+{
+  char path[PATH_MAX];
+  FILE * file;
+
+  snprintf (path, sizeof (path), "%s/%s", dir, name);
+  file = fopen (path, "w");
+  CHECK (file != NULL);
+  CHECK (fputs (data, file) >= 0);
+  CHECK (fclose (file) == 0);
+}
+
+int
+main (void)
+{
+  const char * pairs[] = { "DB_POOL=9", "nightly.LOAD_WIDTH=3" };
+  const char * bad_pairs[] = { "LOAD_WIDTH" };
+  const char * secret_pairs[] = { "DB_PASS=hunter2" };
+  const char * overflow_pairs[] = {
+    "LOAD_SEED=99999999999999999999", "LOAD_OUTPUT=99999999999999999999",
+    "LOAD_OUTPUT=18446744073709551615K", "HISTORY_ALPHA=1e999"
+  };
+  char dir[256], path[PATH_MAX], expect[PATH_MAX * 2], logged[4096];
+  conf_vals_t vals;
+  conf_t conf;
+  ssize_t len;
+  size_t i;
+  int fd;
+
+  check_tmpdir ("test_conf", dir, sizeof (dir));
+  write_file (dir, "main.conf",
+              "# Comments and blank lines are skipped\n"
+              "\n"
+              "CACHE_TIMEOUT = 90s\n"
+              "CACHE_CHUNK = 128K\n"
+              "CACHE_COMPRESS = no\n"
+              "HISTORY_FILE = history.db\n"
+              "QUEUE_WEIGHTS = ci:4, dev:1\n"
+              "include extra.conf\n"
+              "-include missing.conf\n"
+              "LOAD_WIDTH = 16\n"
+              "[nightly]\n"
+              "LOAD_DEPTH = 40\n");
+  write_file (dir, "extra.conf",
+              "DB_POOL = 2\n"
+              "LOAD_WIDTH = 8\n");
+
+  snprintf (path, sizeof (path), "%s/main.conf", dir);
+  CHECK (conf_init (&conf, path) == CONF_OK);
+  CHECK (conf.vals.cache_timeout == 90000);
+  CHECK (conf.vals.cache_chunk == 128 * 1024);
+  CHECK (conf.vals.cache_compress == 0);
+  CHECK (conf.vals.db_pool == 2);
+  CHECK (conf.vals.queue_weights.len == 2);
+  CHECK (strcmp (conf.vals.queue_weights.items[0], "ci:4") == 0);
+  CHECK (strcmp (conf.vals.queue_weights.items[1], "dev:1") == 0);
+
+  /* Relative paths are resolved next to the file */
+  snprintf (expect, sizeof (expect), "%s/history.db", dir);
+  CHECK (strcmp (conf.vals.history_file, expect) == 0);
+
+  /* Later definitions win, including over included files */
+  CHECK (conf.vals.load_width == 16);
+  CHECK (strcmp (conf_get (&conf, "LOAD_WIDTH"), "16") == 0);
+
+  /* Unset keys take their defaults */
+  CHECK (conf.vals.db_port == 5432);
+  CHECK (conf.vals.load_depth == 8);
+  CHECK (conf.vals.cache_url == NULL);
+
+  /* Sections only override their own keys */
+  CHECK (conf_section_vals (&conf, "nightly", &vals) == 1);
+  CHECK (vals.load_depth == 40);
+  CHECK (vals.load_width == 16);
+  CHECK (strcmp (conf_get_section (&conf, "nightly", "LOAD_DEPTH"),
+                 "40") == 0);
+  CHECK (conf_get_section (&conf, "other", "LOAD_DEPTH") == NULL);
+  CHECK (strcmp (conf_get_section (&conf, "other", "LOAD_WIDTH"),
+                 "16") == 0);
+
+  /* Overlays win over the files and leave them alone on failure */
+  CHECK (conf_overlay (&conf, "command line", pairs, 2) == CONF_OK);
+  CHECK (conf.vals.db_pool == 9);
+  CHECK (conf_section_vals (&conf, "nightly", &vals) == 2);
+  CHECK (vals.load_width == 3);
+  CHECK (conf_overlay (&conf, "command line", bad_pairs, 1) ==
+         CONF_PARSE_ERR);
+  CHECK (conf.vals.db_pool == 9);
+
+  /* Only variables naming a key are taken from the environment */
+  setenv ("TEST_CONF_DB_POOL", "12", 1);
+  setenv ("TEST_CONF_NOT_A_KEY", "1", 1);
+  CHECK (conf_overlay_env (&conf, "TEST_CONF_") == CONF_OK);
+  CHECK (conf.vals.db_pool == 12);
+
+  /* Credentials are used but never logged */
+  snprintf (path, sizeof (path), "%s/debug.log", dir);
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  CHECK (fd >= 0);
+  CHECK (log_init (fd, LOG_FORMAT_TEXT, LOG_LEVEL_DEBUG, 0) == LOG_OK);
+  CHECK (conf_overlay (&conf, "command line", secret_pairs, 1) == CONF_OK);
+  CHECK (log_destroy () == LOG_OK);
+  log_level = LOG_LEVEL_INFO;
+  CHECK (strcmp (conf.vals.db_pass, "hunter2") == 0);
+  len = pread (fd, logged, sizeof (logged) - 1, 0);
+  CHECK (len > 0);
+  logged[len] = '\0';
+  CHECK (strstr (logged, "key=DB_PASS val=<redacted>") != NULL);
+  CHECK (strstr (logged, "hunter2") == NULL);
+  close (fd);
+
+  /* Numbers which overflow are out of range rather than clamped, and
+     every failed overlay replaces the previous error */
+  for (i = 0; i < sizeof (overflow_pairs) / sizeof (*overflow_pairs); i++)
+    {
+      CHECK (conf_overlay (&conf, "command line", overflow_pairs + i, 1) ==
+             CONF_INVALID);
+      CHECK (strstr (conf_get_err (&conf), "is out of range") != NULL);
+    }
+  CHECK (conf.vals.load_seed == 1);
+  CHECK (conf_destroy (&conf) == CONF_OK);
+
+  /* Unknown keys and bad values name the file and line */
+  write_file (dir, "bad.conf",
+              "DB_POOL = 2\n"
+              "NO_SUCH_KEY = 1\n");
+  snprintf (path, sizeof (path), "%s/bad.conf", dir);
+  CHECK (conf_init (&conf, path) == CONF_INVALID);
+  snprintf (expect, sizeof (expect), "%s:2: Unknown key NO_SUCH_KEY\n",
+            path);
+  CHECK (strcmp (conf_get_err (&conf), expect) == 0);
+  conf_destroy (&conf);
+
+  write_file (dir, "bad.conf",
+              "CACHE_TIMEOUT = soon\n");
+  CHECK (conf_init (&conf, path) == CONF_INVALID);
+  CHECK (strstr (conf_get_err (&conf), ":1: Invalid") != NULL);
+  conf_destroy (&conf);
+
+  write_file (dir, "bad.conf",
+              "\n"
+              "DB_POOL = 100000\n");
+  CHECK (conf_init (&conf, path) == CONF_INVALID);
+  CHECK (strstr (conf_get_err (&conf), ":2: 100000 is out of range") !=
+         NULL);
+  conf_destroy (&conf);
+
+  /* A missing file leaves the defaults, which may still be overlaid */
+  snprintf (path, sizeof (path), "%s/missing.conf", dir);
+  CHECK (conf_init (&conf, path) == CONF_NO_FILE);
+  CHECK (conf.vals.db_port == 5432);
+  CHECK (conf_overlay (&conf, "command line", pairs, 1) == CONF_OK);
+  CHECK (conf.vals.db_pool == 9);
+  conf_destroy (&conf);
+
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
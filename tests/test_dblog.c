@@ -0,0 +1,198 @@
+/**
+   @file test_dblog.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Database Log Tests
+   @details Checks the COPY escaping, then streams jobs through a log
+   whose database refuses every connection, so every sealed chunk,
+   gap note and output dropped by backpressure ends up in the spill
+   store where it can be read back in order.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include "check.h"
+#include "buffer.h"
+#include "dblog.h"
+#include "logstore.h"
+
+#define LINE 64
+#define JOBS 4
+
+/* Nothing listens on port 1, so every connection is refused at once */
+#define REFUSED "host=127.0.0.1 port=1 connect_timeout=1"
+#define REPLACEMENT "\xef\xbf\xbd"
+
+/* Checks the escaped form of one input */
+static void
+check_escape (const char * in, size_t len, const char * expect)
+{
+  char out[256];
+  size_t n;
+
+  n = dblog_copy_escape (in, len, out);
+  CHECK (n <= 3 * len);
+  CHECK (n == strlen (expect) && memcmp (out, expect, n) == 0);
+}
+
+/* Checks that a spilled section is valid UTF-8 */
+static int
+valid_utf8 (const uint8_t * s, size_t len)
+{
+  size_t i = 0, n, k;
+
+  while (i < len)
+    {
+      n = s[i] < 0x80 ? 1 : s[i] >= 0xc2 && s[i] <= 0xdf ? 2 :
+        s[i] >= 0xe0 && s[i] <= 0xef ? 3 : s[i] >= 0xf0 && s[i] <= 0xf4 ?
+        4 : 0;
+      if (n == 0 || i + n > len)
+        return 0;
+      for (k = 1; k < n; k++)
+        if ((s[i+k] & 0xc0) != 0x80)
+          return 0;
+      i += n;
+    }
+  return 1;
+}
+
+/* Writes lines first to last of a job, each exactly LINE bytes */
+static void
+write_lines (dblog_t * dl, uint64_t job, buffer_t * expect, int first,
+             int last)
+{
+  char line[LINE + 1];
+  int i;
+
+  for (i = first; i <= last; i++)
+    {
+      snprintf (line, sizeof (line), "job %llu line %04d %*s\n",
+                (unsigned long long)job, i, LINE - 17, "x");
+      CHECK (strlen (line) == LINE);
+      CHECK (dblog_write (dl, job, line, LINE) == DBLOG_OK);
+      CHECK (buffer_add (expect, line, LINE) == BUFF_OK);
+    }
+}
+
+int
+main (void)
+{
+  char dir[256], path[PATH_MAX], big[8192], note[64],
+    multi[LINE * 5 + 1], * data, * end, * next;
+  buffer_t expect[JOBS], got[JOBS], all;
+  uint64_t job;
+  logstore_t spill;
+  dblog_t dl;
+  size_t i;
+
+  /* Escaping for COPY */
+  check_escape ("plain text", 10, "plain text");
+  check_escape ("a\\b\nc\rd\te", 9, "a\\\\b\\nc\\rd\\te");
+  check_escape ("nul\0end", 7, "nul" REPLACEMENT "end");
+  check_escape ("h\xc3\xa9 \xe2\x9c\x93 \xf0\x9d\x84\x9e", 12,
+                "h\xc3\xa9 \xe2\x9c\x93 \xf0\x9d\x84\x9e");
+  check_escape ("\xff", 1, REPLACEMENT);
+  /* Truncated, overlong and surrogate sequences */
+  check_escape ("\xe2\x9c", 2, REPLACEMENT REPLACEMENT);
+  check_escape ("\xc0\xaf", 2, REPLACEMENT REPLACEMENT);
+  check_escape ("\xed\xa0\x80", 3, REPLACEMENT REPLACEMENT REPLACEMENT);
+  check_escape ("\xf4\x90\x80\x80", 4,
+                REPLACEMENT REPLACEMENT REPLACEMENT REPLACEMENT);
+
+  check_tmpdir ("test_dblog", dir, sizeof (dir));
+  snprintf (path, sizeof (path), "%s/spill", dir);
+  CHECK (logstore_open (&spill, path, 1, 4096) == LOGSTORE_OK);
+  CHECK (dblog_init (&dl, REFUSED, &spill) == DBLOG_OK);
+  dl.chunk_size = 4 * LINE;
+  dl.flush_ms = 10;
+  dl.max_queued = 4096;
+  for (i = 0; i < JOBS; i++)
+    {
+      buffer_init (&expect[i], 0, 0);
+      buffer_init (&got[i], 0, 0);
+    }
+
+  /* Chunks are sealed every four lines */
+  write_lines (&dl, 1, &expect[1], 0, 9);
+
+  /* Over max_queued the output only goes to the spill store and the
+     job's next chunk notes the gap */
+  memset (big, 'b', sizeof (big));
+  big[sizeof (big) - 1] = '\n';
+  CHECK (dblog_write (&dl, 2, big, sizeof (big)) == DBLOG_DROPPED);
+  CHECK (buffer_add (&expect[2], big, sizeof (big)) == BUFF_OK);
+  snprintf (note, sizeof (note), "[%zu bytes only in the local log]\n",
+            sizeof (big));
+  CHECK (buffer_add (&expect[2], note, strlen (note)) == BUFF_OK);
+  write_lines (&dl, 2, &expect[2], 0, 1);
+
+  /* A write longer than a chunk is never cut inside a character */
+  multi[0] = 'e';
+  for (i = 1; i + 1 < sizeof (multi); i += 2)
+    memcpy (multi + i, "\xc3\xa9", 2);
+  CHECK (dblog_write (&dl, 3, multi, sizeof (multi)) == DBLOG_OK);
+  CHECK (buffer_add (&expect[3], multi, sizeof (multi)) == BUFF_OK);
+
+  for (job = 1; job < JOBS; job++)
+    CHECK (dblog_end (&dl, job) == DBLOG_OK);
+  CHECK (dblog_destroy (&dl) == DBLOG_OK);
+  CHECK (logstore_close (&spill) == LOGSTORE_OK);
+
+  /* Split the spill store back into the jobs */
+  CHECK (logstore_open (&spill, path, 0, 4096) == LOGSTORE_OK);
+  buffer_init (&all, 0, 0);
+  CHECK (logstore_tail (&spill, SIZE_MAX, &all) == LOGSTORE_OK);
+  CHECK (buffer_add (&all, "", 1) == BUFF_OK);
+  job = 0;
+  for (data = all.data; *data != '\0'; data = next)
+    {
+      end = strchr (data, '\n');
+      CHECK (end != NULL);
+      next = end + 1;
+      if (strncmp (data, "--- job ", 8) == 0)
+        {
+          job = strtoull (data + 8, NULL, 10);
+          continue;
+        }
+      CHECK (job > 0 && job < JOBS);
+      CHECK (valid_utf8 ((uint8_t*)data, end - data));
+
+      /* Job 3 has no newlines, the spill ends each of its chunks */
+      CHECK (buffer_add (&got[job], data, job == 3 ? end - data :
+                         next - data) == BUFF_OK);
+    }
+
+  for (job = 1; job < JOBS; job++)
+    {
+      CHECK (got[job].len == expect[job].len);
+      CHECK (memcmp (got[job].data, expect[job].data, got[job].len) == 0);
+    }
+
+  for (i = 0; i < JOBS; i++)
+    {
+      buffer_destroy (&expect[i]);
+      buffer_destroy (&got[i]);
+    }
+  buffer_destroy (&all);
+  CHECK (logstore_close (&spill) == LOGSTORE_OK);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
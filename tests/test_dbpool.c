@@ -0,0 +1,123 @@
+/**
+   @file test_dbpool.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Database Pool Tests
+   @details Checks the connection string built from the configuration, the
+   latency percentiles and that the breaker opens against a database
+   which refuses every connection. Queries against a live server are
+   left to test_pg.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include "check.h"
+#include "conf.h"
+#include "dbpool.h"
+
+#define REFUSED "host=127.0.0.1 port=1 connect_timeout=1"
+#define TRIES 16
+
+static int called;
+
+static void
+count_cb (void * arg, dbpool_err_t ret)
+{
+  (void) arg;
+  (void) ret;
+  __atomic_add_fetch (&called, 1, __ATOMIC_RELAXED);
+}
+
+int
+main (void)
+{
+  const char * pairs[] = {
+    "DB_TYPE=postgresql", "DB_HOST=db.example.com", "DB_PORT=6543",
+    "DB_USER=o'brien", "DB_PASS=back\\slash quote' space", "DB_DB=builds"
+  };
+  dbpool_query_t query = { .sql = "SELECT 1" };
+  uint64_t hist[DBPOOL_BUCKETS];
+  dbpool_stats_t stats;
+  dbpool_err_t ret;
+  dbpool_t pool;
+  conf_t conf;
+  int i;
+
+  /* Only postgresql is supported */
+  CHECK (conf_init (&conf, "/nonexistent/autobuild.conf") == CONF_NO_FILE);
+  CHECK (dbpool_init_conf (&pool, &conf, NULL) == DBPOOL_INVALID);
+  CHECK (strstr (dbpool_get_err (&pool), "DB_TYPE") != NULL);
+  dbpool_destroy (&pool);
+
+  /* Every value is quoted and escaped, unset keys are left out */
+  CHECK (conf_overlay (&conf, "command line", pairs, 1) == CONF_OK);
+  CHECK (dbpool_init_conf (&pool, &conf, NULL) == DBPOOL_OK);
+  CHECK (strcmp (pool.conninfo, "port='5432' connect_timeout='5'") == 0);
+  CHECK (pool.size == 4 && pool.trip_after == 3);
+  dbpool_destroy (&pool);
+
+  CHECK (conf_overlay (&conf, "command line", pairs,
+                       sizeof (pairs) / sizeof (pairs[0])) == CONF_OK);
+  CHECK (dbpool_init_conf (&pool, &conf, NULL) == DBPOOL_OK);
+  CHECK (strcmp (pool.conninfo, "host='db.example.com' port='6543' "
+                 "user='o\\'brien' password='back\\\\slash quote\\' space' "
+                 "dbname='builds' connect_timeout='5'") == 0);
+  dbpool_destroy (&pool);
+  conf_destroy (&conf);
+
+  /* Percentiles are the upper bound of their bucket */
+  memset (hist, 0, sizeof (hist));
+  CHECK (dbpool_hist_pct (hist, 50) == 0);
+  hist[0] = 1;
+  CHECK (dbpool_hist_pct (hist, 50) == 2);
+  CHECK (dbpool_hist_pct (hist, 100) == 2);
+  hist[0] = 0;
+  hist[3] = 99;
+  hist[10] = 1;
+  CHECK (dbpool_hist_pct (hist, 50) == 16);
+  CHECK (dbpool_hist_pct (hist, 99) == 16);
+  CHECK (dbpool_hist_pct (hist, 99.5) == 2048);
+  CHECK (dbpool_hist_pct (hist, 100) == 2048);
+  memset (hist, 0, sizeof (hist));
+  hist[DBPOOL_BUCKETS - 1] = 5;
+  CHECK (dbpool_hist_pct (hist, 50) == (uint64_t)2 << (DBPOOL_BUCKETS - 1));
+
+  /* Failed connections open the breaker, then queries fail at once */
+  CHECK (dbpool_init (&pool, REFUSED, 1, NULL) == DBPOOL_OK);
+  pool.trip_after = 2;
+  for (i = 0; i < TRIES; i++)
+    {
+      ret = dbpool_exec (&pool, &query);
+      CHECK (ret == DBPOOL_FAILED || ret == DBPOOL_UNAVAILABLE);
+      if (ret == DBPOOL_UNAVAILABLE)
+        break;
+    }
+  CHECK (i < TRIES);
+  CHECK (dbpool_submit (&pool, &query, count_cb, NULL) ==
+         DBPOOL_UNAVAILABLE);
+  dbpool_drain (&pool);
+  CHECK (called == 0);
+  dbpool_stats (&pool, &stats);
+  CHECK (stats.trips == 1 && stats.connects == 0 && stats.queries == 0);
+  CHECK (stats.lost >= 2 && stats.rejected >= 2);
+  CHECK (dbpool_destroy (&pool) == DBPOOL_OK);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+   @file test_digest.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief SHA-256 Digest Tests
+   @details Checks the FIPS 180-2 test vectors, fed whole and in
+   uneven pieces, and the hex encoding.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "check.h"
+#include "digest.h"
+
+/* Digests data fed in pieces of step bytes and compares the hex */
+static void
+check_vector (const char * data, size_t len, size_t step, const char * hex)
+{
+  uint8_t raw[DIGEST_LEN];
+  char out[DIGEST_HEX_LEN];
+  digest_t dgst;
+  size_t off, n;
+
+  digest_init (&dgst);
+  for (off = 0; off < len; off += n)
+    {
+      n = len - off < step ? len - off : step;
+      digest_update (&dgst, data + off, n);
+    }
+  digest_final (&dgst, raw);
+  digest_hex (raw, out);
+  CHECK (strcmp (out, hex) == 0);
+}
+
+int
+main (void)
+{
+  static const char * two =
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  static const size_t steps[] = { 1, 3, 55, 56, 63, 64, 65, 1000 };
+  uint8_t raw[DIGEST_LEN], whole[DIGEST_LEN];
+  char * million;
+  size_t i;
+
+  check_vector ("", 0, 1,
+                "e3b0c44298fc1c149afbf4c8996fb924"
+                "27ae41e4649b934ca495991b7852b855");
+  for (i = 0; i < sizeof (steps) / sizeof (steps[0]); i++)
+    {
+      check_vector ("abc", 3, steps[i],
+                    "ba7816bf8f01cfea414140de5dae2223"
+                    "b00361a396177a9cb410ff61f20015ad");
+      check_vector (two, strlen (two), steps[i],
+                    "248d6a61d20638b8e5c026930c3e6039"
+                    "a33ce45964ff2167f6ecedd419db06c1");
+    }
+
+  million = malloc (1000000);
+  CHECK (million != NULL);
+  memset (million, 'a', 1000000);
+  for (i = 0; i < sizeof (steps) / sizeof (steps[0]); i++)
+    check_vector (million, 1000000, steps[i] * 997,
+                  "cdc76e5c9914fb9281a1c7e284d73e67"
+                  "f1809a48a497200e046d39ccc7112cd0");
+
+  /* The one shot helper matches the streaming interface */
+  digest_buffer (million, 1000000, whole);
+  check_vector (million, 1000000, 1000000,
+                "cdc76e5c9914fb9281a1c7e284d73e67"
+                "f1809a48a497200e046d39ccc7112cd0");
+  digest_buffer (million, 999999, raw);
+  CHECK (memcmp (raw, whole, DIGEST_LEN) != 0);
+  free (million);
+
+  return EXIT_SUCCESS;
+}
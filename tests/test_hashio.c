@@ -0,0 +1,89 @@
+/**
+   @file test_hashio.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Batched File Hashing Tests
+   @details Checks that every file of a batch larger than the engine's
+   depth hashes to the same digest as hashing it in memory, over sizes
+   around the small file and block boundaries, and that a missing file
+   only fails its own result.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include "check.h"
+#include "hashio.h"
+
+#define FILES 40 /**< Files in the batch, the last one missing */
+
+static const size_t sizes[] = { 0, 1, 63, 64, 4095, 4096, 65537,
+                                (1 << 20) + 3 };
+
+int
+main (void)
+{
+  char dir[256], names[FILES][PATH_MAX];
+  const char * paths[FILES];
+  hashio_result_t res[FILES];
+  uint8_t * data, expect[FILES][DIGEST_LEN];
+  size_t i, size, nsizes = sizeof (sizes) / sizeof (sizes[0]);
+  hashio_t hio;
+  FILE * file;
+
+  data = malloc (sizes[nsizes-1]);
+  CHECK (data != NULL);
+  check_tmpdir ("test_hashio", dir, sizeof (dir));
+  for (i = 0; i < FILES; i++)
+    {
+      snprintf (names[i], sizeof (names[i]), "%s/file%zu", dir, i);
+      paths[i] = names[i];
+      if (i == FILES - 1)
+        break;
+      size = sizes[i % nsizes];
+      check_random (data, size, i);
+      digest_buffer (data, size, expect[i]);
+      file = fopen (names[i], "w");
+      CHECK (file != NULL);
+      CHECK (fwrite (data, 1, size, file) == size);
+      CHECK (fclose (file) == 0);
+    }
+
+  /* A small depth makes the batch cycle through the jobs */
+  CHECK (hashio_init (&hio, 2, 4) == HASHIO_OK);
+  CHECK (hashio_hash (&hio, paths, FILES, res) == HASHIO_OK);
+  for (i = 0; i < FILES - 1; i++)
+    {
+      CHECK (res[i].err == 0);
+      CHECK (res[i].size == sizes[i % nsizes]);
+      CHECK (memcmp (res[i].digest, expect[i], DIGEST_LEN) == 0);
+    }
+  CHECK (res[FILES-1].err == ENOENT);
+  CHECK (hio.files == FILES - 1);
+
+  /* The engine can be reused */
+  CHECK (hashio_hash (&hio, paths + 5, 3, res) == HASHIO_OK);
+  CHECK (memcmp (res[2].digest, expect[7], DIGEST_LEN) == 0);
+  CHECK (hashio_destroy (&hio) == HASHIO_OK);
+
+  free (data);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/**
+   @file test_jobq.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Fair Job Queue Tests
+   @details Checks that tenants share dispatch by weight, that strict
+   priority drains the higher classes first, that aging lets a lower
+   class through and that the per tenant metrics add up.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "check.h"
+#include "jobq.h"
+
+#define JOBS 400 /**< Jobs queued by each tenant */
+
+static jobq_job_t jobs[JOBS * 2];
+
+/* Tallies the metrics of every tenant */
+static void
+count_stats (void * arg, const jobq_stats_t * stats)
+{
+  uint64_t * totals = arg, sum = 0;
+  size_t i;
+
+  for (i = 0; i < JOBQ_BUCKETS; i++)
+    sum += stats->wait_hist[i];
+  CHECK (sum == stats->dispatched);
+  CHECK (stats->enqueued == stats->queued + stats->dispatched);
+  totals[0] += stats->enqueued;
+  totals[1] += stats->dispatched;
+  totals[2] += stats->queued;
+}
+
+/* Queues JOBS jobs for each of two tenants with the given classes */
+static void
+fill (jobq_t * q, const char * a, uint8_t prio_a, const char * b,
+      uint8_t prio_b)
+{
+  size_t i;
+
+  memset (jobs, 0, sizeof (jobs));
+  for (i = 0; i < JOBS; i++)
+    {
+      jobs[i].tenant = a;
+      jobs[i].prio = prio_a;
+      jobs[i].cost = 100;
+      CHECK (jobq_push (q, &jobs[i]) == JOBQ_OK);
+      jobs[JOBS + i].tenant = b;
+      jobs[JOBS + i].prio = prio_b;
+      jobs[JOBS + i].cost = 100;
+      CHECK (jobq_push (q, &jobs[JOBS + i]) == JOBQ_OK);
+    }
+}
+
+int
+main (void)
+{
+  uint64_t totals[3] = { 0 };
+  size_t i, first, heavy;
+  jobq_job_t * job, bad = { 0 };
+  jobq_t q;
+
+  /* A tenant with three times the weight gets three times the jobs */
+  CHECK (jobq_init (&q, 4, 0) == JOBQ_OK);
+  CHECK (jobq_weight (&q, "heavy", 3) == JOBQ_OK);
+  CHECK (jobq_weight (&q, "light", 0) == JOBQ_INVALID);
+  fill (&q, "heavy", 1, "light", 1);
+  heavy = 0;
+  for (i = 0; i < JOBS; i++)
+    {
+      job = jobq_pop (&q, 0);
+      CHECK (job != NULL);
+      heavy += strcmp (job->tenant, "heavy") == 0;
+    }
+  CHECK (heavy >= JOBS * 3 / 4 - 2 && heavy <= JOBS * 3 / 4 + 2);
+  for (i = 0; i < JOBS; i++)
+    CHECK (jobq_pop (&q, 0) != NULL);
+  CHECK (jobq_pop (&q, 0) == NULL);
+
+  /* Every job is accounted for in the metrics */
+  jobq_stats (&q, count_stats, totals);
+  CHECK (totals[0] == JOBS * 2);
+  CHECK (totals[1] == JOBS * 2);
+  CHECK (totals[2] == 0);
+
+  bad.tenant = "heavy";
+  bad.prio = JOBQ_CLASSES;
+  CHECK (jobq_push (&q, &bad) == JOBQ_INVALID);
+  CHECK (jobq_destroy (&q) == JOBQ_OK);
+
+  /* Without aging a lower class waits for the higher one to drain */
+  CHECK (jobq_init (&q, 4, 0) == JOBQ_OK);
+  fill (&q, "batch", 2, "interactive", 0);
+  for (i = 0; i < JOBS * 2; i++)
+    {
+      job = jobq_pop (&q, 0);
+      CHECK (job != NULL);
+      CHECK ((i < JOBS) == (job->prio == 0));
+    }
+  CHECK (jobq_destroy (&q) == JOBQ_OK);
+
+  /* With aging the lower class only waits for that much cost */
+  CHECK (jobq_init (&q, 4, 1000) == JOBQ_OK);
+  fill (&q, "batch", 2, "interactive", 0);
+  first = SIZE_MAX;
+  for (i = 0; i < JOBS * 2; i++)
+    {
+      job = jobq_pop (&q, 0);
+      CHECK (job != NULL);
+      if (job->prio == 2 && first == SIZE_MAX)
+        first = i;
+    }
+  CHECK (first > 0 && first < JOBS / 4);
+  CHECK (jobq_destroy (&q) == JOBQ_OK);
+
+  return EXIT_SUCCESS;
+}
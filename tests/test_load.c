@@ -0,0 +1,159 @@
+/**
+   @file test_load.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Load Generator Tests
+   @details Generates graphs from a fixed LOAD_SEED and checks that they have
+   exactly LOAD_DEPTH levels of LOAD_WIDTH targets, that each target
+   depends on distinct targets of the level before it and that the
+   durations drawn are the same on every run. A small load is then
+   run for real.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include "check.h"
+#include "conf.h"
+#include "load.h"
+
+#define WIDTH 16
+#define DEPTH 6
+#define FANIN 3
+#define DURATION 20
+
+static const char * dists[] = { "const", "uniform", "exp", "lognormal" };
+
+/* Total of the durations drawn with LOAD_SEED=42. They change only if
+   the generator does, which makes loads from before incomparable. */
+static const uint64_t works[] = { 1920, 2074, 1614, 1814 };
+
+/* Generates a load from the base settings and one more pair */
+static void
+generate (load_t * load, const char * dist, const char * seed)
+{
+  char dist_pair[64];
+  const char * pairs[] = {
+    "LOAD_WIDTH=16", "LOAD_DEPTH=6", "LOAD_FANIN=3", "LOAD_DURATION=20ms",
+    dist_pair, seed
+  };
+  conf_t conf;
+
+  snprintf (dist_pair, sizeof (dist_pair), "LOAD_DIST=%s", dist);
+  CHECK (conf_init (&conf, "/nonexistent/autobuild.conf") == CONF_NO_FILE);
+  CHECK (conf_overlay (&conf, "test", pairs,
+                       sizeof (pairs) / sizeof (pairs[0])) == CONF_OK);
+  CHECK (load_init (load, &conf) == LOAD_OK);
+  conf_destroy (&conf);
+}
+
+/* Checks the shape of a generated graph */
+static void
+check_shape (load_t * load)
+{
+  size_t level[WIDTH * DEPTH], i, j, k, dep, * deps;
+  runner_task_t * task;
+
+  CHECK (load->njobs == WIDTH * DEPTH);
+  CHECK (load->ndeps == WIDTH * (DEPTH - 1) * FANIN);
+  CHECK (load->runner.ntasks == load->njobs);
+
+  /* Targets are added level by level, so a dependency always comes
+     before its dependents */
+  for (i = 0; i < load->njobs; i++)
+    level[i] = 0;
+  for (i = 0; i < load->njobs; i++)
+    {
+      task = load->runner.tasks[i];
+      CHECK (task->ndeps == (i < WIDTH ? 0 : FANIN));
+      CHECK (level[i] == i / WIDTH);
+      for (j = 0; j < task->nrdeps; j++)
+        {
+          CHECK (task->rdeps[j]->idx > i);
+          if (level[task->rdeps[j]->idx] < level[i] + 1)
+            level[task->rdeps[j]->idx] = level[i] + 1;
+        }
+    }
+  CHECK (level[load->njobs - 1] == DEPTH - 1);
+
+  /* Each target draws distinct dependencies from the level before */
+  for (i = WIDTH; i < load->njobs; i++)
+    {
+      deps = load->deps + (i - WIDTH) * FANIN;
+      for (j = 0; j < FANIN; j++)
+        {
+          dep = deps[j];
+          CHECK (dep / WIDTH == i / WIDTH - 1);
+          for (k = 0; k < j; k++)
+            CHECK (deps[k] != dep);
+        }
+    }
+}
+
+int
+main (void)
+{
+  load_t load, again;
+  load_report_t rep;
+  size_t i, d;
+
+  for (d = 0; d < sizeof (dists) / sizeof (dists[0]); d++)
+    {
+      generate (&load, dists[d], "LOAD_SEED=42");
+      check_shape (&load);
+
+      /* The same seed draws the same graph */
+      generate (&again, dists[d], "LOAD_SEED=42");
+      CHECK (again.work_ms == load.work_ms);
+      CHECK (memcmp (again.deps, load.deps,
+                     load.ndeps * sizeof (size_t)) == 0);
+      for (i = 0; i < load.njobs; i++)
+        CHECK (again.runner.tasks[i]->sim_ms ==
+               load.runner.tasks[i]->sim_ms);
+      CHECK (load_destroy (&again) == LOAD_OK);
+
+      /* Every distribution keeps the mean roughly at LOAD_DURATION */
+      CHECK (load.work_ms == works[d]);
+      CHECK (load.work_ms > WIDTH * DEPTH * DURATION * 3 / 4);
+      CHECK (load.work_ms < WIDTH * DEPTH * DURATION * 5 / 4);
+
+      /* Another seed draws another graph */
+      generate (&again, dists[d], "LOAD_SEED=43");
+      check_shape (&again);
+      CHECK (memcmp (again.deps, load.deps,
+                     load.ndeps * sizeof (size_t)) != 0);
+      CHECK (strcmp (dists[d], "const") == 0 ||
+             again.work_ms != load.work_ms);
+      CHECK (load_destroy (&again) == LOAD_OK);
+      CHECK (load_destroy (&load) == LOAD_OK);
+    }
+
+  /* A short run reports the whole graph */
+  generate (&load, "const", "LOAD_DURATION=1ms");
+  CHECK (load_run (&load, &rep) == LOAD_OK);
+  CHECK (rep.jobs == WIDTH * DEPTH && rep.edges == load.ndeps);
+  CHECK (rep.work_us == WIDTH * DEPTH * 1000);
+  CHECK (rep.critical_us == DEPTH * 1000);
+  CHECK (rep.ideal_us >= rep.critical_us);
+  CHECK (rep.makespan_us >= rep.critical_us);
+  CHECK (rep.overhead_max_us >= rep.overhead_p50_us);
+  CHECK (load_destroy (&load) == LOAD_OK);
+
+  return EXIT_SUCCESS;
+}
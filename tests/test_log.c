@@ -0,0 +1,312 @@
+/**
+   @file test_log.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Structured Logging Tests
+   @details Writes escaped, multibyte and overlong values through the
+   JSON writer and parses every line back with a strict parser, so a
+   line cut at the length limit must still be a whole object whose
+   cut values end in an ellipsis and carry "truncated":true.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include "check.h"
+#include "log.h"
+
+/* The line limit of log.c */
+#define MSG_MAX 1024
+#define MAX_FIELDS 32
+#define ELLIPSIS "\xe2\x80\xa6"
+
+/**
+   @brief One Parsed Line
+   @details Values which are not strings are kept as their text.
+**/
+struct json_t
+{
+  size_t n;
+  char keys[MAX_FIELDS][64];
+  char vals[MAX_FIELDS][4 * MSG_MAX];
+};
+
+/* Parses a string at *p into out, rejecting raw control characters,
+   unknown escapes and invalid UTF-8 */
+static int
+parse_string (const char ** p, char * out, size_t len)
+{
+  const unsigned char * s = (const unsigned char*) *p;
+  size_t pos = 0, n, i;
+  unsigned cp;
+
+  if (*s++ != '"')
+    return 0;
+  while (*s != '"')
+    {
+      if (*s < 0x20 || pos + 4 >= len)
+        return 0;
+      if (*s == '\\')
+        {
+          s++;
+          switch (*s++)
+            {
+            case '"': out[pos++] = '"'; break;
+            case '\\': out[pos++] = '\\'; break;
+            case '/': out[pos++] = '/'; break;
+            case 'b': out[pos++] = '\b'; break;
+            case 'f': out[pos++] = '\f'; break;
+            case 'n': out[pos++] = '\n'; break;
+            case 'r': out[pos++] = '\r'; break;
+            case 't': out[pos++] = '\t'; break;
+            case 'u':
+              if (sscanf ((const char*)s, "%4x", &cp) != 1 ||
+                  (cp >= 0xd800 && cp < 0xe000))
+                return 0;
+              s += 4;
+              if (cp < 0x80)
+                out[pos++] = cp;
+              else if (cp < 0x800)
+                {
+                  out[pos++] = 0xc0 | cp >> 6;
+                  out[pos++] = 0x80 | (cp & 0x3f);
+                }
+              else
+                {
+                  out[pos++] = 0xe0 | cp >> 12;
+                  out[pos++] = 0x80 | (cp >> 6 & 0x3f);
+                  out[pos++] = 0x80 | (cp & 0x3f);
+                }
+              break;
+            default:
+              return 0;
+            }
+          continue;
+        }
+
+      /* Raw bytes must be whole UTF-8 sequences */
+      if (*s < 0x80)
+        n = 1;
+      else if (*s >= 0xc2 && *s <= 0xdf)
+        n = 2;
+      else if (*s >= 0xe0 && *s <= 0xef)
+        n = 3;
+      else if (*s >= 0xf0 && *s <= 0xf4)
+        n = 4;
+      else
+        return 0;
+      for (i = 1; i < n; i++)
+        if ((s[i] & 0xc0) != 0x80)
+          return 0;
+      for (i = 0; i < n; i++)
+        out[pos++] = *s++;
+    }
+  out[pos] = '\0';
+  *p = (const char*) s + 1;
+  return 1;
+}
+
+/* Parses one flat object, the only kind the logger writes */
+static int
+parse_line (const char * line, struct json_t * json)
+{
+  const char * p = line;
+  char * end;
+  size_t len;
+
+  json->n = 0;
+  if (*p++ != '{')
+    return 0;
+  do
+    {
+      if (json->n == MAX_FIELDS ||
+          !parse_string (&p, json->keys[json->n], sizeof (json->keys[0])) ||
+          *p++ != ':')
+        return 0;
+      if (*p == '"')
+        {
+          if (!parse_string (&p, json->vals[json->n], sizeof (json->vals[0])))
+            return 0;
+        }
+      else
+        {
+          len = strcspn (p, ",}");
+          if (len == 0 || len >= sizeof (json->vals[0]))
+            return 0;
+          memcpy (json->vals[json->n], p, len);
+          json->vals[json->n][len] = '\0';
+          if (strcmp (json->vals[json->n], "true") != 0 &&
+              strcmp (json->vals[json->n], "false") != 0 &&
+              strcmp (json->vals[json->n], "null") != 0 &&
+              (strtod (json->vals[json->n], &end), *end != '\0'))
+            return 0;
+          p += len;
+        }
+      json->n++;
+    }
+  while (*p++ == ',');
+  return p[-1] == '}' && strcmp (p, "\n") == 0;
+}
+
+static const char *
+get (const struct json_t * json, const char * key)
+{
+  size_t i;
+
+  for (i = 0; i < json->n; i++)
+    if (strcmp (json->keys[i], key) == 0)
+      return json->vals[i];
+  return NULL;
+}
+
+/* Checks that val is orig cut short and marked as such */
+static void
+check_cut (const struct json_t * json, const char * val, const char * orig)
+{
+  size_t len = strlen (val) - strlen (ELLIPSIS);
+
+  CHECK (strlen (val) > strlen (ELLIPSIS));
+  CHECK (strcmp (val + len, ELLIPSIS) == 0);
+  CHECK (len < strlen (orig) && strncmp (val, orig, len) == 0);
+  CHECK (get (json, "truncated") != NULL);
+  CHECK (strcmp (get (json, "truncated"), "true") == 0);
+}
+
+/* Fills str with count copies of unit */
+static char *
+repeat (char * str, const char * unit, size_t count)
+{
+  size_t i;
+
+  str[0] = '\0';
+  for (i = 0; i < count; i++)
+    strcat (str, unit);
+  return str;
+}
+
+int
+main (void)
+{
+  const char * escaped = "quote \" backslash \\ newline \n tab \t bell \a "
+    "equals = end";
+  const char * multibyte = "h\xc3\xa9llo w\xc3\xb6rld \xe2\x9c\x93 "
+    "\xf0\x9d\x84\x9e";
+  static char long_ascii[1201], long_mb[1201], long_esc[601], pad[916];
+  static struct json_t json;
+  char dir[256], path[PATH_MAX], * line = NULL;
+  size_t cap = 0, lines = 0;
+  const char * msg, * val;
+  ssize_t len;
+  FILE * file;
+  int fd;
+
+  repeat (long_ascii, "a", 1200);
+  repeat (long_mb, "\xc3\xa9", 600);
+  repeat (long_esc, "\"", 600);
+  repeat (pad, "p", 915);
+
+  check_tmpdir ("test_log", dir, sizeof (dir));
+  snprintf (path, sizeof (path), "%s/log.json", dir);
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  CHECK (fd >= 0);
+
+  CHECK (log_init (fd, LOG_FORMAT_JSON, LOG_LEVEL_TRACE, 0) == LOG_OK);
+  log_info ("escaped", LOG_STR ("val", escaped));
+  log_info ("multibyte", LOG_STR ("val", multibyte));
+  log_info ("long", LOG_STR ("val", long_ascii), LOG_UINT ("after", 1));
+  log_info ("long multibyte", LOG_STR ("val", long_mb));
+  log_info ("long escaped", LOG_STR ("val", long_esc));
+  log_info ("invalid", LOG_STR ("val", "bad \xff\xc3 end"));
+  log_info ("numbers", LOG_DBL ("inf", INFINITY), LOG_INT ("neg", -5),
+            LOG_STR ("null", NULL));
+  /* The pad just fits, the number after it does not and is left out */
+  log_info ("pad", LOG_STR ("pad", pad), LOG_UINT ("n", 123456789));
+  CHECK (log_destroy () == LOG_OK);
+
+  file = fopen (path, "r");
+  CHECK (file != NULL);
+  while ((len = getline (&line, &cap, file)) > 0)
+    {
+      CHECK (len <= MSG_MAX);
+      if (!parse_line (line, &json))
+        {
+          fprintf (stderr, "invalid JSON: %s", line);
+          return EXIT_FAILURE;
+        }
+      lines++;
+      msg = get (&json, "msg");
+      val = get (&json, "val");
+      CHECK (msg != NULL && get (&json, "time") != NULL);
+      CHECK (strcmp (get (&json, "level"), "info") == 0);
+      if (strcmp (msg, "escaped") == 0)
+        CHECK (strcmp (val, escaped) == 0 && get (&json, "truncated") == NULL);
+      else if (strcmp (msg, "multibyte") == 0)
+        CHECK (strcmp (val, multibyte) == 0);
+      else if (strcmp (msg, "long") == 0)
+        {
+          check_cut (&json, val, long_ascii);
+          CHECK (get (&json, "after") == NULL);
+        }
+      else if (strcmp (msg, "long multibyte") == 0)
+        check_cut (&json, val, long_mb);
+      else if (strcmp (msg, "long escaped") == 0)
+        check_cut (&json, val, long_esc);
+      else if (strcmp (msg, "invalid") == 0)
+        CHECK (strcmp (val, "bad \xef\xbf\xbd\xef\xbf\xbd end") == 0);
+      else if (strcmp (msg, "numbers") == 0)
+        {
+          CHECK (strcmp (get (&json, "inf"), "null") == 0);
+          CHECK (strcmp (get (&json, "neg"), "-5") == 0);
+          CHECK (strcmp (get (&json, "null"), "(null)") == 0);
+        }
+      else if (strcmp (msg, "pad") == 0)
+        {
+          CHECK (strcmp (get (&json, "pad"), pad) == 0);
+          CHECK (get (&json, "n") == NULL);
+          CHECK (strcmp (get (&json, "truncated"), "true") == 0);
+        }
+      else
+        CHECK (!"unexpected message");
+    }
+  CHECK (lines == 8);
+  CHECK (fclose (file) == 0);
+
+  /* Text lines are cut the same way */
+  CHECK (ftruncate (fd, 0) == 0);
+  CHECK (lseek (fd, 0, SEEK_SET) == 0);
+  CHECK (log_init (fd, LOG_FORMAT_TEXT, LOG_LEVEL_TRACE, 0) == LOG_OK);
+  log_info ("long", LOG_STR ("val", long_ascii));
+  CHECK (log_destroy () == LOG_OK);
+  file = fopen (path, "r");
+  CHECK (file != NULL);
+  len = getline (&line, &cap, file);
+  CHECK (len > 0 && len <= MSG_MAX);
+  CHECK (strstr (line, " INFO long val=aaa") != NULL);
+  CHECK (strcmp (line + len - 19, ELLIPSIS " truncated=true\n") == 0);
+  CHECK (getline (&line, &cap, file) < 0);
+  CHECK (fclose (file) == 0);
+
+  free (line);
+  close (fd);
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+/**
+   @file test_logstore.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Log Store Tests
+   @details Checks writing, tailing and searching a store, reading it
+   back read-only and that a store a crash left torn reopens with its
+   intact chunks.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include "check.h"
+#include "logstore.h"
+
+#define LINES 20000 /**< Lines written to the store */
+#define NEEDLE 12345 /**< The only line holding an error */
+
+/* Records the lines a search matched */
+static int
+match (void * arg, uint64_t line, const char * data, size_t len)
+{
+  uint64_t * found = arg;
+
+  CHECK (len > 0 && data[len-1] != '\n');
+  CHECK (memmem (data, len, "error: boom", 11) != NULL);
+  found[0]++;
+  found[1] = line;
+  return 0;
+}
+
+/* Checks the last three lines and the one error of a full store */
+static void
+check_contents (logstore_t * ls, uint64_t lines)
+{
+  uint64_t found[2] = { 0, 0 };
+  char expect[128];
+  buffer_t out;
+
+  CHECK (buffer_init (&out, 0, 0) == BUFF_OK);
+  CHECK (logstore_tail (ls, 3, &out) == LOGSTORE_OK);
+  snprintf (expect, sizeof (expect),
+            "line %" PRIu64 ": ok\nline %" PRIu64 ": ok\n"
+            "line %" PRIu64 ": ok\n", lines - 3, lines - 2, lines - 1);
+  CHECK (out.len == strlen (expect));
+  CHECK (memcmp (out.data, expect, out.len) == 0);
+  buffer_destroy (&out);
+
+  ls->chunks_read = 0;
+  CHECK (logstore_search (ls, "error: boom", match, found) ==
+         LOGSTORE_OK);
+  CHECK (found[0] == 1);
+  CHECK (found[1] == NEEDLE);
+
+  /* The trigram filters rule out nearly every chunk */
+  CHECK (ls->chunks_read * 8 < ls->nchunks);
+}
+
+/* Writes lines [from, to) in uneven pieces */
+static void
+write_lines (logstore_t * ls, uint64_t from, uint64_t to)
+{
+  char line[128];
+  size_t len, off, step = 1;
+  uint64_t i;
+
+  for (i = from; i < to; i++)
+    {
+      len = snprintf (line, sizeof (line), "line %" PRIu64 ": %s\n", i,
+                      i == NEEDLE ? "error: boom" : "ok");
+      for (off = 0; off < len; off += step)
+        {
+          step = (i + off) % 7 + 1;
+          if (step > len - off)
+            step = len - off;
+          CHECK (logstore_write (ls, line + off, step) == LOGSTORE_OK);
+        }
+    }
+}
+
+/* Shortens a file by len bytes */
+static void
+chop (const char * path, off_t len)
+{
+  struct stat st;
+
+  CHECK (stat (path, &st) == 0);
+  CHECK (truncate (path, st.st_size - len) == 0);
+}
+
+int
+main (void)
+{
+  char dir[256], base[512], dat[PATH_MAX], idx[PATH_MAX];
+  uint8_t zeros[64] = { 0 };
+  size_t nchunks;
+  logstore_t ls;
+  int fd;
+
+  check_tmpdir ("test_logstore", dir, sizeof (dir));
+  snprintf (base, sizeof (base), "%s/build", dir);
+  snprintf (dat, sizeof (dat), "%s.dat", base);
+  snprintf (idx, sizeof (idx), "%s.idx", base);
+
+  CHECK (logstore_open (&ls, base, 1, 4096) == LOGSTORE_OK);
+  write_lines (&ls, 0, LINES);
+  check_contents (&ls, LINES);
+  CHECK (ls.raw_bytes > ls.stored_bytes);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  /* A read-only store sees everything and refuses writes */
+  CHECK (logstore_open (&ls, base, 0, 4096) == LOGSTORE_OK);
+  CHECK (ls.lines == LINES);
+  check_contents (&ls, LINES);
+  CHECK (logstore_write (&ls, "x\n", 2) == LOGSTORE_READ_ONLY);
+  nchunks = ls.nchunks;
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  /* A torn last chunk is dropped and writing carries on after it */
+  chop (dat, 10);
+  CHECK (logstore_open (&ls, base, 1, 4096) == LOGSTORE_OK);
+  CHECK (ls.nchunks == nchunks - 1);
+  CHECK (ls.lines < LINES);
+  write_lines (&ls, ls.lines, LINES);
+  check_contents (&ls, LINES);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  /* So is a last chunk which was never synced */
+  CHECK (logstore_open (&ls, base, 0, 4096) == LOGSTORE_OK);
+  nchunks = ls.nchunks;
+  fd = open (dat, O_WRONLY);
+  CHECK (fd >= 0);
+  CHECK (pwrite (fd, zeros, sizeof (zeros),
+                 ls.chunks[nchunks-1].offset) == sizeof (zeros));
+  close (fd);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+  CHECK (logstore_open (&ls, base, 1, 4096) == LOGSTORE_OK);
+  CHECK (ls.nchunks == nchunks - 1);
+  write_lines (&ls, ls.lines, LINES);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  /* And a partially written index record */
+  fd = open (idx, O_WRONLY | O_APPEND);
+  CHECK (fd >= 0);
+  CHECK (write (fd, zeros, 7) == 7);
+  close (fd);
+  CHECK (logstore_open (&ls, base, 1, 4096) == LOGSTORE_OK);
+  CHECK (ls.lines == LINES);
+  check_contents (&ls, LINES);
+  CHECK (logstore_close (&ls) == LOGSTORE_OK);
+
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}
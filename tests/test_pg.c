@@ -0,0 +1,288 @@
+/**
+   @file test_pg.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Live Database Tests
+   @details Runs the pool and the database log against a throwaway postgres
+   cluster on a unix socket in a scratch directory, kills the server
+   with an immediate shutdown in the middle of the run and restarts
+   it. Queries must fail fast while it is down, output must land in
+   the spill store instead and both must recover once it is back.
+   Skipped unless initdb and pg_ctl are found in TEST_PG_BINDIR, the
+   PATH or /usr/lib/postgresql, and never run as root since initdb
+   refuses to.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <glob.h>
+#include <limits.h>
+#include <unistd.h>
+#include "check.h"
+#include "buffer.h"
+#include "dblog.h"
+#include "dbpool.h"
+#include "logstore.h"
+
+#define PORT 5432
+#define WAIT_MS 60000
+#define ROWS 8
+
+#define SETUP "CREATE TABLE IF NOT EXISTS pool_test (n integer NOT NULL)"
+#define INSERT "INSERT INTO pool_test (n) VALUES ($1)"
+
+static char bindir[PATH_MAX], dir[PATH_MAX];
+static int running;
+
+/* Looks for initdb in one directory */
+static int
+try_bindir (const char * path)
+{
+  char exe[PATH_MAX];
+
+  snprintf (exe, sizeof (exe), "%s/initdb", path);
+  if (access (exe, X_OK) != 0)
+    return 0;
+  snprintf (bindir, sizeof (bindir), "%s", path);
+  return 1;
+}
+
+static int
+find_bindir (void)
+{
+  const char * env = getenv ("TEST_PG_BINDIR");
+  char * path, * save, * part;
+  glob_t found;
+  size_t i;
+  int ret = 0;
+
+  if (env != NULL && env[0] != '\0')
+    return try_bindir (env);
+  env = getenv ("PATH");
+  path = strdup (env != NULL ? env : "");
+  CHECK (path != NULL);
+  for (part = strtok_r (path, ":", &save); part != NULL && !ret;
+       part = strtok_r (NULL, ":", &save))
+    ret = try_bindir (part);
+  free (path);
+  if (ret)
+    return 1;
+
+  /* Debian keeps the server binaries out of the PATH, newest last */
+  if (glob ("/usr/lib/postgresql/*/bin", 0, NULL, &found) == 0)
+    {
+      for (i = found.gl_pathc; i > 0 && !ret; i--)
+        ret = try_bindir (found.gl_pathv[i-1]);
+      globfree (&found);
+    }
+  return ret;
+}
+
+static int
+pg_ctl (const char * action)
+{
+  char cmd[4 * PATH_MAX];
+
+  snprintf (cmd, sizeof (cmd), "'%s/pg_ctl' -D '%s/data' -l '%s/server.log' "
+            "-o \"-k '%s' -p %d -c listen_addresses=\" -w %s > /dev/null",
+            bindir, dir, dir, dir, PORT, action);
+  return system (cmd);
+}
+
+/* Never leave a server behind, even when a check fails */
+static void
+cleanup (void)
+{
+  if (running)
+    pg_ctl ("-m immediate stop");
+  running = 0;
+  check_rmdir (dir);
+}
+
+/* Inserts one row, 1 if it went through */
+static int
+insert (dbpool_t * pool, int n)
+{
+  dbpool_query_t query = { .sql = INSERT, .nparams = 1 };
+  const char * params[1];
+  char num[32];
+
+  snprintf (num, sizeof (num), "%d", n);
+  params[0] = num;
+  query.params = params;
+  return dbpool_exec (pool, &query) == DBPOOL_OK;
+}
+
+/* Checks a condition on the server, 1 if it holds */
+static int
+holds (dbpool_t * pool, const char * cond)
+{
+  char sql[512];
+  dbpool_query_t query = { .sql = sql };
+
+  snprintf (sql, sizeof (sql), "DO $$ BEGIN IF NOT (%s) THEN "
+            "RAISE EXCEPTION 'failed'; END IF; END $$", cond);
+  return dbpool_exec (pool, &query) == DBPOOL_OK;
+}
+
+/* Writes a few lines of a job and ends it */
+static void
+write_job (dblog_t * dl, uint64_t job)
+{
+  char line[64];
+  int i, len;
+
+  for (i = 0; i < ROWS; i++)
+    {
+      len = snprintf (line, sizeof (line), "job %llu line %d\n",
+                      (unsigned long long)job, i);
+      CHECK (dblog_write (dl, job, line, len) != DBLOG_INVALID);
+    }
+  CHECK (dblog_end (dl, job) == DBLOG_OK);
+}
+
+/* Waits until the log has inserted rows rows */
+static int
+wait_rows (dblog_t * dl, uint64_t rows)
+{
+  dblog_stats_t stats;
+  uint64_t start = check_ns ();
+
+  do
+    {
+      dblog_stats (dl, &stats);
+      if (stats.rows >= rows)
+        return 1;
+      usleep (10000);
+    }
+  while (check_ns () - start < WAIT_MS * 1000000ull);
+  return 0;
+}
+
+int
+main (void)
+{
+  char cmd[4 * PATH_MAX], conninfo[2 * PATH_MAX], path[PATH_MAX];
+  dbpool_query_t query = { .sql = SETUP };
+  dbpool_stats_t stats;
+  dblog_stats_t dstats;
+  logstore_t spill;
+  buffer_t out;
+  dbpool_err_t ret;
+  dbpool_t pool;
+  dblog_t dl;
+  uint64_t start;
+  int i;
+
+  if (geteuid () == 0 || !find_bindir ())
+    return CHECK_SKIP;
+
+  check_tmpdir ("test_pg", dir, sizeof (dir));
+  atexit (cleanup);
+  snprintf (cmd, sizeof (cmd), "'%s/initdb' -D '%s/data' -A trust "
+            "-U postgres --no-sync > /dev/null", bindir, dir);
+  CHECK (system (cmd) == 0);
+  CHECK (pg_ctl ("start") == 0);
+  running = 1;
+  snprintf (conninfo, sizeof (conninfo), "host='%s' port=%d user=postgres "
+            "dbname=postgres connect_timeout=2", dir, PORT);
+
+  /* The pool prepares each statement once per connection */
+  CHECK (dbpool_init (&pool, conninfo, 2, SETUP) == DBPOOL_OK);
+  pool.trip_after = 2;
+  for (i = 0; i < ROWS; i++)
+    CHECK (insert (&pool, i));
+  CHECK (holds (&pool, "(SELECT count(*) FROM pool_test) = 8"));
+  dbpool_stats (&pool, &stats);
+  CHECK (stats.connects >= 1 && stats.connects <= 2);
+  CHECK (stats.reused >= ROWS - stats.connects);
+  CHECK (stats.trips == 0);
+
+  snprintf (path, sizeof (path), "%s/spill", dir);
+  CHECK (logstore_open (&spill, path, 1, 0) == LOGSTORE_OK);
+  CHECK (dblog_init (&dl, conninfo, &spill) == DBLOG_OK);
+  dl.flush_ms = 10;
+  write_job (&dl, 1);
+  CHECK (wait_rows (&dl, 1));
+
+  /* Kill the server mid-run, queries then fail instead of waiting */
+  CHECK (pg_ctl ("-m immediate stop") == 0);
+  running = 0;
+  for (i = 0; i < ROWS; i++)
+    {
+      ret = dbpool_exec (&pool, &query);
+      if (ret == DBPOOL_UNAVAILABLE)
+        break;
+      CHECK (ret == DBPOOL_FAILED);
+    }
+  CHECK (i < ROWS);
+  start = check_ns ();
+  CHECK (!insert (&pool, -1));
+  CHECK (check_ns () - start < 1000000000ull);
+  dbpool_stats (&pool, &stats);
+  CHECK (stats.trips == 1 && stats.rejected >= 1);
+
+  /* The output written while it is down only lands locally */
+  write_job (&dl, 2);
+  start = check_ns ();
+  do
+    {
+      dblog_stats (&dl, &dstats);
+      usleep (10000);
+    }
+  while (dstats.spilled == 0 && check_ns () - start < WAIT_MS * 1000000ull);
+  CHECK (dstats.spilled > 0);
+
+  /* Restart it, the breaker closes again once a probe connects */
+  CHECK (pg_ctl ("start") == 0);
+  running = 1;
+  start = check_ns ();
+  while (!insert (&pool, ROWS) && check_ns () - start < WAIT_MS * 1000000ull)
+    usleep (50000);
+  CHECK (holds (&pool, "(SELECT count(*) FROM pool_test) = 9"));
+  dbpool_stats (&pool, &stats);
+  CHECK (stats.connects >= 2 && stats.trips == 1);
+
+  /* The log recovers with it */
+  dblog_stats (&dl, &dstats);
+  write_job (&dl, 3);
+  CHECK (wait_rows (&dl, dstats.rows + 1));
+  CHECK (dblog_destroy (&dl) == DBLOG_OK);
+  CHECK (holds (&pool, "(SELECT string_agg(data, '' ORDER BY seq) FROM "
+                "build_log WHERE job = 3) = 'job 3 line 0\njob 3 line 1\n"
+                "job 3 line 2\njob 3 line 3\njob 3 line 4\njob 3 line 5\n"
+                "job 3 line 6\njob 3 line 7\n'"));
+  CHECK (holds (&pool, "NOT EXISTS (SELECT 1 FROM build_log WHERE job = 2)"));
+  CHECK (dbpool_destroy (&pool) == DBPOOL_OK);
+
+  /* Job 2 is in the spill store */
+  CHECK (logstore_close (&spill) == LOGSTORE_OK);
+  CHECK (logstore_open (&spill, path, 0, 0) == LOGSTORE_OK);
+  buffer_init (&out, 0, 0);
+  CHECK (logstore_tail (&spill, SIZE_MAX, &out) == LOGSTORE_OK);
+  CHECK (buffer_add (&out, "", 1) == BUFF_OK);
+  CHECK (strstr (out.data, "--- job 2 ---\njob 2 line 0\n") != NULL);
+  buffer_destroy (&out);
+  CHECK (logstore_close (&spill) == LOGSTORE_OK);
+
+  CHECK (pg_ctl ("-m fast stop") == 0);
+  running = 0;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/**
+   @file test_queue.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Lock-Free Queue Tests
+   @details Checks the sizing, the full and empty cases and the
+   order of a single thread, then that no item is lost or repeated
+   with several producers and consumers.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "check.h"
+#include "queue.h"
+
+#define THREADS 4 /**< Producers, and as many consumers */
+#define ITEMS 200000 /**< Items pushed by each producer */
+
+static queue_t queue;
+static uint64_t sums[THREADS];
+static size_t counts[THREADS];
+static size_t popped;
+static pthread_mutex_t sums_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pushes 1..ITEMS tagged with the producer, retrying while full */
+static void *
+producer (void * arg)
+{
+  uintptr_t id = (uintptr_t)arg, i;
+
+  for (i = 1; i <= ITEMS; i++)
+    while (queue_push (&queue, (void *)(id << 32 | i)) == QUEUE_FULL)
+      sched_yield ();
+  return NULL;
+}
+
+/* Pops until every item of every producer has been seen */
+static void *
+consumer (void * arg)
+{
+  uint64_t local_sums[THREADS] = { 0 };
+  size_t local_counts[THREADS] = { 0 }, i;
+  void * data;
+  uintptr_t val;
+
+  (void) arg;
+  while (__atomic_load_n (&popped, __ATOMIC_ACQUIRE) < THREADS * ITEMS)
+    {
+      if (queue_pop (&queue, &data) == QUEUE_EMPTY)
+        {
+          sched_yield ();
+          continue;
+        }
+      val = (uintptr_t)data;
+      CHECK ((val >> 32) < THREADS);
+      local_sums[val >> 32] += val & 0xffffffff;
+      local_counts[val >> 32]++;
+      __atomic_add_fetch (&popped, 1, __ATOMIC_RELEASE);
+    }
+
+  pthread_mutex_lock (&sums_lock);
+  for (i = 0; i < THREADS; i++)
+    {
+      sums[i] += local_sums[i];
+      counts[i] += local_counts[i];
+    }
+  pthread_mutex_unlock (&sums_lock);
+  return NULL;
+}
+
+int
+main (void)
+{
+  pthread_t threads[THREADS * 2];
+  void * data;
+  uintptr_t i;
+
+  /* Sizes round up to a power of two */
+  CHECK (queue_init (&queue, 5) == QUEUE_OK);
+  CHECK (queue.mask == 7);
+  for (i = 1; i <= 8; i++)
+    CHECK (queue_push (&queue, (void *)i) == QUEUE_OK);
+  CHECK (queue_push (&queue, (void *)i) == QUEUE_FULL);
+  for (i = 1; i <= 8; i++)
+    {
+      CHECK (queue_pop (&queue, &data) == QUEUE_OK);
+      CHECK ((uintptr_t)data == i);
+    }
+  CHECK (queue_pop (&queue, &data) == QUEUE_EMPTY);
+
+  /* Wrapping around the ring keeps the order */
+  for (i = 1; i <= 100; i++)
+    {
+      CHECK (queue_push (&queue, (void *)i) == QUEUE_OK);
+      CHECK (queue_push (&queue, (void *)(i + 1000)) == QUEUE_OK);
+      CHECK (queue_pop (&queue, &data) == QUEUE_OK);
+      CHECK ((uintptr_t)data == i);
+      CHECK (queue_pop (&queue, &data) == QUEUE_OK);
+      CHECK ((uintptr_t)data == i + 1000);
+    }
+  CHECK (queue_destroy (&queue) == QUEUE_OK);
+
+  /* A small ring keeps the producers contending for cells */
+  CHECK (queue_init (&queue, 64) == QUEUE_OK);
+  for (i = 0; i < THREADS; i++)
+    {
+      CHECK (pthread_create (&threads[i], NULL, producer,
+                             (void *)i) == 0);
+      CHECK (pthread_create (&threads[THREADS + i], NULL, consumer,
+                             NULL) == 0);
+    }
+  for (i = 0; i < THREADS * 2; i++)
+    pthread_join (threads[i], NULL);
+  CHECK (queue_pop (&queue, &data) == QUEUE_EMPTY);
+  for (i = 0; i < THREADS; i++)
+    {
+      CHECK (counts[i] == ITEMS);
+      CHECK (sums[i] == (uint64_t)ITEMS * (ITEMS + 1) / 2);
+    }
+  CHECK (queue_destroy (&queue) == QUEUE_OK);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/**
+   @file test_runner.c
+   @author William A. Kennington III <william@wkennington.com>
+   @brief Scheduler Tests
+   @details Checks that the duration history folds runs into an exponentially
+   weighted estimate and keeps it across a reload and a compaction of
+   its journal, that simulation replays a small graph with a known
+   critical path, and that a straggling target is relaunched and its
+   copy wins, both simulated and in a real run.
+**/
+/*
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of AutoBuilder.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <unistd.h>
+#include "check.h"
+#include "history.h"
+#include "runner.h"
+
+#define RECORDS 20
+#define WAIT_MS 10000
+
+/* Only simulated, never run */
+static int
+no_exec (void * arg, runner_task_t * task, const int * cancel)
+{
+  (void) arg;
+  (void) task;
+  (void) cancel;
+  CHECK (0);
+  return 1;
+}
+
+/* The first copy hangs until it is cancelled, the second returns */
+static int
+straggle (void * arg, runner_task_t * task, const int * cancel)
+{
+  int * calls = (int*) arg;
+  uint64_t start = check_ns ();
+
+  (void) task;
+  if (__atomic_fetch_add (calls, 1, __ATOMIC_RELAXED) > 0)
+    return 0;
+  while (!__atomic_load_n (cancel, __ATOMIC_ACQUIRE))
+    {
+      CHECK (check_ns () - start < WAIT_MS * 1000000ull);
+      usleep (1000);
+    }
+  return 1;
+}
+
+/* Counts the lines of the journal */
+static size_t
+journal_lines (const char * path)
+{
+  size_t lines = 0;
+  FILE * file;
+  int c;
+
+  file = fopen (path, "r");
+  CHECK (file != NULL);
+  while ((c = fgetc (file)) != EOF)
+    lines += c == '\n';
+  fclose (file);
+  return lines;
+}
+
+int
+main (void)
+{
+  char dir[256], path[PATH_MAX];
+  runner_task_t a = { .name = "a", .sim_ms = 10 };
+  runner_task_t b = { .name = "b", .sim_ms = 30 };
+  runner_task_t c = { .name = "c", .sim_ms = 50 };
+  runner_task_t d = { .name = "d", .sim_ms = 5 };
+  runner_task_t s = { .name = "s", .sim_ms = 1000,
+                      .flags = RUNNER_SPECULABLE };
+  history_t hist;
+  runner_sim_t sim;
+  runner_t r;
+  uint64_t start;
+  int i, calls = 0;
+
+  /* Each run moves the estimate alpha of the way to it */
+  check_tmpdir ("test_runner", dir, sizeof (dir));
+  snprintf (path, sizeof (path), "%s/history", dir);
+  CHECK (history_open (&hist, path, 1.5) == HISTORY_INVALID);
+  history_close (&hist);
+  CHECK (history_open (&hist, path, 0.5) == HISTORY_OK);
+  CHECK (history_estimate (&hist, "cc", 7) == 7);
+  CHECK (history_record (&hist, "cc", 100, 0) == HISTORY_OK);
+  CHECK (history_estimate (&hist, "cc", 7) == 100);
+  CHECK (history_record (&hist, "cc", 200, 0) == HISTORY_OK);
+  CHECK (history_estimate (&hist, "cc", 7) == 150);
+  CHECK (history_record (&hist, "cc", 50, 0) == HISTORY_OK);
+  CHECK (history_estimate (&hist, "cc", 7) == 100);
+  CHECK (history_record (&hist, "ld", 40, 0) == HISTORY_OK);
+  CHECK (history_record (&hist, "bad\tname", 1, 0) == HISTORY_INVALID);
+  CHECK (history_close (&hist) == HISTORY_OK);
+  CHECK (journal_lines (path) == 4);
+
+  /* Reloading replays the journal */
+  CHECK (history_open (&hist, path, 0.5) == HISTORY_OK);
+  CHECK (history_estimate (&hist, "cc", 7) == 100);
+  CHECK (history_estimate (&hist, "ld", 7) == 40);
+  for (i = 0; i < RECORDS; i++)
+    CHECK (history_record (&hist, "ld", 40, 0) == HISTORY_OK);
+  CHECK (history_close (&hist) == HISTORY_OK);
+
+  /* A journal of mostly superseded records is compacted on open */
+  CHECK (journal_lines (path) == 4 + RECORDS);
+  CHECK (history_open (&hist, path, 0.5) == HISTORY_OK);
+  CHECK (journal_lines (path) == 2);
+  CHECK (history_estimate (&hist, "cc", 7) == 100);
+  CHECK (history_estimate (&hist, "ld", 7) == 40);
+  CHECK (history_close (&hist) == HISTORY_OK);
+
+  /* a feeds b and c which both feed d, c is on the critical path */
+  CHECK (runner_init (&r, NULL, 2, no_exec, NULL) == RUNNER_OK);
+  r.straggler = 0;
+  CHECK (runner_add (&r, &a) == RUNNER_OK);
+  CHECK (runner_add (&r, &b) == RUNNER_OK);
+  CHECK (runner_add (&r, &c) == RUNNER_OK);
+  CHECK (runner_add (&r, &d) == RUNNER_OK);
+  CHECK (runner_dep (&r, &b, &a) == RUNNER_OK);
+  CHECK (runner_dep (&r, &c, &a) == RUNNER_OK);
+  CHECK (runner_dep (&r, &d, &b) == RUNNER_OK);
+  CHECK (runner_dep (&r, &d, &c) == RUNNER_OK);
+  CHECK (runner_simulate (&r, &sim) == RUNNER_OK);
+  CHECK (sim.critical_ms == 65 && sim.work_ms == 95);
+  CHECK (sim.makespan_ms == 65 && sim.busy_ms == 95);
+  CHECK (sim.speculated == 0);
+
+  /* One worker runs everything back to back */
+  r.nworkers = 1;
+  CHECK (runner_simulate (&r, &sim) == RUNNER_OK);
+  CHECK (sim.makespan_ms == 95);
+  CHECK (runner_destroy (&r) == RUNNER_OK);
+
+  /* A target far over its estimate gets a copy which finishes first */
+  CHECK (history_open (&hist, NULL, 0) == HISTORY_OK);
+  CHECK (history_record (&hist, "s", 100, 0) == HISTORY_OK);
+  CHECK (runner_init (&r, &hist, 2, no_exec, NULL) == RUNNER_OK);
+  r.straggler = 2;
+  r.slack_ms = 0;
+  CHECK (runner_add (&r, &s) == RUNNER_OK);
+  CHECK (runner_simulate (&r, &sim) == RUNNER_OK);
+  CHECK (sim.speculated == 1 && sim.spec_wins == 1);
+  CHECK (sim.makespan_ms == 300 && sim.busy_ms == 400);
+
+  /* Without the flag it runs to the end */
+  s.flags = 0;
+  CHECK (runner_simulate (&r, &sim) == RUNNER_OK);
+  CHECK (sim.speculated == 0 && sim.makespan_ms == 1000);
+  CHECK (runner_destroy (&r) == RUNNER_OK);
+
+  /* The same in a real run, the hanging copy is cancelled */
+  CHECK (history_record (&hist, "s", 20, 0) == HISTORY_OK);
+  CHECK (history_record (&hist, "s", 20, 0) == HISTORY_OK);
+  CHECK (runner_init (&r, &hist, 2, straggle, &calls) == RUNNER_OK);
+  r.straggler = 2;
+  r.slack_ms = 0;
+  s.flags = RUNNER_SPECULABLE;
+  CHECK (runner_add (&r, &s) == RUNNER_OK);
+  start = check_ns ();
+  CHECK (runner_run (&r) == RUNNER_OK);
+  CHECK (check_ns () - start < WAIT_MS * 1000000ull);
+  CHECK (calls == 2);
+  CHECK (r.speculated == 1 && r.spec_wins == 1);
+  CHECK (s.result == 0 && s.cancel);
+  CHECK (runner_destroy (&r) == RUNNER_OK);
+  CHECK (history_close (&hist) == HISTORY_OK);
+
+  check_rmdir (dir);
+  return EXIT_SUCCESS;
+}